@@ -1,46 +1,123 @@
 
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+
 #include "qhy9.h"
+#include "qhy9_usb.h"
+#include "qhy9_sim.h"
 
 
 #define POLLMS 1000
 #define MINIMUM_CCD_EXPOSURE 0.001
 #define TEMPERATURE_THRESHOLD 0.1
 
-static QHY9 *camera = NULL;
+#define SETTLE_MS        200		/* after a full register change */
+#define SETTLE_TIMING_MS 20		/* after an exposure time change only */
+
+#define TIMING_TAB "Timing"
+#define THERMAL_TAB "Thermal"
+#define COMPRESS_TAB "Compression"
+#define CALIB_TAB "Calibration"
+#define LIBRARY_TAB "Dark Library"
+#define STATS_TAB "Statistics"
+#define FOCUS_TAB "Focus"
+#define VIDEO_TAB "Video"
+#define RECORD_TAB "Recording"
+
+#define QHY9_MAX_CAMERAS 8
+
+static std::vector<QHY9 *> cameras;
+
+/*
+ * One camera per QHY9 on the bus, or one per bus port / serial number listed
+ * in QHY9_DEVICES (comma separated). The first one is "QHY9", the others
+ * "QHY9 2", "QHY9 3", ...
+ */
+static void initialize()
+{
+	std::vector<QHY9DeviceInfo> found;
+	std::vector<std::string> ids;
+	const char *env;
+	char name[32];
+	size_t i;
+
+	if (!cameras.empty())
+		return;
+
+	env = getenv("QHY9_DEVICES");
+	if (env && *env) {
+		std::string list = env;
+		size_t start = 0, end;
+
+		do {
+			end = list.find(',', start);
+			ids.push_back(list.substr(start, end == std::string::npos ? end : end - start));
+			start = end + 1;
+		} while (end != std::string::npos);
+	} else {
+		QHY9USBTransport::enumerate(found);
+		for (i = 0; i < found.size(); i++)
+			ids.push_back(found[i].port);
+	}
+
+	/* nothing plugged in yet, or simulation */
+	if (ids.empty())
+		ids.push_back("");
+
+	for (i = 0; i < ids.size() && i < QHY9_MAX_CAMERAS; i++) {
+		if (i == 0)
+			snprintf(name, sizeof(name), "QHY9");
+		else
+			snprintf(name, sizeof(name), "QHY9 %d", (int) i + 1);
+
+		cameras.push_back(new QHY9(i, ids[i].c_str()));
+		cameras.back()->setDeviceName(name);
+	}
+}
 
-static QHY9 *initialize()
+/* is a client message for this camera ? NULL dev is for all of them */
+static bool for_camera(QHY9 *camera, const char *dev)
 {
-	if (!camera)
-		camera = new QHY9();
-	return camera;
+	if (dev && strcmp(dev, camera->getDeviceName()))
+		return false;
+
+	qhy9_trace_set_source(camera->getIndex());
+	return true;
 }
 
 void ISGetProperties(const char *dev)
 {
-	if (!initialize() || (dev && strcmp(dev, camera->getDeviceName())))
-		return;
-	camera->ISGetProperties(dev);
+	initialize();
+	for (size_t i = 0; i < cameras.size(); i++)
+		if (for_camera(cameras[i], dev))
+			cameras[i]->ISGetProperties(dev);
 }
 
 void ISNewSwitch(const char *dev, const char *name, ISState *states, char *names[], int n)
 {
-	if (!initialize() || (dev && strcmp(dev, camera->getDeviceName())))
-		return;
-	camera->ISNewSwitch(dev, name, states, names, n);
+	initialize();
+	for (size_t i = 0; i < cameras.size(); i++)
+		if (for_camera(cameras[i], dev))
+			cameras[i]->ISNewSwitch(dev, name, states, names, n);
 }
 
 void ISNewText (const char *dev, const char *name, char *texts[], char *names[], int n)
 {
-	if (!initialize() || (dev && strcmp(dev, camera->getDeviceName())))
-		return;
-	camera->ISNewText(dev, name, texts, names, n);
+	initialize();
+	for (size_t i = 0; i < cameras.size(); i++)
+		if (for_camera(cameras[i], dev))
+			cameras[i]->ISNewText(dev, name, texts, names, n);
 }
 
 void ISNewNumber (const char *dev, const char *name, double values[], char *names[], int n)
 {
-	if (!initialize() || (dev && strcmp(dev, camera->getDeviceName())))
-		return;
-	camera->ISNewNumber(dev, name, values, names, n);
+	initialize();
+	for (size_t i = 0; i < cameras.size(); i++)
+		if (for_camera(cameras[i], dev))
+			cameras[i]->ISNewNumber(dev, name, values, names, n);
 }
 
 void ISNewBLOB (const char *dev, const char *name, int sizes[], int blobsizes[], char *blobs[], char *formats[], char *names[], int n)
@@ -57,16 +134,91 @@ void ISNewBLOB (const char *dev, const char *name, int sizes[], int blobsizes[],
 
 void ISSnoopDevice (XMLEle *root)
 {
-	if (initialize())
-		camera->ISSnoopDevice(root);
+	initialize();
+	for (size_t i = 0; i < cameras.size(); i++)
+		if (for_camera(cameras[i], NULL))
+			cameras[i]->ISSnoopDevice(root);
 }
 
 
 
-QHY9::QHY9()
+QHY9::QHY9(int index, const char *device)
 	: INDI::CCD()
 {
-	usb_handle = NULL;
+	cameraIndex = index;
+	usbDevice = device ? device : "";
+
+	transport = NULL;
+	usb = NULL;
+	deviceLost = false;
+	resumeExposure = false;
+
+	pthread_mutex_init(&readoutLock, NULL);
+	pthread_cond_init(&readoutCond, NULL);
+	readoutRunning = false;
+	readoutQuit = false;
+	readoutJob = NULL;
+	readoutActive = NULL;
+	readoutPipe[0] = readoutPipe[1] = -1;
+	readoutCallback = -1;
+	exposureTimer = -1;
+	wakePipe[0] = wakePipe[1] = -1;
+	stagingBuffer = NULL;
+	stagingSize = 0;
+	Downloading = false;
+	framePartial = false;
+	framePackets = frameTotalPackets = 0;
+	exposureArmed = false;
+	sequenceAbort = false;
+	REGValid = false;
+
+	SequenceCount = 0;
+	SequenceRemaining = 0;
+
+	coolerCycles = 0;
+	cooler.setTelemetry(&telemetry);
+	historySent = 0;
+
+	gateWaiting = false;
+	gateDuration = 0;
+	compressPixels = 0;
+	statsPixels = 0;
+	frameMeasured = false;
+	memset(&frameStats, 0, sizeof(frameStats));
+	calibRescan = false;
+	frameCalibrated = false;
+	memset(&frameTemp, 0, sizeof(frameTemp));
+
+	libraryJob = 0;
+	libraryActive = false;
+	libraryPending = false;
+	librarySaved = false;
+	pendingDuration = 0;
+
+	focusLoop = false;
+	focusRestart = false;
+	focusFrames = 0;
+	memset(&focusLast, 0, sizeof(focusLast));
+
+	videoRunning = false;
+	videoPending = false;
+	videoWake = false;
+	videoSent = 0;
+	videoStreamed = 0;
+	videoRateSeq = 0;
+	videoTimer = -1;
+	videoMeasure = false;
+	videoStatsQuit = false;
+	videoStatsReady = false;
+	videoMeasured = 0;
+	memset(&videoStats, 0, sizeof(videoStats));
+	videoRecording = false;
+	videoRecordQuit = false;
+	recordSkipped = 0;
+	clock_gettime(CLOCK_MONOTONIC, &lastClientExposure);
+
+	memset(armPhase, 0, sizeof(armPhase));
+	memset(framePhase, 0, sizeof(framePhase));
 
 	SetCCDCapability(CCD_HAS_SHUTTER | CCD_HAS_COOLER | CCD_CAN_ABORT);
 
@@ -90,6 +242,8 @@ QHY9::QHY9()
 
 bool QHY9::initProperties()
 {
+	QHY9CoolerStatus status;
+
 	INDI::CCD::initProperties();
 	initFilterProperties(getDeviceName(), FILTER_TAB);
 
@@ -115,6 +269,249 @@ bool QHY9::initProperties()
 	IUFillNumberVector(&OffsetNP, &OffsetN[0], 1, getDeviceName(), "CCD_OFFSET", "CCD Offset",
 			   IMAGE_SETTINGS_TAB, IP_RW, 60, IPS_IDLE);
 
+	// Software binning
+	IUFillSwitch(&SoftBinS[0], "SOFT_BIN_SUM",     "Sum",     ISS_ON);
+	IUFillSwitch(&SoftBinS[1], "SOFT_BIN_AVERAGE", "Average", ISS_OFF);
+	IUFillSwitchVector(&SoftBinSP, SoftBinS, 2, getDeviceName(), "SOFT_BIN_MODE", "Software Bin",
+			   IMAGE_SETTINGS_TAB, IP_RW, ISR_1OFMANY, 0, IPS_IDLE);
+
+	// Byte swap
+	IUFillSwitch(&ByteSwapS[0], "BYTE_SWAP_OFF", "Off", ISS_ON);
+	IUFillSwitch(&ByteSwapS[1], "BYTE_SWAP_ON",  "On",  ISS_OFF);
+	IUFillSwitchVector(&ByteSwapSP, ByteSwapS, 2, getDeviceName(), "BYTE_SWAP", "Byte Swap",
+			   OPTIONS_TAB, IP_RW, ISR_1OFMANY, 0, IPS_IDLE);
+
+	// Sequence capture
+	IUFillNumber(&SequenceN[0], "FRAMES",   "Frames",       "%4.0f", 1, 9999, 1, 10);
+	IUFillNumber(&SequenceN[1], "EXPOSURE", "Exposure (s)", "%5.3f", MINIMUM_CCD_EXPOSURE, 3600, 1, 1);
+	IUFillNumberVector(&SequenceNP, SequenceN, 2, getDeviceName(), "CCD_SEQUENCE", "Sequence",
+			   MAIN_CONTROL_TAB, IP_RW, 60, IPS_IDLE);
+
+	// USB transfers
+	IUFillNumber(&USBTransferN[0], "TRANSFERS", "In flight", "%2.0f", 1, QHY9Readout::MAX_TRANSFERS, 1,
+		     readout.getTransferCount());
+	IUFillNumber(&USBTransferN[1], "TRANSFER_KB", "Size (KiB)", "%4.0f", 16, 4096, 16,
+		     readout.getTransferSize() / 1024);
+	IUFillNumber(&USBTransferN[2], "TIMEOUT_MS", "Timeout (ms)", "%5.0f", 100, 60000, 500,
+		     readout.getTimeout());
+	IUFillNumberVector(&USBTransferNP, USBTransferN, 3, getDeviceName(), "USB_TRANSFERS", "USB Transfers",
+			   OPTIONS_TAB, IP_RW, 60, IPS_IDLE);
+
+	// Frame timing
+	for (int i = 0; i < QHY9_NPHASES; i++) {
+		static const char *stat[3] = { "LAST", "MEAN", "P95" };
+		char name[32], label[32];
+
+		for (int j = 0; j < 3; j++) {
+			snprintf(name, sizeof(name), "%s_%s", qhy9_phase_name(i), stat[j]);
+			snprintf(label, sizeof(label), "%s %s (ms)", qhy9_phase_name(i), stat[j]);
+			IUFillNumber(&TimingN[i * 3 + j], name, label, "%9.2f", 0, 1e9, 0, 0);
+		}
+	}
+	IUFillNumberVector(&TimingNP, TimingN, QHY9_NPHASES * 3, getDeviceName(), "CCD_TIMING", "Frame Timing",
+			   TIMING_TAB, IP_RO, 60, IPS_IDLE);
+
+	IUFillSwitch(&TimingFitsS[0], "TIMING_FITS_OFF", "Off", ISS_ON);
+	IUFillSwitch(&TimingFitsS[1], "TIMING_FITS_ON",  "On",  ISS_OFF);
+	IUFillSwitchVector(&TimingFitsSP, TimingFitsS, 2, getDeviceName(), "TIMING_FITS", "Timing in FITS",
+			   TIMING_TAB, IP_RW, ISR_1OFMANY, 0, IPS_IDLE);
+
+	// Preview, a downsampled and stretched PGM ahead of the full frame
+	IUFillSwitch(&PreviewS[0], "PREVIEW_OFF", "Off", ISS_ON);
+	IUFillSwitch(&PreviewS[1], "PREVIEW_ON",  "On",  ISS_OFF);
+	IUFillSwitchVector(&PreviewSP, PreviewS, 2, getDeviceName(), "CCD_PREVIEW", "Preview",
+			   IMAGE_SETTINGS_TAB, IP_RW, ISR_1OFMANY, 0, IPS_IDLE);
+
+	IUFillNumber(&PreviewN[0], "FACTOR", "Downsample", "%2.0f", 1, 16, 1, 4);
+	IUFillNumberVector(&PreviewNP, PreviewN, 1, getDeviceName(), "CCD_PREVIEW_SETTINGS", "Preview",
+			   IMAGE_SETTINGS_TAB, IP_RW, 60, IPS_IDLE);
+
+	IUFillBLOB(&PreviewB[0], "PREVIEW", "Preview", ".pgm");
+	IUFillBLOBVector(&PreviewBP, PreviewB, 1, getDeviceName(), "CCD_PREVIEW_IMAGE", "Preview Image",
+			 IMAGE_SETTINGS_TAB, IP_RO, 60, IPS_IDLE);
+
+	// Calibration, master frames from a directory applied to light frames
+	IUFillSwitch(&CalibS[0], "CALIB_OFF", "Off", ISS_ON);
+	IUFillSwitch(&CalibS[1], "CALIB_ON",  "On",  ISS_OFF);
+	IUFillSwitchVector(&CalibSP, CalibS, 2, getDeviceName(), "CCD_CALIBRATION", "Calibrate",
+			   CALIB_TAB, IP_RW, ISR_1OFMANY, 0, IPS_IDLE);
+
+	IUFillText(&CalibDirT[0], "DIR", "Masters", "");
+	IUFillTextVector(&CalibDirTP, CalibDirT, 1, getDeviceName(), "CALIB_DIR", "Library",
+			 CALIB_TAB, IP_RW, 60, IPS_IDLE);
+
+	IUFillNumber(&CalibSetN[0], "TEMP_TOL", "Dark temperature (C, +/-)", "%4.1f", 0.1, 20, 0.5, 2);
+	IUFillNumber(&CalibSetN[1], "PEDESTAL", "Pedestal (ADU)", "%5.0f", 0, 10000, 10, 100);
+	IUFillNumber(&CalibSetN[2], "CACHE_MB", "Cache (MiB)", "%5.0f", 64, 16384, 64, 512);
+	IUFillNumberVector(&CalibSetNP, CalibSetN, 3, getDeviceName(), "CALIB_SETTINGS", "Settings",
+			   CALIB_TAB, IP_RW, 60, IPS_IDLE);
+
+	IUFillNumber(&CalibLibN[0], "BIAS", "Bias masters", "%3.0f", 0, 1000, 0, 0);
+	IUFillNumber(&CalibLibN[1], "DARK", "Dark masters", "%3.0f", 0, 1000, 0, 0);
+	IUFillNumber(&CalibLibN[2], "FLAT", "Flat masters", "%3.0f", 0, 1000, 0, 0);
+	IUFillNumber(&CalibLibN[3], "CACHED_MB", "Cached (MiB)", "%5.0f", 0, 16384, 0, 0);
+	IUFillNumberVector(&CalibLibNP, CalibLibN, 4, getDeviceName(), "CALIB_LIBRARY", "Found",
+			   CALIB_TAB, IP_RO, 60, IPS_IDLE);
+
+	IUFillText(&CalibUsedT[0], "BIAS", "Bias", "");
+	IUFillText(&CalibUsedT[1], "DARK", "Dark", "");
+	IUFillText(&CalibUsedT[2], "FLAT", "Flat", "");
+	IUFillTextVector(&CalibUsedTP, CalibUsedT, 3, getDeviceName(), "CALIB_MASTERS", "Last frame",
+			 CALIB_TAB, IP_RO, 60, IPS_IDLE);
+
+	// Focus loop, a small ROI exposed back to back
+	IUFillSwitch(&FocusS[0], "FOCUS_START", "Start", ISS_OFF);
+	IUFillSwitch(&FocusS[1], "FOCUS_STOP",  "Stop",  ISS_ON);
+	IUFillSwitchVector(&FocusSP, FocusS, 2, getDeviceName(), "CCD_FOCUS_LOOP", "Focus Loop",
+			   FOCUS_TAB, IP_RW, ISR_1OFMANY, 0, IPS_IDLE);
+
+	IUFillNumber(&FocusSetN[0], "EXPOSURE", "Exposure (s)", "%5.3f", MINIMUM_CCD_EXPOSURE, 60, 0.1, 0.1);
+	IUFillNumber(&FocusSetN[1], "X", "Center X", "%4.0f", 0, QHY9_SENSOR_WIDTH, 1, QHY9_SENSOR_WIDTH / 2);
+	IUFillNumber(&FocusSetN[2], "Y", "Center Y", "%4.0f", 0, QHY9_SENSOR_HEIGHT, 1, QHY9_SENSOR_HEIGHT / 2);
+	IUFillNumber(&FocusSetN[3], "SIZE", "Size (px)", "%4.0f", 32, 1024, 32, 256);
+	IUFillNumber(&FocusSetN[4], "BIN", "Binning", "%2.0f", 1, QHY9_MAX_HW_BIN, 1, 1);
+	IUFillNumberVector(&FocusSetNP, FocusSetN, 5, getDeviceName(), "CCD_FOCUS_SETTINGS", "ROI",
+			   FOCUS_TAB, IP_RW, 60, IPS_IDLE);
+
+	IUFillNumber(&FocusStatN[0], "FRAMES", "Frames", "%6.0f", 0, 1e9, 0, 0);
+	IUFillNumber(&FocusStatN[1], "FPS", "Frames / s", "%5.2f", 0, 1000, 0, 0);
+	IUFillNumberVector(&FocusStatNP, FocusStatN, 2, getDeviceName(), "CCD_FOCUS_STATUS", "Loop",
+			   FOCUS_TAB, IP_RO, 60, IPS_IDLE);
+
+	// Live video, the camera runs free into a frame ring
+	IUFillSwitch(&VideoS[0], "VIDEO_ON",  "On",  ISS_OFF);
+	IUFillSwitch(&VideoS[1], "VIDEO_OFF", "Off", ISS_ON);
+	IUFillSwitchVector(&VideoSP, VideoS, 2, getDeviceName(), "CCD_VIDEO", "Live Video",
+			   VIDEO_TAB, IP_RW, ISR_1OFMANY, 0, IPS_IDLE);
+
+	IUFillNumber(&VideoSetN[0], "EXPOSURE", "Exposure (ms)", "%5.0f", 1, 10000, 10, 50);
+	IUFillNumber(&VideoSetN[1], "STREAM_FPS", "Stream (frames / s)", "%3.0f", 0, 60, 1, 10);
+	IUFillNumber(&VideoSetN[2], "SCALE", "Stream downsample", "%2.0f", 1, 16, 1, 1);
+	IUFillNumber(&VideoSetN[3], "SLOTS", "Ring slots", "%2.0f", 4, QHY9FrameRing::MAX_SLOTS, 1, 8);
+	IUFillNumberVector(&VideoSetNP, VideoSetN, 4, getDeviceName(), "CCD_VIDEO_SETTINGS", "Settings",
+			   VIDEO_TAB, IP_RW, 60, IPS_IDLE);
+
+	IUFillNumber(&VideoStatN[0], "FRAMES", "Frames", "%8.0f", 0, 1e12, 0, 0);
+	IUFillNumber(&VideoStatN[1], "FPS", "Frames / s", "%5.1f", 0, 1000, 0, 0);
+	IUFillNumber(&VideoStatN[2], "STREAMED", "Streamed", "%8.0f", 0, 1e12, 0, 0);
+	IUFillNumber(&VideoStatN[3], "MEASURED", "Measured", "%8.0f", 0, 1e12, 0, 0);
+	IUFillNumberVector(&VideoStatNP, VideoStatN, 4, getDeviceName(), "CCD_VIDEO_STATUS", "Status",
+			   VIDEO_TAB, IP_RO, 60, IPS_IDLE);
+
+	IUFillBLOB(&VideoB[0], "FRAME", "Frame", ".pgm");
+	IUFillBLOBVector(&VideoBP, VideoB, 1, getDeviceName(), "CCD_VIDEO_STREAM", "Stream",
+			 VIDEO_TAB, IP_RO, 60, IPS_IDLE);
+
+	// Raw recording, frames written to a local file as they come
+	IUFillSwitch(&RecordS[0], "RECORD_OFF",  "Off",          ISS_ON);
+	IUFillSwitch(&RecordS[1], "RECORD_ON",   "On",           ISS_OFF);
+	IUFillSwitch(&RecordS[2], "RECORD_ONLY", "Instead of sending", ISS_OFF);
+	IUFillSwitchVector(&RecordSP, RecordS, 3, getDeviceName(), "CCD_RECORD", "Record",
+			   RECORD_TAB, IP_RW, ISR_1OFMANY, 0, IPS_IDLE);
+
+	IUFillText(&RecordDirT[0], "DIR", "Directory", "");
+	IUFillTextVector(&RecordDirTP, RecordDirT, 1, getDeviceName(), "CCD_RECORD_DIR", "Directory",
+			 RECORD_TAB, IP_RW, 60, IPS_IDLE);
+
+	IUFillNumber(&RecordSetN[0], "PREALLOC_MB", "Preallocate (MiB)", "%6.0f", 0, 1048576, 1024, 4096);
+	IUFillNumber(&RecordSetN[1], "BUFFER_MB", "Buffers (MiB)", "%4.0f", 1, 1024, 8, 64);
+	IUFillNumberVector(&RecordSetNP, RecordSetN, 2, getDeviceName(), "CCD_RECORD_SETTINGS", "Settings",
+			   RECORD_TAB, IP_RW, 60, IPS_IDLE);
+
+	IUFillNumber(&RecordStatN[0], "FRAMES", "Frames", "%8.0f", 0, 1e12, 0, 0);
+	IUFillNumber(&RecordStatN[1], "DROPPED", "Dropped", "%8.0f", 0, 1e12, 0, 0);
+	IUFillNumber(&RecordStatN[2], "MB", "Written (MiB)", "%8.0f", 0, 1e12, 0, 0);
+	IUFillNumber(&RecordStatN[3], "MBPS", "Disk (MB / s)", "%6.1f", 0, 1e6, 0, 0);
+	IUFillNumberVector(&RecordStatNP, RecordStatN, 4, getDeviceName(), "CCD_RECORD_STATUS", "Status",
+			   RECORD_TAB, IP_RO, 60, IPS_IDLE);
+
+	IUFillText(&RecordFileT[0], "FILE", "File", "");
+	IUFillTextVector(&RecordFileTP, RecordFileT, 1, getDeviceName(), "CCD_RECORD_FILE", "Recording",
+			 RECORD_TAB, IP_RO, 60, IPS_IDLE);
+
+	// Frame statistics, counted while the frame downloads
+	IUFillSwitch(&StatsS[0], "STATS_OFF",  "Off",             ISS_ON);
+	IUFillSwitch(&StatsS[1], "STATS_ON",   "On",              ISS_OFF);
+	IUFillSwitch(&StatsS[2], "STATS_ONLY", "Only, no images", ISS_OFF);
+	IUFillSwitchVector(&StatsSP, StatsS, 3, getDeviceName(), "CCD_STATS", "Statistics",
+			   STATS_TAB, IP_RW, ISR_1OFMANY, 0, IPS_IDLE);
+
+	IUFillNumber(&StatsSetN[0], "THRESHOLD", "Star threshold (sigma), 0 = none", "%4.1f", 0, 100, 0.5, 5);
+	IUFillNumber(&StatsSetN[1], "RADIUS", "Star box radius (px)", "%3.0f", 2, 64, 1, 12);
+	IUFillNumberVector(&StatsSetNP, StatsSetN, 2, getDeviceName(), "CCD_STATS_SETTINGS", "Settings",
+			   STATS_TAB, IP_RW, 60, IPS_IDLE);
+
+	IUFillNumber(&StatsN[0], "MIN", "Min", "%5.0f", 0, 65535, 0, 0);
+	IUFillNumber(&StatsN[1], "MAX", "Max", "%5.0f", 0, 65535, 0, 0);
+	IUFillNumber(&StatsN[2], "MEAN", "Mean", "%7.1f", 0, 65535, 0, 0);
+	IUFillNumber(&StatsN[3], "MEDIAN", "Median", "%5.0f", 0, 65535, 0, 0);
+	IUFillNumber(&StatsN[4], "MAD", "MAD", "%5.0f", 0, 65535, 0, 0);
+	IUFillNumber(&StatsN[5], "STARS", "Stars", "%3.0f", 0, QHY9Stats::MAX_STARS, 0, 0);
+	IUFillNumber(&StatsN[6], "HFR", "HFR (px)", "%5.2f", 0, 100, 0, 0);
+	IUFillNumber(&StatsN[7], "FWHM", "FWHM (px)", "%5.2f", 0, 100, 0, 0);
+	IUFillNumber(&StatsN[8], "MS", "After download (ms)", "%6.1f", 0, 1e6, 0, 0);
+	IUFillNumberVector(&StatsNP, StatsN, 9, getDeviceName(), "CCD_FRAME_STATS", "Last Frame",
+			   STATS_TAB, IP_RO, 60, IPS_IDLE);
+
+	// Dark library, masters taken into CALIB_DIR while the camera is idle
+	IUFillSwitch(&LibraryS[0], "LIBRARY_ON",  "On",  ISS_OFF);
+	IUFillSwitch(&LibraryS[1], "LIBRARY_OFF", "Off", ISS_ON);
+	IUFillSwitchVector(&LibrarySP, LibraryS, 2, getDeviceName(), "DARK_LIBRARY", "Dark Library",
+			   LIBRARY_TAB, IP_RW, ISR_1OFMANY, 0, IPS_IDLE);
+
+	IUFillText(&LibraryPlanT[0], "EXPOSURES", "Exposures (s), 0 = bias", "0,1,10,60,300");
+	IUFillText(&LibraryPlanT[1], "BINS", "Binnings", "1,2");
+	IUFillText(&LibraryPlanT[2], "GAINS", "Gains, empty = current", "");
+	IUFillTextVector(&LibraryPlanTP, LibraryPlanT, 3, getDeviceName(), "DARK_LIBRARY_PLAN", "Plan",
+			 LIBRARY_TAB, IP_RW, 60, IPS_IDLE);
+
+	IUFillNumber(&LibrarySetN[0], "FRAMES", "Frames per master", "%3.0f", 1, 500, 1, 20);
+	IUFillNumber(&LibrarySetN[1], "IDLE_SEC", "Idle before starting (s)", "%5.0f", 0, 86400, 10, 60);
+	IUFillNumber(&LibrarySetN[2], "MAX_AGE_D", "Retake after (days)", "%4.0f", 1, 3650, 1, 30);
+	IUFillNumberVector(&LibrarySetNP, LibrarySetN, 3, getDeviceName(), "DARK_LIBRARY_SETTINGS", "Settings",
+			   LIBRARY_TAB, IP_RW, 60, IPS_IDLE);
+
+	IUFillNumber(&LibraryStatN[0], "MASTER", "Master", "%3.0f", 0, 10000, 0, 0);
+	IUFillNumber(&LibraryStatN[1], "MASTERS", "Of", "%3.0f", 0, 10000, 0, 0);
+	IUFillNumber(&LibraryStatN[2], "FRAME", "Frame", "%3.0f", 0, 500, 0, 0);
+	IUFillNumber(&LibraryStatN[3], "FRAMES", "Of", "%3.0f", 0, 500, 0, 0);
+	IUFillNumberVector(&LibraryStatNP, LibraryStatN, 4, getDeviceName(), "DARK_LIBRARY_STATUS", "Progress",
+			   LIBRARY_TAB, IP_RO, 60, IPS_IDLE);
+
+	// Compressed frames, deflated in tiles across threads while they download
+	IUFillSwitch(&CompressS[0], "COMPRESS_OFF", "Off", ISS_ON);
+	IUFillSwitch(&CompressS[1], "COMPRESS_ON",  "On",  ISS_OFF);
+	IUFillSwitchVector(&CompressSP, CompressS, 2, getDeviceName(), "CCD_FAST_COMPRESS", "Compress",
+			   COMPRESS_TAB, IP_RW, ISR_1OFMANY, 0, IPS_IDLE);
+
+	IUFillNumber(&CompressSetN[0], "LEVEL", "Level", "%1.0f", 0, 9, 1, compressor.getLevel());
+	IUFillNumber(&CompressSetN[1], "THREADS", "Threads, 0 = all CPUs", "%2.0f", 0, QHY9Compressor::MAX_THREADS, 1, 0);
+	IUFillNumberVector(&CompressSetNP, CompressSetN, 2, getDeviceName(), "COMPRESS_SETTINGS", "Settings",
+			   COMPRESS_TAB, IP_RW, 60, IPS_IDLE);
+
+	IUFillNumber(&CompressStatN[0], "RATIO", "Ratio", "%5.2f", 0, 100, 0, 0);
+	IUFillNumber(&CompressStatN[1], "WALL_MS", "Total (ms)", "%7.1f", 0, 1e9, 0, 0);
+	IUFillNumber(&CompressStatN[2], "TAIL_MS", "After download (ms)", "%7.1f", 0, 1e9, 0, 0);
+	IUFillNumber(&CompressStatN[3], "CPU_MS", "CPU (ms)", "%7.1f", 0, 1e9, 0, 0);
+	IUFillNumber(&CompressStatN[4], "SIZE_KB", "Size (KiB)", "%7.0f", 0, 1e9, 0, 0);
+	IUFillNumberVector(&CompressStatNP, CompressStatN, 5, getDeviceName(), "COMPRESS_STATS", "Last Frame",
+			   COMPRESS_TAB, IP_RO, 60, IPS_IDLE);
+
+	// Which camera this device drives
+	IUFillText(&USBDeviceT[0], "PORT", "Port or serial", usbDevice.c_str());
+	IUFillTextVector(&USBDeviceTP, USBDeviceT, 1, getDeviceName(), "USB_DEVICE", "USB Device",
+			 OPTIONS_TAB, IP_RW, 60, IPS_IDLE);
+
+	// Trace ring dump
+	IUFillText(&TraceFileT[0], "TRACE_FILE", "File", "/tmp/indi_qhy9.trace");
+	IUFillTextVector(&TraceFileTP, TraceFileT, 1, getDeviceName(), "TRACE_FILE", "Trace File",
+			 OPTIONS_TAB, IP_RW, 60, IPS_IDLE);
+
+	IUFillSwitch(&TraceDumpS[0], "TRACE_DUMP_TEXT",   "Text",   ISS_OFF);
+	IUFillSwitch(&TraceDumpS[1], "TRACE_DUMP_BINARY", "Binary", ISS_OFF);
+	IUFillSwitchVector(&TraceDumpSP, TraceDumpS, 2, getDeviceName(), "TRACE_DUMP", "Dump Trace",
+			   OPTIONS_TAB, IP_RW, ISR_ATMOST1, 0, IPS_IDLE);
+
 	// TEC Power
 	IUFillNumber(&TECN[1], "TEC_POWER", "Output (%)", "%5.2f", 0, 100, 0, 0);
 	IUFillNumberVector(&TECPowerNP, &TECN[1], 1, getDeviceName(), "CCD_TEC_POWER", "TEC",
@@ -125,7 +522,51 @@ bool QHY9::initProperties()
 	IUFillNumberVector(&TECLimitNP, &TECN[2], 1, getDeviceName(), "CCD_TEC_LIMIT", "TEC",
 			   MAIN_CONTROL_TAB, IP_RW, 60, IPS_IDLE);
 
+	// TEC controller gains, per 60 degC of error
+	cooler.getStatus(&status);
+	IUFillNumber(&TECPidN[0], "KP", "Proportional", "%7.4f", 0, 100, 0, status.kp);
+	IUFillNumber(&TECPidN[1], "KI", "Integral (1/s)", "%7.4f", 0, 10, 0, status.ki);
+	IUFillNumber(&TECPidN[2], "KD", "Derivative (s)", "%7.4f", 0, 1000, 0, status.kd);
+	IUFillNumberVector(&TECPidNP, TECPidN, 3, getDeviceName(), "CCD_TEC_PID", "TEC PID",
+			   OPTIONS_TAB, IP_RW, 60, IPS_IDLE);
+
+	// Relay auto-tune of the gains, at the current setpoint
+	IUFillSwitch(&TECTuneS[0], "TUNE_START", "Start", ISS_OFF);
+	IUFillSwitch(&TECTuneS[1], "TUNE_ABORT", "Abort", ISS_OFF);
+	IUFillSwitchVector(&TECTuneSP, TECTuneS, 2, getDeviceName(), "CCD_TEC_AUTOTUNE", "TEC Auto-tune",
+			   OPTIONS_TAB, IP_RW, ISR_ATMOST1, 0, IPS_IDLE);
+
+	// Thermal stability over the gate window
+	IUFillNumber(&ThermalN[0], "ERROR", "Max error (C)", "%6.2f", 0, 100, 0, 0);
+	IUFillNumber(&ThermalN[1], "SLOPE", "Slope (C/min)", "%6.3f", -100, 100, 0, 0);
+	IUFillNumber(&ThermalN[2], "MIN", "Min (C)", "%6.2f", -50, 50, 0, 0);
+	IUFillNumber(&ThermalN[3], "MAX", "Max (C)", "%6.2f", -50, 50, 0, 0);
+	IUFillNumber(&ThermalN[4], "MEAN", "Mean (C)", "%6.2f", -50, 50, 0, 0);
+	IUFillNumber(&ThermalN[5], "TEC_MEAN", "TEC mean (%)", "%5.1f", 0, 100, 0, 0);
+	IUFillNumberVector(&ThermalNP, ThermalN, 6, getDeviceName(), "CCD_THERMAL", "Stability",
+			   THERMAL_TAB, IP_RO, 60, IPS_IDLE);
+
+	// Exposure gate: wait for the above to be inside the limits
+	IUFillSwitch(&ThermalGateS[0], "GATE_ON",  "On",  ISS_OFF);
+	IUFillSwitch(&ThermalGateS[1], "GATE_OFF", "Off", ISS_ON);
+	IUFillSwitchVector(&ThermalGateSP, ThermalGateS, 2, getDeviceName(), "THERMAL_GATE", "Exposure Gate",
+			   THERMAL_TAB, IP_RW, ISR_1OFMANY, 0, IPS_IDLE);
+
+	IUFillNumber(&ThermalLimitN[0], "MAX_ERROR", "Max error (C)", "%5.2f", 0.05, 10, 0.05, 0.3);
+	IUFillNumber(&ThermalLimitN[1], "MAX_SLOPE", "Max slope (C/min)", "%5.2f", 0.01, 10, 0.01, 0.1);
+	IUFillNumber(&ThermalLimitN[2], "WINDOW", "Window (s)", "%3.0f", 10, 290, 10, 60);
+	IUFillNumber(&ThermalLimitN[3], "TIMEOUT", "Timeout (s), 0 = none", "%4.0f", 0, 7200, 60, 0);
+	IUFillNumberVector(&ThermalLimitNP, ThermalLimitN, 4, getDeviceName(), "THERMAL_GATE_LIMITS", "Gate Limits",
+			   THERMAL_TAB, IP_RW, 60, IPS_IDLE);
+
+	// Downsampled temperature history, CSV
+	IUFillBLOB(&TempHistoryB[0], "TEMP_HISTORY", "History", ".csv");
+	IUFillBLOBVector(&TempHistoryBP, TempHistoryB, 1, getDeviceName(), "CCD_TEMP_HISTORY", "Temperature History",
+			 THERMAL_TAB, IP_RO, 60, IPS_IDLE);
+
 	PrimaryCCD.setMinMaxStep("CCD_EXPOSURE", "CCD_EXPOSURE_VALUE", MINIMUM_CCD_EXPOSURE, 3600, 1, false);
+	PrimaryCCD.setMinMaxStep("CCD_BINNING", "HOR_BIN", 1, QHY9_MAX_BIN, 1, false);
+	PrimaryCCD.setMinMaxStep("CCD_BINNING", "VER_BIN", 1, QHY9_MAX_BIN, 1, false);
 
 	addAuxControls();
 
@@ -138,12 +579,58 @@ void QHY9::ISGetProperties(const char *dev)
 {
 	INDI::CCD::ISGetProperties(dev);
 
+	defineText(&USBDeviceTP);
+
 	if (isConnected()) {
 		defineSwitch(&ReadOutSP);
 		defineNumber(&GainNP);
 		defineNumber(&OffsetNP);
 		defineNumber(&TECLimitNP);
 		defineNumber(&TECPowerNP);
+		defineNumber(&TECPidNP);
+		defineSwitch(&TECTuneSP);
+		defineNumber(&ThermalNP);
+		defineSwitch(&ThermalGateSP);
+		defineNumber(&ThermalLimitNP);
+		defineBLOB(&TempHistoryBP);
+		defineNumber(&SequenceNP);
+		defineSwitch(&SoftBinSP);
+		defineSwitch(&ByteSwapSP);
+		defineSwitch(&PreviewSP);
+		defineNumber(&PreviewNP);
+		defineBLOB(&PreviewBP);
+		defineNumber(&USBTransferNP);
+		defineNumber(&TimingNP);
+		defineSwitch(&TimingFitsSP);
+		defineSwitch(&CompressSP);
+		defineNumber(&CompressSetNP);
+		defineNumber(&CompressStatNP);
+		defineSwitch(&CalibSP);
+		defineText(&CalibDirTP);
+		defineNumber(&CalibSetNP);
+		defineNumber(&CalibLibNP);
+		defineText(&CalibUsedTP);
+		defineSwitch(&FocusSP);
+		defineNumber(&FocusSetNP);
+		defineNumber(&FocusStatNP);
+		defineSwitch(&VideoSP);
+		defineNumber(&VideoSetNP);
+		defineNumber(&VideoStatNP);
+		defineBLOB(&VideoBP);
+		defineSwitch(&RecordSP);
+		defineText(&RecordDirTP);
+		defineNumber(&RecordSetNP);
+		defineNumber(&RecordStatNP);
+		defineText(&RecordFileTP);
+		defineSwitch(&StatsSP);
+		defineNumber(&StatsSetNP);
+		defineNumber(&StatsNP);
+		defineSwitch(&LibrarySP);
+		defineText(&LibraryPlanTP);
+		defineNumber(&LibrarySetNP);
+		defineNumber(&LibraryStatNP);
+		defineText(&TraceFileTP);
+		defineSwitch(&TraceDumpSP);
 		defineText(FilterNameTP);
 	}
 }
@@ -159,6 +646,50 @@ bool QHY9::updateProperties()
 		defineNumber(&OffsetNP);
 		defineNumber(&TECLimitNP);
 		defineNumber(&TECPowerNP);
+		defineNumber(&TECPidNP);
+		defineSwitch(&TECTuneSP);
+		defineNumber(&ThermalNP);
+		defineSwitch(&ThermalGateSP);
+		defineNumber(&ThermalLimitNP);
+		defineBLOB(&TempHistoryBP);
+		defineNumber(&SequenceNP);
+		defineSwitch(&SoftBinSP);
+		defineSwitch(&ByteSwapSP);
+		defineSwitch(&PreviewSP);
+		defineNumber(&PreviewNP);
+		defineBLOB(&PreviewBP);
+		defineNumber(&USBTransferNP);
+		defineNumber(&TimingNP);
+		defineSwitch(&TimingFitsSP);
+		defineSwitch(&CompressSP);
+		defineNumber(&CompressSetNP);
+		defineNumber(&CompressStatNP);
+		defineSwitch(&CalibSP);
+		defineText(&CalibDirTP);
+		defineNumber(&CalibSetNP);
+		defineNumber(&CalibLibNP);
+		defineText(&CalibUsedTP);
+		defineSwitch(&FocusSP);
+		defineNumber(&FocusSetNP);
+		defineNumber(&FocusStatNP);
+		defineSwitch(&VideoSP);
+		defineNumber(&VideoSetNP);
+		defineNumber(&VideoStatNP);
+		defineBLOB(&VideoBP);
+		defineSwitch(&RecordSP);
+		defineText(&RecordDirTP);
+		defineNumber(&RecordSetNP);
+		defineNumber(&RecordStatNP);
+		defineText(&RecordFileTP);
+		defineSwitch(&StatsSP);
+		defineNumber(&StatsSetNP);
+		defineNumber(&StatsNP);
+		defineSwitch(&LibrarySP);
+		defineText(&LibraryPlanTP);
+		defineNumber(&LibrarySetNP);
+		defineNumber(&LibraryStatNP);
+		defineText(&TraceFileTP);
+		defineSwitch(&TraceDumpSP);
 
 		defineNumber(&FilterSlotNP);
 		GetFilterNames(FILTER_TAB);
@@ -173,6 +704,50 @@ bool QHY9::updateProperties()
 		deleteProperty(OffsetNP.name);
 		deleteProperty(TECPowerNP.name);
 		deleteProperty(TECLimitNP.name);
+		deleteProperty(TECPidNP.name);
+		deleteProperty(TECTuneSP.name);
+		deleteProperty(ThermalNP.name);
+		deleteProperty(ThermalGateSP.name);
+		deleteProperty(ThermalLimitNP.name);
+		deleteProperty(TempHistoryBP.name);
+		deleteProperty(SequenceNP.name);
+		deleteProperty(SoftBinSP.name);
+		deleteProperty(ByteSwapSP.name);
+		deleteProperty(PreviewSP.name);
+		deleteProperty(PreviewNP.name);
+		deleteProperty(PreviewBP.name);
+		deleteProperty(USBTransferNP.name);
+		deleteProperty(TimingNP.name);
+		deleteProperty(TimingFitsSP.name);
+		deleteProperty(CompressSP.name);
+		deleteProperty(CompressSetNP.name);
+		deleteProperty(CompressStatNP.name);
+		deleteProperty(CalibSP.name);
+		deleteProperty(CalibDirTP.name);
+		deleteProperty(CalibSetNP.name);
+		deleteProperty(CalibLibNP.name);
+		deleteProperty(CalibUsedTP.name);
+		deleteProperty(FocusSP.name);
+		deleteProperty(FocusSetNP.name);
+		deleteProperty(FocusStatNP.name);
+		deleteProperty(VideoSP.name);
+		deleteProperty(VideoSetNP.name);
+		deleteProperty(VideoStatNP.name);
+		deleteProperty(VideoBP.name);
+		deleteProperty(RecordSP.name);
+		deleteProperty(RecordDirTP.name);
+		deleteProperty(RecordSetNP.name);
+		deleteProperty(RecordStatNP.name);
+		deleteProperty(RecordFileTP.name);
+		deleteProperty(StatsSP.name);
+		deleteProperty(StatsSetNP.name);
+		deleteProperty(StatsNP.name);
+		deleteProperty(LibrarySP.name);
+		deleteProperty(LibraryPlanTP.name);
+		deleteProperty(LibrarySetNP.name);
+		deleteProperty(LibraryStatNP.name);
+		deleteProperty(TraceFileTP.name);
+		deleteProperty(TraceDumpSP.name);
 
 		RemoveTimer(pollTimer);
 	}
@@ -183,37 +758,55 @@ bool QHY9::updateProperties()
 
 bool QHY9::Connect()
 {
-	libusb_device **devices;
-	libusb_device *dev;
-	struct libusb_device_descriptor desc;
-	unsigned int devID;
-	int i, n;
+	QHY9USBTransport *usb;
 
 	/* already connected ? */
-	if (usb_handle)
+	if (transport)
 		return true;
 
-	if (libusb_init(NULL))
-		return false;
-
-	n = libusb_get_device_list(NULL, &devices);
-	for (i = 0; i < n; i++) {
-		dev = devices[i];
+	REGValid = false;
+	phaseStats.reset();
 
-		if (libusb_get_device_descriptor(dev, &desc) < 0)
-			continue;
+	if (isSimulation()) {
+		transport = new QHY9SimTransport();
+	} else {
+		/* kept across connects, it holds the libusb context and hotplug watch */
+		if (!usb)
+			usb = new QHY9USBTransport(&readout);
+
+		if (!usb->open(USBDeviceT[0].text)) {
+			if (*USBDeviceT[0].text)
+				DEBUGF(INDI::Logger::DBG_ERROR, "No QHY9 camera at %s.", USBDeviceT[0].text);
+			else
+				DEBUG(INDI::Logger::DBG_ERROR, "No QHY9 camera found.");
+			return false;
+		}
+		transport = usb;
+	}
 
-		devID = (desc.idVendor << 16) + desc.idProduct;
-		if (devID == QHY9_USB_DEVID) {
+	deviceLost = false;
+	resumeExposure = false;
 
-			libusb_ref_device(dev);
-			libusb_free_device_list(devices, 1);
+	DEBUGF(INDI::Logger::DBG_SESSION, "Connected through %s transport.", transport->getName());
 
-			return !libusb_open(dev, &usb_handle);
-		}
+	if (!startReadoutThread()) {
+		if (transport == usb)
+			usb->close();
+		else
+			delete transport;
+		transport = NULL;
+		return false;
 	}
 
-	libusb_free_device_list(devices, 1);
+	telemetry.reset();
+	historySent = 0;
+
+	cooler.setTarget(TemperatureTarget);
+	cooler.setLimit(TECLimit / 100.0);
+	cooler.start(transport, cameraIndex);
+
+	transport->setHotplugHandler(hotplugHandler, this);
+	transport->setProgressHandler(downloadProgress, this);
 
 	return true;
 }
@@ -221,23 +814,62 @@ bool QHY9::Connect()
 
 bool QHY9::Disconnect()
 {
-	if (usb_handle) {
-		libusb_close(usb_handle);
-		usb_handle = NULL;
+	if (transport)
+		transport->setHotplugHandler(NULL, NULL);
+
+	stopReadoutThread();
+	cooler.stop();
+	compressor.abort();
+
+	/* the video frame went with the readout thread */
+	videoPending = false;
+	if (videoRunning)
+		endVideo(IPS_IDLE, NULL);
+	statistics.abort();
+
+	if (recorder.isOpen())
+		stopRecording(IPS_IDLE, NULL);
+
+	if (gateWaiting) {
+		gateWaiting = false;
+		InExposure = false;
+	}
 
-		libusb_exit(NULL);
+	if (focusLoop) {
+		focusLoop = focusRestart = false;
+		InExposure = false;
+		restoreFrameSettings(&focusSettings);
+		FocusSP.s = IPS_IDLE;
+	}
+
+	if (libraryActive || libraryPending)
+		InExposure = false;
+	libraryActive = libraryPending = false;
+	libraryRestore();
+	accumulator.reset();
+
+	if (TECTuneSP.s == IPS_BUSY) {
+		TECTuneSP.s = IPS_IDLE;
+		IDSetSwitch(&TECTuneSP, "Auto-tune aborted.");
 	}
 
+	if (transport == usb)
+		usb->close();
+	else
+		delete transport;
+	transport = NULL;
+
 	return true;
 }
 
+/* called with readoutLock held */
 double QHY9::calcTimeLeft()
 {
-	struct timeval now;
+	struct timespec now;
 	double timeLeft;
 
-	gettimeofday(&now, NULL);
-	timeLeft = (ExposureRequest - tv_diff(&now, &exposure_start)) / 1000.0;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	timeLeft = ts_ms(&exposure_end, &now) / 1000.0;
 
 	return (timeLeft > 0.0) ? timeLeft : 0.0;
 }
@@ -246,47 +878,113 @@ void QHY9::TimerHit()
 {
 	double timeLeft;
 
+	qhy9_trace_set_source(cameraIndex);
+
 	if (!isConnected())
 		return;
 
-	if (InExposure) {
-		timeLeft = calcTimeLeft();
-		PrimaryCCD.setExposureLeft(timeLeft);
+	/* the readout thread picks up the frame at exposure_end, this only reports progress */
+	if (InExposure && !libraryActive) {
+		pthread_mutex_lock(&readoutLock);
+		timeLeft = exposureArmed ? calcTimeLeft() : 0.0;
+		pthread_mutex_unlock(&readoutLock);
 
-		if (timeLeft < 1.0) {
-			if (timeLeft > 0.25) {
-				pollTimer = SetTimer(250);
-			} else if (timeLeft > 0.07) {
-				pollTimer = SetTimer(50);
-			} else {
-				PrimaryCCD.setExposureLeft(0);
-				GrabExposure();
+		PrimaryCCD.setExposureLeft(timeLeft);
+	}
 
-				pollTimer = SetTimer(POLLMS);
-			}
+	pollTimer = SetTimer(POLLMS);
 
-			return;
-		}
+	/* without hotplug this is where a returning camera is found */
+	if (deviceLost) {
+		recoverDevice();
+		return;
 	}
 
-
-	pollTimer = SetTimer(POLLMS);
 	updateTemperature();
+
+	if (gateWaiting)
+		checkExposureGate();
+
+	if (videoRunning)
+		updateVideo();
+
+	if (recorder.isOpen())
+		updateRecording();
+
+	if (LibraryS[0].s == ISS_ON)
+		libraryStep();
 }
 
 int QHY9::SetTemperature(double temperature)
 {
 	TemperatureTarget = temperature;
+	cooler.setTarget(temperature);
+
+	/* masters are per setpoint */
+	if (LibraryS[0].s == ISS_ON)
+		planLibrary();
+
 	return 1;			     // success
 }
 
 bool QHY9::StartExposure(float duration)
 {
-	CCDChip::CCD_FRAME type;
+	if (videoRunning || videoPending) {
+		DEBUG(INDI::Logger::DBG_ERROR, "Live video is running, stop it first.");
+		return false;
+	}
+
+	/* the library frame on the camera is dropped, this one starts in processCompletions once it is off */
+	if (libraryActive) {
+		libraryYield();
+
+		libraryPending = true;
+		pendingDuration = duration;
+
+		InExposure = true;
+		ExposureRequest = duration * 1000;
+		PrimaryCCD.setExposureDuration(duration);
+
+		return true;
+	}
 
 	if (InExposure)
 		return false;
 
+	if (Downloading) {
+		DEBUG(INDI::Logger::DBG_ERROR, "Previous frame is still downloading.");
+		return false;
+	}
+
+	libraryRestore();
+	clock_gettime(CLOCK_MONOTONIC, &lastClientExposure);
+
+	/* hold it in TimerHit until the sensor has settled */
+	if (ThermalGateS[0].s == ISS_ON && !thermalSettled()) {
+		gateWaiting = true;
+		gateDuration = duration;
+		clock_gettime(CLOCK_MONOTONIC, &gateStart);
+
+		InExposure = true;
+		ExposureRequest = duration * 1000;
+		PrimaryCCD.setExposureDuration(duration);
+
+		ThermalGateSP.s = IPS_BUSY;
+		IDSetSwitch(&ThermalGateSP, "Waiting for the temperature to settle before exposing.");
+
+		return true;
+	}
+
+	return beginExposure(duration);
+}
+
+/* main loop: upload, settle, shutter and start the camera */
+bool QHY9::beginExposure(float duration)
+{
+	CCDChip::CCD_FRAME type;
+	struct timespec t0, t1, t2, t3;
+	int dirty;
+
 	if (duration < MINIMUM_CCD_EXPOSURE)
 		duration = MINIMUM_CCD_EXPOSURE;
 
@@ -294,30 +992,100 @@ bool QHY9::StartExposure(float duration)
 	if (type == CCDChip::BIAS_FRAME)
 		duration = MINIMUM_CCD_EXPOSURE;
 
-	DEBUGF(INDI::Logger::DBG_SESSION, "Exposure set to %.3f ms", duration * 1000);
+	DEBUGF(libraryActive ? INDI::Logger::DBG_DEBUG : INDI::Logger::DBG_SESSION,
+	       "Exposure set to %.3f ms", duration * 1000);
 
 	ExposureRequest = duration * 1000;
 	PrimaryCCD.setExposureDuration(duration);
 
-	setCameraRegisters();
-	usleep(200 * 1000);
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	dirty = setCameraRegisters();
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	usleep(settleTime(dirty) * 1000);
+	clock_gettime(CLOCK_MONOTONIC, &t2);
 
 	if (type == CCDChip::DARK_FRAME || type == CCDChip::BIAS_FRAME) {
-		fprintf(stderr, "SHOOTING A DARK, CLOSING SHUTTER\n");
+		qhy9_trace_text("dark frame, closing shutter");
 		setShutter(SHUTTER_CLOSE);
 		usleep(500*1000);		     // shutter speed is 1/10 to 1/2 sec
 	}
-
-
+	clock_gettime(CLOCK_MONOTONIC, &t3);
 
 	InExposure = true;
-	gettimeofday(&exposure_start, NULL);
 
+	pthread_mutex_lock(&readoutLock);
+	armPhase[QHY9_PHASE_UPLOAD] = ts_ms(&t1, &t0);
+	armPhase[QHY9_PHASE_SETTLE] = ts_ms(&t2, &t1);
+	armPhase[QHY9_PHASE_SHUTTER] = ts_ms(&t3, &t2);
+	sequenceAbort = false;
+	markExposureStart();
 	beginVideo();
+	pthread_mutex_unlock(&readoutLock);
+
+	/* queue the download, the readout thread waits for the exposure to end */
+	if (!GrabExposure()) {
+		abortVideo();
+		InExposure = false;
+		return false;
+	}
+
+	return true;
+}
+
+/* called with readoutLock held, right before beginVideo */
+void QHY9::markExposureStart()
+{
+	clock_gettime(CLOCK_MONOTONIC, &exposure_start);
+	clock_gettime(CLOCK_REALTIME, &exposure_start_rt);
+
+	exposure_end = exposure_start;
+	ts_add(&exposure_end, ExposureRequest);
+
+	exposureArmed = true;
+}
+
+bool QHY9::startSequence(int count, double duration)
+{
+	if ((InExposure || Downloading) && !libraryActive) {
+		DEBUG(INDI::Logger::DBG_ERROR, "Cannot start a sequence while an exposure is in progress.");
+		return false;
+	}
+
+	SequenceCount = SequenceRemaining = count;
+
+	if (!StartExposure(duration)) {
+		SequenceCount = SequenceRemaining = 0;
+		return false;
+	}
+
+	INumberVectorProperty *exp = getNumber("CCD_EXPOSURE");
+	if (exp) {
+		exp->s = IPS_BUSY;
+		IDSetNumber(exp, NULL);
+	}
+
+	DEBUGF(INDI::Logger::DBG_SESSION, "Sequence of %d frames started.", count);
 
 	return true;
 }
 
+void QHY9::endSequence(IPState state)
+{
+	if (!SequenceCount)
+		return;
+
+	if (state == IPS_OK)
+		DEBUGF(INDI::Logger::DBG_SESSION, "Sequence of %d frames complete.", SequenceCount);
+	else
+		DEBUGF(INDI::Logger::DBG_SESSION, "Sequence stopped after %d of %d frames.",
+		       SequenceCount - SequenceRemaining, SequenceCount);
+
+	SequenceCount = SequenceRemaining = 0;
+
+	SequenceNP.s = state;
+	IDSetNumber(&SequenceNP, NULL);
+}
+
 bool QHY9::AbortExposure()
 {
 	if (!InExposure) {
@@ -325,17 +1093,78 @@ bool QHY9::AbortExposure()
 		return true;
 	}
 
+	if (focusLoop) {
+		stopFocus(IPS_IDLE, "Focus loop stopped.");
+		return true;
+	}
+
+	/* nothing on the camera yet */
+	if (gateWaiting) {
+		gateWaiting = false;
+		InExposure = false;
+		resumeExposure = false;
+
+		ThermalGateSP.s = IPS_IDLE;
+		IDSetSwitch(&ThermalGateSP, NULL);
+
+		endSequence(IPS_ALERT);
+		DEBUG(INDI::Logger::DBG_SESSION, "Exposure aborted.");
+
+		return true;
+	}
+
+	/* still behind a library frame that is already on its way out */
+	if (libraryPending) {
+		libraryPending = false;
+		InExposure = false;
+		resumeExposure = false;
+
+		endSequence(IPS_ALERT);
+		DEBUG(INDI::Logger::DBG_SESSION, "Exposure aborted.");
+
+		return true;
+	}
+
+	/* not the client's exposure, but the client wants the camera */
+	if (libraryActive) {
+		libraryYield();
+		return true;
+	}
+
 // FIXME: if camera still locks on exposure transfer, check if we can still abort
 // or the camera is dead
 
-	abortVideo();
+	abortCamera();
 	InExposure = false;
+	resumeExposure = false;
+
+	endSequence(IPS_ALERT);
 
 	DEBUG(INDI::Logger::DBG_SESSION, "Exposure aborted.");
 
 	return true;
 }
 
+/* main loop: stop the exposure or download on the camera, the frame comes back aborted */
+void QHY9::abortCamera()
+{
+	/* the readout thread may be about to start the next frame of a sequence */
+	pthread_mutex_lock(&readoutLock);
+	sequenceAbort = true;
+	exposureArmed = false;
+	if (readoutJob)
+		readoutJob->aborted = true;
+	if (readoutActive) {
+		readoutActive->aborted = true;
+		transport->cancelRead();
+	}
+	pthread_mutex_unlock(&readoutLock);
+
+	wakeReadoutThread();
+
+	abortVideo();
+}
+
 bool QHY9::UpdateCCDFrame(int x, int y, int w, int h)
 {
 	if (x < 0 || w <= 0 || x + w > QHY9_SENSOR_WIDTH ||
@@ -348,11 +1177,10 @@ bool QHY9::UpdateCCDFrame(int x, int y, int w, int h)
 
 bool QHY9::UpdateCCDBin(int hbin, int vbin)
 {
-	if (hbin < 1 || hbin > 4 || vbin != hbin)
+	if (hbin < 1 || hbin > QHY9_MAX_BIN || vbin < 1 || vbin > QHY9_MAX_BIN)
 		return false;
 
-	// camxbin = hbin
-	// camybin = vbin
+	// camera bins by qhy9_hardware_bin(hbin, vbin), GrabExposure does the rest
 
 	PrimaryCCD.setBin(hbin, vbin);
 
@@ -360,322 +1188,2407 @@ bool QHY9::UpdateCCDBin(int hbin, int vbin)
 }
 
 
+/* main loop: queue the download of the exposure in progress, hands the frame buffer to the readout thread */
 bool QHY9::GrabExposure()
 {
-	static uint16_t *buffer = NULL;
-	static size_t bufsize = 0;
-	struct timeval tv1, tv2;
-	int pos = 0;
-	int x, y, w, h, bx, by, ix, iy;
-	uint16_t *dst;
+	QHY9Frame *frame;
+	size_t size;
 
-	gettimeofday(&tv1, NULL);
-	fprintf(stderr, "GrabExposure enter: %ld msec from exposure_start\n", tv_diff(&tv1, &exposure_start));
-
-	/* grab to local buffer first */
-	if (bufsize != p_size * total_p) {
-		free(buffer);
-		bufsize = p_size * total_p;
-		buffer = (uint16_t *) malloc(bufsize);
-	}
+	if (!readoutRunning)
+		return false;
 
-	fprintf(stderr, "expecting: p_size %d, total_p %d, bufsize %zd\n",
-		p_size, total_p, bufsize);
+	frame = new QHY9Frame;
+	size = setupFrame(frame, ByteSwapS[1].s == ISS_ON);
 
-	if (bulk_transfer_read(QHY9_DATA_BULK_EP, (uint8_t *) buffer, p_size, total_p, &pos))
-		return false;
+	frame->compress = (CompressS[1].s == ISS_ON);
+	frame->previewFactor = (PreviewS[1].s == ISS_ON) ? (int) PreviewN[0].value : 0;
 
-	fprintf(stderr, "transferred\n");
+	/* only averaged, nobody sees it */
+	frame->library = libraryActive;
+	if (frame->library) {
+		frame->compress = false;
+		frame->previewFactor = 0;
+	}
 
-	x  = PrimaryCCD.getSubX();
-	y  = PrimaryCCD.getSubY();
-	w  = PrimaryCCD.getSubW();
-	h  = PrimaryCCD.getSubH();
-	bx = PrimaryCCD.getBinX();
-	by = PrimaryCCD.getBinY();
+	/* byte swapped pixels would only give nonsense */
+	frame->measure = (StatsS[0].s != ISS_ON || focusLoop) && !frame->swap && !frame->library;
+	frame->statsOnly = frame->measure && StatsS[2].s == ISS_ON;
+	if (frame->statsOnly)
+		frame->compress = false;
+
+	/* the file gets the raw pixels, the client nothing */
+	frame->recordOnly = recorder.isOpen() && RecordS[2].s == ISS_ON && !frame->library;
+	if (frame->recordOnly) {
+		frame->compress = false;
+		frame->previewFactor = 0;
+	}
+	if (frame->measure) {
+		statistics.setThreshold(StatsSetN[0].value);
+		statistics.setRadius((int) StatsSetN[1].value);
+	}
 
-	fprintf(stderr, "x %d, y %d, w %d, h %d, bx %d, by %d\n",
-		x, y, w, h, bx, by);
+	matchCalibration(frame);
 
-	PrimaryCCD.setFrameBufferSize(w / bx * h / by * 2);
-	dst = (uint16_t *) PrimaryCCD.getFrameBuffer();
-	for (iy = 0; iy < h / by; iy++) {
-		for (ix = x / bx; ix < (x + w) / bx; ix++) {
-			*dst++ = buffer[iy * LineSize + ix];
-		}
+	if (frame->compress) {
+		compressor.setLevel((int) CompressSetN[0].value);
+		compressor.setThreads((int) CompressSetN[1].value);
 	}
 
-	gettimeofday(&tv2, NULL);
-	fprintf(stderr, "GrabExposure: readout took %ld msec\n", tv_diff(&tv2, &tv1));
+	frame->rearm = SequenceRemaining > 1 || focusLoop;
+	if (focusLoop)
+		frame->previewFactor = 0;
 
-	setShutter(SHUTTER_FREE);
+	/* the readout thread owns the frame buffer until the frame comes back */
+	PrimaryCCD.setFrameBufferSize(size);
+	frame->dst = (uint16_t *) PrimaryCCD.getFrameBuffer();
 
-	ExposureComplete(&PrimaryCCD);
-	InExposure = false;
+	pthread_mutex_lock(&readoutLock);
+	readoutJob = frame;
+	pthread_cond_signal(&readoutCond);
+	pthread_mutex_unlock(&readoutLock);
+
+	Downloading = true;
 
 	return true;
 }
 
-
-double QHY9::mv_to_degrees(double mv)
+/* main loop: geometry and camera layout of the next frame; returns the bytes it needs */
+size_t QHY9::setupFrame(QHY9Frame *frame, bool swap)
 {
-	double V = 1.024 * mv;
-	double R, T, LNR;
-
-	R = 33 / (V/1000 + 1.625) - 10;
-	R = clamp_double(R, 1, 400);
+	size_t size;
+
+	frame->x  = PrimaryCCD.getSubX();
+	frame->y  = PrimaryCCD.getSubY();
+	frame->w  = PrimaryCCD.getSubW();
+	frame->h  = PrimaryCCD.getSubH();
+	frame->bx = PrimaryCCD.getBinX();
+	frame->by = PrimaryCCD.getBinY();
+
+	frame->p_size = p_size;
+	frame->total_p = total_p;
+	frame->LineSize = LineSize;
+
+	frame->status = 0;
+	frame->pos = 0;
+	frame->partial = false;
+	frame->aborted = false;
+	frame->video = false;
+
+	frame->hwbin = qhy9_hardware_bin(frame->bx, frame->by);
+	frame->sbx = frame->bx / frame->hwbin;
+	frame->sby = frame->by / frame->hwbin;
+	frame->average = (SoftBinS[1].s == ISS_ON);
+	frame->swap = swap;
+
+	/*
+	 * When the subframe spans whole camera lines the image is the head of the
+	 * USB stream, so download straight into the frame buffer. It must then also
+	 * hold the padding at the end; the FITS writer only looks at the image part.
+	 */
+	size = frame->w / frame->bx * frame->h / frame->by * 2;
+	frame->direct = (frame->x == 0 && frame->w / frame->hwbin == frame->LineSize &&
+			 frame->sbx == 1 && frame->sby == 1 && !frame->swap);
+	if (frame->direct && size < frame->p_size * frame->total_p)
+		size = frame->p_size * frame->total_p;
+
+	return size;
+}
 
-	LNR = log(R);
+/* readout thread: bulk download and crop into the frame buffer; 0 or a LIBUSB_ERROR code */
+int QHY9::downloadFrame(QHY9Frame *frame)
+{
+	struct timespec t0, t1, t2;
+	int x, w, h, sx, sy, ret;
+	size_t npix = (size_t) (frame->w / frame->bx) * (frame->h / frame->by);
+	uint16_t *src;
 
-	T= 1 / ( 0.002679+0.000291*LNR + LNR*LNR*LNR*4.28e-7  );
+	frame->phase_ms[QHY9_PHASE_EXPOSURE] = ts_ms(&frame->close_rt, &frame->open_rt);
 
-        T -= 273.15;
+	qhy9_trace_frame(frame->x, frame->y, frame->w, frame->h,
+			 frame->hwbin, frame->sbx, frame->sby, frame->direct);
 
-	return T;
-}
+	clock_gettime(CLOCK_MONOTONIC, &t0);
 
-double QHY9::degrees_to_mv(double degrees)
-{
-	double V, R, T;
-	double x, y;
-	double A=0.002679;
-	double B=0.000291;
-	double C=4.28e-7;
+	/* DownloadCloseTEC: the camera drops the TEC until the data is out */
+	cooler.setDownloading(true);
 
-#define SQR3(x) ((x)*(x)*(x))
-#define SQRT3(x) (exp(log(x)/3))
+	if (frame->direct) {
+		/* the image is the head of the stream, deflate tiles as they land unless it is calibrated first */
+		if (frame->compress && !frame->calibrate) {
+			compressor.begin(frame->dst, npix);
+			compressPixels = npix;
+		}
+		if (frame->measure && !frame->calibrate) {
+			statistics.begin(frame->dst, frame->w / frame->bx, frame->h / frame->by);
+			statsPixels = npix;
+		}
 
-	T = 273.15 + clamp_double(degrees, -50, 50);
+		ret = transport->readFrame((uint8_t *) frame->dst, frame->p_size, frame->total_p, &frame->pos);
+		cooler.setDownloading(false);
+		compressPixels = 0;
+		statsPixels = 0;
+		if (ret && !partialFrame(frame, (uint8_t *) frame->dst, ret)) {
+			compressor.abort();
+			return ret;
+		}
 
-	y = (A - 1/T) / C;
-	x = sqrt( SQR3(B/(3*C)) + (y*y)/4 );
-	R = exp(SQRT3(x-y/2) - SQRT3(x+y/2));
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		frame->phase_ms[QHY9_PHASE_DOWNLOAD] = ts_ms(&t1, &t0);
 
-	V = 33000/(R+10) - 1625;
+		/* calibration counts as extract */
+		if (frame->calibrate) {
+			qhy9_calibrate_frame(frame->dst, frame->w / frame->bx, frame->h / frame->by, &frame->calib);
+			if (frame->compress) {
+				compressor.begin(frame->dst, npix);
+				compressor.feed(npix);
+			}
+			if (frame->measure) {
+				statistics.begin(frame->dst, frame->w / frame->bx, frame->h / frame->by);
+				statistics.feed(npix);
+			}
 
-	return V;
-}
+			clock_gettime(CLOCK_MONOTONIC, &t2);
+			frame->phase_ms[QHY9_PHASE_EXTRACT] = ts_ms(&t2, &t1);
+		}
 
+		return 0;
+	}
 
-int QHY9::getDC201Interrupt()
-{
-	unsigned char buffer[4] = { 0, 0, 0, 0 };
-	int transferred;
+	/* subframe narrower than a line or processed, grab to local buffer first */
+	src = getStagingBuffer(frame->p_size * frame->total_p);
+	if (!src) {
+		cooler.setDownloading(false);
+		return -1;
+	}
 
-	if (!usb_handle)
-		return 0;
+	ret = transport->readFrame((uint8_t *) src, frame->p_size, frame->total_p, &frame->pos);
+	cooler.setDownloading(false);
+	if (ret && !partialFrame(frame, (uint8_t *) src, ret))
+		return ret;
 
-	libusb_bulk_transfer(usb_handle, QHY9_INTERRUPT_READ_EP, buffer, 4, &transferred, 0);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
 
-	return ((int16_t) (buffer[1] * 256 + buffer[2]));
-}
+	x  = frame->x / frame->hwbin;
+	w  = frame->w / frame->hwbin;
+	h  = frame->h / frame->hwbin;
+	sx = frame->sbx;
+	sy = frame->sby;
 
+	qhy9_extract_frame(frame->dst, src, frame->LineSize, x, w, h, sx, sy, frame->average, frame->swap);
 
-void QHY9::setDC201Interrupt(uint8_t PWM, uint8_t FAN)
-{
-	uint8_t buffer[3];
-	int transferred;
+	if (frame->calibrate)
+		qhy9_calibrate_frame(frame->dst, frame->w / frame->bx, frame->h / frame->by, &frame->calib);
 
-	buffer[0] = 0x01;
-	buffer[1] = PWM;
-	buffer[2] = FAN;
+	if (frame->compress) {
+		compressor.begin(frame->dst, npix);
+		compressor.feed(npix);
+	}
+	if (frame->measure) {
+		statistics.begin(frame->dst, frame->w / frame->bx, frame->h / frame->by);
+		statistics.feed(npix);
+	}
 
-	if (!usb_handle)
-		return;
+	clock_gettime(CLOCK_MONOTONIC, &t2);
+	frame->phase_ms[QHY9_PHASE_DOWNLOAD] = ts_ms(&t1, &t0);
+	frame->phase_ms[QHY9_PHASE_EXTRACT] = ts_ms(&t2, &t1);
 
-	libusb_bulk_transfer(usb_handle, QHY9_INTERRUPT_WRITE_EP, buffer, 3, &transferred, 0);
+	return 0;
 }
 
-void QHY9::setCameraRegisters()
+/* readout thread: bytes of a direct download are in the frame buffer, hand what they complete to the compressor and the stats */
+void QHY9::downloadProgress(void *arg, long bytes)
 {
-	uint8_t REG[64];
-	unsigned long T;
-	uint8_t time_L, time_M, time_H;
-	int bin;
+	QHY9 *self = (QHY9 *) arg;
+	size_t pixels = bytes / 2;
 
-	/* Compute frame sizes, skips, number of patches, etc according to binning. wth is a "patch" ? */
-	bin = PrimaryCCD.getBinX();
-	switch (bin) {
-	case 0:
-	case 1:
-		HBIN = 1;
-		VBIN = 1;
-		LineSize = 3584;
-		VerticalSize = 2574;
-		p_size = 3584 * 2; // must be multiple of 512
-		break;
-
-	case 2:
-		HBIN = 2;
-		VBIN = 2;
-		LineSize = 1792;
-		VerticalSize = 1287;
-		p_size = 3584 * 2; // multiple of 512
-		break;
-
-	case 3:
-		HBIN = 3;
-		VBIN = 3;
-		LineSize = 1194;               // was 1196, bad
-		VerticalSize = 858;
-		p_size = 1024;
-		break;
-
-	case 4:
-		HBIN = 4;
-		VBIN = 4;
-		LineSize = 896;
-		VerticalSize = 644;
-		p_size = 1024;
-		break;
-	}
-
-	SKIP_TOP = PrimaryCCD.getSubY() / PrimaryCCD.getBinY();
-	SKIP_BOTTOM = VerticalSize - SKIP_TOP - PrimaryCCD.getSubH() / PrimaryCCD.getBinY();
-	VerticalSize = VerticalSize - SKIP_TOP - SKIP_BOTTOM;
-
-	T = (LineSize * VerticalSize + TopSkipPix) * 2;
-
-	if (T % p_size) {
-		total_p = T / p_size + 1;
-		patchnum = (total_p * p_size - T) / 2 + 16;
-	} else {
-		total_p = T / p_size;
-		patchnum = 16;
-	}
+	if (self->compressPixels)
+		self->compressor.feed(pixels < self->compressPixels ? pixels : self->compressPixels);
 
-	fprintf(stderr, "linesize=%d, vertsize=%d, T=%lu, p_size=%d, total_p=%d, patchnum=%d\n",
-		LineSize, VerticalSize, T, p_size, total_p, patchnum);
+	if (self->statsPixels)
+		self->statistics.feed(pixels < self->statsPixels ? pixels : self->statsPixels);
+}
 
-	/* 1 = disable AMP during exposure */
-	AMPVOLTAGE = 1;
+/*
+ * readout thread: the camera stopped sending and resuming did not help. Keep
+ * what arrived with the missing tail zeroed and flag the frame, a long
+ * exposure with a few lines short is still worth having.
+ */
+bool QHY9::partialFrame(QHY9Frame *frame, uint8_t *data, int ret)
+{
+	size_t got = (size_t) frame->pos * frame->p_size;
 
-	/* manual shutter for darks and biases */
-	CCDChip::CCD_FRAME ft = PrimaryCCD.getFrameType();
-	MechanicalShutterMode = (ft == CCDChip::DARK_FRAME || ft == CCDChip::BIAS_FRAME) ? 1 : 0;
+	if (ret != LIBUSB_ERROR_TIMEOUT && ret != LIBUSB_ERROR_IO)
+		return false;
+	if (frame->pos <= 0)
+		return false;
 
-	TopSkipNull = 30; // ???
+	memset(data + got, 0, (size_t) frame->p_size * frame->total_p - got);
+	frame->partial = true;
 
-	SDRAM_MAXSIZE = 100;
+	qhy9_trace_text("partial frame: %d of %d packets, %s", frame->pos, frame->total_p, libusb_error_name(ret));
 
-	/* fill in register buffer */
-	memset(REG, 0, 64);
+	return true;
+}
 
-	Exptime = (unsigned long) floor(ExposureRequest);
-	time_L = Exptime % 256;
-	time_M = (Exptime - time_L)/256;
-	time_H = (Exptime - time_L - time_M * 256) / 65536;
+/* readout thread: staging buffer for subframes, in USB device memory when the platform has it */
+uint16_t *QHY9::getStagingBuffer(size_t size)
+{
+	if (stagingBuffer && stagingSize == size)
+		return stagingBuffer;
 
-	REG[0]=camgain;
-	REG[1]=camoffset;
+	freeStagingBuffer();
 
-	REG[2]=time_H;
-	REG[3]=time_M;
-	REG[4]=time_L;
+	stagingBuffer = (uint16_t *) transport->allocBuffer(size);
+	if (stagingBuffer)
+		stagingSize = size;
 
-	REG[5]=HBIN;
-	REG[6]=VBIN;
+	return stagingBuffer;
+}
+
+void QHY9::freeStagingBuffer()
+{
+	if (!stagingBuffer)
+		return;
 
-	REG[7]=MSB(LineSize);
-	REG[8]=LSB(LineSize);
+	transport->freeBuffer((uint8_t *) stagingBuffer, stagingSize);
 
-	REG[9]= MSB(VerticalSize);
-	REG[10]=LSB(VerticalSize);
+	stagingBuffer = NULL;
+	stagingSize = 0;
+}
 
-	REG[11]=MSB(SKIP_TOP);
-	REG[12]=LSB(SKIP_TOP);
+bool QHY9::startReadoutThread()
+{
+	if (readoutRunning)
+		return true;
 
-	REG[13]=MSB(SKIP_BOTTOM);
-	REG[14]=LSB(SKIP_BOTTOM);
+	if (pipe(readoutPipe)) {
+		DEBUGF(INDI::Logger::DBG_ERROR, "Cannot create readout pipe: %s", strerror(errno));
+		return false;
+	}
 
-	REG[15]=MSB(LiveVideo_BeginLine);
-	REG[16]=LSB(LiveVideo_BeginLine);
+	fcntl(readoutPipe[0], F_SETFL, O_NONBLOCK);
 
-	REG[17]=MSB(patchnum);
-	REG[18]=LSB(patchnum);
+	exposureTimer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+	if (exposureTimer < 0 || pipe(wakePipe)) {
+		DEBUGF(INDI::Logger::DBG_ERROR, "Cannot create exposure timer: %s", strerror(errno));
+		goto err_pipe;
+	}
 
-	REG[19]=MSB(AnitInterlace);
-	REG[20]=LSB(AnitInterlace);
+	fcntl(wakePipe[0], F_SETFL, O_NONBLOCK);
 
-	REG[22]=MultiFieldBIN;
+	readoutQuit = false;
+	if (pthread_create(&readoutThread, NULL, readoutThreadEntry, this)) {
+		DEBUG(INDI::Logger::DBG_ERROR, "Cannot start readout thread.");
+		goto err_pipe;
+	}
 
-	REG[29]=MSB(ClockADJ);
-	REG[30]=LSB(ClockADJ);
+	readoutCallback = IEAddCallback(readoutPipe[0], readoutDoneCallback, this);
+	readoutRunning = true;
 
-	REG[32]=AMPVOLTAGE;
+	return true;
 
-	REG[33]=DownloadSpeed;
+err_pipe:
+	if (exposureTimer >= 0)
+		close(exposureTimer);
+	if (wakePipe[0] >= 0) {
+		close(wakePipe[0]);
+		close(wakePipe[1]);
+	}
+	close(readoutPipe[0]);
+	close(readoutPipe[1]);
 
-	REG[35]=TgateMode;
-	REG[36]=ShortExposure;
-	REG[37]=VSUB;
-	REG[38]=CLAMP;
+	exposureTimer = -1;
+	wakePipe[0] = wakePipe[1] = -1;
+	readoutPipe[0] = readoutPipe[1] = -1;
 
-	REG[42]=TransferBIT;
+	return false;
+}
 
-	REG[46]=TopSkipNull;
+void QHY9::stopReadoutThread()
+{
+	if (!readoutRunning)
+		return;
 
-	REG[47]=MSB(TopSkipPix);
-	REG[48]=LSB(TopSkipPix);
+	pthread_mutex_lock(&readoutLock);
+	readoutQuit = true;
+	if (readoutActive) {
+		readoutActive->aborted = true;
+		transport->cancelRead();
+	}
+	pthread_cond_signal(&readoutCond);
+	pthread_mutex_unlock(&readoutLock);
 
-	REG[51]=MechanicalShutterMode;
-	REG[52]=DownloadCloseTEC;
+	wakeReadoutThread();
+	pthread_join(readoutThread, NULL);
 
-	REG[53]=(WindowHeater&~0xf0)*16+(MotorHeating&~0xf0);
+	IERmCallback(readoutCallback);
+	close(readoutPipe[0]);
+	close(readoutPipe[1]);
+	readoutPipe[0] = readoutPipe[1] = -1;
 
-	REG[58]=SDRAM_MAXSIZE;
-	REG[63]=Trig;
+	close(exposureTimer);
+	close(wakePipe[0]);
+	close(wakePipe[1]);
+	exposureTimer = -1;
+	wakePipe[0] = wakePipe[1] = -1;
 
-	int i;
-	fprintf(stderr, "Sending REGS...\n");
-	for (i = 0; i < 64; i++) {
-		if (i % 16 == 0) {
-			fprintf(stderr, "\n%02d: ", i);
-		}
+	delete readoutJob;
+	readoutJob = NULL;
 
-		fprintf(stderr, "%02x ", REG[i]);
+	while (!readoutDone.empty()) {
+		delete readoutDone.front();
+		readoutDone.pop_front();
 	}
-	fprintf(stderr, "\n");
 
-	if (!usb_handle)
-		return;
+	/* device memory belongs to the handle */
+	freeStagingBuffer();
 
-	libusb_control_transfer(usb_handle, QHY9_VENDOR_REQUEST_WRITE,
-				QHY9_REGISTERS_CMD, 0, 0, REG, 64, 0);
+	readoutRunning = false;
+	Downloading = false;
+	InExposure = false;
 }
 
-bool QHY9::ISNewNumber(const char *dev, const char *name, double values[], char *names[], int n)
+void *QHY9::readoutThreadEntry(void *arg)
 {
-	if (dev && !strcmp(dev, getDeviceName())) {
-		if (!strcmp(name, FilterSlotNP.name)) {
-			processFilterSlot(dev, values, names);
-			return true;
-		}
+	qhy9_trace_set_source(((QHY9 *) arg)->cameraIndex);
+	((QHY9 *) arg)->readoutLoop();
+	return NULL;
+}
 
-		if (!strcmp(name, GainNP.name)) {
-			if (n < 1) return false;
+void QHY9::readoutLoop()
+{
+	QHY9Frame *frame;
+	bool next;
+	char c = 0;
 
-			camgain = GainN[0].value = clamp_int(values[0], 0, 255);
-			GainNP.s = IPS_OK;
-			IDSetNumber(&GainNP, NULL);
-			return true;
+	pthread_mutex_lock(&readoutLock);
+
+	while (!readoutQuit) {
+		if (!readoutJob) {
+			pthread_cond_wait(&readoutCond, &readoutLock);
+			continue;
 		}
 
-		if (!strcmp(name, OffsetNP.name)) {
-			if (n < 1) return false;
+		frame = readoutJob;
+		readoutJob = NULL;
+		readoutActive = frame;
+
+		/* an abort from here on sticks until the next job */
+		transport->clearCancel();
+
+		/* the exposure of this frame was started before the job got here */
+		memset(frame->phase_ms, 0, sizeof(frame->phase_ms));
+		memcpy(frame->phase_ms, armPhase, sizeof(armPhase));
+		pthread_mutex_unlock(&readoutLock);
+
+		if (frame->video)
+			videoLoop(frame);
+		else if (waitExposureEnd(frame) == 0 && !downloadAborted(frame))
+			frame->status = downloadFrame(frame);
+		else
+			frame->status = -1;
+
+		/* the preview is a few ms off the download, well before the frame itself is out */
+		if (frame->status == 0 && frame->previewFactor && !frame->aborted) {
+			struct timespec t0, t1;
+
+			clock_gettime(CLOCK_MONOTONIC, &t0);
+			qhy9_make_preview(frame->dst, frame->w / frame->bx, frame->h / frame->by,
+					  frame->previewFactor, &frame->preview);
+			clock_gettime(CLOCK_MONOTONIC, &t1);
+
+			qhy9_trace_text("preview: %dx%d, black %u white %u, %.2f ms",
+					frame->preview.width, frame->preview.height,
+					frame->preview.black, frame->preview.white, ts_ms(&t1, &t0));
+		}
 
-			camoffset = OffsetN[0].value = clamp_int(values[0], 0, 255);
-			OffsetNP.s = IPS_OK;
-			IDSetNumber(&OffsetNP, NULL);
-			return true;
+		/* star detection ran alongside the preview */
+		if (frame->measure) {
+			if (frame->status == 0 && !frame->aborted)
+				frame->measure = statistics.finish(&frame->stats);
+			else
+				statistics.abort();
 		}
 
-		if (!strcmp(name, TECLimitNP.name)) {
-			if (n < 1) return false;
+		pthread_mutex_lock(&readoutLock);
+		readoutActive = NULL;
+		next = frame->rearm && frame->status == 0 && !frame->aborted && !readoutQuit;
+		readoutDone.push_back(frame);
 
-			TECN[1].value = clamp_int(values[0], 0, 100);
-			TECLimitNP.s = IPS_OK;
-			IDSetNumber(&TECLimitNP, NULL);
+		if (write(readoutPipe[1], &c, 1) != 1)
+			fprintf(stderr, "readout: cannot wake main loop\n");
+
+		/* sequence: expose the next frame while this one is delivered */
+		if (next) {
+			pthread_mutex_unlock(&readoutLock);
+			armNextExposure();
+			pthread_mutex_lock(&readoutLock);
+		}
+	}
+
+	pthread_mutex_unlock(&readoutLock);
+}
+
+/* readout thread: aborted since the dequeue; a later abort cancels the read itself */
+bool QHY9::downloadAborted(QHY9Frame *frame)
+{
+	bool aborted;
+
+	pthread_mutex_lock(&readoutLock);
+	aborted = frame->aborted || readoutQuit;
+	pthread_mutex_unlock(&readoutLock);
+
+	return aborted;
+}
+
+/* readout thread: sleep until the camera should be done exposing */
+int QHY9::waitExposureEnd(QHY9Frame *frame)
+{
+	struct itimerspec its;
+	struct pollfd pfd[2];
+	uint64_t expirations;
+	char buf[16];
+
+	memset(&its, 0, sizeof(its));
+
+	pthread_mutex_lock(&readoutLock);
+	if (!exposureArmed || frame->aborted || readoutQuit) {
+		pthread_mutex_unlock(&readoutLock);
+		return -1;
+	}
+	its.it_value = exposure_end;
+	frame->open_rt = exposure_start_rt;
+	frame->open_mono = exposure_start;
+	pthread_mutex_unlock(&readoutLock);
+
+	/* an absolute deadline already in the past fires right away */
+	if (timerfd_settime(exposureTimer, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+		return -1;
+
+	pfd[0].fd = exposureTimer;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = wakePipe[0];
+	pfd[1].events = POLLIN;
+
+	for (;;) {
+		if (poll(pfd, 2, -1) < 0 && errno != EINTR)
+			return -1;
+
+		if (pfd[1].revents & POLLIN) {
+			while (read(wakePipe[0], buf, sizeof(buf)) > 0)
+				;
+
+			pthread_mutex_lock(&readoutLock);
+			if (frame->aborted || readoutQuit) {
+				pthread_mutex_unlock(&readoutLock);
+				return -1;
+			}
+			pthread_mutex_unlock(&readoutLock);
+		}
+
+		if ((pfd[0].revents & POLLIN) &&
+		    read(exposureTimer, &expirations, sizeof(expirations)) == sizeof(expirations))
+			break;
+	}
+
+	clock_gettime(CLOCK_REALTIME, &frame->close_rt);
+	clock_gettime(CLOCK_MONOTONIC, &frame->close_mono);
+
+	pthread_mutex_lock(&readoutLock);
+	exposureArmed = false;
+	pthread_mutex_unlock(&readoutLock);
+
+	return 0;
+}
+
+void QHY9::wakeReadoutThread()
+{
+	char c = 0;
+
+	if (wakePipe[1] >= 0 && write(wakePipe[1], &c, 1) != 1)
+		fprintf(stderr, "readout: cannot wake readout thread\n");
+}
+
+void QHY9::readoutDoneCallback(int fd, void *arg)
+{
+	INDI_UNUSED(fd);
+	qhy9_trace_set_source(((QHY9 *) arg)->cameraIndex);
+	((QHY9 *) arg)->processCompletions();
+}
+
+/* main loop: deliver frames coming back from the readout thread */
+void QHY9::processCompletions()
+{
+	QHY9Frame *frame;
+	char buf[16];
+
+	while (read(readoutPipe[0], buf, sizeof(buf)) > 0)
+		;
+
+	if (!deviceLost && transport && transport->isLost())
+		deviceGone();
+
+	if (videoRunning)
+		videoDeliver();
+
+	for (;;) {
+		pthread_mutex_lock(&readoutLock);
+		if (readoutDone.empty()) {
+			pthread_mutex_unlock(&readoutLock);
+			break;
+		}
+		frame = readoutDone.front();
+		readoutDone.pop_front();
+		pthread_mutex_unlock(&readoutLock);
+
+		Downloading = false;
+
+		/* stopped, failed or the camera went away; video is not resumed */
+		if (frame->video) {
+			if (frame->status || deviceLost)
+				endVideo(IPS_ALERT, "Live video stopped, download failed.");
+			else
+				endVideo(IPS_IDLE, NULL);
+			delete frame;
+			continue;
+		}
+
+		if (frame->aborted) {
+			if (frame->compress)
+				compressor.abort();
+			delete frame;
+			continue;
+		}
+
+		/* camera unplugged under the download, try the frame again when it is back */
+		if (frame->status == LIBUSB_ERROR_NO_DEVICE || deviceLost) {
+			if (!deviceLost)
+				deviceGone();
+			resumeExposure = InExposure;
+			if (frame->compress)
+				compressor.abort();
+			delete frame;
+			continue;
+		}
+
+		/* the shutter stays closed for the next one */
+		if (frame->library) {
+			libraryFrame(frame);
+			delete frame;
+			continue;
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &lastClientExposure);
+
+		if (!frame->rearm)
+			setShutter(SHUTTER_FREE);
+
+		if (frame->status) {
+			DEBUGF(INDI::Logger::DBG_ERROR, "Download failed after %d of %d packets.",
+			       frame->pos, frame->total_p);
+		} else {
+			struct timespec t0, t1;
+
+			if (frame->partial)
+				DEBUGF(INDI::Logger::DBG_WARNING, "Frame incomplete: %d of %d packets, the rest is zero.",
+				       frame->pos, frame->total_p);
+
+			frame_open = frame->open_rt;
+			frame_close = frame->close_rt;
+			framePartial = frame->partial;
+			telemetry.range(&frame->open_mono, &frame->close_mono, &frameTemp);
+			framePackets = frame->pos;
+			frameCalibrated = frame->calibrate;
+			if (frame->calibrate)
+				frameCalib = frame->calib;
+			frameTotalPackets = frame->total_p;
+			frameMeasured = frame->measure;
+			if (frame->measure)
+				frameStats = frame->stats;
+			memcpy(framePhase, frame->phase_ms, sizeof(framePhase));
+
+			if (frame->measure)
+				updateStats();
+
+			if (focusLoop)
+				focusFrame(frame);
+
+			if (frame->previewFactor)
+				sendPreview(frame);
+
+			if (recorder.isOpen())
+				recordFrame(frame);
+
+			/* fitsKeywords splits sending the frame into header and the rest */
+			clock_gettime(CLOCK_MONOTONIC, &t0);
+			fitsHeaderDone = t0;
+			if (frame->statsOnly || frame->recordOnly) {
+				INumberVectorProperty *exp = getNumber("CCD_EXPOSURE");
+
+				/* what ExposureComplete does short of the image */
+				if (exp) {
+					exp->np[0].value = 0;
+					exp->s = IPS_OK;
+					IDSetNumber(exp, NULL);
+				}
+			} else if (!(frame->compress && sendCompressed(frame)) && !sendFits(frame)) {
+				ExposureComplete(&PrimaryCCD);
+			}
+			clock_gettime(CLOCK_MONOTONIC, &t1);
+
+			frame->phase_ms[QHY9_PHASE_FITS] = ts_ms(&fitsHeaderDone, &t0);
+			frame->phase_ms[QHY9_PHASE_BLOB] = ts_ms(&t1, &fitsHeaderDone);
+			updateTiming(frame->phase_ms);
+			qhy9_trace_timing(frame->phase_ms, QHY9_NPHASES);
+
+			if (SequenceRemaining > 0)
+				SequenceRemaining--;
+		}
+
+		/* the readout thread starts the next exposure right after the download */
+		if (frame->rearm && frame->status == 0 && (SequenceRemaining > 0 || (focusLoop && !focusRestart)) && InExposure) {
+			if (SequenceRemaining > 0)
+				DEBUGF(INDI::Logger::DBG_SESSION, "Sequence frame %d of %d.",
+				       SequenceCount - SequenceRemaining + 1, SequenceCount);
+
+			/* frame buffer is free again, queue the next download */
+			GrabExposure();
+
+			INumberVectorProperty *exp = getNumber("CCD_EXPOSURE");
+			if (exp) {
+				exp->s = IPS_BUSY;
+				IDSetNumber(exp, NULL);
+			}
+		} else {
+			if (frame->rearm)
+				setShutter(SHUTTER_FREE);
+
+			/* a restart goes on below, anything else ends the loop */
+			if (focusLoop && !focusRestart)
+				stopFocus(frame->status ? IPS_ALERT : IPS_IDLE,
+					  frame->status ? "Focus loop stopped, download failed." : NULL);
+
+			if (!focusRestart)
+				InExposure = false;
+			endSequence(frame->status ? IPS_ALERT : (SequenceRemaining ? IPS_ALERT : IPS_OK));
+		}
+
+		delete frame;
+	}
+
+	/* new settings or a library frame was in the way */
+	if (videoPending && !Downloading && !deviceLost)
+		startVideo();
+
+	/* new ROI or exposure: the loop frame is off the camera, start over with them */
+	if (focusRestart && !Downloading && !deviceLost)
+		startFocus();
+
+	/* the library frame is off the camera, the client exposure behind it can go */
+	if (libraryPending && !Downloading && !deviceLost) {
+		libraryPending = false;
+		InExposure = false;
+		if (!StartExposure(pendingDuration))
+			exposureFailed();
+	}
+
+	if (deviceLost)
+		recoverDevice();
+}
+
+/* main loop: read the master headers in CALIB_DIR */
+void QHY9::scanCalibration()
+{
+	int found, err;
+
+	calibRescan = false;
+
+	found = calibration.scan(CalibDirT[0].text);
+	err = errno;
+
+	CalibLibN[0].value = calibration.count(QHY9_MASTER_BIAS);
+	CalibLibN[1].value = calibration.count(QHY9_MASTER_DARK);
+	CalibLibN[2].value = calibration.count(QHY9_MASTER_FLAT);
+	CalibLibN[3].value = 0;
+	CalibLibNP.s = (found < 0) ? IPS_ALERT : IPS_OK;
+	IDSetNumber(&CalibLibNP, NULL);
+
+	CalibDirTP.s = (found < 0) ? IPS_ALERT : IPS_OK;
+	if (found < 0)
+		IDSetText(&CalibDirTP, "Cannot read %s: %s", CalibDirT[0].text, strerror(err));
+	else
+		IDSetText(&CalibDirTP, "%d master frames in %s.", found, CalibDirT[0].text);
+}
+
+/*
+ * main loop: pick the masters for a frame about to be downloaded, loading
+ * them now if they are not cached; the exposure runs meanwhile. Light
+ * frames only, and not byte swapped ones.
+ */
+void QHY9::matchCalibration(QHY9Frame *frame)
+{
+	QHY9CalibKey key;
+	int i;
+
+	frame->calibrate = false;
+
+	if (CalibS[1].s != ISS_ON || PrimaryCCD.getFrameType() != CCDChip::LIGHT_FRAME || frame->swap)
+		return;
+
+	if (calibRescan)
+		scanCalibration();
+
+	key.x = frame->x;
+	key.y = frame->y;
+	key.w = frame->w;
+	key.h = frame->h;
+	key.bx = frame->bx;
+	key.by = frame->by;
+	key.exposure = ExposureRequest / 1000.0;
+	key.gain = camgain;
+	key.offset = camoffset;
+	key.temperature = Temperature;
+	key.filter = FilterNameT[CurrentFilter - 1].text;
+
+	calibration.setCacheLimit((size_t) CalibSetN[2].value * 1024 * 1024);
+	frame->calibrate = calibration.match(&key, &frame->calib);
+
+	for (i = 0; i < QHY9_MASTER_TYPES; i++)
+		IUSaveText(&CalibUsedT[i], frame->calib.names[i].c_str());
+	CalibUsedTP.s = frame->calibrate ? IPS_OK : IPS_ALERT;
+	IDSetText(&CalibUsedTP, frame->calibrate ? NULL : "No master frames match this frame.");
+
+	CalibLibN[3].value = calibration.cacheBytes() / (1024.0 * 1024.0);
+	IDSetNumber(&CalibLibNP, NULL);
+}
+
+/* main loop: (re)start the dark library from the first master of the plan */
+bool QHY9::planLibrary()
+{
+	bool ok;
+
+	libraryYield();
+	accumulator.reset();
+	libraryJob = 0;
+
+	ok = qhy9_dark_plan(LibraryPlanT[0].text, LibraryPlanT[1].text, LibraryPlanT[2].text,
+			    (int) Gain, libraryJobs);
+
+	LibraryPlanTP.s = ok ? IPS_OK : IPS_ALERT;
+	if (ok)
+		IDSetText(&LibraryPlanTP, "%d masters in the dark library plan.", (int) libraryJobs.size());
+	else
+		IDSetText(&LibraryPlanTP, "Cannot read the plan, expecting comma separated numbers.");
+
+	LibraryStatNP.s = IPS_IDLE;
+	updateLibrary();
+
+	return ok;
+}
+
+/* master file in CALIB_DIR, named by what it is matched on; false if there is no directory */
+bool QHY9::libraryPath(const QHY9DarkJob *job, std::string &path)
+{
+	char name[128];
+
+	if (!*CalibDirT[0].text)
+		return false;
+
+	if (job->exposure > 0)
+		snprintf(name, sizeof(name), "qhy9_dark_%gs_bin%d_gain%d_offset%d_%+.0fC.fits",
+			 job->exposure, job->bin, job->gain, (int) camoffset, TemperatureTarget);
+	else
+		snprintf(name, sizeof(name), "qhy9_bias_bin%d_gain%d_offset%d_%+.0fC.fits",
+			 job->bin, job->gain, (int) camoffset, TemperatureTarget);
+
+	path = std::string(CalibDirT[0].text) + "/" + name;
+
+	return true;
+}
+
+/*
+ * main loop, TimerHit: when the camera has been idle long enough and the
+ * sensor sits at its setpoint, take the next frame of the first master that
+ * is missing or too old. The client's binning, subframe, frame type and
+ * gain are put back when the plan is done or the client wants the camera.
+ */
+void QHY9::libraryStep()
+{
+	const QHY9DarkJob *job;
+	struct timespec now;
+	struct stat st;
+	std::string path;
+
+	if (InExposure || Downloading || gateWaiting || deviceLost || SequenceCount || focusLoop ||
+	    videoRunning || videoPending)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (ts_ms(&now, &lastClientExposure) < LibrarySetN[1].value * 1000)
+		return;
+
+	/* darks only match frames taken at the setpoint */
+	if (!thermalSettled())
+		return;
+
+	for (; libraryJob < (int) libraryJobs.size(); libraryJob++) {
+		if (!libraryPath(&libraryJobs[libraryJob], path)) {
+			libraryRestore();
+			LibraryStatNP.s = IPS_ALERT;
+			IDSetNumber(&LibraryStatNP, "Set the calibration library directory for the dark library.");
+			IUResetSwitch(&LibrarySP);
+			LibraryS[1].s = ISS_ON;
+			LibrarySP.s = IPS_ALERT;
+			IDSetSwitch(&LibrarySP, NULL);
+			return;
+		}
+
+		/* a master already being taken is finished even if one appeared meanwhile */
+		if (accumulator.count() || stat(path.c_str(), &st) ||
+		    time(NULL) - st.st_mtime > LibrarySetN[2].value * 86400)
+			break;
+	}
+
+	if (libraryJob >= (int) libraryJobs.size()) {
+		if (librarySaved) {
+			libraryRestore();
+			LibraryStatNP.s = IPS_OK;
+			updateLibrary();
+			DEBUG(INDI::Logger::DBG_SESSION, "Dark library complete.");
+		}
+		return;
+	}
+
+	job = &libraryJobs[libraryJob];
+
+	if (!librarySaved) {
+		saveFrameSettings(&librarySettings);
+		librarySaved = true;
+	}
+
+	PrimaryCCD.setBin(job->bin, job->bin);
+	PrimaryCCD.setFrame(0, 0, QHY9_SENSOR_WIDTH, QHY9_SENSOR_HEIGHT);
+	PrimaryCCD.setFrameType(job->exposure > 0 ? CCDChip::DARK_FRAME : CCDChip::BIAS_FRAME);
+	camgain = job->gain;
+
+	if (!accumulator.count())
+		DEBUGF(INDI::Logger::DBG_SESSION, "Dark library: taking %s.", path.c_str());
+
+	libraryActive = true;
+	if (!beginExposure(job->exposure)) {
+		libraryActive = false;
+		libraryRestore();
+		return;
+	}
+
+	LibraryStatNP.s = IPS_BUSY;
+	updateLibrary();
+}
+
+/* main loop: a library frame is in, add it and write the master once there are enough */
+void QHY9::libraryFrame(QHY9Frame *frame)
+{
+	QHY9MasterInfo info;
+	QHY9TempStats temp;
+	std::string path;
+	const QHY9DarkJob *job;
+	int w = frame->w / frame->bx, h = frame->h / frame->by;
+
+	libraryActive = false;
+	if (!libraryPending)
+		InExposure = false;
+
+	/* plan changed or library switched off under it */
+	if (LibraryS[0].s != ISS_ON || libraryJob >= (int) libraryJobs.size())
+		return;
+
+	if (frame->status || frame->partial) {
+		DEBUG(INDI::Logger::DBG_WARNING, "Dark library frame lost, taking it again.");
+		return;
+	}
+
+	if (!accumulator.count() || accumulator.width() != w || accumulator.height() != h)
+		accumulator.start(w, h);
+
+	telemetry.range(&frame->open_mono, &frame->close_mono, &temp);
+	accumulator.add(frame->dst, temp.count ? temp.mean : Temperature);
+
+	if (accumulator.count() >= (int) LibrarySetN[0].value) {
+		job = &libraryJobs[libraryJob];
+
+		info.exposure = job->exposure;
+		info.bin = job->bin;
+		info.gain = job->gain;
+		info.offset = camoffset;
+		info.setpoint = TemperatureTarget;
+
+		if (libraryPath(job, path) && accumulator.write(path.c_str(), &info)) {
+			DEBUGF(INDI::Logger::DBG_SESSION, "Dark library: %s written from %d frames.",
+			       path.c_str(), accumulator.count());
+			calibRescan = true;
+		} else {
+			DEBUGF(INDI::Logger::DBG_ERROR, "Dark library: cannot write %s.", path.c_str());
+		}
+
+		accumulator.reset();
+		libraryJob++;
+	}
+
+	updateLibrary();
+}
+
+/* main loop: give the camera back to the client, dropping a library frame in progress */
+void QHY9::libraryYield()
+{
+	if (libraryActive) {
+		qhy9_trace_text("library: yielding the camera");
+
+		abortCamera();
+		libraryActive = false;
+		InExposure = false;
+	}
+
+	libraryRestore();
+
+	/* idle time starts over */
+	clock_gettime(CLOCK_MONOTONIC, &lastClientExposure);
+}
+
+/* main loop: the client's settings back, the frames taken so far stay in the accumulator */
+void QHY9::libraryRestore()
+{
+	if (!librarySaved)
+		return;
+
+	restoreFrameSettings(&librarySettings);
+	camgain = (int) Gain;
+
+	if (!deviceLost)
+		setShutter(SHUTTER_FREE);
+
+	librarySaved = false;
+
+	if (LibraryStatNP.s == IPS_BUSY) {
+		LibraryStatNP.s = IPS_IDLE;
+		updateLibrary();
+	}
+}
+
+void QHY9::saveFrameSettings(QHY9FrameSettings *settings)
+{
+	settings->binX = PrimaryCCD.getBinX();
+	settings->binY = PrimaryCCD.getBinY();
+	settings->x = PrimaryCCD.getSubX();
+	settings->y = PrimaryCCD.getSubY();
+	settings->w = PrimaryCCD.getSubW();
+	settings->h = PrimaryCCD.getSubH();
+	settings->type = PrimaryCCD.getFrameType();
+}
+
+void QHY9::restoreFrameSettings(const QHY9FrameSettings *settings)
+{
+	PrimaryCCD.setBin(settings->binX, settings->binY);
+	PrimaryCCD.setFrame(settings->x, settings->y, settings->w, settings->h);
+	PrimaryCCD.setFrameType(settings->type);
+}
+
+void QHY9::updateLibrary()
+{
+	int jobs = libraryJobs.size();
+
+	LibraryStatN[0].value = (libraryJob < jobs) ? libraryJob + 1 : jobs;
+	LibraryStatN[1].value = jobs;
+	LibraryStatN[2].value = accumulator.count();
+	LibraryStatN[3].value = LibrarySetN[0].value;
+	IDSetNumber(&LibraryStatNP, NULL);
+}
+
+/*
+ * main loop: expose the focus ROI back to back. Only the first frame pays
+ * for the register upload and settle, the readout thread arms the others
+ * right after each download with the registers unchanged. Every frame is
+ * measured; with STATS_ONLY nothing but the numbers goes to the client.
+ */
+bool QHY9::startFocus()
+{
+	int bin = (int) FocusSetN[4].value;
+	int size = (int) FocusSetN[3].value / bin * bin;
+	int x, y;
+
+	if (!focusLoop) {
+		if (libraryActive)
+			libraryYield();
+
+		if ((InExposure && !libraryPending) || SequenceCount || videoRunning || videoPending) {
+			DEBUG(INDI::Logger::DBG_ERROR, "Cannot start the focus loop while an exposure is in progress.");
+			return false;
+		}
+
+		libraryPending = false;
+		libraryRestore();
+		saveFrameSettings(&focusSettings);
+
+		focusLoop = true;
+		focusFrames = 0;
+		FocusStatN[0].value = FocusStatN[1].value = 0;
+	}
+
+	/* a library frame or the last loop frame is still coming off the camera */
+	if (Downloading) {
+		focusRestart = true;
+		InExposure = true;
+		return true;
+	}
+
+	focusRestart = false;
+	InExposure = false;
+
+	/* centered on X, Y, inside the sensor, on the binned grid */
+	x = clamp_int((int) FocusSetN[1].value - size / 2, 0, QHY9_SENSOR_WIDTH - size) / bin * bin;
+	y = clamp_int((int) FocusSetN[2].value - size / 2, 0, QHY9_SENSOR_HEIGHT - size) / bin * bin;
+
+	PrimaryCCD.setBin(bin, bin);
+	PrimaryCCD.setFrame(x, y, size, size);
+	PrimaryCCD.setFrameType(CCDChip::LIGHT_FRAME);
+	memset(&focusLast, 0, sizeof(focusLast));
+
+	if (!beginExposure(FocusSetN[0].value)) {
+		stopFocus(IPS_ALERT, "Cannot start the focus loop.");
+		return false;
+	}
+
+	INumberVectorProperty *exp = getNumber("CCD_EXPOSURE");
+	if (exp) {
+		exp->s = IPS_BUSY;
+		IDSetNumber(exp, NULL);
+	}
+
+	FocusSP.s = IPS_BUSY;
+	IDSetSwitch(&FocusSP, "Focus loop on %dx%d at %d,%d, bin %d, %.3f s.",
+		    size, size, x, y, bin, FocusSetN[0].value);
+
+	return true;
+}
+
+/* main loop: end the loop, dropping the frame on the camera, and give the client its frame back */
+void QHY9::stopFocus(IPState state, const char *msg)
+{
+	if (!focusLoop)
+		return;
+
+	if (InExposure && !focusRestart)
+		abortCamera();
+
+	focusLoop = focusRestart = false;
+	InExposure = false;
+
+	restoreFrameSettings(&focusSettings);
+
+	INumberVectorProperty *exp = getNumber("CCD_EXPOSURE");
+	if (exp && exp->s == IPS_BUSY) {
+		exp->s = (state == IPS_ALERT) ? IPS_ALERT : IPS_IDLE;
+		IDSetNumber(exp, NULL);
+	}
+
+	IUResetSwitch(&FocusSP);
+	FocusS[1].s = ISS_ON;
+	FocusSP.s = state;
+	IDSetSwitch(&FocusSP, "%s", msg ? msg : "Focus loop stopped.");
+}
+
+/* main loop: count a loop frame, the rate is from exposure start to exposure start */
+void QHY9::focusFrame(QHY9Frame *frame)
+{
+	double ms;
+
+	focusFrames++;
+
+	if (focusLast.tv_sec || focusLast.tv_nsec) {
+		ms = ts_ms(&frame->open_mono, &focusLast);
+		if (ms > 0)
+			FocusStatN[1].value = 1000.0 / ms;
+	}
+	focusLast = frame->open_mono;
+
+	FocusStatN[0].value = focusFrames;
+	FocusStatNP.s = IPS_BUSY;
+	IDSetNumber(&FocusStatNP, NULL);
+}
+
+/*
+ * main loop: live video. The registers go up once, in live mode, and the
+ * readout thread then starts, waits out and downloads one frame after the
+ * other into a ring slot, without settling or shutter moves in between.
+ * The stream here and the stats thread each take the newest frame when
+ * they are ready for one; a slow client only sees fewer frames.
+ */
+bool QHY9::startVideo()
+{
+	QHY9Frame *frame;
+	CCDChip::CCD_FRAME type;
+	size_t size;
+	int dirty;
+
+	if (videoRunning)
+		return true;
+
+	if (libraryActive)
+		libraryYield();
+
+	if (InExposure || SequenceCount || focusLoop) {
+		videoPending = false;
+		DEBUG(INDI::Logger::DBG_ERROR, "Cannot start live video while an exposure is in progress.");
+		return false;
+	}
+
+	/* a library frame is still coming off the camera, or the last video frame */
+	if (Downloading) {
+		videoPending = true;
+		VideoSP.s = IPS_BUSY;
+		IDSetSwitch(&VideoSP, NULL);
+		return true;
+	}
+
+	videoPending = false;
+	if (!readoutRunning || deviceLost)
+		return false;
+
+	libraryRestore();
+
+	/* setCameraRegisters puts the camera in live mode from here on */
+	videoRunning = true;
+	ExposureRequest = VideoSetN[0].value;
+
+	dirty = setCameraRegisters();
+	usleep(settleTime(dirty) * 1000);
+
+	/* open for good instead of cycling the shutter every frame */
+	type = PrimaryCCD.getFrameType();
+	setShutter((type == CCDChip::DARK_FRAME || type == CCDChip::BIAS_FRAME) ? SHUTTER_CLOSE : SHUTTER_OPEN);
+	usleep(500*1000);
+
+	frame = new QHY9Frame;
+	size = setupFrame(frame, false);
+	frame->video = true;
+	frame->compress = false;
+	frame->previewFactor = 0;
+	frame->calibrate = false;
+	frame->library = false;
+	frame->measure = false;
+	frame->statsOnly = false;
+	frame->recordOnly = false;
+	frame->rearm = false;
+
+	/* stream, stats and recorder hold a slot each at most, the minimum leaves one for the camera */
+	if (!videoRing.allocate((int) VideoSetN[3].value, size)) {
+		delete frame;
+		videoRunning = false;
+		setShutter(SHUTTER_FREE);
+		DEBUGF(INDI::Logger::DBG_ERROR, "Cannot allocate %d video frames of %zu bytes.",
+		       (int) VideoSetN[3].value, size);
+		return false;
+	}
+
+	videoSent = 0;
+	videoStreamed = 0;
+	videoMeasured = 0;
+	videoRateSeq = 0;
+	videoWake = false;
+	memset(&videoLastSent, 0, sizeof(videoLastSent));
+	clock_gettime(CLOCK_MONOTONIC, &videoRateTime);
+
+	if (StatsS[0].s != ISS_ON) {
+		statistics.setThreshold(StatsSetN[0].value);
+		statistics.setRadius((int) StatsSetN[1].value);
+
+		videoStatsQuit = false;
+		videoStatsReady = false;
+		if (pthread_create(&videoStatsThread, NULL, videoStatsEntry, this) == 0)
+			videoMeasure = true;
+		else
+			DEBUG(INDI::Logger::DBG_WARNING, "Cannot start the video stats thread, frames are not measured.");
+	}
+
+	if (recorder.isOpen())
+		startVideoRecord();
+
+	pthread_mutex_lock(&readoutLock);
+	sequenceAbort = false;
+	readoutJob = frame;
+	pthread_cond_signal(&readoutCond);
+	pthread_mutex_unlock(&readoutLock);
+
+	Downloading = true;
+
+	VideoSP.s = IPS_BUSY;
+	IDSetSwitch(&VideoSP, "Live video on %dx%d at %.0f ms, %d slots.",
+		    frame->w / frame->bx, frame->h / frame->by, ExposureRequest, videoRing.slots());
+
+	return true;
+}
+
+/* main loop: drop the frame on the camera, endVideo runs once it is back */
+void QHY9::stopVideo()
+{
+	videoPending = false;
+
+	if (videoRunning)
+		abortCamera();
+}
+
+/* main loop: the settings changed, start over with them once the frame is off */
+void QHY9::restartVideo()
+{
+	if (!videoRunning)
+		return;
+
+	stopVideo();
+	videoPending = true;
+}
+
+/* main loop: the video frame is back or gone with the readout thread; stop the consumers and free the ring */
+void QHY9::endVideo(IPState state, const char *msg)
+{
+	/* both consumers out before the ring goes */
+	__atomic_store_n(&videoStatsQuit, true, __ATOMIC_RELEASE);
+	__atomic_store_n(&videoRecordQuit, true, __ATOMIC_RELEASE);
+	videoRing.stop();
+
+	if (videoMeasure) {
+		pthread_join(videoStatsThread, NULL);
+		videoMeasure = false;
+	}
+	stopVideoRecord();
+
+	if (videoTimer >= 0) {
+		IERmTimer(videoTimer);
+		videoTimer = -1;
+	}
+
+	videoRunning = false;
+	updateVideo();
+	videoRing.reset();
+
+	if (!deviceLost && transport)
+		setShutter(SHUTTER_FREE);
+
+	/* a restart keeps it busy */
+	if (videoPending)
+		return;
+
+	IUResetSwitch(&VideoSP);
+	VideoS[1].s = ISS_ON;
+	VideoSP.s = state;
+	IDSetSwitch(&VideoSP, "%s", msg ? msg : "Live video stopped.");
+}
+
+/*
+ * readout thread: the video frame loop. Each frame is BEGIN_VIDEO, the
+ * exposure and the download straight into a slot; frame->dst moves from
+ * slot to slot. Returns once the frame is aborted or a download fails, the
+ * status is in frame->status.
+ */
+void QHY9::videoLoop(QHY9Frame *frame)
+{
+	QHY9RingFrame *slot;
+	char c = 0;
+	int ret;
+
+	for (;;) {
+		slot = videoRing.claim();
+		if (!slot) {
+			qhy9_trace_text("video: every slot held");
+			frame->status = -1;
+			return;
+		}
+
+		/* hold the lock over beginVideo so abortCamera either sees the exposure or stops it */
+		pthread_mutex_lock(&readoutLock);
+		if (frame->aborted || sequenceAbort || readoutQuit) {
+			pthread_mutex_unlock(&readoutLock);
+			videoRing.discard(slot);
+			return;
+		}
+		markExposureStart();
+		beginVideo();
+		pthread_mutex_unlock(&readoutLock);
+
+		frame->dst = slot->data;
+		frame->pos = 0;
+		frame->partial = false;
+
+		if (waitExposureEnd(frame)) {
+			videoRing.discard(slot);
+			return;
+		}
+
+		ret = downloadFrame(frame);
+		if (ret) {
+			videoRing.discard(slot);
+			frame->status = ret;
+			return;
+		}
+
+		slot->x = frame->x;
+		slot->y = frame->y;
+		slot->w = frame->w / frame->bx;
+		slot->h = frame->h / frame->by;
+		slot->bx = frame->bx;
+		slot->by = frame->by;
+		slot->exposure = ExposureRequest;
+		slot->open_rt = frame->open_rt;
+		slot->close_rt = frame->close_rt;
+		slot->open_mono = frame->open_mono;
+		slot->close_mono = frame->close_mono;
+		slot->partial = frame->partial;
+		videoRing.publish(slot);
+
+		/* one wakeup until the main loop has looked */
+		if (!__atomic_exchange_n(&videoWake, true, __ATOMIC_ACQ_REL) &&
+		    readoutPipe[1] >= 0 && write(readoutPipe[1], &c, 1) != 1)
+			fprintf(stderr, "video: cannot wake main loop\n");
+	}
+}
+
+void QHY9::videoTimerHit(void *arg)
+{
+	QHY9 *self = (QHY9 *) arg;
+
+	qhy9_trace_set_source(self->cameraIndex);
+	self->videoTimer = -1;
+	if (self->videoRunning)
+		self->videoDeliver();
+}
+
+/* main loop: stream the newest frame, at most STREAM_FPS a second, and publish the newest stats */
+void QHY9::videoDeliver()
+{
+	QHY9RingFrame *frame;
+	struct timespec now;
+	double fps = VideoSetN[1].value, wait;
+	bool ready;
+
+	__atomic_store_n(&videoWake, false, __ATOMIC_RELEASE);
+
+	pthread_mutex_lock(&readoutLock);
+	ready = videoStatsReady;
+	videoStatsReady = false;
+	if (ready)
+		frameStats = videoStats;
+	pthread_mutex_unlock(&readoutLock);
+
+	if (ready) {
+		videoMeasured++;
+		updateStats();
+	}
+
+	/* recording instead of sending */
+	if (fps <= 0 || videoTimer >= 0 || (recorder.isOpen() && RecordS[2].s == ISS_ON))
+		return;
+
+	/* too early, come back when the next one is due */
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	wait = 1000.0 / fps - ts_ms(&now, &videoLastSent);
+	if (wait > 1) {
+		videoTimer = IEAddTimer((int) ceil(wait), videoTimerHit, this);
+		return;
+	}
+
+	frame = videoRing.acquireLatest(videoSent);
+	if (!frame)
+		return;
+
+	videoSent = frame->seq;
+	qhy9_make_preview(frame->data, frame->w, frame->h, (int) VideoSetN[2].value, &videoPreview);
+	videoRing.release(frame);
+
+	if (videoPreview.pgm.empty())
+		return;
+
+	VideoB[0].blob = &videoPreview.pgm[0];
+	VideoB[0].bloblen = VideoB[0].size = videoPreview.pgm.size();
+	VideoBP.s = IPS_BUSY;
+	IDSetBLOB(&VideoBP, NULL);
+
+	VideoB[0].blob = NULL;
+	VideoB[0].bloblen = VideoB[0].size = 0;
+
+	videoLastSent = now;
+	videoStreamed++;
+}
+
+/* main loop: frame counts and the camera frame rate since the last update */
+void QHY9::updateVideo()
+{
+	struct timespec now;
+	uint64_t frames = videoRing.published();
+	double ms;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ms = ts_ms(&now, &videoRateTime);
+	if (ms > 0 && frames >= videoRateSeq)
+		VideoStatN[1].value = (frames - videoRateSeq) * 1000.0 / ms;
+	videoRateSeq = frames;
+	videoRateTime = now;
+
+	VideoStatN[0].value = frames;
+	VideoStatN[2].value = videoStreamed;
+	VideoStatN[3].value = videoMeasured;
+
+	VideoStatNP.s = videoRunning ? IPS_BUSY : IPS_IDLE;
+	IDSetNumber(&VideoStatNP, NULL);
+}
+
+void *QHY9::videoStatsEntry(void *arg)
+{
+	qhy9_trace_set_source(((QHY9 *) arg)->cameraIndex);
+	((QHY9 *) arg)->videoStatsLoop();
+	return NULL;
+}
+
+/* stats thread: measure the newest frame whenever the last one is done, the main loop publishes */
+void QHY9::videoStatsLoop()
+{
+	QHY9RingFrame *frame;
+	QHY9FrameStats stats;
+	uint64_t seen = 0;
+	char c = 0;
+	bool ok;
+
+	while (!__atomic_load_n(&videoStatsQuit, __ATOMIC_ACQUIRE)) {
+		if (!videoRing.wait(seen, 500))
+			continue;
+
+		frame = videoRing.acquireLatest(seen);
+		if (!frame)
+			continue;
+
+		seen = frame->seq;
+		statistics.begin(frame->data, frame->w, frame->h);
+		statistics.feed((size_t) frame->w * frame->h);
+		ok = statistics.finish(&stats);
+		videoRing.release(frame);
+
+		if (!ok)
+			continue;
+
+		pthread_mutex_lock(&readoutLock);
+		videoStats = stats;
+		videoStatsReady = true;
+		pthread_mutex_unlock(&readoutLock);
+
+		if (!__atomic_exchange_n(&videoWake, true, __ATOMIC_ACQ_REL) &&
+		    readoutPipe[1] >= 0 && write(readoutPipe[1], &c, 1) != 1)
+			fprintf(stderr, "video: cannot wake main loop\n");
+	}
+}
+
+/*
+ * main loop: open a new recording in RECORD_DIR. Frames are added as they
+ * are delivered, video frames by their own thread off the ring; the
+ * recorder copies them and takes them to disk on its writer thread, so
+ * nothing here waits for the disk.
+ */
+bool QHY9::startRecording()
+{
+	std::string path;
+	struct stat st;
+	char name[64];
+	time_t now = time(NULL);
+	struct tm *tm = gmtime(&now);
+
+	if (!*RecordDirT[0].text || stat(RecordDirT[0].text, &st) || !S_ISDIR(st.st_mode)) {
+		DEBUGF(INDI::Logger::DBG_ERROR, "Recording directory \"%s\" does not exist.", RecordDirT[0].text);
+		return false;
+	}
+
+	strftime(name, sizeof(name), "/qhy9_%Y%m%dT%H%M%S.qr9", tm);
+	path = std::string(RecordDirT[0].text) + name;
+
+	if (!recorder.open(path.c_str(), getDeviceName(), (size_t) RecordSetN[0].value << 20,
+			   (size_t) RecordSetN[1].value << 20, (size_t) QHY9_SENSOR_WIDTH * QHY9_SENSOR_HEIGHT)) {
+		DEBUGF(INDI::Logger::DBG_ERROR, "Cannot create %s.", path.c_str());
+		return false;
+	}
+
+	if (!recorder.isDirect())
+		DEBUG(INDI::Logger::DBG_WARNING, "No direct I/O on this file system, recording through the page cache.");
+
+	recordSkipped = 0;
+	if (videoRunning)
+		startVideoRecord();
+
+	IUSaveText(&RecordFileT[0], path.c_str());
+	RecordFileTP.s = IPS_BUSY;
+	IDSetText(&RecordFileTP, NULL);
+
+	RecordSP.s = IPS_BUSY;
+	IDSetSwitch(&RecordSP, "Recording to %s.", path.c_str());
+
+	updateRecording();
+
+	return true;
+}
+
+/* main loop: flush, finish and close the recording */
+void QHY9::stopRecording(IPState state, const char *msg)
+{
+	bool ok;
+
+	if (!recorder.isOpen())
+		return;
+
+	stopVideoRecord();
+	updateRecording();
+
+	ok = recorder.close();
+	if (!ok && state == IPS_IDLE)
+		state = IPS_ALERT;
+
+	RecordStatNP.s = state;
+	IDSetNumber(&RecordStatNP, NULL);
+	RecordFileTP.s = ok ? IPS_OK : IPS_ALERT;
+	IDSetText(&RecordFileTP, NULL);
+
+	IUResetSwitch(&RecordSP);
+	RecordS[0].s = ISS_ON;
+	RecordSP.s = state;
+	if (msg)
+		IDSetSwitch(&RecordSP, "%s", msg);
+	else
+		IDSetSwitch(&RecordSP, "Recording of %.0f frames %s.", RecordStatN[0].value,
+			    ok ? "closed" : "closed, some writes failed");
+}
+
+/* any thread: record header of a frame, with the registers on the camera and its temperature */
+void QHY9::recordHeader(QHY9RecordFrame *rec, const QHY9RingFrame *frame)
+{
+	QHY9TempStats temp;
+
+	memset(rec, 0, sizeof(*rec));
+
+	rec->camera_seq = frame->seq;
+	rec->x = frame->x;
+	rec->y = frame->y;
+	rec->w = frame->w * frame->bx;
+	rec->h = frame->h * frame->by;
+	rec->bx = frame->bx;
+	rec->by = frame->by;
+	rec->width = frame->w;
+	rec->height = frame->h;
+	rec->exposure = frame->exposure;
+	rec->open_rt = frame->open_rt.tv_sec * 1000000000LL + frame->open_rt.tv_nsec;
+	rec->close_rt = frame->close_rt.tv_sec * 1000000000LL + frame->close_rt.tv_nsec;
+	rec->open_mono = frame->open_mono.tv_sec * 1000000000LL + frame->open_mono.tv_nsec;
+	rec->close_mono = frame->close_mono.tv_sec * 1000000000LL + frame->close_mono.tv_nsec;
+
+	telemetry.range(&frame->open_mono, &frame->close_mono, &temp);
+	if (temp.count) {
+		rec->temp = temp.mean;
+		rec->temp_min = temp.min;
+		rec->temp_max = temp.max;
+	} else {
+		rec->temp = rec->temp_min = rec->temp_max = Temperature;
+	}
+	rec->setpoint = TemperatureTarget;
+
+	rec->flags = (frame->seq ? QHY9_RECORD_VIDEO : 0) | (frame->partial ? QHY9_RECORD_PARTIAL : 0);
+
+	/* unchanged while frames come in, uploads only happen between them */
+	memcpy(rec->reg, REGUploaded, sizeof(rec->reg));
+}
+
+/* main loop: an exposure into the recording, copied so the frame buffer is free right after */
+void QHY9::recordFrame(QHY9Frame *frame)
+{
+	QHY9RecordFrame rec;
+	QHY9RingFrame f;
+
+	memset(&f, 0, sizeof(f));
+	f.x = frame->x;
+	f.y = frame->y;
+	f.w = frame->w / frame->bx;
+	f.h = frame->h / frame->by;
+	f.bx = frame->bx;
+	f.by = frame->by;
+	f.exposure = ExposureRequest;
+	f.open_rt = frame->open_rt;
+	f.close_rt = frame->close_rt;
+	f.open_mono = frame->open_mono;
+	f.close_mono = frame->close_mono;
+	f.partial = frame->partial;
+
+	recordHeader(&rec, &f);
+
+	/* the pixels as they are sent, not as the camera sent them */
+	if (frame->swap)
+		rec.flags |= QHY9_RECORD_SWAPPED;
+	if (frame->calibrate) {
+		int len = 0;
+
+		for (int i = 0; i < QHY9_MASTER_TYPES; i++)
+			if (!frame->calib.names[i].empty())
+				rec.calstat[len++] = "BDF"[i];
+		rec.pedestal = (int) -frame->calib.pedestal;
+		rec.flags |= QHY9_RECORD_CALIBRATED;
+	}
+
+	if (!recorder.add(&rec, frame->dst))
+		DEBUG(INDI::Logger::DBG_WARNING, "Frame not recorded, the disk is behind.");
+}
+
+/* main loop: recording progress; a failed write ends it */
+void QHY9::updateRecording()
+{
+	int err = recorder.getError();
+
+	RecordStatN[0].value = recorder.getFrames();
+	RecordStatN[1].value = recorder.getDropped() + __atomic_load_n(&recordSkipped, __ATOMIC_RELAXED);
+	RecordStatN[2].value = recorder.getBytes() / 1048576.0;
+	RecordStatN[3].value = recorder.getRate();
+	RecordStatNP.s = IPS_BUSY;
+	IDSetNumber(&RecordStatNP, NULL);
+
+	if (err && RecordSP.s == IPS_BUSY) {
+		char msg[128];
+
+		snprintf(msg, sizeof(msg), "Recording stopped, write failed: %s", strerror(err));
+		stopRecording(IPS_ALERT, msg);
+	}
+}
+
+/* main loop: video frames into the recording, from the frame after the newest */
+void QHY9::startVideoRecord()
+{
+	if (videoRecording)
+		return;
+
+	videoRecordQuit = false;
+	if (pthread_create(&videoRecordThread, NULL, videoRecordEntry, this) == 0)
+		videoRecording = true;
+	else
+		DEBUG(INDI::Logger::DBG_WARNING, "Cannot start the video record thread, video is not recorded.");
+}
+
+void QHY9::stopVideoRecord()
+{
+	if (!videoRecording)
+		return;
+
+	/* it looks at the flag at least twice a second */
+	__atomic_store_n(&videoRecordQuit, true, __ATOMIC_RELEASE);
+	pthread_join(videoRecordThread, NULL);
+	videoRecording = false;
+}
+
+void *QHY9::videoRecordEntry(void *arg)
+{
+	qhy9_trace_set_source(((QHY9 *) arg)->cameraIndex);
+	((QHY9 *) arg)->videoRecordLoop();
+	return NULL;
+}
+
+/* record thread: every frame in order while it keeps up, the oldest are gone when it does not */
+void QHY9::videoRecordLoop()
+{
+	QHY9RingFrame *frame;
+	QHY9RecordFrame rec;
+	uint64_t seen = videoRing.published();
+
+	while (!__atomic_load_n(&videoRecordQuit, __ATOMIC_ACQUIRE)) {
+		if (!videoRing.wait(seen, 500))
+			continue;
+
+		while ((frame = videoRing.acquireNext(seen))) {
+			if (frame->seq > seen + 1)
+				__atomic_add_fetch(&recordSkipped, frame->seq - seen - 1, __ATOMIC_RELAXED);
+			seen = frame->seq;
+
+			recordHeader(&rec, frame);
+			recorder.add(&rec, frame->data);
+			videoRing.release(frame);
+		}
+	}
+}
+
+/* main loop: publish the stats of the frame being delivered */
+void QHY9::updateStats()
+{
+	StatsN[0].value = frameStats.min;
+	StatsN[1].value = frameStats.max;
+	StatsN[2].value = frameStats.mean;
+	StatsN[3].value = frameStats.median;
+	StatsN[4].value = frameStats.mad;
+	StatsN[5].value = frameStats.stars;
+	StatsN[6].value = frameStats.hfr;
+	StatsN[7].value = frameStats.fwhm;
+	StatsN[8].value = frameStats.ms;
+
+	StatsNP.s = IPS_OK;
+	IDSetNumber(&StatsNP, NULL);
+}
+
+/* main loop: the preview goes out first, the client can show it while the frame follows */
+void QHY9::sendPreview(QHY9Frame *frame)
+{
+	if (frame->preview.pgm.empty())
+		return;
+
+	PreviewB[0].blob = &frame->preview.pgm[0];
+	PreviewB[0].bloblen = PreviewB[0].size = frame->preview.pgm.size();
+	PreviewBP.s = IPS_OK;
+	IDSetBLOB(&PreviewBP, NULL);
+
+	/* the frame and its preview go together */
+	PreviewB[0].blob = NULL;
+	PreviewB[0].bloblen = PreviewB[0].size = 0;
+}
+
+/*
+ * main loop: ExposureComplete for a compressed frame. The header comes from
+ * the keyword collector, the image from the compressor, which has been at it
+ * since the first tiles arrived; the client gets it as a .fits.z BLOB, the
+ * upload directory a .fits.gz. False if it could not be done, the caller then
+ * falls back to the uncompressed frame.
+ */
+bool QHY9::sendCompressed(QHY9Frame *frame)
+{
+	IBLOBVectorProperty *bp = getBLOB("CCD1");
+	ISwitchVectorProperty *upload = getSwitch("UPLOAD_MODE");
+	INumberVectorProperty *exp;
+	ISwitch *mode = upload ? IUFindOnSwitch(upload) : NULL;
+	bool client = true, local = false;
+	QHY9FitsHeader keys;
+	std::string header;
+	uint8_t *out;
+	size_t outlen, raw;
+	int w, h;
+
+	if (!bp || !compressor.active())
+		return false;
+
+	if (mode && !strcmp(mode->name, "UPLOAD_LOCAL"))
+		client = false;
+	if (mode && strcmp(mode->name, "UPLOAD_CLIENT"))
+		local = true;
+
+	w = frame->w / frame->bx;
+	h = frame->h / frame->by;
+
+	keys.image(w, h);
+	fitsKeywords(&keys, &PrimaryCCD);
+	header = keys.finish();
+
+	raw = qhy9_fits_size(header.size(), (size_t) w * h);
+
+	if (local) {
+		if (!compressor.finish((const uint8_t *) header.data(), header.size(), QHY9Compressor::GZIP, &out, &outlen))
+			return false;
+		saveCompressed(out, outlen);
+	}
+
+	if (client) {
+		/* same deflate stream, only the wrapper differs */
+		if (local)
+			compressor.rewrap(QHY9Compressor::ZLIB, &out, &outlen);
+		else if (!compressor.finish((const uint8_t *) header.data(), header.size(), QHY9Compressor::ZLIB, &out, &outlen))
+			return false;
+
+		bp->bp[0].blob = out;
+		bp->bp[0].bloblen = outlen;
+		bp->bp[0].size = raw;
+		strcpy(bp->bp[0].format, ".fits.z");
+		bp->s = IPS_OK;
+		IDSetBLOB(bp, NULL);
+	}
+
+	exp = getNumber("CCD_EXPOSURE");
+	if (exp) {
+		exp->np[0].value = 0;
+		exp->s = IPS_OK;
+		IDSetNumber(exp, NULL);
+	}
+
+	CompressStatN[0].value = compressor.getRatio();
+	CompressStatN[1].value = compressor.getWallMs();
+	CompressStatN[2].value = compressor.getFinishMs();
+	CompressStatN[3].value = compressor.getCpuMs();
+	CompressStatN[4].value = outlen / 1024.0;
+	CompressStatNP.s = IPS_OK;
+	IDSetNumber(&CompressStatNP, NULL);
+
+	return true;
+}
+
+/*
+ * main loop: ExposureComplete for an uncompressed frame, without cfitsio.
+ * The header comes from the keyword collector and the pixels go into FITS
+ * order in one pass of the kernels, straight into the file in the upload
+ * directory, mapped, or into the BLOB buffer when there is no file. The
+ * client gets the same bytes either way. False if it could not be done,
+ * the caller then leaves it to ExposureComplete.
+ */
+bool QHY9::sendFits(QHY9Frame *frame)
+{
+	IBLOBVectorProperty *bp = getBLOB("CCD1");
+	ISwitchVectorProperty *upload = getSwitch("UPLOAD_MODE");
+	INumberVectorProperty *exp;
+	ISwitchVectorProperty *zlib = getSwitch("CCD_COMPRESSION");
+	ISwitch *mode = upload ? IUFindOnSwitch(upload) : NULL;
+	ISwitch *zmode = zlib ? IUFindOnSwitch(zlib) : NULL;
+	bool client = true, local = false;
+	QHY9FitsHeader keys;
+	std::string header, name;
+	size_t npix, size;
+	uint8_t *out;
+	int w, h;
+
+	if (!bp)
+		return false;
+
+	if (mode && !strcmp(mode->name, "UPLOAD_LOCAL"))
+		client = false;
+	if (mode && strcmp(mode->name, "UPLOAD_CLIENT"))
+		local = true;
+
+	/* a zlib BLOB of the whole file is still ExposureComplete's */
+	if (client && zmode && !strcmp(zmode->name, "CCD_COMPRESS"))
+		return false;
+
+	w = frame->w / frame->bx;
+	h = frame->h / frame->by;
+	npix = (size_t) w * h;
+
+	keys.image(w, h);
+	fitsKeywords(&keys, &PrimaryCCD);
+	header = keys.finish();
+	size = qhy9_fits_size(header.size(), npix);
+
+	if (local) {
+		name = uploadPath(".fits");
+		if (!fitsFile.create(name.c_str(), size)) {
+			DEBUGF(INDI::Logger::DBG_ERROR, "Cannot write %s: %s", name.c_str(), strerror(errno));
+			return false;
+		}
+		out = fitsFile.data();
+	} else {
+		if (fitsBlob.size() < size)
+			fitsBlob.resize(size);
+		out = &fitsBlob[0];
+	}
+
+	qhy9_fits_pack(out, header, frame->dst, npix);
+
+	if (client) {
+		bp->bp[0].blob = out;
+		bp->bp[0].bloblen = bp->bp[0].size = size;
+		strcpy(bp->bp[0].format, ".fits");
+		bp->s = IPS_OK;
+		IDSetBLOB(bp, NULL);
+		bp->bp[0].blob = NULL;
+	}
+
+	if (local) {
+		if (fitsFile.close())
+			DEBUGF(INDI::Logger::DBG_SESSION, "Image saved to %s", name.c_str());
+		else
+			DEBUGF(INDI::Logger::DBG_ERROR, "Cannot write %s: %s", name.c_str(), strerror(errno));
+	}
+
+	exp = getNumber("CCD_EXPOSURE");
+	if (exp) {
+		exp->np[0].value = 0;
+		exp->s = IPS_OK;
+		IDSetNumber(exp, NULL);
+	}
+
+	return true;
+}
+
+/* main loop: first free name in the upload directory, IMAGE_XXX style prefix */
+std::string QHY9::uploadPath(const char *ext)
+{
+	ITextVectorProperty *settings = getText("UPLOAD_SETTINGS");
+	IText *dir = settings ? IUFindText(settings, "UPLOAD_DIR") : NULL;
+	IText *prefix = settings ? IUFindText(settings, "UPLOAD_PREFIX") : NULL;
+	std::string name, pre;
+	char num[16];
+	size_t at;
+	int i;
+
+	pre = (prefix && prefix->text) ? prefix->text : "IMAGE_XXX";
+	at = pre.find("XXX");
+
+	/* first free number in place of XXX */
+	for (i = 1; i < 100000; i++) {
+		name = (dir && dir->text && *dir->text) ? dir->text : ".";
+		name += "/";
+		if (at == std::string::npos) {
+			snprintf(num, sizeof(num), "_%03d", i);
+			name += pre + num;
+		} else {
+			snprintf(num, sizeof(num), "%03d", i);
+			name += pre.substr(0, at) + num + pre.substr(at + 3);
+		}
+		name += ext;
+
+		if (access(name.c_str(), F_OK))
+			break;
+	}
+
+	return name;
+}
+
+/* main loop: a .fits.gz in the upload directory */
+bool QHY9::saveCompressed(uint8_t *data, size_t len)
+{
+	std::string name = uploadPath(".fits.gz");
+	FILE *fp;
+
+	fp = fopen(name.c_str(), "wb");
+	if (!fp || fwrite(data, 1, len, fp) != len) {
+		DEBUGF(INDI::Logger::DBG_ERROR, "Cannot write %s: %s", name.c_str(), strerror(errno));
+		if (fp)
+			fclose(fp);
+		return false;
+	}
+	fclose(fp);
+
+	DEBUGF(INDI::Logger::DBG_SESSION, "Image saved to %s", name.c_str());
+
+	return true;
+}
+
+/* any thread: the transport saw the camera leave or a camera arrive */
+void QHY9::hotplugHandler(void *arg)
+{
+	QHY9 *self = (QHY9 *) arg;
+	char c = 0;
+
+	/* the main loop sorts it out with the completions */
+	if (self->readoutPipe[1] >= 0 && write(self->readoutPipe[1], &c, 1) != 1)
+		fprintf(stderr, "hotplug: cannot wake main loop\n");
+}
+
+/* main loop: the camera is gone, stop what is running and wait for it */
+void QHY9::deviceGone()
+{
+	deviceLost = true;
+	clock_gettime(CLOCK_MONOTONIC, &lostTime);
+
+	cooler.suspend();
+
+	DEBUG(INDI::Logger::DBG_WARNING, "Camera disconnected, waiting for it to come back.");
+
+	/* a library frame is dropped, a client exposure waiting behind it is resumed like any other */
+	if (libraryActive && !libraryPending)
+		InExposure = false;
+	libraryActive = libraryPending = false;
+	libraryRestore();
+
+	/* the exposure in progress is lost, it starts over after the reconnect */
+	pthread_mutex_lock(&readoutLock);
+	resumeExposure = InExposure;
+	sequenceAbort = true;
+	exposureArmed = false;
+	if (readoutJob)
+		readoutJob->aborted = true;
+	if (readoutActive) {
+		readoutActive->aborted = true;
+		transport->cancelRead();
+	}
+	pthread_mutex_unlock(&readoutLock);
+
+	wakeReadoutThread();
+}
+
+/* main loop: reopen a lost camera, restore its state and pick up where it stopped */
+bool QHY9::recoverDevice()
+{
+	struct timespec now;
+	bool busy;
+
+	/* the readout thread must be done with the old handle first */
+	pthread_mutex_lock(&readoutLock);
+	busy = readoutActive || readoutJob || !readoutDone.empty();
+	pthread_mutex_unlock(&readoutLock);
+
+	if (busy)
+		return false;
+
+	/* device memory belongs to the old handle, free it while that is still open */
+	freeStagingBuffer();
+
+	if (!transport->reopen())
+		return false;
+
+	deviceLost = false;
+	REGValid = false;
+	Downloading = false;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	DEBUGF(INDI::Logger::DBG_SESSION, "Camera back after %.0f ms.", ts_ms(&now, &lostTime));
+
+	/* the cooler writes the TEC power again on its next step */
+	cooler.resume();
+
+	if (!resumeExposure) {
+		/* nothing running, the next exposure uploads the registers anyway */
+		uploadRegisters();
+		return true;
+	}
+
+	resumeExposure = false;
+	InExposure = false;
+	gateWaiting = false;
+
+	/* StartExposure uploads the full register block since REGValid is false */
+	if (!StartExposure(ExposureRequest / 1000.0)) {
+		DEBUG(INDI::Logger::DBG_ERROR, "Cannot restart the exposure after reconnecting.");
+		endSequence(IPS_ALERT);
+		return true;
+	}
+
+	if (SequenceRemaining > 0)
+		DEBUGF(INDI::Logger::DBG_SESSION, "Sequence resumed at frame %d of %d.",
+		       SequenceCount - SequenceRemaining + 1, SequenceCount);
+
+	return true;
+}
+
+/* main loop: account a delivered frame and publish the stats */
+void QHY9::updateTiming(const double *ms)
+{
+	int i;
+
+	phaseStats.add(ms);
+
+	for (i = 0; i < QHY9_NPHASES; i++) {
+		TimingN[i * 3 + 0].value = phaseStats.last(i);
+		TimingN[i * 3 + 1].value = phaseStats.mean(i);
+		TimingN[i * 3 + 2].value = phaseStats.p95(i);
+	}
+
+	TimingNP.s = IPS_OK;
+	IDSetNumber(&TimingNP, NULL);
+}
+
+int QHY9::setCameraRegisters()
+{
+	int bin;
+
+	bin = qhy9_hardware_bin(PrimaryCCD.getBinX(), PrimaryCCD.getBinY());
+	qhy9_frame_layout(this, bin, PrimaryCCD.getSubY(), PrimaryCCD.getSubH());
+
+	qhy9_trace_layout(LineSize, VerticalSize, SKIP_TOP, SKIP_BOTTOM, p_size, total_p, patchnum, bin);
+
+	/* 1 = disable AMP during exposure */
+	AMPVOLTAGE = 1;
+
+	/* manual shutter for darks and biases */
+	CCDChip::CCD_FRAME ft = PrimaryCCD.getFrameType();
+	MechanicalShutterMode = (ft == CCDChip::DARK_FRAME || ft == CCDChip::BIAS_FRAME) ? 1 : 0;
+
+	TopSkipNull = 30; // ???
+
+	/* live video: short exposure timing, free running, read from the first ROI line */
+	ShortExposure = videoRunning ? 1 : 0;
+	TgateMode = videoRunning ? 1 : 0;
+	LiveVideo_BeginLine = videoRunning ? SKIP_TOP : 0;
+
+	SDRAM_MAXSIZE = 100;
+
+	Exptime = (unsigned long) floor(ExposureRequest);
+
+	qhy9_pack_registers(this, REG);
+
+	return uploadRegisters();
+}
+
+/* send REG to the camera unless it already has it; returns what changed */
+int QHY9::uploadRegisters()
+{
+	int dirty = REGS_CLEAN;
+	int i;
+
+	if (!REGValid) {
+		dirty = REGS_DIRTY;
+	} else {
+		for (i = 0; i < 64; i++) {
+			if (REG[i] == REGUploaded[i])
+				continue;
+
+			/* REG[2..4] is the exposure time */
+			if (i >= 2 && i <= 4)
+				dirty = (dirty == REGS_CLEAN) ? REGS_TIMING : dirty;
+			else
+				dirty = REGS_DIRTY;
+		}
+	}
+
+	if (dirty == REGS_CLEAN)
+		return REGS_CLEAN;
+
+	qhy9_trace_regs(REG, dirty);
+
+	if (!transport)
+		return dirty;
+
+	if (transport->vendorWrite(QHY9_REGISTERS_CMD, REG, 64) == 64) {
+		memcpy(REGUploaded, REG, 64);
+		REGValid = true;
+	} else {
+		REGValid = false;
+	}
+
+	return dirty;
+}
+
+/* msec to wait after a register upload */
+int QHY9::settleTime(int dirty)
+{
+	switch (dirty) {
+	case REGS_CLEAN:
+		return 0;
+	case REGS_TIMING:
+		return SETTLE_TIMING_MS;
+	default:
+		return SETTLE_MS;
+	}
+}
+
+/* readout thread: start the next exposure of a sequence with the same registers */
+bool QHY9::armNextExposure()
+{
+	struct timespec t0, t1, t2;
+	int dirty;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	dirty = uploadRegisters();
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	usleep(settleTime(dirty) * 1000);
+	clock_gettime(CLOCK_MONOTONIC, &t2);
+
+	/* hold the lock over beginVideo so AbortExposure either sees the exposure or stops it */
+	pthread_mutex_lock(&readoutLock);
+	if (sequenceAbort || readoutQuit) {
+		pthread_mutex_unlock(&readoutLock);
+		return false;
+	}
+
+	/* the shutter stays where the first frame put it */
+	armPhase[QHY9_PHASE_UPLOAD] = ts_ms(&t1, &t0);
+	armPhase[QHY9_PHASE_SETTLE] = ts_ms(&t2, &t1);
+	armPhase[QHY9_PHASE_SHUTTER] = 0;
+
+	markExposureStart();
+	beginVideo();
+	pthread_mutex_unlock(&readoutLock);
+
+	return true;
+}
+
+bool QHY9::ISNewNumber(const char *dev, const char *name, double values[], char *names[], int n)
+{
+	if (dev && !strcmp(dev, getDeviceName())) {
+		if (!strcmp(name, FilterSlotNP.name)) {
+			processFilterSlot(dev, values, names);
+			return true;
+		}
+
+		/* the client wants the camera, the library and the focus loop give its settings back before they change */
+		if (!strcmp(name, "CCD_BINNING") || !strcmp(name, "CCD_FRAME")) {
+			stopFocus(IPS_IDLE, "Focus loop stopped, the frame changed.");
+			restartVideo();
+			if (librarySaved)
+				libraryYield();
+		}
+
+		/* exposure and slots need a new start, the stream settings apply to the next frame */
+		if (!strcmp(name, RecordSetNP.name)) {
+			if (IUUpdateNumber(&RecordSetNP, values, names, n) < 0)
+				return false;
+
+			RecordSetNP.s = IPS_OK;
+			IDSetNumber(&RecordSetNP, recorder.isOpen() ? "Applies to the next recording." : NULL);
+
+			return true;
+		}
+
+		if (!strcmp(name, VideoSetNP.name)) {
+			double exposure = VideoSetN[0].value, slots = VideoSetN[3].value;
+
+			if (IUUpdateNumber(&VideoSetNP, values, names, n) < 0)
+				return false;
+
+			VideoSetNP.s = IPS_OK;
+			IDSetNumber(&VideoSetNP, NULL);
+
+			if (VideoSetN[0].value != exposure || VideoSetN[3].value != slots)
+				restartVideo();
+
+			return true;
+		}
+
+		/* the loop starts over with the new ROI once the frame on the camera is off */
+		if (!strcmp(name, FocusSetNP.name)) {
+			if (IUUpdateNumber(&FocusSetNP, values, names, n) < 0)
+				return false;
+
+			FocusSetNP.s = IPS_OK;
+			IDSetNumber(&FocusSetNP, NULL);
+
+			if (focusLoop && !focusRestart) {
+				focusRestart = true;
+				abortCamera();
+				if (!Downloading)
+					startFocus();
+			}
+
+			return true;
+		}
+
+		if (!strcmp(name, GainNP.name)) {
+			if (n < 1) return false;
+
+			camgain = GainN[0].value = clamp_int(values[0], 0, 255);
+			GainNP.s = IPS_OK;
+			IDSetNumber(&GainNP, NULL);
+
+			if (LibraryS[0].s == ISS_ON)
+				planLibrary();
+			restartVideo();
+			return true;
+		}
+
+		if (!strcmp(name, OffsetNP.name)) {
+			if (n < 1) return false;
+
+			camoffset = OffsetN[0].value = clamp_int(values[0], 0, 255);
+			OffsetNP.s = IPS_OK;
+			IDSetNumber(&OffsetNP, NULL);
+
+			if (LibraryS[0].s == ISS_ON)
+				planLibrary();
+			restartVideo();
+			return true;
+		}
+
+		if (!strcmp(name, TECLimitNP.name)) {
+			if (n < 1) return false;
+
+			TECLimit = clamp_int(values[0], 0, 100);
+			cooler.setLimit(TECLimit / 100.0);
+			TECLimitNP.s = IPS_OK;
+			IDSetNumber(&TECLimitNP, NULL);
+
+			return true;
+		}
+
+		if (!strcmp(name, ThermalLimitNP.name)) {
+			if (IUUpdateNumber(&ThermalLimitNP, values, names, n) < 0)
+				return false;
+
+			ThermalLimitNP.s = IPS_OK;
+			IDSetNumber(&ThermalLimitNP, NULL);
+
+			return true;
+		}
+
+		if (!strcmp(name, CalibSetNP.name)) {
+			if (IUUpdateNumber(&CalibSetNP, values, names, n) < 0)
+				return false;
+
+			/* a smaller cache is trimmed at the next frame */
+			calibration.setTemperatureTolerance(CalibSetN[0].value);
+			calibration.setPedestal(CalibSetN[1].value);
+			CalibSetNP.s = IPS_OK;
+			IDSetNumber(&CalibSetNP, NULL);
+
+			return true;
+		}
+
+		/* taken up by the next GrabExposure */
+		if (!strcmp(name, StatsSetNP.name)) {
+			if (IUUpdateNumber(&StatsSetNP, values, names, n) < 0)
+				return false;
+
+			StatsSetNP.s = IPS_OK;
+			IDSetNumber(&StatsSetNP, NULL);
+
+			return true;
+		}
+
+		/* taken up by the next library frame */
+		if (!strcmp(name, LibrarySetNP.name)) {
+			if (IUUpdateNumber(&LibrarySetNP, values, names, n) < 0)
+				return false;
+
+			LibrarySetNP.s = IPS_OK;
+			IDSetNumber(&LibrarySetNP, NULL);
+			updateLibrary();
+
+			return true;
+		}
+
+		if (!strcmp(name, PreviewNP.name)) {
+			if (IUUpdateNumber(&PreviewNP, values, names, n) < 0)
+				return false;
+
+			PreviewNP.s = IPS_OK;
+			IDSetNumber(&PreviewNP, NULL);
+
+			return true;
+		}
+
+		/* taken up by the next GrabExposure, the compressor is idle then */
+		if (!strcmp(name, CompressSetNP.name)) {
+			if (IUUpdateNumber(&CompressSetNP, values, names, n) < 0)
+				return false;
+
+			CompressSetNP.s = IPS_OK;
+			IDSetNumber(&CompressSetNP, NULL);
+
+			return true;
+		}
+
+		if (!strcmp(name, TECPidNP.name)) {
+			if (IUUpdateNumber(&TECPidNP, values, names, n) < 0)
+				return false;
+
+			cooler.setGains(TECPidN[0].value, TECPidN[1].value, TECPidN[2].value);
+			TECPidNP.s = IPS_OK;
+			IDSetNumber(&TECPidNP, NULL);
+
+			return true;
+		}
+
+		if (!strcmp(name, SequenceNP.name)) {
+			if (IUUpdateNumber(&SequenceNP, values, names, n) < 0)
+				return false;
+
+			if (startSequence((int) SequenceN[0].value, SequenceN[1].value)) {
+				SequenceNP.s = IPS_BUSY;
+			} else {
+				SequenceNP.s = IPS_ALERT;
+			}
+			IDSetNumber(&SequenceNP, NULL);
+
+			return true;
+		}
+
+		if (!strcmp(name, USBTransferNP.name)) {
+			if (IUUpdateNumber(&USBTransferNP, values, names, n) < 0)
+				return false;
+
+			readout.setTransfers((int) USBTransferN[0].value, (int) USBTransferN[1].value * 1024);
+			USBTransferN[0].value = readout.getTransferCount();
+			USBTransferN[1].value = readout.getTransferSize() / 1024;
+			readout.setTimeout((int) USBTransferN[2].value);
+			USBTransferN[2].value = readout.getTimeout();
+
+			USBTransferNP.s = IPS_OK;
+			IDSetNumber(&USBTransferNP, NULL);
 
 			return true;
 		}
@@ -687,6 +3600,72 @@ bool QHY9::ISNewNumber(const char *dev, const char *name, double values[], char
 bool QHY9::ISNewSwitch(const char *dev, const char *name, ISState *states, char *names[], int n)
 {
 	if (dev && !strcmp(dev, getDeviceName())) {
+		if (!strcmp(name, "CCD_FRAME_TYPE")) {
+			stopFocus(IPS_IDLE, "Focus loop stopped, the frame type changed.");
+			restartVideo();
+			if (librarySaved)
+				libraryYield();
+		}
+
+		if (!strcmp(name, RecordSP.name)) {
+			if (IUUpdateSwitch(&RecordSP, states, names, n) < 0)
+				return false;
+
+			if (RecordS[0].s == ISS_ON) {
+				stopRecording(IPS_IDLE, NULL);
+			} else if (recorder.isOpen()) {
+				/* on / only switch over at the next frame */
+				IDSetSwitch(&RecordSP, NULL);
+			} else if (!startRecording()) {
+				IUResetSwitch(&RecordSP);
+				RecordS[0].s = ISS_ON;
+				RecordSP.s = IPS_ALERT;
+				IDSetSwitch(&RecordSP, NULL);
+			}
+
+			return true;
+		}
+
+		if (!strcmp(name, VideoSP.name)) {
+			if (IUUpdateSwitch(&VideoSP, states, names, n) < 0)
+				return false;
+
+			if (VideoS[0].s == ISS_ON) {
+				if (!videoRunning && !videoPending && !startVideo()) {
+					IUResetSwitch(&VideoSP);
+					VideoS[1].s = ISS_ON;
+					VideoSP.s = IPS_ALERT;
+					IDSetSwitch(&VideoSP, NULL);
+				}
+			} else if (videoRunning) {
+				stopVideo();
+			} else {
+				videoPending = false;
+				VideoSP.s = IPS_IDLE;
+				IDSetSwitch(&VideoSP, NULL);
+			}
+
+			return true;
+		}
+
+		if (!strcmp(name, FocusSP.name)) {
+			if (IUUpdateSwitch(&FocusSP, states, names, n) < 0)
+				return false;
+
+			if (FocusS[0].s == ISS_ON) {
+				if (!focusLoop && !startFocus()) {
+					IUResetSwitch(&FocusSP);
+					FocusS[1].s = ISS_ON;
+					FocusSP.s = IPS_ALERT;
+					IDSetSwitch(&FocusSP, NULL);
+				}
+			} else {
+				stopFocus(IPS_IDLE, NULL);
+			}
+
+			return true;
+		}
+
 		if (!strcmp(name, ReadOutSP.name)) {
 			if (IUUpdateSwitch(&ReadOutSP, states, names, n) < 0)
 				return false;
@@ -705,6 +3684,161 @@ bool QHY9::ISNewSwitch(const char *dev, const char *name, ISState *states, char
 
 			return true;
 		}
+
+		if (!strcmp(name, ThermalGateSP.name)) {
+			if (IUUpdateSwitch(&ThermalGateSP, states, names, n) < 0)
+				return false;
+
+			/* switched off while holding an exposure, let it go */
+			if (ThermalGateS[1].s == ISS_ON && gateWaiting) {
+				gateWaiting = false;
+				InExposure = false;
+				if (!beginExposure(gateDuration))
+					exposureFailed();
+			}
+
+			ThermalGateSP.s = IPS_OK;
+			IDSetSwitch(&ThermalGateSP, NULL);
+
+			return true;
+		}
+
+		if (!strcmp(name, TECTuneSP.name)) {
+			if (IUUpdateSwitch(&TECTuneSP, states, names, n) < 0)
+				return false;
+
+			if (TECTuneS[1].s == ISS_ON) {
+				cooler.abortAutotune();
+				TECTuneSP.s = IPS_IDLE;
+				IDSetSwitch(&TECTuneSP, "Auto-tune aborted, gains unchanged.");
+			} else if (TECTuneS[0].s == ISS_ON && TECTuneSP.s != IPS_BUSY) {
+				if (cooler.startAutotune()) {
+					TECTuneSP.s = IPS_BUSY;
+					IDSetSwitch(&TECTuneSP, "Auto-tune running around %.1f C, this takes a while.",
+						    TemperatureTarget);
+				} else {
+					TECTuneSP.s = IPS_ALERT;
+					IDSetSwitch(&TECTuneSP, "Cannot auto-tune, the TEC needs room below its limit at this setpoint.");
+				}
+			}
+
+			IUResetSwitch(&TECTuneSP);
+
+			return true;
+		}
+
+		if (!strcmp(name, SoftBinSP.name)) {
+			if (IUUpdateSwitch(&SoftBinSP, states, names, n) < 0)
+				return false;
+
+			SoftBinSP.s = IPS_OK;
+			IDSetSwitch(&SoftBinSP, NULL);
+
+			return true;
+		}
+
+		if (!strcmp(name, CalibSP.name)) {
+			if (IUUpdateSwitch(&CalibSP, states, names, n) < 0)
+				return false;
+
+			CalibSP.s = IPS_OK;
+			IDSetSwitch(&CalibSP, NULL);
+
+			return true;
+		}
+
+		if (!strcmp(name, LibrarySP.name)) {
+			if (IUUpdateSwitch(&LibrarySP, states, names, n) < 0)
+				return false;
+
+			if (LibraryS[0].s == ISS_ON) {
+				LibrarySP.s = planLibrary() ? IPS_OK : IPS_ALERT;
+				IDSetSwitch(&LibrarySP, NULL);
+			} else {
+				libraryYield();
+				accumulator.reset();
+
+				LibrarySP.s = IPS_IDLE;
+				IDSetSwitch(&LibrarySP, NULL);
+				LibraryStatNP.s = IPS_IDLE;
+				updateLibrary();
+			}
+
+			return true;
+		}
+
+		if (!strcmp(name, StatsSP.name)) {
+			if (IUUpdateSwitch(&StatsSP, states, names, n) < 0)
+				return false;
+
+			StatsSP.s = IPS_OK;
+			IDSetSwitch(&StatsSP, NULL);
+
+			return true;
+		}
+
+		if (!strcmp(name, PreviewSP.name)) {
+			if (IUUpdateSwitch(&PreviewSP, states, names, n) < 0)
+				return false;
+
+			PreviewSP.s = IPS_OK;
+			IDSetSwitch(&PreviewSP, NULL);
+
+			return true;
+		}
+
+		if (!strcmp(name, CompressSP.name)) {
+			if (IUUpdateSwitch(&CompressSP, states, names, n) < 0)
+				return false;
+
+			CompressSP.s = IPS_OK;
+			IDSetSwitch(&CompressSP, NULL);
+
+			return true;
+		}
+
+		if (!strcmp(name, ByteSwapSP.name)) {
+			if (IUUpdateSwitch(&ByteSwapSP, states, names, n) < 0)
+				return false;
+
+			ByteSwapSP.s = IPS_OK;
+			IDSetSwitch(&ByteSwapSP, NULL);
+
+			return true;
+		}
+
+		if (!strcmp(name, TraceDumpSP.name)) {
+			int ret;
+
+			if (IUUpdateSwitch(&TraceDumpSP, states, names, n) < 0)
+				return false;
+
+			if (TraceDumpS[1].s == ISS_ON)
+				ret = qhy9_trace_dump_binary(TraceFileT[0].text);
+			else
+				ret = qhy9_trace_dump_text(TraceFileT[0].text);
+
+			if (ret)
+				DEBUGF(INDI::Logger::DBG_ERROR, "Cannot write trace to %s.", TraceFileT[0].text);
+			else
+				DEBUGF(INDI::Logger::DBG_SESSION, "Trace written to %s.", TraceFileT[0].text);
+
+			IUResetSwitch(&TraceDumpSP);
+			TraceDumpSP.s = ret ? IPS_ALERT : IPS_OK;
+			IDSetSwitch(&TraceDumpSP, NULL);
+
+			return true;
+		}
+
+		if (!strcmp(name, TimingFitsSP.name)) {
+			if (IUUpdateSwitch(&TimingFitsSP, states, names, n) < 0)
+				return false;
+
+			TimingFitsSP.s = IPS_OK;
+			IDSetSwitch(&TimingFitsSP, NULL);
+
+			return true;
+		}
         }
 
 	return CCD::ISNewSwitch(dev, name, states, names, n);
@@ -717,6 +3851,65 @@ bool QHY9::ISNewText (const char *dev, const char *name, char *texts[], char *na
 			processFilterName(dev, texts, names, n);
 			return true;
 		}
+
+		if (!strcmp(name, USBDeviceTP.name)) {
+			if (isConnected()) {
+				USBDeviceTP.s = IPS_ALERT;
+				IDSetText(&USBDeviceTP, "Disconnect before changing the USB device.");
+				return true;
+			}
+
+			if (IUUpdateText(&USBDeviceTP, texts, names, n) < 0)
+				return false;
+
+			USBDeviceTP.s = IPS_OK;
+			IDSetText(&USBDeviceTP, NULL);
+
+			return true;
+		}
+
+		if (!strcmp(name, CalibDirTP.name)) {
+			if (IUUpdateText(&CalibDirTP, texts, names, n) < 0)
+				return false;
+
+			/* the readout thread may be using the cache */
+			if (Downloading)
+				calibRescan = true;
+			else
+				scanCalibration();
+
+			return true;
+		}
+
+		if (!strcmp(name, LibraryPlanTP.name)) {
+			if (IUUpdateText(&LibraryPlanTP, texts, names, n) < 0)
+				return false;
+
+			planLibrary();
+
+			return true;
+		}
+
+		if (!strcmp(name, RecordDirTP.name)) {
+			if (IUUpdateText(&RecordDirTP, texts, names, n) < 0)
+				return false;
+
+			/* the next recording goes there */
+			RecordDirTP.s = IPS_OK;
+			IDSetText(&RecordDirTP, NULL);
+
+			return true;
+		}
+
+		if (!strcmp(name, TraceFileTP.name)) {
+			if (IUUpdateText(&TraceFileTP, texts, names, n) < 0)
+				return false;
+
+			TraceFileTP.s = IPS_OK;
+			IDSetText(&TraceFileTP, NULL);
+
+			return true;
+		}
 	}
 
 	return INDI::CCD::ISNewText(dev, name, texts, names, n);
@@ -732,7 +3925,32 @@ bool QHY9::saveConfigItems(FILE *fp)
 	IUSaveConfigNumber(fp, &GainNP);
 	IUSaveConfigNumber(fp, &OffsetNP);
 	IUSaveConfigSwitch(fp, &ReadOutSP);
+	IUSaveConfigSwitch(fp, &SoftBinSP);
+	IUSaveConfigSwitch(fp, &ByteSwapSP);
 	IUSaveConfigNumber(fp, &TECLimitNP);
+	IUSaveConfigNumber(fp, &TECPidNP);
+	IUSaveConfigSwitch(fp, &ThermalGateSP);
+	IUSaveConfigNumber(fp, &ThermalLimitNP);
+	IUSaveConfigNumber(fp, &USBTransferNP);
+	IUSaveConfigSwitch(fp, &TimingFitsSP);
+	IUSaveConfigSwitch(fp, &PreviewSP);
+	IUSaveConfigNumber(fp, &PreviewNP);
+	IUSaveConfigSwitch(fp, &CompressSP);
+	IUSaveConfigNumber(fp, &CompressSetNP);
+	IUSaveConfigSwitch(fp, &CalibSP);
+	IUSaveConfigText(fp, &CalibDirTP);
+	IUSaveConfigNumber(fp, &CalibSetNP);
+	IUSaveConfigNumber(fp, &FocusSetNP);
+	IUSaveConfigNumber(fp, &VideoSetNP);
+	IUSaveConfigText(fp, &RecordDirTP);
+	IUSaveConfigNumber(fp, &RecordSetNP);
+	IUSaveConfigSwitch(fp, &StatsSP);
+	IUSaveConfigNumber(fp, &StatsSetNP);
+	IUSaveConfigText(fp, &LibraryPlanTP);
+	IUSaveConfigNumber(fp, &LibrarySetNP);
+	IUSaveConfigSwitch(fp, &LibrarySP);
+	IUSaveConfigText(fp, &TraceFileTP);
+	IUSaveConfigText(fp, &USBDeviceTP);
 
 	return true;
 }
@@ -742,33 +3960,31 @@ void QHY9::beginVideo()
 {
 	uint8_t buffer[1] = { 100 };
 
-	if (!usb_handle)
+	if (!transport)
 		return;
 
-	libusb_control_transfer(usb_handle, QHY9_VENDOR_REQUEST_WRITE,
-				QHY9_BEGIN_VIDEO_CMD, 0, 0, buffer, 1, 0);
+	transport->vendorWrite(QHY9_BEGIN_VIDEO_CMD, buffer, 1);
 }
 
 void QHY9::abortVideo()
 {
 	uint8_t buffer[1] = { 0xff };
-	int transferred;
 
-	if (!usb_handle)
+	if (!transport)
 		return;
 
-	libusb_bulk_transfer(usb_handle, QHY9_INTERRUPT_WRITE_EP, buffer, 1, &transferred, 0);
+	/* same endpoint as the DC201, it goes in line with the cooler commands */
+	cooler.send(buffer, 1);
 }
 
 void QHY9::setShutter(int mode)
 {
 	uint8_t buffer[1] = { (uint8_t) mode };
 
-	if (!usb_handle)
+	if (!transport)
 		return;
 
-	libusb_control_transfer(usb_handle, QHY9_VENDOR_REQUEST_WRITE,
-				QHY9_SHUTTER_CMD, 0, 0, buffer, 1, 0);
+	transport->vendorWrite(QHY9_SHUTTER_CMD, buffer, 1);
 }
 
 bool QHY9::SelectFilter(int slot)
@@ -780,10 +3996,8 @@ bool QHY9::SelectFilter(int slot)
 	buffer[0] = 0x5A;
 	buffer[1] = slot;
 
-	if (usb_handle) {
-		libusb_control_transfer(usb_handle, QHY9_VENDOR_REQUEST_WRITE,
-					QHY9_CFW_CMD, 0, 0, buffer, 2, 0);
-	}
+	if (transport)
+		transport->vendorWrite(QHY9_CFW_CMD, buffer, 2);
 
 	CurrentFilter = slot + 1;
 
@@ -831,116 +4045,295 @@ bool QHY9::GetFilterNames(const char *groupName)
 	return true;
 }
 
+/* main loop: publish what the cooler thread measured */
 void QHY9::updateTemperature()
 {
-	//double kp = 1.6, ki = 0.5, kd = 0.0;	     // PID gains
-	double kp = 1.6, ki = 0.2, kd = 0.0;
-	double pwm;
-	static double error = 0.0, integral = 0.0, deriv = 0.0;
-	static int alternate = 0;
+	QHY9CoolerStatus status;
 
-	alternate = !alternate;
-	if (alternate) {
-		int16_t voltage = getDC201Interrupt();
-		Temperature = mv_to_degrees(1.024 * voltage);
-		IDSetNumber(&TemperatureNP, NULL);
+	cooler.getStatus(&status);
+	if (!status.valid)
+		return;
+
+	Temperature = status.temperature;
+	IDSetNumber(&TemperatureNP, NULL);
+
+	TECValue = status.power * 255.0;
+	TECPercent = status.power * 100.0;
+	IDSetNumber(&TECPowerNP, NULL);
+
+	if (status.tune == QHY9_TUNE_DONE) {
+		TECPidN[0].value = status.kp;
+		TECPidN[1].value = status.ki;
+		TECPidN[2].value = status.kd;
+		TECPidNP.s = IPS_OK;
+		IDSetNumber(&TECPidNP, NULL);
+
+		TECTuneSP.s = IPS_OK;
+		IDSetSwitch(&TECTuneSP, "Auto-tune done, kp %.3f ki %.4f.", status.kp, status.ki);
+	} else if (status.tune == QHY9_TUNE_FAILED) {
+		TECTuneSP.s = IPS_ALERT;
+		IDSetSwitch(&TECTuneSP, "Auto-tune failed, gains unchanged.");
+	} else if (status.mode == QHY9_COOLER_AUTOTUNE && status.cycles != coolerCycles) {
+		IDSetSwitch(&TECTuneSP, "Auto-tune: %d of %d oscillations.", status.cycles, QHY9Cooler::TUNE_CYCLES);
+	}
 
-		deriv = (TemperatureTarget - Temperature) / -60.0 - error;
-		error = (TemperatureTarget - Temperature) / -60.0;
+	coolerCycles = status.cycles;
 
-		// anti-windup
-		integral = clamp_double(integral + error, -3.0, 3.0);
+	updateThermal();
+}
 
-		pwm = clamp_double(255.0 * (kp * error + ki * integral + kd * deriv), 0.0, 255.0);
+/* main loop: stability over the gate window, and the history once a new point is in */
+void QHY9::updateThermal()
+{
+	QHY9TelemetryPoint points[QHY9Telemetry::POINTS];
+	struct timespec now;
+	QHY9TempStats stats;
+	double error, slope, power;
+	unsigned long total;
+	bool full;
+	char line[2048];		/* room for six of the widest doubles */
+	int i, n;
 
-		fprintf(stderr, "temp %.6f, target %.6f, PWM %.f, err %.6f, int %.6f, der %.6f\n",
-			Temperature, TemperatureTarget, pwm, error, integral, deriv);
+	full = telemetry.stability(ThermalLimitN[2].value, &error, &slope, &power, &stats);
+	if (stats.count) {
+		ThermalN[0].value = error;
+		ThermalN[1].value = slope;
+		ThermalN[2].value = stats.min;
+		ThermalN[3].value = stats.max;
+		ThermalN[4].value = stats.mean;
+		ThermalN[5].value = power * 100.0;
+		ThermalNP.s = (full && settledWithin(error, slope)) ? IPS_OK : IPS_BUSY;
+		IDSetNumber(&ThermalNP, NULL);
+	}
 
-		TECValue = clamp_int((int) pwm, 0, (int) (TECLimit / 100.0 * 255.0));
-		TECPercent = TECValue * 100.0 / 255.0;
-		IDSetNumber(&TECPowerNP, NULL);
-	} else {
+	total = telemetry.pointCount();
+	if (total == historySent)
+		return;
+	historySent = total;
+
+	/* seconds before now, so clients need not know the driver's clock */
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	n = telemetry.history(points, QHY9Telemetry::POINTS);
 
-		// getting and setting DC201 back-to-back seems to lock the camera
-		setDC201Interrupt(TECValue, 255);
+	historyText = "age_s,temp_min,temp_mean,temp_max,tec_percent,error\n";
+	for (i = 0; i < n; i++) {
+		snprintf(line, sizeof(line), "%.0f,%.2f,%.2f,%.2f,%.1f,%.3f\n",
+			 ts_ms(&now, &points[i].start) / 1000.0, points[i].tmin, points[i].tmean,
+			 points[i].tmax, points[i].power * 100.0, points[i].error);
+		historyText += line;
 	}
+
+	TempHistoryB[0].blob = (void *) historyText.data();
+	TempHistoryB[0].bloblen = TempHistoryB[0].size = historyText.size();
+	strcpy(TempHistoryB[0].format, ".csv");
+	TempHistoryBP.s = IPS_OK;
+	IDSetBLOB(&TempHistoryBP, NULL);
 }
 
+bool QHY9::settledWithin(double error, double slope)
+{
+	return error <= ThermalLimitN[0].value && fabs(slope) <= ThermalLimitN[1].value;
+}
 
-int QHY9::bulk_transfer_read(int ep, unsigned char *data, int psize, int pnum, int *pos)
+/* main loop: error and slope inside the limits for the whole window */
+bool QHY9::thermalSettled()
 {
-	int ret, length_transfered;
-        int i;
+	QHY9TempStats stats;
+	double error, slope, power;
 
-	if (!usb_handle)
-		return -1;
+	if (!telemetry.stability(ThermalLimitN[2].value, &error, &slope, &power, &stats))
+		return false;
 
-        for (i = 0; i < pnum; ++i) {
-                length_transfered = 0;
+	return settledWithin(error, slope);
+}
 
-                ret = libusb_bulk_transfer(usb_handle ,ep, data + i * psize, psize, &length_transfered, 0);
-                if (ret < 0 || length_transfered != psize) {
-                        fprintf(stderr, "bulk_transfer %d, %d\n", ret, length_transfered);
-                        return -1;
-                }
-                *pos = i;
-        }
+/* main loop: TimerHit, an exposure is held by the gate */
+void QHY9::checkExposureGate()
+{
+	struct timespec now;
+	double waited;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	waited = ts_ms(&now, &gateStart) / 1000.0;
+
+	if (thermalSettled()) {
+		gateWaiting = false;
+		InExposure = false;
+
+		ThermalGateSP.s = IPS_OK;
+		IDSetSwitch(&ThermalGateSP, "Temperature settled after %.0f s, exposing.", waited);
+
+		if (!beginExposure(gateDuration))
+			exposureFailed();
+		return;
+	}
+
+	if (ThermalLimitN[3].value > 0 && waited > ThermalLimitN[3].value) {
+		gateWaiting = false;
+		InExposure = false;
+
+		ThermalGateSP.s = IPS_ALERT;
+		IDSetSwitch(&ThermalGateSP, "Temperature did not settle in %.0f s, exposure cancelled.", waited);
+
+		exposureFailed();
+		return;
+	}
 
-        return 0;
+	PrimaryCCD.setExposureLeft(gateDuration);
 }
 
+/* main loop: a held exposure could not start */
+void QHY9::exposureFailed()
+{
+	INumberVectorProperty *exp = getNumber("CCD_EXPOSURE");
+
+	if (exp) {
+		exp->s = IPS_ALERT;
+		IDSetNumber(exp, NULL);
+	}
+
+	endSequence(IPS_ALERT);
+}
 
 
+/* what ExposureComplete writes through cfitsio, the same cards as the driver's own FITS */
 void QHY9::addFITSKeywords(fitsfile *fptr, CCDChip *chip)
 {
-	static char obsdata[128];
-	float exposure;
-	struct tm *dobs;
+	QHY9FitsHeader keys;
 	int status = 0;
 
+	fitsKeywords(&keys, chip);
+
+	for (int i = 0; i < keys.count(); i++)
+		fits_write_record(fptr, keys.card(i).c_str(), &status);
+}
+
+/* the frame's keywords, from the settings and what was measured while it downloaded */
+void QHY9::fitsKeywords(QHY9FitsHeader *keys, CCDChip *chip)
+{
+	char obsdata[128];
+	struct tm *dobs;
+
 	/* Date of observation, includes time */
-	dobs = gmtime(&exposure_start.tv_sec);
+	dobs = gmtime(&frame_open.tv_sec);
 	snprintf(obsdata, 32, "%04d-%02d-%02dT%02d:%02d:%02d.%03d",
 		 1900 + dobs->tm_year, 1 + dobs->tm_mon, dobs->tm_mday,
 		 dobs->tm_hour, dobs->tm_min, dobs->tm_sec,
-		 (int) (exposure_start.tv_usec / 1000));
+		 (int) (frame_open.tv_nsec / 1000000));
 
-	fits_write_key(fptr, TSTRING, "DATE-OBS", obsdata, "Date of start of observation, UTC", &status);
+	keys->addString("DATE-OBS", obsdata, "Date of start of observation, UTC");
 
 	/* Time of observation for compatibility */
 	snprintf(obsdata, 32, "%02d:%02d:%02d.%03d",
 		 dobs->tm_hour, dobs->tm_min, dobs->tm_sec,
-		 (int) (exposure_start.tv_usec / 1000));
-	fits_write_key(fptr, TSTRING, "TIME-OBS", obsdata, "Time of start of observation, UTC", &status);
+		 (int) (frame_open.tv_nsec / 1000000));
+	keys->addString("TIME-OBS", obsdata, "Time of start of observation, UTC");
+
+	/* End of observation, as seen by the exposure timer */
+	dobs = gmtime(&frame_close.tv_sec);
+	snprintf(obsdata, 32, "%04d-%02d-%02dT%02d:%02d:%02d.%03d",
+		 1900 + dobs->tm_year, 1 + dobs->tm_mon, dobs->tm_mday,
+		 dobs->tm_hour, dobs->tm_min, dobs->tm_sec,
+		 (int) (frame_close.tv_nsec / 1000000));
+
+	keys->addString("DATE-END", obsdata, "Date of end of observation, UTC");
 
 	/* Exposure time */
-	exposure = Exptime / 1000.0;
-	fits_write_key(fptr, TFLOAT, "EXPTIME", &exposure, "Exposure time in seconds", &status);
+	keys->addFloat("EXPTIME", Exptime / 1000.0, "Exposure time in seconds");
 
 	/* Binning */
-	fits_write_key(fptr, TBYTE, "CCDBIN1", &HBIN, "CCD BIN X", &status);
-	fits_write_key(fptr, TBYTE, "CCDBIN2", &VBIN, "CCD BIN Y", &status);
+	keys->addInt("CCDBIN1", chip->getBinX(), "CCD BIN X");
+	keys->addInt("CCDBIN2", chip->getBinY(), "CCD BIN Y");
+	keys->addInt("QHYHWBIN", HBIN, "Binning done by the camera");
 
 	/* Gain */
-	fits_write_key(fptr, TBYTE, "QHYGAIN", &camgain, "CCD Gain, 0..255", &status);
+	keys->addInt("QHYGAIN", camgain, "CCD Gain, 0..255");
 
 	/* Offset */
-	fits_write_key(fptr, TBYTE, "QHYBIAS", &camoffset, "CCD Offset", &status);
+	keys->addInt("QHYBIAS", camoffset, "CCD Offset");
 
 	/* Readout speed */
-	fits_write_key(fptr, TBYTE, "QHYSPEED", &DownloadSpeed, "CCD readout speed", &status);
+	keys->addInt("QHYSPEED", DownloadSpeed, "CCD readout speed");
 
 	/* CLAMP */
-	fits_write_key(fptr, TBYTE, "QHYCLAMP", &CLAMP, "CCD clamp, on/off", &status);
+	keys->addInt("QHYCLAMP", CLAMP, "CCD clamp, on/off");
 
 
 	/* CCD Temperature */
-	fits_write_key(fptr, TDOUBLE, "CCDTEMP", &Temperature, "CCD temperature, degC", &status);
-	fits_write_key(fptr, TDOUBLE, "CCDTSET", &TemperatureTarget, "CCD set temperature, degC", &status);
+	keys->addDouble("CCDTEMP", Temperature, "CCD temperature, degC");
+	keys->addDouble("CCDTSET", TemperatureTarget, "CCD set temperature, degC");
+
+	if (frameTemp.count) {
+		keys->addDouble("CCDTMIN", frameTemp.min, "CCD temperature during exposure, min, degC");
+		keys->addDouble("CCDTMAX", frameTemp.max, "CCD temperature during exposure, max, degC");
+		keys->addDouble("CCDTMEAN", frameTemp.mean, "CCD temperature during exposure, mean, degC");
+	}
 
 	/* Filters */
-	void *filtername = FilterNameT[CurrentFilter - 1].text;
+	keys->addString("FILTER", FilterNameT[CurrentFilter - 1].text, "Filter name");
+	keys->addInt("FLT-SLOT", CurrentFilter, "Filter slot");
+
+	/* Calibrated in the driver, MaxIm style PEDESTAL */
+	if (frameCalibrated) {
+		static const char *names[QHY9_MASTER_TYPES] = { "BIASFILE", "DARKFILE", "FLATFILE" };
+		static const char *comments[QHY9_MASTER_TYPES] = { "Master bias", "Master dark", "Master flat" };
+		char calstat[4];
+		int len = 0;
+
+		for (int i = 0; i < QHY9_MASTER_TYPES; i++) {
+			if (frameCalib.names[i].empty())
+				continue;
+			calstat[len++] = "BDF"[i];
+			keys->addString(names[i], frameCalib.names[i].c_str(), comments[i]);
+		}
+		calstat[len] = 0;
+
+		keys->addString("CALSTAT", calstat, "Calibration applied: bias, dark, flat");
+		if (!frameCalib.names[QHY9_MASTER_DARK].empty())
+			keys->addDouble("DARKSCAL", frameCalib.darkScale, "Master dark scale factor");
+		keys->addInt("PEDESTAL", (int) -frameCalib.pedestal, "Add to get calibrated ADU");
+	}
+
+	/* Statistics, counted while it downloaded */
+	if (frameMeasured) {
+		keys->addInt("DATAMIN", frameStats.min, "Minimum pixel value");
+		keys->addInt("DATAMAX", frameStats.max, "Maximum pixel value");
+		keys->addDouble("QHYMEAN", frameStats.mean, "Mean pixel value");
+		keys->addDouble("QHYMEDN", frameStats.median, "Median pixel value");
+		keys->addDouble("QHYMAD", frameStats.mad, "Median absolute deviation");
+		keys->addInt("QHYSTARS", frameStats.stars, "Stars detected");
+		if (frameStats.stars) {
+			keys->addDouble("QHYHFR", frameStats.hfr, "Median half flux radius, px");
+			keys->addDouble("QHYFWHM", frameStats.fwhm, "Median FWHM, px");
+		}
+	}
+
+	/* Download cut short, the image is zero past QHYPKTS packets */
+	if (framePartial) {
+		keys->addLogical("QHYPART", true, "Incomplete download, missing data is zero");
+		keys->addInt("QHYPKTS", framePackets, "USB packets received");
+		keys->addInt("QHYPKTN", frameTotalPackets, "USB packets expected");
+	}
+
+	/* Timing, this frame up to the download; FITS and BLOB are only known for earlier frames */
+	if (TimingFitsS[1].s == ISS_ON) {
+		static const char *names[QHY9_NPHASES] = {
+			"QHYTUPLD", "QHYTSETL", "QHYTSHUT", "QHYTEXPO", "QHYTDOWN", "QHYTXTRC", "QHYTFITS", "QHYTBLOB"
+		};
+		char comment[64];
+		double ms;
+
+		for (int i = 0; i < QHY9_NPHASES; i++) {
+			if (i < QHY9_PHASE_FITS) {
+				ms = framePhase[i];
+				snprintf(comment, sizeof(comment), "%s time, msec", qhy9_phase_name(i));
+			} else {
+				ms = phaseStats.mean(i);
+				snprintf(comment, sizeof(comment), "%s time, msec, mean of previous frames", qhy9_phase_name(i));
+			}
+			keys->addDouble(names[i], ms, comment);
+		}
+	}
 
-	fits_write_key(fptr, TSTRING, "FILTER", filtername, "Filter name", &status);
-	fits_write_key(fptr, TINT, "FLT-SLOT", &CurrentFilter, "Filter slot", &status);
+	clock_gettime(CLOCK_MONOTONIC, &fitsHeaderDone);
 }
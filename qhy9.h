@@ -7,7 +7,12 @@
 #include <string.h>
 #include <string>
 #include <sys/time.h>
+#include <time.h>
 #include <unistd.h>
+#include <pthread.h>
+
+#include <deque>
+#include <vector>
 
 #include <fitsio.h>
 
@@ -17,7 +22,23 @@
 #include <indifilterinterface.h>
 #include <base64.h>
 
-#include <libusb-1.0/libusb.h>
+#include "qhy9_transport.h"
+#include "qhy9_registers.h"
+#include "qhy9_readout.h"
+#include "qhy9_kernels.h"
+#include "qhy9_timing.h"
+#include "qhy9_trace.h"
+#include "qhy9_cooler.h"
+#include "qhy9_compress.h"
+#include "qhy9_preview.h"
+#include "qhy9_calib.h"
+#include "qhy9_library.h"
+#include "qhy9_stats.h"
+#include "qhy9_ring.h"
+#include "qhy9_recorder.h"
+#include "qhy9_fits.h"
+
+class QHY9USBTransport;
 
 enum {
 	SHUTTER_OPEN = 0,
@@ -25,38 +46,76 @@ enum {
 	SHUTTER_FREE
 };
 
-#define QHY9_SENSOR_WIDTH  3584
-#define QHY9_SENSOR_HEIGHT 2574
+/* what changed in the register image since the last upload */
+enum {
+	REGS_CLEAN = 0,		/* nothing, upload skipped */
+	REGS_TIMING,		/* exposure time only */
+	REGS_DIRTY		/* binning, geometry, gain, ... */
+};
 
 #define QHY9_MAX_FILTERS 5
 
-#define QHY9_USB_DEVID 0x16188301
+/* client binning, subframe and frame type, kept while the driver has the camera */
+struct QHY9FrameSettings {
+	int binX, binY;
+	int x, y, w, h;
+	CCDChip::CCD_FRAME type;
+};
 
+/* one frame download, handed from the main loop to the readout thread and back */
+struct QHY9Frame {
+	/* subframe and binning, unbinned pixels */
+	int x, y, w, h;
+	int bx, by;
+
+	int hwbin;			/* camera binning, square */
+	int sbx, sby;			/* software binning on top of it */
+	bool average;			/* software bins average instead of sum */
+	bool swap;			/* byte swap pixels */
+	bool compress;			/* deflate while it downloads, send as .fits.z */
+	int previewFactor;		/* downsampling of the preview, 0 for none */
+	bool calibrate;			/* apply calib after the download */
+	QHY9CalibSet calib;
+	QHY9Preview preview;
+	bool library;			/* dark library frame, averaged and not sent */
+	bool measure;			/* statistics while it downloads */
+	bool statsOnly;			/* and nothing else sent */
+	bool recordOnly;		/* recorded locally, not sent */
+	QHY9FrameStats stats;
+
+	/* camera side layout */
+	unsigned int p_size;
+	unsigned int total_p;
+	unsigned short LineSize;
 
-class QHY9 : public INDI::CCD, INDI::FilterInterface
-{
-public:
-	/* control request types */
-	// LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE;
-	static const int QHY9_VENDOR_REQUEST_WRITE = 0x40;
+	uint16_t *dst;			/* PrimaryCCD frame buffer */
+	bool direct;			/* full lines, USB lands straight in dst */
 
-	// LIBUSB_ENDPOINT_IN  | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE;
-	static const int QHY9_VENDOR_REQUEST_READ  = 0xC0;
+	struct timespec open_rt;	/* exposure start, wall clock */
+	struct timespec close_rt;	/* exposure end, wall clock */
+	struct timespec open_mono;	/* the same, CLOCK_MONOTONIC */
+	struct timespec close_mono;
 
-	/* vendor request commands */
-	static const int QHY9_BEGIN_VIDEO_CMD = 0xB3;
-	static const int QHY9_REGISTERS_CMD   = 0xB5;
-	static const int QHY9_CFW_CMD         = 0xC1;
-	static const int QHY9_VERSION_CMD     = 0xC2;
-	static const int QHY9_SHUTTER_CMD     = 0xC7;
+	int status;			/* 0 on success */
+	int pos;			/* packets received */
+	bool partial;			/* camera stopped early, data past pos is zero */
+	bool aborted;
 
-	static const int QHY9_DATA_BULK_EP       = 0x86;
-	static const int QHY9_INTERRUPT_WRITE_EP = 0x01;
-	static const int QHY9_INTERRUPT_READ_EP  = 0x81;
+	bool rearm;			/* sequence: start the next exposure after download */
+	bool video;			/* live video into the frame ring until aborted */
+
+	double phase_ms[QHY9_NPHASES];	/* time spent in each phase */
+};
 
-	QHY9();
+
+class QHY9 : public INDI::CCD, INDI::FilterInterface, protected QHY9Registers
+{
+public:
+	QHY9(int index, const char *device);
 	~QHY9() {}
 
+	int getIndex() { return cameraIndex; }
+
 	/* Device */
 	const char *getDefaultName() { return (char *) "QHY9"; }
 
@@ -83,6 +142,7 @@ public:
 	bool UpdateCCDBin(int binx, int biny);
 
 	void addFITSKeywords(fitsfile *fptr, CCDChip *chip);
+	void fitsKeywords(QHY9FitsHeader *keys, CCDChip *chip);
 
 	/* Filter wheel Interface */
 	int  QueryFilter();
@@ -95,18 +155,45 @@ protected:
 
 	int pollTimer;
 
-	libusb_device_handle *usb_handle;	 /* USB device handle */
+	int cameraIndex;			 /* in this driver process, 0 for "QHY9" */
+	std::string usbDevice;			 /* bus port or serial we were created for */
+
+	// USB device, bus port or serial number; empty for the first QHY9 found
+	IText USBDeviceT[1];
+	ITextVectorProperty USBDeviceTP;
+
+	QHY9Transport *transport;		 /* USB or simulator */
+	QHY9USBTransport *usb;			 /* kept between connects */
+
+	/* camera unplugged while connected */
+	bool deviceLost;
+	struct timespec lostTime;
+	bool resumeExposure;			 /* start the interrupted exposure again once it is back */
+
+	static void hotplugHandler(void *arg);
+	void deviceGone();
+	bool recoverDevice();
+
+	/* exposure in progress, guarded by readoutLock */
+	struct timespec exposure_start;	 /* CLOCK_MONOTONIC */
+	struct timespec exposure_start_rt; /* CLOCK_REALTIME, for FITS */
+	struct timespec exposure_end;	 /* CLOCK_MONOTONIC deadline */
+	bool exposureArmed;		 /* the above are valid */
+
+	struct timespec frame_open;	 /* times of the frame being delivered, for FITS */
+	struct timespec frame_close;
+	bool framePartial;		 /* and whether it came in whole */
+	int framePackets, frameTotalPackets;
+	QHY9TempStats frameTemp;	 /* sensor temperature while it exposed */
+	bool frameCalibrated;		 /* and what it was calibrated with */
+	QHY9CalibSet frameCalib;
 
-	struct timeval exposure_start;	 /* used by the timer to call ExposureComplete() */
 	double ExposureRequest;
 	double calcTimeLeft();
 
 	// Temperature control
 	double TemperatureTarget;		 /* temperature setpoint in degC */
 
-	unsigned char camgain;
-	unsigned char camoffset;
-
 #define Temperature TemperatureN[0].value
 
 #define TECValue   TECN[0].value
@@ -118,6 +205,12 @@ protected:
 	INumberVectorProperty TECPowerNP;
 	INumberVectorProperty TECLimitNP;
 
+	// TEC controller gains and auto-tune
+	INumber TECPidN[3];
+	INumberVectorProperty TECPidNP;
+	ISwitch TECTuneS[2];
+	ISwitchVectorProperty TECTuneSP;
+
 #define Gain GainN[0].value
 	// gain
 	INumber GainN[1];
@@ -132,57 +225,329 @@ protected:
 	ISwitch ReadOutS[3];
 	ISwitchVectorProperty ReadOutSP;
 
-	// Camera Settings
-	//unsigned char Gain;
-	//unsigned char Offset;
-	unsigned long Exptime;
-	unsigned char HBIN;
-	unsigned char VBIN;
-	unsigned short LineSize;
-	unsigned short VerticalSize;
-	unsigned short SKIP_TOP;
-	unsigned short SKIP_BOTTOM;
-	unsigned short LiveVideo_BeginLine;
-	unsigned short AnitInterlace;
-	unsigned char MultiFieldBIN;
-	unsigned char AMPVOLTAGE;
-	unsigned char DownloadSpeed;
-	unsigned char TgateMode;
-	unsigned char ShortExposure;
-	unsigned char VSUB;
-	unsigned char CLAMP;
-	unsigned char TransferBIT;
-	unsigned char TopSkipNull;
-	unsigned short TopSkipPix;
-	unsigned char MechanicalShutterMode;
-	unsigned char DownloadCloseTEC;
-	unsigned char SDRAM_MAXSIZE;
-	unsigned short ClockADJ;
-	unsigned char Trig;
-	unsigned char MotorHeating;   //0,1,2
-	unsigned char WindowHeater;   //0-15
-
-	/* I don't fully understand these */
-	unsigned int p_size;
-	unsigned int patchnum;
-	unsigned int total_p;
+	// sequence capture
+	INumber SequenceN[2];
+	INumberVectorProperty SequenceNP;
+
+	int SequenceCount;
+	int SequenceRemaining;
+	bool sequenceAbort;		 /* guarded by readoutLock */
+
+	bool startSequence(int count, double duration);
+	void endSequence(IPState state);
+
+	// software binning mode
+	ISwitch SoftBinS[2];
+	ISwitchVectorProperty SoftBinSP;
+
+	// pixel byte order
+	ISwitch ByteSwapS[2];
+	ISwitchVectorProperty ByteSwapSP;
+
+	// USB bulk transfers in flight, their size and timeout
+	INumber USBTransferN[3];
+	INumberVectorProperty USBTransferNP;
+
+	// per phase frame timing, last / mean / p95 of each phase
+	INumber TimingN[QHY9_NPHASES * 3];
+	INumberVectorProperty TimingNP;
+
+	// timing in FITS headers
+	ISwitch TimingFitsS[2];
+	ISwitchVectorProperty TimingFitsSP;
+
+	// compressed frames: on / off, level and threads, last frame ratio and times
+	ISwitch CompressS[2];
+	ISwitchVectorProperty CompressSP;
+	INumber CompressSetN[2];
+	INumberVectorProperty CompressSetNP;
+	INumber CompressStatN[5];
+	INumberVectorProperty CompressStatNP;
+
+	QHY9Compressor compressor;
+	size_t compressPixels;			/* image pixels of a direct download, 0 when not compressing */
+
+	static void downloadProgress(void *arg, long bytes);
+	bool sendCompressed(QHY9Frame *frame);
+	bool saveCompressed(uint8_t *data, size_t len);
+	std::string uploadPath(const char *ext);
+
+	// FITS built in the driver, straight into the BLOB buffer or a mapped file
+	std::vector<uint8_t> fitsBlob;
+	QHY9FitsFile fitsFile;
+
+	bool sendFits(QHY9Frame *frame);
+
+	// stretched 8 bit preview sent ahead of each frame, on / off and downsampling
+	ISwitch PreviewS[2];
+	ISwitchVectorProperty PreviewSP;
+	INumber PreviewN[1];
+	INumberVectorProperty PreviewNP;
+	IBLOB PreviewB[1];
+	IBLOBVectorProperty PreviewBP;
+
+	void sendPreview(QHY9Frame *frame);
+
+	// calibration with master frames: on / off, library directory, matching and cache
+	ISwitch CalibS[2];
+	ISwitchVectorProperty CalibSP;
+	IText CalibDirT[1];
+	ITextVectorProperty CalibDirTP;
+	INumber CalibSetN[3];
+	INumberVectorProperty CalibSetNP;
+	INumber CalibLibN[4];
+	INumberVectorProperty CalibLibNP;
+	IText CalibUsedT[3];
+	ITextVectorProperty CalibUsedTP;
+
+	QHY9Calibration calibration;
+	bool calibRescan;			 /* directory changed during a download, scan at the next frame */
+
+	void scanCalibration();
+	void matchCalibration(QHY9Frame *frame);
+
+	// dark library built while idle: on / off, what to take, how often, progress
+	ISwitch LibraryS[2];
+	ISwitchVectorProperty LibrarySP;
+	IText LibraryPlanT[3];
+	ITextVectorProperty LibraryPlanTP;
+	INumber LibrarySetN[3];
+	INumberVectorProperty LibrarySetNP;
+	INumber LibraryStatN[4];
+	INumberVectorProperty LibraryStatNP;
+
+	std::vector<QHY9DarkJob> libraryJobs;
+	int libraryJob;				 /* master being taken, libraryJobs.size() when done */
+	bool libraryActive;			 /* a library frame is on the camera */
+	bool libraryPending;			 /* a client exposure waits for it to come off */
+	float pendingDuration;
+	struct timespec lastClientExposure;	 /* CLOCK_MONOTONIC, idle time counts from here */
+	QHY9Accumulator accumulator;
+
+	bool librarySaved;			 /* the client's settings are in librarySettings */
+	QHY9FrameSettings librarySettings;
+
+	bool planLibrary();
+	bool libraryPath(const QHY9DarkJob *job, std::string &path);
+	void libraryStep();
+	void libraryFrame(QHY9Frame *frame);
+	void libraryYield();
+	void libraryRestore();
+	void updateLibrary();
+
+	void saveFrameSettings(QHY9FrameSettings *settings);
+	void restoreFrameSettings(const QHY9FrameSettings *settings);
+
+	// focus loop: start / stop, ROI, exposure, frame count and rate
+	ISwitch FocusS[2];
+	ISwitchVectorProperty FocusSP;
+	INumber FocusSetN[5];
+	INumberVectorProperty FocusSetNP;
+	INumber FocusStatN[2];
+	INumberVectorProperty FocusStatNP;
+
+	bool focusLoop;				 /* ROI exposures back to back until stopped */
+	bool focusRestart;			 /* start it over once the frame on the camera is off */
+	int focusFrames;
+	struct timespec focusLast;		 /* CLOCK_MONOTONIC start of the previous frame */
+	QHY9FrameSettings focusSettings;
+
+	bool startFocus();
+	void stopFocus(IPState state, const char *msg);
+	void focusFrame(QHY9Frame *frame);
+
+	// live video: on / off, exposure, stream rate, scale and ring slots, counters, stream
+	ISwitch VideoS[2];
+	ISwitchVectorProperty VideoSP;
+	INumber VideoSetN[4];
+	INumberVectorProperty VideoSetNP;
+	INumber VideoStatN[4];
+	INumberVectorProperty VideoStatNP;
+	IBLOB VideoB[1];
+	IBLOBVectorProperty VideoBP;
+
+	QHY9FrameRing videoRing;
+	bool videoRunning;			 /* the readout thread fills videoRing */
+	bool videoPending;			 /* start once the frame on the camera is off */
+	bool videoWake;				 /* main loop woken for a frame and not there yet, atomic */
+	uint64_t videoSent;			 /* seq of the last frame streamed */
+	long videoStreamed;
+	struct timespec videoLastSent;		 /* CLOCK_MONOTONIC */
+	uint64_t videoRateSeq;			 /* frame rate since the last update */
+	struct timespec videoRateTime;
+	int videoTimer;				 /* next stream frame when rate limited, -1 if none */
+	QHY9Preview videoPreview;
+
+	pthread_t videoStatsThread;
+	bool videoMeasure;			 /* the stats thread is running */
+	bool videoStatsQuit;
+	bool videoStatsReady;			 /* videoStats not published yet, guarded by readoutLock */
+	QHY9FrameStats videoStats;
+	long videoMeasured;
+
+	bool startVideo();
+	void stopVideo();
+	void restartVideo();
+	void endVideo(IPState state, const char *msg);
+	void videoLoop(QHY9Frame *frame);
+	void videoDeliver();
+	void updateVideo();
+
+	static void videoTimerHit(void *arg);
+	static void *videoStatsEntry(void *arg);
+	void videoStatsLoop();
+
+	// raw recording to local disk: off / on / instead of sending, directory, sizes, progress, file
+	ISwitch RecordS[3];
+	ISwitchVectorProperty RecordSP;
+	IText RecordDirT[1];
+	ITextVectorProperty RecordDirTP;
+	INumber RecordSetN[2];
+	INumberVectorProperty RecordSetNP;
+	INumber RecordStatN[4];
+	INumberVectorProperty RecordStatNP;
+	IText RecordFileT[1];
+	ITextVectorProperty RecordFileTP;
+
+	QHY9Recorder recorder;
+	pthread_t videoRecordThread;
+	bool videoRecording;			 /* the video record thread is running */
+	bool videoRecordQuit;
+	uint64_t recordSkipped;			 /* video frames gone from the ring before it got to them, atomic */
+
+	bool startRecording();
+	void stopRecording(IPState state, const char *msg);
+	void recordHeader(QHY9RecordFrame *rec, const QHY9RingFrame *frame);
+	void recordFrame(QHY9Frame *frame);
+	void updateRecording();
+	void startVideoRecord();
+	void stopVideoRecord();
+
+	static void *videoRecordEntry(void *arg);
+	void videoRecordLoop();
+
+	// frame statistics: off / on / instead of the image, detection settings, last frame
+	ISwitch StatsS[3];
+	ISwitchVectorProperty StatsSP;
+	INumber StatsSetN[2];
+	INumberVectorProperty StatsSetNP;
+	INumber StatsN[9];
+	INumberVectorProperty StatsNP;
+
+	QHY9Stats statistics;
+	size_t statsPixels;			 /* image pixels of a direct download, 0 when not measuring */
+	bool frameMeasured;			 /* frame being delivered has stats, for FITS */
+	QHY9FrameStats frameStats;
+
+	void updateStats();
+
+	// trace ring dump, as text or binary for qhy9_trace_decode
+	IText TraceFileT[1];
+	ITextVectorProperty TraceFileTP;
+	ISwitch TraceDumpS[2];
+	ISwitchVectorProperty TraceDumpSP;
+
+	QHY9PhaseStats phaseStats;
+	double armPhase[QHY9_PHASE_EXPOSURE];	 /* upload, settle, shutter of the exposure in progress, guarded by readoutLock */
+	double framePhase[QHY9_NPHASES];	 /* frame being delivered, for FITS */
+	struct timespec fitsHeaderDone;		 /* addFITSKeywords returned */
+
+	void updateTiming(const double *ms);
+
+	QHY9Readout readout;
+
+	// Readout thread, owns the data endpoint
+	pthread_t readoutThread;
+	pthread_mutex_t readoutLock;
+	pthread_cond_t readoutCond;
+	bool readoutRunning;
+	bool readoutQuit;
+
+	QHY9Frame *readoutJob;			/* pending download, NULL if none */
+	QHY9Frame *readoutActive;		/* download in progress */
+	std::deque<QHY9Frame *> readoutDone;	/* completion queue, drained by the main loop */
+
+	int readoutPipe[2];			/* wakes the main loop on completion */
+	int readoutCallback;
+
+	int exposureTimer;			/* timerfd, fires at exposure_end */
+	int wakePipe[2];			/* wakes the readout thread on abort */
+
+	uint16_t *stagingBuffer;
+	size_t stagingSize;
+
+	uint16_t *getStagingBuffer(size_t size);
+	void freeStagingBuffer();
+
+	bool Downloading;
+
+	bool startReadoutThread();
+	void stopReadoutThread();
+
+	static void *readoutThreadEntry(void *arg);
+	void readoutLoop();
+
+	void markExposureStart();
+	int  waitExposureEnd(QHY9Frame *frame);
+	bool downloadAborted(QHY9Frame *frame);
+	void wakeReadoutThread();
+
+	static void readoutDoneCallback(int fd, void *arg);
+	void processCompletions();
+
+	size_t setupFrame(QHY9Frame *frame, bool swap);
+	int downloadFrame(QHY9Frame *frame);
+	bool partialFrame(QHY9Frame *frame, uint8_t *data, int ret);
+
+	uint8_t REG[64];		 /* last register image built */
+	uint8_t REGUploaded[64];	 /* what the camera has now */
+	bool REGValid;			 /* REGUploaded matches the camera */
+
+	int  setCameraRegisters();
+	int  uploadRegisters();
+	int  settleTime(int dirty);
+	bool armNextExposure();
 
-	int bulk_transfer_read(int ep, unsigned char *data, int psize, int pnum, int *pos);
+	void beginVideo();
+	void abortVideo();
+	void abortCamera();
 
-	double mv_to_degrees(double mv);
-	double degrees_to_mv(double degrees);
+	void setShutter(int mode);
 
-	int  getDC201Interrupt();
-	void setDC201Interrupt(uint8_t PWM, uint8_t FAN);
+	// TEC control, on its own thread
+	QHY9Cooler cooler;
+	int coolerCycles;			 /* auto-tune progress last published */
 
-	void setCameraRegisters();
+	// cooler history, fed by the cooler thread
+	QHY9Telemetry telemetry;
+	unsigned long historySent;		 /* history points already sent */
+	std::string historyText;		 /* CSV of the last history sent */
 
-	void beginVideo();
-	void abortVideo();
+	// stability over the gate window
+	INumber ThermalN[6];
+	INumberVectorProperty ThermalNP;
 
-	void setShutter(int mode);
+	// exposure gate and its limits: error, slope, window, timeout
+	ISwitch ThermalGateS[2];
+	ISwitchVectorProperty ThermalGateSP;
+	INumber ThermalLimitN[4];
+	INumberVectorProperty ThermalLimitNP;
+
+	IBLOB TempHistoryB[1];
+	IBLOBVectorProperty TempHistoryBP;
+
+	bool gateWaiting;			 /* StartExposure held until the sensor settles */
+	float gateDuration;
+	struct timespec gateStart;
+
+	bool beginExposure(float duration);
+	bool thermalSettled();
+	bool settledWithin(double error, double slope);
+	void checkExposureGate();
+	void exposureFailed();
 
 	void updateTemperature();
+	void updateThermal();
 };
 
 /* Utility functions */
@@ -203,15 +568,5 @@ static inline int clamp_int(int val, int min, int max)
 	return val;
 }
 
-static inline uint8_t MSB(unsigned short val)
-{
-	return (val / 256);
-}
-
-static inline uint8_t LSB(unsigned short val)
-{
-	return (val & 0xff);
-}
-
 
 #endif
@@ -0,0 +1,432 @@
+/*
+ * Readout pipeline benchmark.
+ *
+ * Drives the simulated QHY9 through the same register layout and crop / bin
+ * code as the driver, then packages the frame as a FITS file the way the
+ * driver does and compresses it the way INDI does before sending a BLOB.
+ * Every phase is timed for each readout speed, binning and a few
+ * representative subframes; results go out as JSON.
+ *
+ * The first phase is the simulator producing the frame, rendering it and,
+ * with -r, pacing it at the modeled bus rate. It does not go through the
+ * USB readout engine, which needs the camera.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+
+#include <algorithm>
+#include <vector>
+
+#include <zlib.h>
+
+#include "qhy9_registers.h"
+#include "qhy9_kernels.h"
+#include "qhy9_fits.h"
+#include "qhy9_sim.h"
+
+enum {
+	PHASE_SIM = 0,
+	PHASE_EXTRACT,
+	PHASE_FITS,
+	PHASE_COMPRESS,
+	PHASE_TOTAL,
+	NPHASES
+};
+
+static const char *phase_names[NPHASES] = {
+	"sim_frame", "extract", "fits", "compress", "total"
+};
+
+struct BenchROI {
+	const char *name;
+	double x, y, w, h;		/* fractions of the sensor */
+};
+
+static const BenchROI rois[] = {
+	{ "full",   0.0,  0.0,  1.0,  1.0  },
+	{ "half",   0.25, 0.25, 0.5,  0.5  },
+	{ "strip",  0.0,  0.45, 1.0,  0.1  },
+	{ "256",    -1,   -1,   256,  256  },	/* 256 x 256 output pixels, centered */
+};
+
+struct BenchCase {
+	int speed;
+	int bin;
+	const BenchROI *roi;
+};
+
+struct BenchResult {
+	BenchCase c;
+	int hwbin;
+	int x, y, w, h;			/* unbinned subframe */
+	int width, height;		/* output image */
+	bool direct;
+	long bytes;			/* over the bus */
+	double bus_ms;			/* modeled bus time at the readout speed */
+	size_t fits_bytes;
+	size_t compressed_bytes;
+	std::vector<double> samples[NPHASES];
+};
+
+static double now_ms()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static double mean(const std::vector<double> &v)
+{
+	double sum = 0;
+	size_t i;
+
+	for (i = 0; i < v.size(); i++)
+		sum += v[i];
+
+	return v.empty() ? 0 : sum / v.size();
+}
+
+static double percentile(std::vector<double> v, double p)
+{
+	size_t i;
+
+	if (v.empty())
+		return 0;
+
+	std::sort(v.begin(), v.end());
+	i = (size_t) (p * (v.size() - 1) + 0.5);
+
+	return v[i];
+}
+
+/* align a subframe in unbinned pixels to the binning */
+static void place_roi(const BenchROI *roi, int bin, int *x, int *y, int *w, int *h)
+{
+	if (roi->x < 0) {
+		*w = (int) roi->w * bin;
+		*h = (int) roi->h * bin;
+		*x = (QHY9_SENSOR_WIDTH - *w) / 2;
+		*y = (QHY9_SENSOR_HEIGHT - *h) / 2;
+	} else {
+		*x = (int) (roi->x * QHY9_SENSOR_WIDTH);
+		*y = (int) (roi->y * QHY9_SENSOR_HEIGHT);
+		*w = (int) (roi->w * QHY9_SENSOR_WIDTH);
+		*h = (int) (roi->h * QHY9_SENSOR_HEIGHT);
+	}
+
+	*x -= *x % bin;
+	*y -= *y % bin;
+	*w -= *w % bin;
+	*h -= *h % bin;
+}
+
+/* FITS file in memory, as the driver builds it for the BLOB; returns its size or 0 */
+static size_t package_fits(uint16_t *image, int width, int height, int bin, void **memptr, size_t *memsize)
+{
+	QHY9FitsHeader keys;
+	std::string header;
+	size_t size, npix = (size_t) width * height;
+	void *p;
+
+	keys.image(width, height);
+	keys.addDouble("EXPTIME", 0, "Total Exposure Time (s)");
+	keys.addInt("XBINNING", bin, "Binning factor in width");
+	keys.addInt("YBINNING", bin, "Binning factor in height");
+	header = keys.finish();
+
+	size = qhy9_fits_size(header.size(), npix);
+	if (size > *memsize) {
+		p = realloc(*memptr, size);
+		if (!p) {
+			fprintf(stderr, "bench: cannot allocate %zu bytes\n", size);
+			return 0;
+		}
+		*memptr = p;
+		*memsize = size;
+	}
+
+	qhy9_fits_pack((uint8_t *) *memptr, header, image, npix);
+
+	return size;
+}
+
+static bool run_case(QHY9SimTransport *sim, BenchResult *res, int iterations, int level)
+{
+	QHY9Registers regs;
+	uint8_t REG[64];
+	uint8_t *raw;
+	uint16_t *image;
+	void *memptr = NULL;
+	size_t memsize = 2880, fits_size;
+	uLongf zsize;
+	std::vector<Bytef> zbuf;
+	int i, pos, sbin;
+	double t0, t1, t2, t3, t4;
+	bool ok = true;
+
+	res->hwbin = qhy9_hardware_bin(res->c.bin, res->c.bin);
+	sbin = res->c.bin / res->hwbin;
+	place_roi(res->c.roi, res->c.bin, &res->x, &res->y, &res->w, &res->h);
+
+	regs.DownloadSpeed = res->c.speed;
+	regs.AMPVOLTAGE = 1;
+	regs.TopSkipNull = 30;
+	regs.SDRAM_MAXSIZE = 100;
+	qhy9_frame_layout(&regs, res->hwbin, res->y, res->h);
+	qhy9_pack_registers(&regs, REG);
+
+	res->width = res->w / res->c.bin;
+	res->height = res->h / res->c.bin;
+	res->direct = res->x == 0 && res->w / res->hwbin == regs.LineSize && sbin == 1;
+	res->bytes = (long) regs.p_size * regs.total_p;
+	res->bus_ms = res->bytes / QHY9SimTransport::downloadRate(res->c.speed) * 1000.0;
+
+	raw = (uint8_t *) malloc(res->bytes);
+	image = (uint16_t *) malloc(std::max((size_t) res->bytes, (size_t) res->width * res->height * 2));
+	if (!raw || !image) {
+		free(raw);
+		free(image);
+		return false;
+	}
+
+	memptr = malloc(memsize);
+	zbuf.resize(compressBound(res->width * res->height * 2 + 2880 * 4));
+
+	for (i = 0; i < iterations && ok; i++) {
+		t0 = now_ms();
+
+		sim->vendorWrite(QHY9_REGISTERS_CMD, REG, 64);
+		sim->vendorWrite(QHY9_BEGIN_VIDEO_CMD, REG, 1);
+		if (sim->readFrame(res->direct ? (uint8_t *) image : raw, regs.p_size, regs.total_p, &pos)) {
+			fprintf(stderr, "bench: transfer failed at packet %d of %d\n", pos, regs.total_p);
+			ok = false;
+			break;
+		}
+		t1 = now_ms();
+
+		if (!res->direct)
+			qhy9_extract_frame(image, (uint16_t *) raw, regs.LineSize, res->x / res->hwbin,
+					   res->w / res->hwbin, res->h / res->hwbin, sbin, sbin, 0, 0);
+		t2 = now_ms();
+
+		fits_size = package_fits(image, res->width, res->height, res->c.bin, &memptr, &memsize);
+		if (!fits_size) {
+			ok = false;
+			break;
+		}
+		t3 = now_ms();
+
+		zsize = zbuf.size();
+		if (compress2(&zbuf[0], &zsize, (const Bytef *) memptr, fits_size, level) != Z_OK) {
+			fprintf(stderr, "bench: compress2 failed\n");
+			ok = false;
+			break;
+		}
+		t4 = now_ms();
+
+		res->fits_bytes = fits_size;
+		res->compressed_bytes = zsize;
+
+		res->samples[PHASE_SIM].push_back(t1 - t0);
+		res->samples[PHASE_EXTRACT].push_back(t2 - t1);
+		res->samples[PHASE_FITS].push_back(t3 - t2);
+		res->samples[PHASE_COMPRESS].push_back(t4 - t3);
+		res->samples[PHASE_TOTAL].push_back(t4 - t0);
+	}
+
+	free(memptr);
+	free(image);
+	free(raw);
+
+	return ok;
+}
+
+/* bytes each phase moves, for MB/s */
+static double phase_bytes(const BenchResult *res, int phase)
+{
+	switch (phase) {
+	case PHASE_SIM:
+		return res->bytes;
+	case PHASE_EXTRACT:
+		return res->direct ? 0 : (double) res->width * res->height * 2;
+	case PHASE_TOTAL:
+		return (double) res->width * res->height * 2;
+	default:
+		return res->fits_bytes;
+	}
+}
+
+static void write_json(FILE *fp, const std::vector<BenchResult> &results, int iterations, int level, bool realtime)
+{
+	size_t i;
+	int p;
+
+	fprintf(fp, "{\n");
+	fprintf(fp, "  \"kernels\": \"%s\",\n", qhy9_kernels_name());
+	fprintf(fp, "  \"realtime\": %s,\n", realtime ? "true" : "false");
+	fprintf(fp, "  \"iterations\": %d,\n", iterations);
+	fprintf(fp, "  \"compression_level\": %d,\n", level);
+	fprintf(fp, "  \"cases\": [\n");
+
+	for (i = 0; i < results.size(); i++) {
+		const BenchResult *r = &results[i];
+
+		fprintf(fp, "    {\n");
+		fprintf(fp, "      \"speed\": %d, \"bin\": %d, \"hwbin\": %d, \"roi\": \"%s\",\n",
+			r->c.speed, r->c.bin, r->hwbin, r->c.roi->name);
+		fprintf(fp, "      \"x\": %d, \"y\": %d, \"w\": %d, \"h\": %d, \"width\": %d, \"height\": %d,\n",
+			r->x, r->y, r->w, r->h, r->width, r->height);
+		fprintf(fp, "      \"direct\": %s, \"bus_bytes\": %ld, \"bus_model_ms\": %.3f,\n",
+			r->direct ? "true" : "false", r->bytes, r->bus_ms);
+		fprintf(fp, "      \"fits_bytes\": %zu, \"compressed_bytes\": %zu,\n",
+			r->fits_bytes, r->compressed_bytes);
+		fprintf(fp, "      \"phases\": {\n");
+
+		for (p = 0; p < NPHASES; p++) {
+			double m = mean(r->samples[p]);
+
+			fprintf(fp, "        \"%s\": { \"mean_ms\": %.3f, \"p95_ms\": %.3f, \"min_ms\": %.3f, \"mb_per_s\": %.1f }%s\n",
+				phase_names[p], m, percentile(r->samples[p], 0.95),
+				percentile(r->samples[p], 0.0),
+				m > 0 ? phase_bytes(r, p) / m / 1000.0 : 0.0,
+				p < NPHASES - 1 ? "," : "");
+		}
+
+		fprintf(fp, "      }\n");
+		fprintf(fp, "    }%s\n", i < results.size() - 1 ? "," : "");
+	}
+
+	fprintf(fp, "  ]\n");
+	fprintf(fp, "}\n");
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [options]\n"
+		"  -n, --iterations N   runs per case (default 5)\n"
+		"  -o, --json FILE      write results to FILE instead of stdout\n"
+		"  -s, --speed S        only readout speed S (0-2)\n"
+		"  -b, --bin B          only binning B (1, 2, 3, 4, 6 or 8)\n"
+		"  -z, --level L        zlib level for the BLOB (default 9, as INDI)\n"
+		"  -r, --realtime       pace simulated frames at the readout speed\n",
+		prog);
+}
+
+/* hardware bins, plus software bins on top of them */
+static const int bins[] = { 1, 2, 3, 4, 6, 8 };
+
+static bool known_bin(int bin)
+{
+	size_t b;
+
+	for (b = 0; b < sizeof(bins) / sizeof(bins[0]); b++)
+		if (bins[b] == bin)
+			return true;
+
+	return false;
+}
+
+int main(int argc, char *argv[])
+{
+	static const struct option options[] = {
+		{ "iterations", required_argument, NULL, 'n' },
+		{ "json",       required_argument, NULL, 'o' },
+		{ "speed",      required_argument, NULL, 's' },
+		{ "bin",        required_argument, NULL, 'b' },
+		{ "level",      required_argument, NULL, 'z' },
+		{ "realtime",   no_argument,       NULL, 'r' },
+		{ "help",       no_argument,       NULL, 'h' },
+		{ NULL, 0, NULL, 0 }
+	};
+	std::vector<BenchResult> results;
+	QHY9SimTransport sim;
+	const char *json = NULL;
+	int iterations = 5, speed = -1, bin = -1, level = 9;
+	bool realtime = false;
+	FILE *fp = stdout;
+	size_t b, r;
+	int c, s;
+
+	while ((c = getopt_long(argc, argv, "n:o:s:b:z:rh", options, NULL)) != -1) {
+		switch (c) {
+		case 'n':
+			iterations = atoi(optarg);
+			break;
+		case 'o':
+			json = optarg;
+			break;
+		case 's':
+			speed = atoi(optarg);
+			break;
+		case 'b':
+			bin = atoi(optarg);
+			break;
+		case 'z':
+			level = atoi(optarg);
+			break;
+		case 'r':
+			realtime = true;
+			break;
+		default:
+			usage(argv[0]);
+			return c == 'h' ? 0 : 1;
+		}
+	}
+
+	/* a bin that is not a case would run nothing */
+	if (iterations < 1 || speed > 2 || (bin != -1 && !known_bin(bin)) || level < 0 || level > 9) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	sim.setRealtime(realtime);
+
+	for (s = 0; s <= 2; s++) {
+		if (speed >= 0 && s != speed)
+			continue;
+
+		for (b = 0; b < sizeof(bins) / sizeof(bins[0]); b++) {
+			if (bin > 0 && bins[b] != bin)
+				continue;
+
+			for (r = 0; r < sizeof(rois) / sizeof(rois[0]); r++) {
+				BenchResult res;
+
+				res.c.speed = s;
+				res.c.bin = bins[b];
+				res.c.roi = &rois[r];
+				res.fits_bytes = res.compressed_bytes = 0;
+
+				if (!run_case(&sim, &res, iterations, level))
+					return 1;
+
+				fprintf(stderr, "speed %d bin %d %-5s %4dx%-4d total %8.2f ms\n",
+					s, bins[b], rois[r].name, res.width, res.height,
+					mean(res.samples[PHASE_TOTAL]));
+
+				results.push_back(res);
+			}
+		}
+	}
+
+	if (json) {
+		fp = fopen(json, "w");
+		if (!fp) {
+			perror(json);
+			return 1;
+		}
+	}
+
+	write_json(fp, results, iterations, level, realtime);
+
+	if (fp != stdout)
+		fclose(fp);
+
+	return 0;
+}
@@ -0,0 +1,386 @@
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <math.h>
+#include <dirent.h>
+
+#include <fitsio.h>
+
+#include "qhy9_calib.h"
+#include "qhy9_kernels.h"
+#include "qhy9_trace.h"
+
+#define EXPOSURE_MATCH 0.01		/* relative, a dark this close is used as is */
+
+static const char *bin_x_keys[]  = { "XBINNING", "CCDBIN1", NULL };
+static const char *bin_y_keys[]  = { "YBINNING", "CCDBIN2", NULL };
+static const char *org_x_keys[]  = { "XORGSUBF", NULL };
+static const char *org_y_keys[]  = { "YORGSUBF", NULL };
+static const char *exp_keys[]    = { "EXPTIME", "EXPOSURE", NULL };
+static const char *gain_keys[]   = { "QHYGAIN", "GAIN", NULL };
+static const char *offset_keys[] = { "QHYBIAS", "OFFSET", NULL };
+static const char *temp_keys[]   = { "CCDTMEAN", "CCDTEMP", "CCD-TEMP", "SET-TEMP", NULL };
+
+
+/* first of keys present in the header, as a double */
+static bool read_key(fitsfile *fptr, const char **keys, double *value)
+{
+	int status;
+
+	for (; *keys; keys++) {
+		status = 0;
+		if (fits_read_key(fptr, TDOUBLE, *keys, value, NULL, &status) == 0)
+			return true;
+	}
+
+	return false;
+}
+
+static double key_or(fitsfile *fptr, const char **keys, double def)
+{
+	double value;
+
+	return read_key(fptr, keys, &value) ? value : def;
+}
+
+static bool fits_name(const char *name)
+{
+	const char *ext = strrchr(name, '.');
+
+	return ext && (!strcasecmp(ext, ".fits") || !strcasecmp(ext, ".fit") || !strcasecmp(ext, ".fts"));
+}
+
+/* IMAGETYP as written by INDI, MaxIm, N.I.N.A., Siril and friends */
+static int master_type(const char *imagetyp)
+{
+	if (strcasestr(imagetyp, "bias") || strcasestr(imagetyp, "offset") || strcasestr(imagetyp, "zero"))
+		return QHY9_MASTER_BIAS;
+	if (strcasestr(imagetyp, "dark"))
+		return QHY9_MASTER_DARK;
+	if (strcasestr(imagetyp, "flat"))
+		return QHY9_MASTER_FLAT;
+
+	return -1;
+}
+
+static const char *base_name(const std::string &path)
+{
+	size_t slash = path.rfind('/');
+
+	return path.c_str() + (slash == std::string::npos ? 0 : slash + 1);
+}
+
+
+QHY9Calibration::QHY9Calibration()
+{
+	cached = 0;
+	cacheLimit = 512 * 1024 * 1024;
+	tempTolerance = 2.0;
+	pedestal = 0;
+}
+
+int QHY9Calibration::scan(const char *dir)
+{
+	struct dirent *de;
+	char imagetyp[FLEN_VALUE], filter[FLEN_VALUE];
+	fitsfile *fptr;
+	long naxes[2];
+	int naxis, status;
+	Master m;
+	DIR *d;
+
+	masters.clear();
+	cache.clear();
+	cached = 0;
+
+	if (!dir || !*dir)
+		return 0;
+
+	d = opendir(dir);
+	if (!d)
+		return -1;
+
+	while ((de = readdir(d))) {
+		if (!fits_name(de->d_name))
+			continue;
+
+		m.path = std::string(dir) + "/" + de->d_name;
+
+		status = 0;
+		if (fits_open_diskfile(&fptr, m.path.c_str(), READONLY, &status))
+			continue;
+
+		naxes[0] = naxes[1] = 0;
+		fits_get_img_dim(fptr, &naxis, &status);
+		fits_get_img_size(fptr, 2, naxes, &status);
+		if (status || naxis != 2 ||
+		    fits_read_key(fptr, TSTRING, "IMAGETYP", imagetyp, NULL, &status) ||
+		    (m.type = master_type(imagetyp)) < 0) {
+			status = 0;
+			fits_close_file(fptr, &status);
+			continue;
+		}
+
+		m.key.bx = (int) key_or(fptr, bin_x_keys, 1);
+		m.key.by = (int) key_or(fptr, bin_y_keys, 1);
+		m.key.x = (int) key_or(fptr, org_x_keys, 0) * m.key.bx;
+		m.key.y = (int) key_or(fptr, org_y_keys, 0) * m.key.by;
+		m.key.w = naxes[0] * m.key.bx;
+		m.key.h = naxes[1] * m.key.by;
+		m.key.exposure = key_or(fptr, exp_keys, 0);
+		m.key.gain = (int) key_or(fptr, gain_keys, -1);
+		m.key.offset = (int) key_or(fptr, offset_keys, -1);
+		m.key.temperature = key_or(fptr, temp_keys, NAN);
+
+		status = 0;
+		if (fits_read_key(fptr, TSTRING, "FILTER", filter, NULL, &status))
+			filter[0] = 0;
+		m.key.filter = filter;
+
+		m.mean = NAN;
+
+		status = 0;
+		fits_close_file(fptr, &status);
+
+		qhy9_trace_text("calib: %s type %d, bin %dx%d, %.3f s, gain %d offset %d, %.1f C, '%s'",
+				de->d_name, m.type, m.key.bx, m.key.by, m.key.exposure,
+				m.key.gain, m.key.offset, m.key.temperature, filter);
+
+		masters.push_back(m);
+	}
+
+	closedir(d);
+
+	return masters.size();
+}
+
+void QHY9Calibration::setCacheLimit(size_t bytes)
+{
+	cacheLimit = bytes;
+	trim(0);
+}
+
+int QHY9Calibration::count(int type)
+{
+	size_t i;
+	int n = 0;
+
+	for (i = 0; i < masters.size(); i++)
+		if (masters[i].type == type)
+			n++;
+
+	return n;
+}
+
+/* best master of type for key; a dark of another exposure only if scaled */
+const QHY9Calibration::Master *QHY9Calibration::find(int type, const QHY9CalibKey *key, bool scaled)
+{
+	const Master *best = NULL;
+	double score, bestScore = 0, ratio;
+	size_t i;
+
+	for (i = 0; i < masters.size(); i++) {
+		const Master *m = &masters[i];
+		const QHY9CalibKey *mk = &m->key;
+
+		if (m->type != type || mk->bx != key->bx || mk->by != key->by)
+			continue;
+
+		/* must cover the subframe on the same pixel grid */
+		if (mk->x > key->x || mk->y > key->y ||
+		    mk->x + mk->w < key->x + key->w || mk->y + mk->h < key->y + key->h ||
+		    (key->x - mk->x) % key->bx || (key->y - mk->y) % key->by)
+			continue;
+
+		score = 0;
+
+		if (type == QHY9_MASTER_FLAT) {
+			if (!mk->filter.empty() && !key->filter.empty() && mk->filter != key->filter)
+				continue;
+		} else {
+			if ((mk->gain >= 0 && mk->gain != key->gain) || (mk->offset >= 0 && mk->offset != key->offset))
+				continue;
+		}
+
+		if (type == QHY9_MASTER_DARK) {
+			if (!isnan(mk->temperature)) {
+				if (fabs(mk->temperature - key->temperature) > tempTolerance)
+					continue;
+				score += fabs(mk->temperature - key->temperature) / tempTolerance;
+			}
+
+			if (mk->exposure <= 0 || key->exposure <= 0)
+				continue;
+
+			ratio = fabs(log(key->exposure / mk->exposure));
+			if (ratio > EXPOSURE_MATCH && !scaled)
+				continue;
+			score += ratio * 10;
+		}
+
+		if (!best || score < bestScore) {
+			best = m;
+			bestScore = score;
+		}
+	}
+
+	return best;
+}
+
+/* mean of the whole flat, read a row at a time; once per master, stays NAN on error */
+void QHY9Calibration::flatMean(const Master *master, fitsfile *fptr)
+{
+	long fpixel[2], lpixel[2], inc[2] = { 1, 1 };
+	long w = master->key.w / master->key.bx, h = master->key.h / master->key.by;
+	std::vector<float> row(w);
+	double sum = 0;
+	int anynul, status = 0;
+	long x, y;
+
+	if (!isnan(master->mean))
+		return;
+
+	fpixel[0] = 1;
+	lpixel[0] = w;
+	for (y = 1; y <= h; y++) {
+		fpixel[1] = lpixel[1] = y;
+		if (fits_read_subset(fptr, TFLOAT, fpixel, lpixel, inc, NULL, &row[0], &anynul, &status))
+			return;
+		for (x = 0; x < w; x++)
+			sum += row[x];
+	}
+
+	master->mean = sum / ((double) w * h);
+}
+
+/* the master cut to the subframe, from the cache or the file; flats as gains */
+const float *QHY9Calibration::load(const Master *master, const QHY9CalibKey *key)
+{
+	std::list<Entry>::iterator it;
+	Entry e;
+	fitsfile *fptr;
+	long fpixel[2], lpixel[2], inc[2] = { 1, 1 };
+	size_t i, n;
+	int anynul, status = 0;
+	float mean;
+
+	e.master = master;
+	e.x = (key->x - master->key.x) / key->bx;
+	e.y = (key->y - master->key.y) / key->by;
+	e.w = key->w / key->bx;
+	e.h = key->h / key->by;
+
+	for (it = cache.begin(); it != cache.end(); ++it) {
+		if (it->master == master && it->x == e.x && it->y == e.y && it->w == e.w && it->h == e.h) {
+			cache.splice(cache.begin(), cache, it);
+			return &cache.front().data[0];
+		}
+	}
+
+	n = (size_t) e.w * e.h;
+
+	fpixel[0] = e.x + 1;
+	fpixel[1] = e.y + 1;
+	lpixel[0] = e.x + e.w;
+	lpixel[1] = e.y + e.h;
+
+	cache.push_front(e);
+	cache.front().data.resize(n);
+	float *data = &cache.front().data[0];
+
+	if (!fits_open_diskfile(&fptr, master->path.c_str(), READONLY, &status)) {
+		fits_read_subset(fptr, TFLOAT, fpixel, lpixel, inc, NULL, data, &anynul, &status);
+		if (!status && master->type == QHY9_MASTER_FLAT)
+			flatMean(master, fptr);
+		int cstatus = 0;
+		fits_close_file(fptr, &cstatus);
+	}
+
+	if (status) {
+		char msg[FLEN_ERRMSG];
+
+		fits_get_errstatus(status, msg);
+		fprintf(stderr, "calib: cannot read %s: %s\n", master->path.c_str(), msg);
+		cache.pop_front();
+		return NULL;
+	}
+
+	/* flats: the gain that takes each pixel to the mean of the whole master */
+	if (master->type == QHY9_MASTER_FLAT) {
+		if (isnan(master->mean)) {
+			fprintf(stderr, "calib: cannot read %s\n", master->path.c_str());
+			cache.pop_front();
+			return NULL;
+		}
+		mean = master->mean;
+
+		for (i = 0; i < n; i++)
+			data[i] = (data[i] > 0) ? mean / data[i] : 1.0f;
+	}
+
+	cached += n * sizeof(float);
+
+	qhy9_trace_text("calib: loaded %s, %dx%d at %d,%d", base_name(master->path), e.w, e.h, e.x, e.y);
+
+	return data;
+}
+
+/* drop least recently used entries over the limit, but not the first keep */
+void QHY9Calibration::trim(size_t keep)
+{
+	while (cached > cacheLimit && cache.size() > keep) {
+		cached -= cache.back().data.size() * sizeof(float);
+		cache.pop_back();
+	}
+}
+
+bool QHY9Calibration::match(const QHY9CalibKey *key, QHY9CalibSet *set)
+{
+	const Master *bias, *dark, *flat;
+	size_t used = 0;
+	int i;
+
+	bias = find(QHY9_MASTER_BIAS, key, false);
+	dark = find(QHY9_MASTER_DARK, key, false);
+	if (!dark && bias)
+		dark = find(QHY9_MASTER_DARK, key, true);
+	flat = find(QHY9_MASTER_FLAT, key, false);
+
+	set->bias = bias ? load(bias, key) : NULL;
+	set->dark = dark ? load(dark, key) : NULL;
+	set->flat = flat ? load(flat, key) : NULL;
+	used = (set->bias != NULL) + (set->dark != NULL) + (set->flat != NULL);
+
+	/* dark current scales with time, the bias in the dark does not */
+	set->darkScale = set->dark ? key->exposure / dark->key.exposure : 0;
+	set->biasScale = set->bias ? 1 - set->darkScale : 0;
+	if (set->dark && !set->bias)
+		set->darkScale = 1;
+	set->pedestal = pedestal;
+
+	for (i = 0; i < QHY9_MASTER_TYPES; i++)
+		set->names[i].clear();
+	if (set->bias) set->names[QHY9_MASTER_BIAS] = base_name(bias->path);
+	if (set->dark) set->names[QHY9_MASTER_DARK] = base_name(dark->path);
+	if (set->flat) set->names[QHY9_MASTER_FLAT] = base_name(flat->path);
+
+	trim(used);
+
+	return used > 0;
+}
+
+
+void qhy9_calibrate_frame(uint16_t *data, int w, int h, const QHY9CalibSet *set)
+{
+	std::vector<float> zeros(w, 0.0f), ones(w, 1.0f);
+	size_t row;
+	int y;
+
+	for (y = 0; y < h; y++) {
+		row = (size_t) y * w;
+		qhy9_calibrate_row(data + row, data + row, w,
+				   set->bias ? set->bias + row : &zeros[0], set->biasScale,
+				   set->dark ? set->dark + row : &zeros[0], set->darkScale,
+				   set->flat ? set->flat + row : &ones[0], set->pedestal);
+	}
+}
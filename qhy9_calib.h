@@ -0,0 +1,102 @@
+#ifndef __QHY9_CALIB_H
+#define __QHY9_CALIB_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <list>
+#include <string>
+#include <vector>
+
+#include <fitsio.h>
+
+enum {
+	QHY9_MASTER_BIAS = 0,
+	QHY9_MASTER_DARK,
+	QHY9_MASTER_FLAT,
+	QHY9_MASTER_TYPES
+};
+
+/* what a frame was taken with, and what a master was made from */
+struct QHY9CalibKey {
+	int x, y, w, h;			/* unbinned pixels */
+	int bx, by;
+	double exposure;		/* sec */
+	int gain, offset;		/* camgain, camoffset; -1 in a master if unknown */
+	double temperature;		/* degC; NAN in a master if unknown */
+	std::string filter;		/* flats only */
+};
+
+/* masters picked for one frame, arrays of its binned size */
+struct QHY9CalibSet {
+	const float *bias, *dark, *flat;	/* NULL if none matched */
+	float biasScale;		/* (src - biasScale * bias - darkScale * dark) * flat */
+	float darkScale;
+	float pedestal;
+	std::string names[QHY9_MASTER_TYPES];	/* file names, empty if not used */
+};
+
+/*
+ * Master bias, dark and flat frames from a directory, matched to each frame
+ * by binning, subframe, gain, offset, temperature and exposure (flats by
+ * filter instead of the last two) and kept in memory, cut to the subframe,
+ * up to a size limit.
+ *
+ * A dark with a different exposure is scaled if there is a bias to take out
+ * first, otherwise only an exact one is used. Flats are expected calibrated
+ * already and are normalized to the mean of the whole master, so every
+ * subframe cut of it scales the same.
+ *
+ * Not locked: the main loop calls everything, the pointers handed out in
+ * QHY9CalibSet stay valid until the next match or scan.
+ */
+class QHY9Calibration
+{
+public:
+	QHY9Calibration();
+
+	/* read the headers of all FITS files in dir, drops the cache; number of masters found, -1 if dir cannot be read */
+	int scan(const char *dir);
+
+	void setTemperatureTolerance(double degrees) { tempTolerance = degrees; }
+	void setCacheLimit(size_t bytes);
+	void setPedestal(double adu) { pedestal = adu; }
+
+	/* masters for a frame; false if none matched */
+	bool match(const QHY9CalibKey *key, QHY9CalibSet *set);
+
+	int count(int type);
+	size_t cacheBytes() { return cached; }
+
+private:
+	struct Master {
+		int type;
+		QHY9CalibKey key;	/* the full frame it covers */
+		std::string path;
+		mutable double mean;	/* flats: of the whole frame, NAN until first loaded */
+	};
+
+	struct Entry {
+		const Master *master;
+		int x, y, w, h;		/* cut out, binned pixels */
+		std::vector<float> data;
+	};
+
+	std::vector<Master> masters;
+	std::list<Entry> cache;		/* most recently used first */
+	size_t cached;
+	size_t cacheLimit;
+
+	double tempTolerance;
+	double pedestal;
+
+	const Master *find(int type, const QHY9CalibKey *key, bool scaled);
+	const float *load(const Master *master, const QHY9CalibKey *key);
+	void flatMean(const Master *master, fitsfile *fptr);
+	void trim(size_t keep);
+};
+
+/* calibrate a w x h frame in place with the masters of set */
+void qhy9_calibrate_frame(uint16_t *data, int w, int h, const QHY9CalibSet *set);
+
+#endif
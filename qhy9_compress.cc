@@ -0,0 +1,401 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <zlib.h>
+
+#include "qhy9_compress.h"
+#include "qhy9_kernels.h"
+#include "qhy9_timing.h"
+#include "qhy9_trace.h"
+
+#define FITS_BLOCK 2880
+
+/* room around the deflate stream for either wrapper */
+#define WRAP_HEAD 10
+#define WRAP_TAIL 8
+
+
+static void put_le32(uint8_t *p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+static void put_be32(uint8_t *p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+long qhy9_deflate_chunk(const uint8_t *in, size_t len, int level, bool last, std::vector<uint8_t> &out)
+{
+	z_stream zs;
+	int ret;
+
+	memset(&zs, 0, sizeof(zs));
+	if (deflateInit2(&zs, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+		return -1;
+
+	/* the full flush adds a few bytes on top of the bound */
+	out.resize(deflateBound(&zs, len) + 16);
+
+	zs.next_in = (Bytef *) in;
+	zs.avail_in = len;
+	zs.next_out = &out[0];
+	zs.avail_out = out.size();
+
+	ret = deflate(&zs, last ? Z_FINISH : Z_FULL_FLUSH);
+	if (ret == Z_STREAM_ERROR || zs.avail_in || (last && ret != Z_STREAM_END)) {
+		deflateEnd(&zs);
+		return -1;
+	}
+
+	deflateEnd(&zs);
+
+	return out.size() - zs.avail_out;
+}
+
+
+QHY9Compressor::QHY9Compressor()
+{
+	pthread_mutex_init(&lock, NULL);
+	pthread_cond_init(&work, NULL);
+	pthread_cond_init(&idle, NULL);
+
+	nthreads = 0;
+	level = 1;
+	quit = false;
+
+	data = NULL;
+	npixels = 0;
+	fed = 0;
+	busy = 0;
+	started = false;
+	wrapped = false;
+
+	ratio = wallMs = finishMs = cpuMs = 0.0;
+
+	setThreads(0);
+}
+
+QHY9Compressor::~QHY9Compressor()
+{
+	abort();
+	stopThreads();
+
+	pthread_cond_destroy(&idle);
+	pthread_cond_destroy(&work);
+	pthread_mutex_destroy(&lock);
+}
+
+void QHY9Compressor::setThreads(int threads)
+{
+	if (threads <= 0)
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (threads < 1)
+		threads = 1;
+	if (threads > MAX_THREADS)
+		threads = MAX_THREADS;
+
+	if (threads == nthreads)
+		return;
+
+	/* queued tiles wait for the new workers */
+	stopThreads();
+	nthreads = threads;
+}
+
+void QHY9Compressor::setLevel(int level)
+{
+	if (level < 0) level = 0;
+	if (level > 9) level = 9;
+
+	pthread_mutex_lock(&lock);
+	this->level = level;
+	pthread_mutex_unlock(&lock);
+}
+
+void QHY9Compressor::startThreads()
+{
+	pthread_t thread;
+	int i;
+
+	quit = false;
+
+	for (i = 0; i < nthreads; i++) {
+		if (pthread_create(&thread, NULL, workerEntry, this)) {
+			fprintf(stderr, "compress: cannot start worker\n");
+			break;
+		}
+		threads.push_back(thread);
+	}
+}
+
+void QHY9Compressor::stopThreads()
+{
+	size_t i;
+
+	if (threads.empty())
+		return;
+
+	pthread_mutex_lock(&lock);
+	quit = true;
+	pthread_cond_broadcast(&work);
+	pthread_mutex_unlock(&lock);
+
+	for (i = 0; i < threads.size(); i++)
+		pthread_join(threads[i], NULL);
+
+	threads.clear();
+	quit = false;
+}
+
+void *QHY9Compressor::workerEntry(void *arg)
+{
+	((QHY9Compressor *) arg)->worker();
+	return NULL;
+}
+
+void QHY9Compressor::worker()
+{
+	std::vector<uint16_t> scratch(TILE_PIXELS);
+	Tile *tile;
+	int lvl;
+
+	pthread_mutex_lock(&lock);
+
+	while (!quit) {
+		if (queue.empty()) {
+			pthread_cond_wait(&work, &lock);
+			continue;
+		}
+
+		tile = &tiles[queue.front()];
+		queue.pop_front();
+		lvl = level;
+		busy++;
+		pthread_mutex_unlock(&lock);
+
+		compressTile(tile, scratch, lvl);
+
+		pthread_mutex_lock(&lock);
+		tile->done = true;
+		busy--;
+		pthread_cond_broadcast(&idle);
+	}
+
+	pthread_mutex_unlock(&lock);
+}
+
+/* worker: FITS byte order into scratch, checksums, deflate */
+void QHY9Compressor::compressTile(Tile *tile, std::vector<uint16_t> &scratch, int level)
+{
+	struct timespec t0, t1;
+	const uint8_t *bytes = (const uint8_t *) &scratch[0];
+	size_t len = tile->count * 2;
+	long ret;
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t0);
+
+	qhy9_fits_row(&scratch[0], data + tile->offset, tile->count);
+
+	tile->crc = crc32(0, bytes, len);
+	tile->adler = adler32(1, bytes, len);
+
+	ret = qhy9_deflate_chunk(bytes, len, level, false, tile->out);
+	tile->outlen = ret < 0 ? 0 : ret;
+	tile->error = ret < 0;
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t1);
+	tile->ms = ts_ms(&t1, &t0);
+}
+
+void QHY9Compressor::begin(const uint16_t *data, size_t npixels)
+{
+	size_t i, n;
+
+	abort();
+
+	if (threads.empty())
+		startThreads();
+
+	pthread_mutex_lock(&lock);
+
+	this->data = data;
+	this->npixels = npixels;
+
+	n = (npixels + TILE_PIXELS - 1) / TILE_PIXELS;
+	tiles.resize(n);
+	for (i = 0; i < n; i++) {
+		tiles[i].offset = i * TILE_PIXELS;
+		tiles[i].count = (i == n - 1) ? npixels - tiles[i].offset : TILE_PIXELS;
+		tiles[i].outlen = 0;
+		tiles[i].queued = tiles[i].done = false;
+		tiles[i].error = 0;
+		tiles[i].ms = 0;
+	}
+
+	fed = 0;
+	started = true;
+	wrapped = false;
+	clock_gettime(CLOCK_MONOTONIC, &beginTime);
+
+	pthread_mutex_unlock(&lock);
+}
+
+void QHY9Compressor::feed(size_t npixels)
+{
+	bool queued = false;
+
+	pthread_mutex_lock(&lock);
+
+	while (started && fed < tiles.size() && tiles[fed].offset + tiles[fed].count <= npixels) {
+		tiles[fed].queued = true;
+		queue.push_back(fed);
+		fed++;
+		queued = true;
+	}
+
+	if (queued)
+		pthread_cond_broadcast(&work);
+
+	pthread_mutex_unlock(&lock);
+}
+
+void QHY9Compressor::abort()
+{
+	pthread_mutex_lock(&lock);
+
+	queue.clear();
+	started = false;
+	while (busy)
+		pthread_cond_wait(&idle, &lock);
+
+	pthread_mutex_unlock(&lock);
+}
+
+bool QHY9Compressor::finish(const uint8_t *header, size_t hlen, int format, uint8_t **out, size_t *outlen)
+{
+	std::vector<uint8_t> head, tail, zeros;
+	struct timespec t0, t1;
+	size_t i, pos, pad, size;
+	long hl, tl;
+	bool error = false;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+
+	if (!active())
+		return false;
+
+	feed(npixels);
+
+	/* the header and padding meanwhile */
+	pad = (FITS_BLOCK - (npixels * 2) % FITS_BLOCK) % FITS_BLOCK;
+	zeros.assign(pad + 1, 0);
+
+	hl = qhy9_deflate_chunk(header, hlen, level, false, head);
+	crc = crc32(0, header, hlen);
+	adler = adler32(1, header, hlen);
+
+	pthread_mutex_lock(&lock);
+	while (busy || !queue.empty())
+		pthread_cond_wait(&idle, &lock);
+	started = false;
+	pthread_mutex_unlock(&lock);
+
+	tl = qhy9_deflate_chunk(&zeros[0], pad, level, true, tail);
+	if (hl < 0 || tl < 0)
+		error = true;
+
+	/* header, tiles, padding with the final block */
+	size = hl + tl;
+	cpuMs = 0;
+	for (i = 0; i < tiles.size(); i++) {
+		error |= tiles[i].error;
+		size += tiles[i].outlen;
+		cpuMs += tiles[i].ms;
+	}
+
+	if (error) {
+		fprintf(stderr, "compress: deflate failed\n");
+		return false;
+	}
+
+	result.resize(WRAP_HEAD + size + WRAP_TAIL);
+	pos = WRAP_HEAD;
+
+	memcpy(&result[pos], &head[0], hl);
+	pos += hl;
+
+	for (i = 0; i < tiles.size(); i++) {
+		memcpy(&result[pos], &tiles[i].out[0], tiles[i].outlen);
+		pos += tiles[i].outlen;
+
+		crc = crc32_combine(crc, tiles[i].crc, tiles[i].count * 2);
+		adler = adler32_combine(adler, tiles[i].adler, tiles[i].count * 2);
+	}
+
+	memcpy(&result[pos], &tail[0], tl);
+	pos += tl;
+
+	crc = crc32(crc, &zeros[0], pad);
+	adler = adler32(adler, &zeros[0], pad);
+
+	total = hlen + npixels * 2 + pad;
+	body = size;
+	wrapped = true;
+
+	rewrap(format, out, outlen);
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	ratio = (double) total / *outlen;
+	wallMs = ts_ms(&t1, &beginTime);
+	finishMs = ts_ms(&t1, &t0);
+
+	qhy9_trace_text("compress: %zu -> %zu bytes in %zu tiles, %.1f ms (%.1f after download, %.1f cpu)",
+			total, *outlen, tiles.size(), wallMs, finishMs, cpuMs);
+
+	return true;
+}
+
+bool QHY9Compressor::rewrap(int format, uint8_t **out, size_t *outlen)
+{
+	uint8_t *p;
+
+	if (!wrapped)
+		return false;
+
+	/* both trailers go right after the deflate stream */
+	if (format == GZIP) {
+		p = &result[0];
+		memset(p, 0, WRAP_HEAD);
+		p[0] = 0x1f;
+		p[1] = 0x8b;
+		p[2] = 8;			/* deflate */
+		p[9] = 3;			/* unix */
+
+		put_le32(&result[WRAP_HEAD + body], crc);
+		put_le32(&result[WRAP_HEAD + body + 4], (uint32_t) total);
+
+		*out = p;
+		*outlen = WRAP_HEAD + body + 8;
+	} else {
+		p = &result[WRAP_HEAD - 2];
+		p[0] = 0x78;
+		p[1] = 0x9c;
+
+		put_be32(&result[WRAP_HEAD + body], adler);
+
+		*out = p;
+		*outlen = 2 + body + 4;
+	}
+
+	return true;
+}
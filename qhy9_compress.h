@@ -0,0 +1,118 @@
+#ifndef __QHY9_COMPRESS_H
+#define __QHY9_COMPRESS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#include <deque>
+#include <vector>
+
+/*
+ * Parallel deflate of a 16 bit FITS image.
+ *
+ * The image is cut into tiles that a pool of threads converts to FITS byte
+ * order and deflates independently, each ending on a byte boundary with a
+ * full flush, so the pieces simply concatenate into one deflate stream. Tiles
+ * can be queued as the pixels arrive from the camera; the header, which is
+ * only known at the end, is deflated last but goes first. The result is
+ * wrapped as zlib (what INDI clients expect for .fits.z) or gzip (.fits.gz,
+ * which cfitsio opens directly).
+ *
+ * begin, feed and abort may come from the readout thread, finish from the
+ * main loop; one frame at a time.
+ */
+class QHY9Compressor
+{
+public:
+	static const int MAX_THREADS = 16;
+	static const int TILE_PIXELS = 512 * 1024;	/* 1 MiB of FITS data */
+
+	enum { ZLIB = 0, GZIP };
+
+	QHY9Compressor();
+	~QHY9Compressor();
+
+	/* workers, 0 for one per CPU */
+	void setThreads(int threads);
+	void setLevel(int level);
+
+	int getThreads() { return nthreads; }
+	int getLevel() { return level; }
+
+	/* a new image of npixels at data; the pixels must stay put until finish or abort */
+	void begin(const uint16_t *data, size_t npixels);
+
+	/* the first npixels have arrived, start on the tiles they complete */
+	void feed(size_t npixels);
+
+	/*
+	 * Header, image and FITS padding as one compressed stream; waits for the
+	 * tiles. *out stays valid until the next begin. False if nothing was begun
+	 * or zlib failed.
+	 */
+	bool finish(const uint8_t *header, size_t hlen, int format, uint8_t **out, size_t *outlen);
+
+	/* the last finished frame in the other wrapper, overwrites the first */
+	bool rewrap(int format, uint8_t **out, size_t *outlen);
+
+	/* drop the frame, waits for tiles in progress so the pixels can go */
+	void abort();
+
+	bool active() { return started; }
+
+	/* last finished frame */
+	double getRatio() { return ratio; }		/* uncompressed / compressed */
+	double getWallMs() { return wallMs; }		/* begin to finish */
+	double getFinishMs() { return finishMs; }	/* finish alone, what is left after the download */
+	double getCpuMs() { return cpuMs; }		/* sum over the workers */
+
+private:
+	struct Tile {
+		size_t offset, count;	/* pixels */
+		std::vector<uint8_t> out;
+		size_t outlen;
+		uint32_t crc, adler;
+		bool queued, done;
+		int error;
+		double ms;
+	};
+
+	pthread_mutex_t lock;
+	pthread_cond_t work;		/* workers wait for tiles */
+	pthread_cond_t idle;		/* finish and abort wait for the workers */
+
+	std::vector<pthread_t> threads;
+	int nthreads;
+	int level;
+	bool quit;
+
+	const uint16_t *data;
+	size_t npixels;
+	std::vector<Tile> tiles;
+	std::deque<int> queue;
+	size_t fed;			/* tiles queued so far */
+	int busy;			/* tiles being compressed */
+	bool started;
+	struct timespec beginTime;
+
+	std::vector<uint8_t> result;	/* wrapper head room, deflate stream, trailer room */
+	size_t body;			/* deflate stream */
+	uint32_t crc, adler;		/* of the uncompressed file */
+	size_t total;
+	bool wrapped;			/* result is complete */
+
+	double ratio, wallMs, finishMs, cpuMs;
+
+	void startThreads();
+	void stopThreads();
+
+	static void *workerEntry(void *arg);
+	void worker();
+	void compressTile(Tile *tile, std::vector<uint16_t> &scratch, int level);
+};
+
+/* deflate len bytes raw into out, ending with a full flush or, if last, the final block; bytes or -1 */
+long qhy9_deflate_chunk(const uint8_t *in, size_t len, int level, bool last, std::vector<uint8_t> &out);
+
+#endif
@@ -0,0 +1,519 @@
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include <libusb-1.0/libusb.h>
+
+#include "qhy9_cooler.h"
+#include "qhy9_dc201.h"
+#include "qhy9_timing.h"
+#include "qhy9_trace.h"
+
+#define COOLER_HYSTERESIS 0.1		/* degC, auto-tune relay */
+#define COOLER_HOLD_MS    2000		/* output held after a download */
+
+#define COOLER_KP 1.6			/* default gains */
+#define COOLER_KI 0.1
+#define COOLER_KD 0.0
+
+
+static double clamp(double val, double min, double max)
+{
+	if (val < min) return min;
+	if (val > max) return max;
+	return val;
+}
+
+
+QHY9Cooler::QHY9Cooler()
+{
+	pthread_condattr_t attr;
+
+	pthread_mutex_init(&lock, NULL);
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	transport = NULL;
+	telemetry = NULL;
+	source = 0;
+	running = quit = suspended = busy = false;
+
+	target = 50;
+	limit = 0.8;
+	kp = COOLER_KP;
+	ki = COOLER_KI;
+	kd = COOLER_KD;
+	downloading = false;
+	memset(&downloadEnd, 0, sizeof(downloadEnd));
+	memset(&lastCommand, 0, sizeof(lastCommand));
+
+	integral = lastError = deriv = power = 0.0;
+
+	mode = QHY9_COOLER_REGULATE;
+	tune = QHY9_TUNE_NONE;
+	relayHigh = haveRise = false;
+	bias = step = tmin = tmax = 0.0;
+	cycles = 0;
+	sumPeriod = sumAmplitude = 0.0;
+
+	valid = false;
+	temperature = 0.0;
+}
+
+QHY9Cooler::~QHY9Cooler()
+{
+	stop();
+
+	pthread_cond_destroy(&cond);
+	pthread_mutex_destroy(&lock);
+}
+
+bool QHY9Cooler::start(QHY9Transport *transport, int source)
+{
+	if (running)
+		return true;
+
+	this->transport = transport;
+	this->source = source;
+
+	quit = false;
+	suspended = false;
+	valid = false;
+	queue.clear();
+
+	if (pthread_create(&thread, NULL, threadEntry, this)) {
+		fprintf(stderr, "cooler: cannot start thread\n");
+		return false;
+	}
+
+	running = true;
+
+	return true;
+}
+
+void QHY9Cooler::stop()
+{
+	if (!running)
+		return;
+
+	pthread_mutex_lock(&lock);
+	quit = true;
+	pthread_cond_broadcast(&cond);
+	pthread_mutex_unlock(&lock);
+
+	pthread_join(thread, NULL);
+	running = false;
+
+	/* a tune cannot survive the camera going away */
+	if (mode == QHY9_COOLER_AUTOTUNE) {
+		mode = QHY9_COOLER_REGULATE;
+		integral = power;
+	}
+
+	transport = NULL;
+}
+
+void QHY9Cooler::suspend()
+{
+	pthread_mutex_lock(&lock);
+	suspended = true;
+	queue.clear();			/* meant for the camera that went away */
+	while (busy)
+		pthread_cond_wait(&cond, &lock);
+	pthread_mutex_unlock(&lock);
+}
+
+void QHY9Cooler::resume()
+{
+	pthread_mutex_lock(&lock);
+	suspended = false;
+	pthread_cond_broadcast(&cond);
+	pthread_mutex_unlock(&lock);
+}
+
+void QHY9Cooler::setTarget(double degrees)
+{
+	pthread_mutex_lock(&lock);
+	target = degrees;
+	pthread_mutex_unlock(&lock);
+}
+
+void QHY9Cooler::setLimit(double power)
+{
+	pthread_mutex_lock(&lock);
+	limit = clamp(power, 0.0, 1.0);
+	pthread_mutex_unlock(&lock);
+}
+
+void QHY9Cooler::setGains(double kp, double ki, double kd)
+{
+	pthread_mutex_lock(&lock);
+
+	this->kp = kp;
+	this->ki = ki;
+	this->kd = kd;
+
+	/* keep the output where it is, only its future changes */
+	integral = power - kp * lastError;
+
+	pthread_mutex_unlock(&lock);
+}
+
+void QHY9Cooler::setDownloading(bool downloading)
+{
+	pthread_mutex_lock(&lock);
+	this->downloading = downloading;
+	if (!downloading)
+		clock_gettime(CLOCK_MONOTONIC, &downloadEnd);
+	pthread_mutex_unlock(&lock);
+}
+
+bool QHY9Cooler::startAutotune()
+{
+	bool ok = false;
+
+	pthread_mutex_lock(&lock);
+
+	if (valid && mode == QHY9_COOLER_REGULATE) {
+		/* swing the output around where it sits now, as far as the limit allows */
+		bias = (power > 0.05) ? power : limit / 2;
+		step = (bias < limit - bias) ? bias : limit - bias;
+
+		if (step >= 0.02) {
+			mode = QHY9_COOLER_AUTOTUNE;
+			tune = QHY9_TUNE_NONE;
+			relayHigh = temperature > target;
+			haveRise = false;
+			cycles = 0;
+			sumPeriod = sumAmplitude = 0.0;
+			clock_gettime(CLOCK_MONOTONIC, &tuneStart);
+			ok = true;
+
+			qhy9_trace_text("cooler: autotune around %.2f, power %.3f +- %.3f", target, bias, step);
+		}
+	}
+
+	pthread_mutex_unlock(&lock);
+
+	return ok;
+}
+
+void QHY9Cooler::abortAutotune()
+{
+	pthread_mutex_lock(&lock);
+	if (mode == QHY9_COOLER_AUTOTUNE) {
+		mode = QHY9_COOLER_REGULATE;
+		integral = power - kp * lastError;
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+void QHY9Cooler::send(const uint8_t *data, int length)
+{
+	Command cmd;
+
+	if (length > (int) sizeof(cmd.data))
+		return;
+
+	memcpy(cmd.data, data, length);
+	cmd.length = length;
+
+	pthread_mutex_lock(&lock);
+	queue.push_back(cmd);
+	pthread_cond_broadcast(&cond);
+	pthread_mutex_unlock(&lock);
+}
+
+void QHY9Cooler::getStatus(QHY9CoolerStatus *status)
+{
+	pthread_mutex_lock(&lock);
+
+	status->valid = valid;
+	status->temperature = temperature;
+	status->target = target;
+	status->power = power;
+	status->mode = mode;
+	status->cycles = (cycles > TUNE_SKIP) ? cycles - TUNE_SKIP : 0;
+	status->tune = tune;
+	status->kp = kp;
+	status->ki = ki;
+	status->kd = kd;
+
+	tune = QHY9_TUNE_NONE;
+
+	pthread_mutex_unlock(&lock);
+}
+
+void *QHY9Cooler::threadEntry(void *arg)
+{
+	((QHY9Cooler *) arg)->loop();
+	return NULL;
+}
+
+void QHY9Cooler::loop()
+{
+	struct timespec now, next, last;
+	double t, dt, error, out;
+
+	qhy9_trace_set_source(source);
+
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	last = next;
+
+	pthread_mutex_lock(&lock);
+
+	while (!quit) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+
+		/* sleep until the next sample unless a command comes in */
+		if ((queue.empty() || suspended) && ts_ms(&next, &now) > 0) {
+			pthread_cond_timedwait(&cond, &lock, &next);
+			continue;
+		}
+
+		if (suspended) {
+			next = now;
+			ts_add(&next, PERIOD_MS);
+			continue;
+		}
+
+		busy = true;
+		pthread_mutex_unlock(&lock);
+
+		drainQueue();
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (ts_ms(&next, &now) <= 0 && readTemperature(&t)) {
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			dt = ts_ms(&now, &last) / 1000.0;
+			last = now;
+
+			pthread_mutex_lock(&lock);
+
+			error = (t - target) / 60.0;
+			temperature = t;
+
+			if (!valid) {
+				/* no history yet */
+				lastError = error;
+				dt = PERIOD_MS / 1000.0;
+				valid = true;
+			}
+
+			if (mode == QHY9_COOLER_AUTOTUNE)
+				relay(error, &now);
+			else
+				regulate(error, dt);
+
+			qhy9_trace_pid(t, target, power * 255.0, error, integral, deriv);
+
+			out = power;
+			pthread_mutex_unlock(&lock);
+
+			writePower(out);
+			if (telemetry)
+				telemetry->add(t, out, error * 60.0);
+		}
+
+		/* keep the rate, but do not try to catch up after a stall */
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		while (ts_ms(&next, &now) <= 0)
+			ts_add(&next, PERIOD_MS);
+
+		pthread_mutex_lock(&lock);
+		busy = false;
+		pthread_cond_broadcast(&cond);
+	}
+
+	pthread_mutex_unlock(&lock);
+}
+
+/* cooler thread: one command on the interrupt endpoints, spaced GAP_MS from the previous one */
+int QHY9Cooler::execute(uint8_t *data, int length, bool read)
+{
+	struct timespec now, wait;
+	double left;
+	int ret;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	left = GAP_MS - ts_ms(&now, &lastCommand);
+	if (left > 0) {
+		wait.tv_sec = 0;
+		wait.tv_nsec = (long) (left * 1000000.0);
+		nanosleep(&wait, NULL);
+	}
+
+	if (read)
+		ret = transport->interruptRead(data, length);
+	else
+		ret = transport->interruptWrite(data, length);
+
+	clock_gettime(CLOCK_MONOTONIC, &lastCommand);
+
+	return ret;
+}
+
+/* cooler thread */
+void QHY9Cooler::drainQueue()
+{
+	Command cmd;
+
+	for (;;) {
+		pthread_mutex_lock(&lock);
+		if (queue.empty() || quit) {
+			pthread_mutex_unlock(&lock);
+			return;
+		}
+		cmd = queue.front();
+		queue.pop_front();
+		pthread_mutex_unlock(&lock);
+
+		execute(cmd.data, cmd.length, false);
+	}
+}
+
+/* cooler thread */
+bool QHY9Cooler::readTemperature(double *degrees)
+{
+	uint8_t buffer[4] = { 0, 0, 0, 0 };
+	int16_t voltage;
+	int ret;
+
+	ret = execute(buffer, 4, true);
+	if (ret < 3) {
+		qhy9_trace_text("cooler: DC201 read failed, %s", ret < 0 ? libusb_error_name(ret) : "short");
+		return false;
+	}
+
+	voltage = (int16_t) (buffer[1] * 256 + buffer[2]);
+	*degrees = dc201_mv_to_degrees(1.024 * voltage);
+
+	return true;
+}
+
+/* cooler thread */
+void QHY9Cooler::writePower(double power)
+{
+	uint8_t buffer[3];
+
+	buffer[0] = 0x01;
+	buffer[1] = (uint8_t) lrint(power * 255.0);
+	buffer[2] = 255;			/* fan */
+
+	execute(buffer, 3, false);
+}
+
+/* called with lock held */
+void QHY9Cooler::regulate(double error, double dt)
+{
+	struct timespec now;
+	double u, step;
+
+	/* low pass the derivative, the thermistor is noisy at this rate */
+	deriv = 0.8 * deriv + 0.2 * (error - lastError) / dt;
+	lastError = error;
+
+	/*
+	 * The TEC is off while the camera reads out and the sensor warms up
+	 * briefly; hold the output until it has recovered rather than chase it.
+	 */
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (downloading || ts_ms(&now, &downloadEnd) < COOLER_HOLD_MS)
+		return;
+
+	u = kp * error + integral + kd * deriv;
+
+	/* anti-windup: stop integrating into saturation */
+	step = ki * error * dt;
+	if (!(u >= limit && step > 0) && !(u <= 0 && step < 0))
+		integral = clamp(integral + step, -limit, limit);
+
+	power = clamp(kp * error + integral + kd * deriv, 0.0, limit);
+}
+
+/* called with lock held */
+void QHY9Cooler::relay(double error, const struct timespec *now)
+{
+	double eps = COOLER_HYSTERESIS / 60.0;
+	double period;
+
+	lastError = error;
+
+	if (ts_ms(now, &tuneStart) > TUNE_TIMEOUT * 1000.0) {
+		qhy9_trace_text("cooler: autotune timed out after %d cycles", cycles);
+		mode = QHY9_COOLER_REGULATE;
+		tune = QHY9_TUNE_FAILED;
+		integral = bias;
+		return;
+	}
+
+	if (!relayHigh && error > eps) {
+		/* warmer than the band, full cooling again; one oscillation per rise */
+		relayHigh = true;
+
+		if (haveRise) {
+			period = ts_ms(now, &lastRise) / 1000.0;
+			cycles++;
+
+			if (cycles > TUNE_SKIP) {
+				sumPeriod += period;
+				sumAmplitude += (tmax - tmin) / 2;
+			}
+
+			if (cycles == TUNE_SKIP + TUNE_CYCLES) {
+				finishAutotune();
+				return;
+			}
+		}
+
+		lastRise = *now;
+		haveRise = true;
+		tmin = tmax = temperature;
+	} else if (relayHigh && error < -eps) {
+		relayHigh = false;
+	}
+
+	if (temperature < tmin) tmin = temperature;
+	if (temperature > tmax) tmax = temperature;
+
+	power = relayHigh ? bias + step : bias - step;
+}
+
+/*
+ * called with lock held. Relay feedback gives the ultimate gain and period of
+ * the loop, Ku = 4 d / (pi sqrt(a^2 - eps^2)); Tyreus-Luyben turns them into
+ * PI gains, slower than Ziegler-Nichols but without its overshoot, which
+ * suits a thermal plant.
+ */
+void QHY9Cooler::finishAutotune()
+{
+	double eps = COOLER_HYSTERESIS / 60.0;
+	double pu = sumPeriod / TUNE_CYCLES;
+	double a = sumAmplitude / TUNE_CYCLES / 60.0;
+	double ku;
+
+	mode = QHY9_COOLER_REGULATE;
+
+	if (a <= eps || pu <= 0) {
+		qhy9_trace_text("cooler: autotune failed, amplitude %.3f degC", a * 60.0);
+		tune = QHY9_TUNE_FAILED;
+		integral = bias;
+		return;
+	}
+
+	ku = 4 * step / (M_PI * sqrt(a * a - eps * eps));
+
+	kp = ku / 3.2;
+	ki = kp / (2.2 * pu);
+	kd = 0.0;
+
+	/* pick up regulating from the middle of the swing */
+	integral = bias - kp * lastError;
+	deriv = 0.0;
+	tune = QHY9_TUNE_DONE;
+
+	qhy9_trace_text("cooler: autotune Ku %.3f Pu %.1f s, kp %.3f ki %.4f", ku, pu, kp, ki);
+}
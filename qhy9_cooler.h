@@ -0,0 +1,152 @@
+#ifndef __QHY9_COOLER_H
+#define __QHY9_COOLER_H
+
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <deque>
+
+#include "qhy9_transport.h"
+#include "qhy9_telemetry.h"
+
+/* controller modes */
+enum {
+	QHY9_COOLER_REGULATE = 0,	/* PID on the setpoint */
+	QHY9_COOLER_AUTOTUNE		/* relay feedback, measuring the loop */
+};
+
+/* auto-tune outcome */
+enum {
+	QHY9_TUNE_NONE = 0,
+	QHY9_TUNE_DONE,			/* new gains in kp, ki, kd */
+	QHY9_TUNE_FAILED
+};
+
+/* cooler state for the main loop to publish */
+struct QHY9CoolerStatus {
+	bool valid;			/* at least one thermistor reading */
+	double temperature;		/* degC */
+	double target;
+	double power;			/* TEC output, 0..1 */
+	int mode;
+	int cycles;			/* auto-tune: oscillations measured */
+	int tune;			/* QHY9_TUNE_*, reported once */
+	double kp, ki, kd;
+};
+
+/*
+ * DC201 cooler control on its own thread.
+ *
+ * Everything on the interrupt endpoints goes through one queue served by this
+ * thread, with a quiet gap between commands; a DC201 read right after a write
+ * locks up the camera. Every PERIOD_MS the thread reads the thermistor and
+ * runs the PID, or in auto-tune mode switches the TEC between two levels
+ * around the setpoint and derives gains from the oscillation it causes.
+ *
+ * The error is (temperature - target) / 60 and the output the TEC power
+ * 0..1, so kp is per 60 degC, ki per 60 degC second and kd per 60 degC / s.
+ */
+class QHY9Cooler
+{
+public:
+	static const int PERIOD_MS = 250;	/* sample and control interval */
+	static const int GAP_MS    = 20;	/* between two DC201 commands */
+
+	static const int TUNE_SKIP   = 2;	/* oscillations to let settle */
+	static const int TUNE_CYCLES = 4;	/* oscillations to average */
+	static const int TUNE_TIMEOUT = 3600;	/* sec */
+
+	QHY9Cooler();
+	~QHY9Cooler();
+
+	/* source is the trace source of the camera */
+	bool start(QHY9Transport *transport, int source);
+	void stop();
+
+	/* every step also goes to telemetry, if set */
+	void setTelemetry(QHY9Telemetry *telemetry) { this->telemetry = telemetry; }
+
+	/* hold off DC201 traffic while the transport reopens, waits for the command in progress */
+	void suspend();
+	void resume();
+
+	void setTarget(double degrees);
+	void setLimit(double power);
+	void setGains(double kp, double ki, double kd);
+
+	/* the camera may drop the TEC while it reads out, do not wind up meanwhile */
+	void setDownloading(bool downloading);
+
+	bool startAutotune();
+	void abortAutotune();
+
+	/* queue a command for the interrupt endpoint, the abort for instance */
+	void send(const uint8_t *data, int length);
+
+	void getStatus(QHY9CoolerStatus *status);
+
+private:
+	struct Command {
+		uint8_t data[8];
+		int length;
+	};
+
+	QHY9Transport *transport;
+	QHY9Telemetry *telemetry;
+	int source;
+
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	bool running;
+	bool quit;
+	bool suspended;
+	bool busy;			/* thread is talking to the camera */
+
+	std::deque<Command> queue;
+	struct timespec lastCommand;
+
+	/* settings, guarded by lock */
+	double target;
+	double limit;
+	double kp, ki, kd;
+	bool downloading;
+	struct timespec downloadEnd;
+
+	/* controller, thread only except for the copies in status */
+	double integral;
+	double lastError;
+	double deriv;
+	double power;
+
+	/* auto-tune */
+	int mode;
+	int tune;
+	bool relayHigh;
+	double bias, step;
+	double tmin, tmax;
+	int cycles;
+	double sumPeriod, sumAmplitude;
+	struct timespec tuneStart;
+	struct timespec lastRise;
+	bool haveRise;
+
+	bool valid;
+	double temperature;
+
+	static void *threadEntry(void *arg);
+	void loop();
+
+	int execute(uint8_t *data, int length, bool read);
+	void drainQueue();
+
+	bool readTemperature(double *degrees);
+	void writePower(double power);
+
+	void regulate(double error, double dt);
+	void relay(double error, const struct timespec *now);
+	void finishAutotune();
+};
+
+#endif
@@ -0,0 +1,57 @@
+#ifndef __QHY9_DC201_H
+#define __QHY9_DC201_H
+
+#include <math.h>
+
+/*
+ * DC201 thermistor conversions. The DC201 reports the sensor thermistor
+ * voltage in mV; these map it to degC and back.
+ */
+
+static inline double dc201_mv_to_degrees(double mv)
+{
+	double V = 1.024 * mv;
+	double R, T, LNR;
+
+	R = 33 / (V/1000 + 1.625) - 10;
+	if (R < 1)   R = 1;
+	if (R > 400) R = 400;
+
+	LNR = log(R);
+
+	T= 1 / ( 0.002679+0.000291*LNR + LNR*LNR*LNR*4.28e-7  );
+
+        T -= 273.15;
+
+	return T;
+}
+
+static inline double dc201_degrees_to_mv(double degrees)
+{
+	double V, R, T;
+	double x, y;
+	double A=0.002679;
+	double B=0.000291;
+	double C=4.28e-7;
+
+#define SQR3(x) ((x)*(x)*(x))
+#define SQRT3(x) (exp(log(x)/3))
+
+	if (degrees < -50) degrees = -50;
+	if (degrees > 50)  degrees = 50;
+
+	T = 273.15 + degrees;
+
+	y = (A - 1/T) / C;
+	x = sqrt( SQR3(B/(3*C)) + (y*y)/4 );
+	R = exp(SQRT3(x-y/2) - SQRT3(x+y/2));
+
+	V = 33000/(R+10) - 1625;
+
+#undef SQR3
+#undef SQRT3
+
+	return V / 1.024;
+}
+
+#endif
@@ -0,0 +1,253 @@
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "qhy9_fits.h"
+#include "qhy9_kernels.h"
+#include "qhy9_trace.h"
+
+#define FITS_VALUE   20		/* value field, columns 11 to 30 */
+#define FITS_STRING  68		/* longest string value that fits a card */
+#define FITS_CHUNK   (1 << 20)	/* pixels per kernel call */
+
+
+QHY9FitsHeader::QHY9FitsHeader()
+{
+	cards.reserve(4 * QHY9_FITS_BLOCK);
+}
+
+void QHY9FitsHeader::image(int width, int height)
+{
+	cards.clear();
+
+	/* what fits_create_img writes for USHORT_IMG */
+	addLogical("SIMPLE", true, "file does conform to FITS standard");
+	addInt("BITPIX", 16, "number of bits per data pixel");
+	addInt("NAXIS", 2, "number of data axes");
+	addInt("NAXIS1", width, "length of data axis 1");
+	addInt("NAXIS2", height, "length of data axis 2");
+	addLogical("EXTEND", true, "FITS dataset may contain extensions");
+	addComment("FITS (Flexible Image Transport System) format is defined in 'Astronomy");
+	addComment("and Astrophysics', volume 376, page 359; bibcode: 2001A&A...376..359H");
+	addInt("BZERO", 32768, "offset data range to that of unsigned short");
+	addInt("BSCALE", 1, "default scaling factor");
+}
+
+/* one card: key, value field and comment, cut or blank padded to 80 columns */
+void QHY9FitsHeader::add(const char *key, const char *value, const char *comment)
+{
+	char card[QHY9_FITS_CARD + 1];
+	int n;
+
+	n = snprintf(card, sizeof(card), "%-8.8s= %-*s", key, FITS_VALUE, value);
+	if (comment && *comment && n < QHY9_FITS_CARD)
+		n += snprintf(card + n, sizeof(card) - n, " / %s", comment);
+	if (n > QHY9_FITS_CARD)
+		n = QHY9_FITS_CARD;
+
+	cards.append(card, n);
+	cards.append(QHY9_FITS_CARD - n, ' ');
+}
+
+void QHY9FitsHeader::addString(const char *key, const char *value, const char *comment)
+{
+	std::string s = "'";
+	int len = 0;
+
+	/* quotes double, short strings pad to 8 characters */
+	for (; value && *value && len < FITS_STRING; value++, len++) {
+		if (*value == '\'') {
+			if (len + 2 > FITS_STRING)
+				break;
+			s += '\'';
+			len++;
+		}
+		s += *value;
+	}
+	for (; len < 8; len++)
+		s += ' ';
+	s += '\'';
+
+	add(key, s.c_str(), comment);
+}
+
+void QHY9FitsHeader::addInt(const char *key, long long value, const char *comment)
+{
+	char buf[32];
+
+	snprintf(buf, sizeof(buf), "%*lld", FITS_VALUE, value);
+	add(key, buf, comment);
+}
+
+/* %G with a decimal point, as cfitsio writes reals */
+void QHY9FitsHeader::addNumber(const char *key, double value, int digits, const char *comment)
+{
+	char num[32], buf[32];
+	char *e;
+
+	if (!isfinite(value))
+		return;
+
+	snprintf(num, sizeof(num) - 1, "%.*G", digits, value);
+	if (!strchr(num, '.')) {
+		e = strchr(num, 'E');
+		if (e) {
+			memmove(e + 1, e, strlen(e) + 1);
+			*e = '.';
+		} else {
+			strcat(num, ".");
+		}
+	}
+
+	snprintf(buf, sizeof(buf), "%*s", FITS_VALUE, num);
+	add(key, buf, comment);
+}
+
+void QHY9FitsHeader::addFloat(const char *key, float value, const char *comment)
+{
+	addNumber(key, value, 7, comment);
+}
+
+void QHY9FitsHeader::addDouble(const char *key, double value, const char *comment)
+{
+	addNumber(key, value, 15, comment);
+}
+
+void QHY9FitsHeader::addLogical(const char *key, bool value, const char *comment)
+{
+	char buf[32];
+
+	snprintf(buf, sizeof(buf), "%*s", FITS_VALUE, value ? "T" : "F");
+	add(key, buf, comment);
+}
+
+void QHY9FitsHeader::addComment(const char *text)
+{
+	char card[QHY9_FITS_CARD + 1];
+	int n;
+
+	n = snprintf(card, sizeof(card), "COMMENT   %s", text);
+	if (n > QHY9_FITS_CARD)
+		n = QHY9_FITS_CARD;
+
+	cards.append(card, n);
+	cards.append(QHY9_FITS_CARD - n, ' ');
+}
+
+std::string QHY9FitsHeader::finish()
+{
+	std::string header = cards;
+
+	header += "END";
+	header.append(QHY9_FITS_CARD - 3, ' ');
+	header.append((QHY9_FITS_BLOCK - header.size() % QHY9_FITS_BLOCK) % QHY9_FITS_BLOCK, ' ');
+
+	return header;
+}
+
+
+size_t qhy9_fits_size(size_t hsize, size_t npix)
+{
+	size_t size = hsize + npix * 2;
+
+	return (size + QHY9_FITS_BLOCK - 1) / QHY9_FITS_BLOCK * QHY9_FITS_BLOCK;
+}
+
+void qhy9_fits_pack(uint8_t *dst, const std::string &header, const uint16_t *src, size_t npix)
+{
+	uint16_t *pix = (uint16_t *) (dst + header.size());
+	size_t i, n, end;
+
+	memcpy(dst, header.data(), header.size());
+
+	for (i = 0; i < npix; i += n) {
+		n = npix - i < FITS_CHUNK ? npix - i : FITS_CHUNK;
+		qhy9_fits_row(pix + i, src + i, (int) n);
+	}
+
+	/* the data unit pads with zeros */
+	end = header.size() + npix * 2;
+	memset(dst + end, 0, qhy9_fits_size(header.size(), npix) - end);
+}
+
+
+QHY9FitsFile::QHY9FitsFile()
+{
+	fd = -1;
+	map = NULL;
+	size = 0;
+}
+
+QHY9FitsFile::~QHY9FitsFile()
+{
+	close();
+}
+
+bool QHY9FitsFile::create(const char *path, size_t size)
+{
+	void *p;
+	int err;
+
+	close();
+
+	fd = ::open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return false;
+
+	/* real blocks behind every page, a full disk fails here */
+	err = posix_fallocate(fd, 0, size);
+	if (err == EOPNOTSUPP || err == EINVAL)
+		err = ftruncate(fd, size) ? errno : 0;
+	if (err) {
+		::close(fd);
+		fd = -1;
+		unlink(path);
+		errno = err;
+		return false;
+	}
+
+	/* populated up front, the pack pass does not fault page by page */
+	p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, 0);
+	if (p == MAP_FAILED) {
+		err = errno;
+		::close(fd);
+		fd = -1;
+		unlink(path);
+		errno = err;
+		return false;
+	}
+
+	map = (uint8_t *) p;
+	this->size = size;
+
+	qhy9_trace_text("fits: %s mapped, %zu bytes", path, size);
+
+	return true;
+}
+
+bool QHY9FitsFile::close()
+{
+	int err = 0;
+
+	/* write-back errors only show here, munmap does not report them */
+	if (map && msync(map, size, MS_SYNC))
+		err = errno;
+	if (map && munmap(map, size) && !err)
+		err = errno;
+	map = NULL;
+
+	if (fd >= 0 && ::close(fd) && !err)
+		err = errno;
+	fd = -1;
+	size = 0;
+
+	/* the first failure, for the caller's message */
+	if (err)
+		errno = err;
+
+	return !err;
+}
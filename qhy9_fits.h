@@ -0,0 +1,79 @@
+#ifndef __QHY9_FITS_H
+#define __QHY9_FITS_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <string>
+
+#define QHY9_FITS_BLOCK 2880
+#define QHY9_FITS_CARD  80
+
+/*
+ * Primary header of a 16 bit image, built card by card in fixed format the
+ * way cfitsio writes it: strings from column 11, other values right aligned
+ * to column 30, then the comment. Keys are at most 8 characters; a value
+ * that cannot be written (NaN, infinity) leaves its key out.
+ */
+class QHY9FitsHeader
+{
+public:
+	QHY9FitsHeader();
+
+	/* start over with the mandatory keys of a width x height USHORT_IMG */
+	void image(int width, int height);
+
+	void addString(const char *key, const char *value, const char *comment);
+	void addInt(const char *key, long long value, const char *comment);
+	void addFloat(const char *key, float value, const char *comment);
+	void addDouble(const char *key, double value, const char *comment);
+	void addLogical(const char *key, bool value, const char *comment);
+	void addComment(const char *text);
+
+	/* the cards so far, each QHY9_FITS_CARD bytes, without END */
+	int count() { return cards.size() / QHY9_FITS_CARD; }
+	std::string card(int i) { return cards.substr(i * QHY9_FITS_CARD, QHY9_FITS_CARD); }
+
+	/* the whole header: the cards, END and blank padding to a full block */
+	std::string finish();
+
+private:
+	std::string cards;
+
+	void add(const char *key, const char *value, const char *comment);
+	void addNumber(const char *key, double value, int digits, const char *comment);
+};
+
+/* bytes of the file for a header of hsize bytes and npix pixels, whole blocks */
+size_t qhy9_fits_size(size_t hsize, size_t npix);
+
+/*
+ * The file into dst, qhy9_fits_size bytes: the header, the pixels big endian
+ * with BZERO 32768 in a single pass of the pixel kernels, and the padding.
+ */
+void qhy9_fits_pack(uint8_t *dst, const std::string &header, const uint16_t *src, size_t npix);
+
+/*
+ * A file of a known size, written through a shared mapping: no write calls,
+ * no copy of the frame on the way. The space is allocated up front, so a
+ * full disk fails create instead of faulting on a store.
+ */
+class QHY9FitsFile
+{
+public:
+	QHY9FitsFile();
+	~QHY9FitsFile();
+
+	bool create(const char *path, size_t size);
+	uint8_t *data() { return map; }
+
+	/* flush to disk, unmap and close; false if the file could not be written out */
+	bool close();
+
+private:
+	int fd;
+	uint8_t *map;
+	size_t size;
+};
+
+#endif
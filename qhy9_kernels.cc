@@ -0,0 +1,831 @@
+#include <string.h>
+
+#include <vector>
+
+#include "qhy9_kernels.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define QHY9_KERNELS_X86 1
+#include <immintrin.h>
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define QHY9_KERNELS_NEON 1
+#include <arm_neon.h>
+#endif
+
+
+struct qhy9_kernels {
+	const char *name;
+
+	/* dst[i] = bswap16(src[i]) */
+	void (*swap_row)(uint16_t *dst, const uint16_t *src, int n);
+
+	/* acc[i] += src[i] */
+	void (*accumulate_row)(uint32_t *acc, const uint16_t *src, int n);
+
+	/* dst[i] = bswap16(src[i] ^ 0x8000) */
+	void (*fits_row)(uint16_t *dst, const uint16_t *src, int n);
+
+	/* dst[i] = (min(sat(src[i] - black), range) << shift) * scale >> 16 */
+	void (*level_row)(uint16_t *dst, const uint16_t *src, int n,
+			  uint16_t black, uint16_t range, int shift, uint16_t scale);
+
+	/* dst[i] = clip((src[i] - a * bias[i] - k * dark[i]) * flat[i] + pedestal) */
+	void (*calibrate_row)(uint16_t *dst, const uint16_t *src, int n, const float *bias, float a,
+			      const float *dark, float k, const float *flat, float pedestal);
+
+	/* *min = min(*min, src[i]), *max = max(*max, src[i]); returns the sum of src[i] */
+	uint64_t (*stats_row)(const uint16_t *src, int n, uint16_t *min, uint16_t *max);
+};
+
+
+/* Plain C */
+
+static void swap_row_scalar(uint16_t *dst, const uint16_t *src, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		dst[i] = (uint16_t) ((src[i] << 8) | (src[i] >> 8));
+}
+
+static void accumulate_row_scalar(uint32_t *acc, const uint16_t *src, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		acc[i] += src[i];
+}
+
+static void fits_row_scalar(uint16_t *dst, const uint16_t *src, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		uint16_t v = src[i] ^ 0x8000;
+		dst[i] = (uint16_t) ((v << 8) | (v >> 8));
+	}
+}
+
+static void level_row_scalar(uint16_t *dst, const uint16_t *src, int n,
+			     uint16_t black, uint16_t range, int shift, uint16_t scale)
+{
+	uint32_t v;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		v = (src[i] > black) ? src[i] - black : 0;
+		if (v > range)
+			v = range;
+		dst[i] = (uint16_t) (((v << shift) * scale) >> 16);
+	}
+}
+
+static void calibrate_row_scalar(uint16_t *dst, const uint16_t *src, int n, const float *bias, float a,
+				 const float *dark, float k, const float *flat, float pedestal)
+{
+	float v;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		v = (src[i] - a * bias[i] - k * dark[i]) * flat[i] + pedestal;
+		if (v < 0.0f) v = 0.0f;
+		if (v > 65535.0f) v = 65535.0f;
+		dst[i] = (uint16_t) (v + 0.5f);
+	}
+}
+
+static uint64_t stats_row_scalar(const uint16_t *src, int n, uint16_t *min, uint16_t *max)
+{
+	uint64_t sum = 0;
+	uint16_t lo = *min, hi = *max;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		if (src[i] < lo)
+			lo = src[i];
+		if (src[i] > hi)
+			hi = src[i];
+		sum += src[i];
+	}
+
+	*min = lo;
+	*max = hi;
+
+	return sum;
+}
+
+
+#ifdef QHY9_KERNELS_X86
+
+/* SSE2 */
+
+__attribute__((target("sse2")))
+static void swap_row_sse2(uint16_t *dst, const uint16_t *src, int n)
+{
+	int i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		__m128i v = _mm_loadu_si128((const __m128i *) (src + i));
+		v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+		_mm_storeu_si128((__m128i *) (dst + i), v);
+	}
+
+	swap_row_scalar(dst + i, src + i, n - i);
+}
+
+__attribute__((target("sse2")))
+static void accumulate_row_sse2(uint32_t *acc, const uint16_t *src, int n)
+{
+	const __m128i zero = _mm_setzero_si128();
+	int i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		__m128i v  = _mm_loadu_si128((const __m128i *) (src + i));
+		__m128i lo = _mm_loadu_si128((const __m128i *) (acc + i));
+		__m128i hi = _mm_loadu_si128((const __m128i *) (acc + i + 4));
+
+		lo = _mm_add_epi32(lo, _mm_unpacklo_epi16(v, zero));
+		hi = _mm_add_epi32(hi, _mm_unpackhi_epi16(v, zero));
+
+		_mm_storeu_si128((__m128i *) (acc + i), lo);
+		_mm_storeu_si128((__m128i *) (acc + i + 4), hi);
+	}
+
+	accumulate_row_scalar(acc + i, src + i, n - i);
+}
+
+__attribute__((target("sse2")))
+static void fits_row_sse2(uint16_t *dst, const uint16_t *src, int n)
+{
+	const __m128i sign = _mm_set1_epi16((short) 0x8000);
+	int i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		__m128i v = _mm_xor_si128(_mm_loadu_si128((const __m128i *) (src + i)), sign);
+		v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+		_mm_storeu_si128((__m128i *) (dst + i), v);
+	}
+
+	fits_row_scalar(dst + i, src + i, n - i);
+}
+
+__attribute__((target("sse2")))
+static void level_row_sse2(uint16_t *dst, const uint16_t *src, int n,
+			   uint16_t black, uint16_t range, int shift, uint16_t scale)
+{
+	const __m128i b = _mm_set1_epi16((short) black);
+	const __m128i r = _mm_set1_epi16((short) range);
+	const __m128i s = _mm_set1_epi16((short) scale);
+	const __m128i sh = _mm_cvtsi32_si128(shift);
+	int i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		__m128i v = _mm_subs_epu16(_mm_loadu_si128((const __m128i *) (src + i)), b);
+		v = _mm_sub_epi16(v, _mm_subs_epu16(v, r));		/* no unsigned min in SSE2 */
+		v = _mm_mulhi_epu16(_mm_sll_epi16(v, sh), s);
+		_mm_storeu_si128((__m128i *) (dst + i), v);
+	}
+
+	level_row_scalar(dst + i, src + i, n - i, black, range, shift, scale);
+}
+
+__attribute__((target("sse2")))
+static void calibrate_row_sse2(uint16_t *dst, const uint16_t *src, int n, const float *bias, float a,
+			       const float *dark, float k, const float *flat, float pedestal)
+{
+	const __m128 va = _mm_set1_ps(a), vk = _mm_set1_ps(k), vp = _mm_set1_ps(pedestal + 0.5f);
+	const __m128 lo = _mm_setzero_ps(), hi = _mm_set1_ps(65535.0f);
+	const __m128i zero = _mm_setzero_si128(), bias16 = _mm_set1_epi32(32768), sign = _mm_set1_epi16((short) 0x8000);
+	int i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		__m128i v = _mm_loadu_si128((const __m128i *) (src + i));
+		__m128 f[2];
+		__m128i r[2];
+		int j;
+
+		f[0] = _mm_cvtepi32_ps(_mm_unpacklo_epi16(v, zero));
+		f[1] = _mm_cvtepi32_ps(_mm_unpackhi_epi16(v, zero));
+
+		for (j = 0; j < 2; j++) {
+			__m128 x = _mm_sub_ps(f[j], _mm_mul_ps(va, _mm_loadu_ps(bias + i + 4 * j)));
+			x = _mm_sub_ps(x, _mm_mul_ps(vk, _mm_loadu_ps(dark + i + 4 * j)));
+			x = _mm_add_ps(_mm_mul_ps(x, _mm_loadu_ps(flat + i + 4 * j)), vp);
+			x = _mm_min_ps(_mm_max_ps(x, lo), _mm_add_ps(hi, _mm_set1_ps(0.5f)));
+
+			/* no unsigned pack in SSE2, go through signed */
+			r[j] = _mm_sub_epi32(_mm_cvttps_epi32(x), bias16);
+		}
+
+		_mm_storeu_si128((__m128i *) (dst + i), _mm_xor_si128(_mm_packs_epi32(r[0], r[1]), sign));
+	}
+
+	calibrate_row_scalar(dst + i, src + i, n - i, bias + i, a, dark + i, k, flat + i, pedestal);
+}
+
+/* no unsigned 16 bit min / max before SSE4.1, compare with the sign bit flipped */
+__attribute__((target("sse2")))
+static uint64_t stats_row_sse2(const uint16_t *src, int n, uint16_t *min, uint16_t *max)
+{
+	const __m128i sign = _mm_set1_epi16((short) 0x8000);
+	const __m128i low = _mm_set1_epi16(0x00ff);
+	const __m128i zero = _mm_setzero_si128();
+	__m128i lo = _mm_set1_epi16((short) 0x7fff), hi = sign;
+	__m128i sum = zero;
+	uint64_t total;
+	uint16_t vmin, vmax;
+	int i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		__m128i v = _mm_loadu_si128((const __m128i *) (src + i));
+		__m128i s = _mm_xor_si128(v, sign);
+
+		lo = _mm_min_epi16(lo, s);
+		hi = _mm_max_epi16(hi, s);
+
+		/* low and high bytes summed separately into 64 bit lanes */
+		sum = _mm_add_epi64(sum, _mm_sad_epu8(_mm_and_si128(v, low), zero));
+		sum = _mm_add_epi64(sum, _mm_slli_epi64(_mm_sad_epu8(_mm_srli_epi16(v, 8), zero), 8));
+	}
+
+	lo = _mm_min_epi16(lo, _mm_shuffle_epi32(lo, _MM_SHUFFLE(1, 0, 3, 2)));
+	lo = _mm_min_epi16(lo, _mm_shuffle_epi32(lo, _MM_SHUFFLE(2, 3, 0, 1)));
+	lo = _mm_min_epi16(lo, _mm_shufflelo_epi16(lo, _MM_SHUFFLE(2, 3, 0, 1)));
+	hi = _mm_max_epi16(hi, _mm_shuffle_epi32(hi, _MM_SHUFFLE(1, 0, 3, 2)));
+	hi = _mm_max_epi16(hi, _mm_shuffle_epi32(hi, _MM_SHUFFLE(2, 3, 0, 1)));
+	hi = _mm_max_epi16(hi, _mm_shufflelo_epi16(hi, _MM_SHUFFLE(2, 3, 0, 1)));
+
+	vmin = (uint16_t) (_mm_cvtsi128_si32(lo) ^ 0x8000);
+	vmax = (uint16_t) (_mm_cvtsi128_si32(hi) ^ 0x8000);
+	if (i && vmin < *min)
+		*min = vmin;
+	if (i && vmax > *max)
+		*max = vmax;
+
+	sum = _mm_add_epi64(sum, _mm_unpackhi_epi64(sum, sum));
+	_mm_storel_epi64((__m128i *) &total, sum);
+
+	return total + stats_row_scalar(src + i, n - i, min, max);
+}
+
+/* AVX2 */
+
+__attribute__((target("avx2")))
+static void swap_row_avx2(uint16_t *dst, const uint16_t *src, int n)
+{
+	int i;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		__m256i v = _mm256_loadu_si256((const __m256i *) (src + i));
+		v = _mm256_or_si256(_mm256_slli_epi16(v, 8), _mm256_srli_epi16(v, 8));
+		_mm256_storeu_si256((__m256i *) (dst + i), v);
+	}
+
+	swap_row_scalar(dst + i, src + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void accumulate_row_avx2(uint32_t *acc, const uint16_t *src, int n)
+{
+	int i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		__m128i v = _mm_loadu_si128((const __m128i *) (src + i));
+		__m256i a = _mm256_loadu_si256((const __m256i *) (acc + i));
+
+		a = _mm256_add_epi32(a, _mm256_cvtepu16_epi32(v));
+		_mm256_storeu_si256((__m256i *) (acc + i), a);
+	}
+
+	accumulate_row_scalar(acc + i, src + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void fits_row_avx2(uint16_t *dst, const uint16_t *src, int n)
+{
+	const __m256i sign = _mm256_set1_epi16((short) 0x8000);
+	int i;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		__m256i v = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *) (src + i)), sign);
+		v = _mm256_or_si256(_mm256_slli_epi16(v, 8), _mm256_srli_epi16(v, 8));
+		_mm256_storeu_si256((__m256i *) (dst + i), v);
+	}
+
+	fits_row_scalar(dst + i, src + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void level_row_avx2(uint16_t *dst, const uint16_t *src, int n,
+			   uint16_t black, uint16_t range, int shift, uint16_t scale)
+{
+	const __m256i b = _mm256_set1_epi16((short) black);
+	const __m256i r = _mm256_set1_epi16((short) range);
+	const __m256i s = _mm256_set1_epi16((short) scale);
+	const __m128i sh = _mm_cvtsi32_si128(shift);
+	int i;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		__m256i v = _mm256_subs_epu16(_mm256_loadu_si256((const __m256i *) (src + i)), b);
+		v = _mm256_min_epu16(v, r);
+		v = _mm256_mulhi_epu16(_mm256_sll_epi16(v, sh), s);
+		_mm256_storeu_si256((__m256i *) (dst + i), v);
+	}
+
+	level_row_scalar(dst + i, src + i, n - i, black, range, shift, scale);
+}
+
+__attribute__((target("avx2")))
+static void calibrate_row_avx2(uint16_t *dst, const uint16_t *src, int n, const float *bias, float a,
+			       const float *dark, float k, const float *flat, float pedestal)
+{
+	const __m256 va = _mm256_set1_ps(a), vk = _mm256_set1_ps(k), vp = _mm256_set1_ps(pedestal + 0.5f);
+	const __m256 lo = _mm256_setzero_ps(), hi = _mm256_set1_ps(65535.5f);
+	int i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		__m256 x = _mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *) (src + i))));
+		__m256i r;
+
+		x = _mm256_sub_ps(x, _mm256_mul_ps(va, _mm256_loadu_ps(bias + i)));
+		x = _mm256_sub_ps(x, _mm256_mul_ps(vk, _mm256_loadu_ps(dark + i)));
+		x = _mm256_add_ps(_mm256_mul_ps(x, _mm256_loadu_ps(flat + i)), vp);
+		x = _mm256_min_ps(_mm256_max_ps(x, lo), hi);
+
+		r = _mm256_cvttps_epi32(x);
+		_mm_storeu_si128((__m128i *) (dst + i),
+				 _mm_packus_epi32(_mm256_castsi256_si128(r), _mm256_extracti128_si256(r, 1)));
+	}
+
+	calibrate_row_scalar(dst + i, src + i, n - i, bias + i, a, dark + i, k, flat + i, pedestal);
+}
+
+__attribute__((target("avx2")))
+static uint64_t stats_row_avx2(const uint16_t *src, int n, uint16_t *min, uint16_t *max)
+{
+	const __m256i low = _mm256_set1_epi16(0x00ff);
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i lo = _mm256_set1_epi16((short) 0xffff), hi = zero;
+	__m256i sum = zero;
+	__m128i l, h, s;
+	uint64_t total;
+	uint16_t vmin, vmax;
+	int i;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		__m256i v = _mm256_loadu_si256((const __m256i *) (src + i));
+
+		lo = _mm256_min_epu16(lo, v);
+		hi = _mm256_max_epu16(hi, v);
+
+		sum = _mm256_add_epi64(sum, _mm256_sad_epu8(_mm256_and_si256(v, low), zero));
+		sum = _mm256_add_epi64(sum, _mm256_slli_epi64(_mm256_sad_epu8(_mm256_srli_epi16(v, 8), zero), 8));
+	}
+
+	/* the smallest lane lands in the low word */
+	l = _mm_minpos_epu16(_mm_min_epu16(_mm256_castsi256_si128(lo), _mm256_extracti128_si256(lo, 1)));
+	h = _mm_max_epu16(_mm256_castsi256_si128(hi), _mm256_extracti128_si256(hi, 1));
+	h = _mm_minpos_epu16(_mm_xor_si128(h, _mm_set1_epi16((short) 0xffff)));
+
+	vmin = (uint16_t) _mm_cvtsi128_si32(l);
+	vmax = (uint16_t) ~_mm_cvtsi128_si32(h);
+	if (i && vmin < *min)
+		*min = vmin;
+	if (i && vmax > *max)
+		*max = vmax;
+
+	s = _mm_add_epi64(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1));
+	s = _mm_add_epi64(s, _mm_unpackhi_epi64(s, s));
+	_mm_storel_epi64((__m128i *) &total, s);
+
+	return total + stats_row_scalar(src + i, n - i, min, max);
+}
+
+#endif /* QHY9_KERNELS_X86 */
+
+
+#ifdef QHY9_KERNELS_NEON
+
+static void swap_row_neon(uint16_t *dst, const uint16_t *src, int n)
+{
+	int i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		uint8x16_t v = vld1q_u8((const uint8_t *) (src + i));
+		vst1q_u8((uint8_t *) (dst + i), vrev16q_u8(v));
+	}
+
+	swap_row_scalar(dst + i, src + i, n - i);
+}
+
+static void accumulate_row_neon(uint32_t *acc, const uint16_t *src, int n)
+{
+	int i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		uint16x8_t v = vld1q_u16(src + i);
+
+		vst1q_u32(acc + i,     vaddw_u16(vld1q_u32(acc + i),     vget_low_u16(v)));
+		vst1q_u32(acc + i + 4, vaddw_u16(vld1q_u32(acc + i + 4), vget_high_u16(v)));
+	}
+
+	accumulate_row_scalar(acc + i, src + i, n - i);
+}
+
+static void fits_row_neon(uint16_t *dst, const uint16_t *src, int n)
+{
+	const uint16x8_t sign = vdupq_n_u16(0x8000);
+	int i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		uint16x8_t v = veorq_u16(vld1q_u16(src + i), sign);
+		vst1q_u8((uint8_t *) (dst + i), vrev16q_u8(vreinterpretq_u8_u16(v)));
+	}
+
+	fits_row_scalar(dst + i, src + i, n - i);
+}
+
+static void level_row_neon(uint16_t *dst, const uint16_t *src, int n,
+			   uint16_t black, uint16_t range, int shift, uint16_t scale)
+{
+	const uint16x8_t b = vdupq_n_u16(black);
+	const uint16x8_t r = vdupq_n_u16(range);
+	const uint16x4_t s = vdup_n_u16(scale);
+	const int16x8_t sh = vdupq_n_s16(shift);
+	int i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		uint16x8_t v = vminq_u16(vqsubq_u16(vld1q_u16(src + i), b), r);
+		v = vshlq_u16(v, sh);
+		vst1q_u16(dst + i, vcombine_u16(vshrn_n_u32(vmull_u16(vget_low_u16(v), s), 16),
+						 vshrn_n_u32(vmull_u16(vget_high_u16(v), s), 16)));
+	}
+
+	level_row_scalar(dst + i, src + i, n - i, black, range, shift, scale);
+}
+
+static void calibrate_row_neon(uint16_t *dst, const uint16_t *src, int n, const float *bias, float a,
+			       const float *dark, float k, const float *flat, float pedestal)
+{
+	const float32x4_t vp = vdupq_n_f32(pedestal + 0.5f);
+	const float32x4_t lo = vdupq_n_f32(0.0f), hi = vdupq_n_f32(65535.5f);
+	int i, j;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		uint16x8_t v = vld1q_u16(src + i);
+		uint32x4_t r[2];
+
+		r[0] = vmovl_u16(vget_low_u16(v));
+		r[1] = vmovl_u16(vget_high_u16(v));
+
+		for (j = 0; j < 2; j++) {
+			float32x4_t x = vcvtq_f32_u32(r[j]);
+
+			x = vmlsq_n_f32(x, vld1q_f32(bias + i + 4 * j), a);
+			x = vmlsq_n_f32(x, vld1q_f32(dark + i + 4 * j), k);
+			x = vmlaq_f32(vp, x, vld1q_f32(flat + i + 4 * j));
+			r[j] = vcvtq_u32_f32(vminq_f32(vmaxq_f32(x, lo), hi));
+		}
+
+		vst1q_u16(dst + i, vcombine_u16(vqmovn_u32(r[0]), vqmovn_u32(r[1])));
+	}
+
+	calibrate_row_scalar(dst + i, src + i, n - i, bias + i, a, dark + i, k, flat + i, pedestal);
+}
+
+static uint64_t stats_row_neon(const uint16_t *src, int n, uint16_t *min, uint16_t *max)
+{
+	uint16x8_t lo = vdupq_n_u16(0xffff), hi = vdupq_n_u16(0);
+	uint64x2_t sum = vdupq_n_u64(0);
+	uint16_t vmin, vmax;
+	int i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		uint16x8_t v = vld1q_u16(src + i);
+
+		lo = vminq_u16(lo, v);
+		hi = vmaxq_u16(hi, v);
+		sum = vpadalq_u32(sum, vpaddlq_u16(v));
+	}
+
+	/* pairwise, vminvq and friends are AArch64 only */
+	uint16x4_t l = vpmin_u16(vget_low_u16(lo), vget_high_u16(lo));
+	uint16x4_t h = vpmax_u16(vget_low_u16(hi), vget_high_u16(hi));
+	l = vpmin_u16(l, l);
+	h = vpmax_u16(h, h);
+	l = vpmin_u16(l, l);
+	h = vpmax_u16(h, h);
+
+	vmin = vget_lane_u16(l, 0);
+	vmax = vget_lane_u16(h, 0);
+	if (i && vmin < *min)
+		*min = vmin;
+	if (i && vmax > *max)
+		*max = vmax;
+
+	return vgetq_lane_u64(sum, 0) + vgetq_lane_u64(sum, 1) + stats_row_scalar(src + i, n - i, min, max);
+}
+
+#endif /* QHY9_KERNELS_NEON */
+
+
+static const struct qhy9_kernels kernels_scalar = {
+	"scalar", swap_row_scalar, accumulate_row_scalar, fits_row_scalar, level_row_scalar, calibrate_row_scalar,
+	stats_row_scalar
+};
+#ifdef QHY9_KERNELS_X86
+static const struct qhy9_kernels kernels_sse2 = {
+	"sse2", swap_row_sse2, accumulate_row_sse2, fits_row_sse2, level_row_sse2, calibrate_row_sse2,
+	stats_row_sse2
+};
+static const struct qhy9_kernels kernels_avx2 = {
+	"avx2", swap_row_avx2, accumulate_row_avx2, fits_row_avx2, level_row_avx2, calibrate_row_avx2,
+	stats_row_avx2
+};
+#endif
+#ifdef QHY9_KERNELS_NEON
+static const struct qhy9_kernels kernels_neon = {
+	"neon", swap_row_neon, accumulate_row_neon, fits_row_neon, level_row_neon, calibrate_row_neon,
+	stats_row_neon
+};
+#endif
+
+static const struct qhy9_kernels *select_kernels()
+{
+#ifdef QHY9_KERNELS_X86
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("avx2"))
+		return &kernels_avx2;
+	if (__builtin_cpu_supports("sse2"))
+		return &kernels_sse2;
+#endif
+#ifdef QHY9_KERNELS_NEON
+	return &kernels_neon;
+#endif
+	return &kernels_scalar;
+}
+
+static const struct qhy9_kernels *kernels()
+{
+	static const struct qhy9_kernels *k = select_kernels();
+
+	return k;
+}
+
+
+const char *qhy9_kernels_name()
+{
+	return kernels()->name;
+}
+
+void qhy9_copy_row(uint16_t *dst, const uint16_t *src, int n, int swap)
+{
+	if (swap)
+		kernels()->swap_row(dst, src, n);
+	else if (dst != src)
+		memcpy(dst, src, n * sizeof(uint16_t));
+}
+
+void qhy9_accumulate_row(uint32_t *acc, const uint16_t *src, int n)
+{
+	kernels()->accumulate_row(acc, src, n);
+}
+
+void qhy9_bin_row(uint16_t *dst, const uint16_t *src, int stride, int cols,
+		  int nx, int ny, int average, uint32_t *acc)
+{
+	const struct qhy9_kernels *k = kernels();
+	uint32_t sum, div = nx * ny;
+	int i, j;
+
+	memset(acc, 0, cols * nx * sizeof(uint32_t));
+
+	/* vertical sums, vectorized */
+	for (j = 0; j < ny; j++)
+		k->accumulate_row(acc, src + j * stride, cols * nx);
+
+	/* horizontal sums, nx is small */
+	for (i = 0; i < cols; i++) {
+		sum = 0;
+		for (j = 0; j < nx; j++)
+			sum += acc[i * nx + j];
+
+		if (average)
+			sum = (sum + div / 2) / div;
+
+		dst[i] = (sum > 65535) ? 65535 : (uint16_t) sum;
+	}
+}
+
+void qhy9_extract_frame(uint16_t *dst, uint16_t *src, int stride, int x, int w, int h,
+			int nx, int ny, int average, int swap)
+{
+	int iy, cols = w / nx;
+
+	if (nx == 1 && ny == 1) {
+		for (iy = 0; iy < h; iy++) {
+			qhy9_copy_row(dst, src + iy * stride + x, cols, swap);
+			dst += cols;
+		}
+		return;
+	}
+
+	std::vector<uint32_t> acc(cols * nx);
+
+	if (swap)
+		qhy9_copy_row(src, src, stride * (h - h % ny), 1);
+
+	for (iy = 0; iy + ny <= h; iy += ny) {
+		qhy9_bin_row(dst, src + iy * stride + x, stride, cols, nx, ny, average, &acc[0]);
+		dst += cols;
+	}
+}
+
+void qhy9_fits_row(uint16_t *dst, const uint16_t *src, int n)
+{
+	kernels()->fits_row(dst, src, n);
+}
+
+void qhy9_stretch_row(uint8_t *dst, const uint16_t *src, int n, uint16_t black, uint16_t white, const uint8_t *curve)
+{
+	const struct qhy9_kernels *k = kernels();
+	uint16_t level[512];
+	uint32_t range = (white > black) ? white - black : 1;
+	int shift = 0, i, len;
+	uint16_t scale;
+
+	/* range << shift in the top bit keeps the scale in 16 bits */
+	while ((range << (shift + 1)) < 65536)
+		shift++;
+	scale = (uint16_t) (((uint32_t) (QHY9_STRETCH_LEVELS - 1) << 16) / (range << shift));
+
+	for (; n > 0; n -= len, src += len, dst += len) {
+		len = (n < 512) ? n : 512;
+
+		k->level_row(level, src, len, black, range, shift, scale);
+		for (i = 0; i < len; i++)
+			dst[i] = curve[level[i]];
+	}
+}
+
+void qhy9_calibrate_row(uint16_t *dst, const uint16_t *src, int n, const float *bias, float a,
+			const float *dark, float k, const float *flat, float pedestal)
+{
+	kernels()->calibrate_row(dst, src, n, bias, a, dark, k, flat, pedestal);
+}
+
+uint64_t qhy9_stats_row(const uint16_t *src, int n, uint16_t *min, uint16_t *max)
+{
+	return kernels()->stats_row(src, n, min, max);
+}
+
+
+/* Self test */
+
+/* xorshift, the same rows on every run */
+static uint32_t test_random(uint32_t *state)
+{
+	uint32_t x = *state;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+
+	return *state = x;
+}
+
+static int test_report(FILE *fp, const struct qhy9_kernels *k, const char *kernel, int n, int at)
+{
+	if (fp)
+		fprintf(fp, "kernels: %s %s differs from scalar, length %d, first at %d\n", k->name, kernel, n, at);
+
+	return 1;
+}
+
+static int test_kernels(FILE *fp, const struct qhy9_kernels *k)
+{
+	static const int lengths[] = { 0, 1, 3, 7, 8, 9, 15, 16, 17, 31, 33, 63, 64, 65, 255, 1023, 4099 };
+	const struct qhy9_kernels *ref = &kernels_scalar;
+	uint32_t state = 0x9e3779b9;
+	int failures = 0;
+	size_t l;
+	int i, n, off;
+
+	for (l = 0; l < sizeof(lengths) / sizeof(lengths[0]); l++) {
+		n = lengths[l];
+
+		for (off = 0; off < 2; off++) {
+			std::vector<uint16_t> src(n + 1), a(n + 1), b(n + 1);
+			std::vector<uint32_t> acca(n + 1), accb(n + 1);
+			std::vector<float> bias(n + 1), dark(n + 1), flat(n + 1);
+			const uint16_t *s = &src[off];
+			uint16_t min1, max1, min2, max2, black, range, scale;
+			uint32_t r;
+			uint64_t sum1, sum2;
+			int shift;
+			float fa, fk, pedestal;
+
+			for (i = 0; i <= n; i++) {
+				src[i] = (uint16_t) test_random(&state);
+				acca[i] = accb[i] = test_random(&state) >> 2;
+				bias[i] = (test_random(&state) % 200000) / 100.0f;
+				dark[i] = (test_random(&state) % 400000) / 100.0f;
+				flat[i] = 0.5f + (test_random(&state) % 10000) / 10000.0f;
+			}
+
+			ref->swap_row(&a[0], s, n);
+			k->swap_row(&b[0], s, n);
+			for (i = 0; i < n; i++)
+				if (a[i] != b[i]) {
+					failures += test_report(fp, k, "swap_row", n, i);
+					break;
+				}
+
+			ref->fits_row(&a[0], s, n);
+			k->fits_row(&b[0], s, n);
+			for (i = 0; i < n; i++)
+				if (a[i] != b[i]) {
+					failures += test_report(fp, k, "fits_row", n, i);
+					break;
+				}
+
+			ref->accumulate_row(&acca[0], s, n);
+			k->accumulate_row(&accb[0], s, n);
+			for (i = 0; i < n; i++)
+				if (acca[i] != accb[i]) {
+					failures += test_report(fp, k, "accumulate_row", n, i);
+					break;
+				}
+
+			/* the way qhy9_stretch_row sets it up */
+			black = (uint16_t) test_random(&state);
+			r = 1 + test_random(&state) % 65535;
+			range = (uint16_t) r;
+			for (shift = 0; (r << (shift + 1)) < 65536; shift++)
+				;
+			scale = (uint16_t) (((uint32_t) (QHY9_STRETCH_LEVELS - 1) << 16) / (r << shift));
+			ref->level_row(&a[0], s, n, black, range, shift, scale);
+			k->level_row(&b[0], s, n, black, range, shift, scale);
+			for (i = 0; i < n; i++)
+				if (a[i] != b[i]) {
+					failures += test_report(fp, k, "level_row", n, i);
+					break;
+				}
+
+			fa = (test_random(&state) % 1000) / 500.0f;
+			fk = (test_random(&state) % 1000) / 250.0f;
+			pedestal = (test_random(&state) % 2000) / 2.0f;
+			ref->calibrate_row(&a[0], s, n, &bias[off], fa, &dark[off], fk, &flat[off], pedestal);
+			k->calibrate_row(&b[0], s, n, &bias[off], fa, &dark[off], fk, &flat[off], pedestal);
+			for (i = 0; i < n; i++)
+				if (a[i] != b[i]) {
+					failures += test_report(fp, k, "calibrate_row", n, i);
+					break;
+				}
+
+			/* fresh extremes, then carried over from an earlier row */
+			min1 = min2 = 65535;
+			max1 = max2 = 0;
+			sum1 = ref->stats_row(s, n, &min1, &max1);
+			sum2 = k->stats_row(s, n, &min2, &max2);
+			if (sum1 != sum2 || min1 != min2 || max1 != max2)
+				failures += test_report(fp, k, "stats_row", n, -1);
+
+			min1 = min2 = 30000;
+			max1 = max2 = 35000;
+			sum1 = ref->stats_row(s, n, &min1, &max1);
+			sum2 = k->stats_row(s, n, &min2, &max2);
+			if (sum1 != sum2 || min1 != min2 || max1 != max2)
+				failures += test_report(fp, k, "stats_row", n, -1);
+		}
+	}
+
+	return failures;
+}
+
+int qhy9_kernels_selftest(FILE *fp)
+{
+	int failures = 0;
+
+#ifdef QHY9_KERNELS_X86
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("sse2"))
+		failures += test_kernels(fp, &kernels_sse2);
+	else if (fp)
+		fprintf(fp, "kernels: sse2 not supported here, skipped\n");
+
+	if (__builtin_cpu_supports("avx2"))
+		failures += test_kernels(fp, &kernels_avx2);
+	else if (fp)
+		fprintf(fp, "kernels: avx2 not supported here, skipped\n");
+#endif
+#ifdef QHY9_KERNELS_NEON
+	failures += test_kernels(fp, &kernels_neon);
+#endif
+
+	return failures;
+}
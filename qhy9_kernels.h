@@ -0,0 +1,71 @@
+#ifndef __QHY9_KERNELS_H
+#define __QHY9_KERNELS_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+/*
+ * Pixel kernels for the readout path.
+ *
+ * The implementation is picked once at runtime: AVX2 or SSE2 on x86, NEON on
+ * ARM, plain C everywhere else. All kernels work on 16 bit pixels.
+ */
+
+/* name of the selected implementation, "avx2", "sse2", "neon" or "scalar" */
+const char *qhy9_kernels_name();
+
+/*
+ * Run every implementation this CPU supports against plain C on random rows,
+ * odd lengths and unaligned starts included. Mismatches are reported to fp;
+ * returns their number, 0 if all agree.
+ */
+int qhy9_kernels_selftest(FILE *fp);
+
+/* copy n pixels, swapping the bytes of each one if swap is set; dst may equal src */
+void qhy9_copy_row(uint16_t *dst, const uint16_t *src, int n, int swap);
+
+/*
+ * Software binning of one output row: sums nx x ny blocks of src, ny rows of
+ * stride pixels starting at src, into cols output pixels. Sums saturate at
+ * 65535, or are divided by nx * ny if average is set. acc is scratch space
+ * for cols * nx values.
+ */
+void qhy9_bin_row(uint16_t *dst, const uint16_t *src, int stride, int cols,
+		  int nx, int ny, int average, uint32_t *acc);
+
+/* acc[i] += src[i], for averaging frames */
+void qhy9_accumulate_row(uint32_t *acc, const uint16_t *src, int n);
+
+/*
+ * Crop and bin a downloaded frame: w x h pixels at column x of src, stride
+ * pixels per line, binned nx x ny into dst. src is byte swapped in place
+ * when binning with swap set.
+ */
+void qhy9_extract_frame(uint16_t *dst, uint16_t *src, int stride, int x, int w, int h,
+			int nx, int ny, int average, int swap);
+
+/*
+ * Pixels as FITS stores them with BITPIX 16 and BZERO 32768: the sign bit
+ * flipped and big endian. dst may equal src.
+ */
+void qhy9_fits_row(uint16_t *dst, const uint16_t *src, int n);
+
+#define QHY9_STRETCH_LEVELS 4096
+
+/*
+ * 8 bit display pixels: src clipped to black .. white, spread linearly over
+ * QHY9_STRETCH_LEVELS levels and mapped through curve, one byte per level.
+ */
+void qhy9_stretch_row(uint8_t *dst, const uint16_t *src, int n, uint16_t black, uint16_t white, const uint8_t *curve);
+
+/*
+ * Calibration: (src - a * bias - k * dark) * flat + pedestal, rounded and
+ * clipped to 0..65535. dst may equal src.
+ */
+void qhy9_calibrate_row(uint16_t *dst, const uint16_t *src, int n, const float *bias, float a,
+			const float *dark, float k, const float *flat, float pedestal);
+
+/* sum of n pixels; *min and *max are lowered / raised to the extremes seen */
+uint64_t qhy9_stats_row(const uint16_t *src, int n, uint16_t *min, uint16_t *max);
+
+#endif
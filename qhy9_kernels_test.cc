@@ -0,0 +1,17 @@
+/*
+ * Pixel kernel self test: every SIMD implementation the CPU supports must
+ * give the same results as plain C. Exit status 0 if they all do.
+ */
+
+#include <stdio.h>
+
+#include "qhy9_kernels.h"
+
+int main()
+{
+	int failures = qhy9_kernels_selftest(stderr);
+
+	fprintf(stderr, "kernels: %s selected, %d mismatches\n", qhy9_kernels_name(), failures);
+
+	return failures ? 1 : 0;
+}
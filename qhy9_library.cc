@@ -0,0 +1,183 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <string>
+
+#include <fitsio.h>
+
+#include "qhy9_library.h"
+#include "qhy9_kernels.h"
+#include "qhy9_trace.h"
+
+
+/* comma separated numbers; empty gives none */
+static bool parse_list(const char *list, std::vector<double> &values)
+{
+	const char *p = list;
+	char *end;
+	double v;
+
+	values.clear();
+
+	while (p && *p) {
+		while (*p == ' ' || *p == ',')
+			p++;
+		if (!*p)
+			break;
+
+		v = strtod(p, &end);
+		if (end == p || v < 0)
+			return false;
+
+		values.push_back(v);
+		p = end;
+	}
+
+	return true;
+}
+
+bool qhy9_dark_plan(const char *exposures, const char *bins, const char *gains, int defgain,
+		    std::vector<QHY9DarkJob> &jobs)
+{
+	std::vector<double> e, b, g;
+	QHY9DarkJob job;
+	size_t i, j, k;
+
+	jobs.clear();
+
+	if (!parse_list(exposures, e) || !parse_list(bins, b) || !parse_list(gains, g))
+		return false;
+
+	if (b.empty())
+		b.push_back(1);
+	if (g.empty())
+		g.push_back(defgain);
+
+	for (k = 0; k < g.size(); k++) {
+		for (j = 0; j < b.size(); j++) {
+			for (i = 0; i < e.size(); i++) {
+				job.exposure = e[i];
+				job.bin = (int) b[j];
+				job.gain = (int) g[k];
+
+				if (job.bin < 1 || job.gain > 255)
+					return false;
+
+				jobs.push_back(job);
+			}
+		}
+	}
+
+	return true;
+}
+
+
+QHY9Accumulator::QHY9Accumulator()
+{
+	w = h = n = 0;
+	tsum = 0;
+}
+
+void QHY9Accumulator::start(int w, int h)
+{
+	this->w = w;
+	this->h = h;
+
+	sum.assign((size_t) w * h, 0);
+	n = 0;
+	tsum = 0;
+}
+
+void QHY9Accumulator::reset()
+{
+	std::vector<uint32_t>().swap(sum);
+	w = h = n = 0;
+	tsum = 0;
+}
+
+void QHY9Accumulator::add(const uint16_t *data, double temperature)
+{
+	size_t row;
+	int y;
+
+	for (y = 0; y < h; y++) {
+		row = (size_t) y * w;
+		qhy9_accumulate_row(&sum[row], data + row, w);
+	}
+
+	tsum += temperature;
+	n++;
+}
+
+bool QHY9Accumulator::write(const char *path, const QHY9MasterInfo *info)
+{
+	std::string tmp = std::string("!") + path + ".tmp";
+	std::vector<float> row(w);
+	char imagetyp[32], date[32];
+	long naxes[2] = { w, h };
+	fitsfile *fptr;
+	double temp, exposure = info->exposure, setpoint = info->setpoint;
+	time_t now = time(NULL);
+	struct tm *tm;
+	int x, y, zero = 0, status = 0;
+
+	if (!n)
+		return false;
+
+	temp = tsum / n;
+
+	strcpy(imagetyp, info->exposure > 0 ? "Master Dark" : "Master Bias");
+	tm = gmtime(&now);
+	strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", tm);
+
+	fits_create_file(&fptr, tmp.c_str(), &status);
+	if (status) {
+		fits_report_error(stderr, status);
+		return false;
+	}
+
+	fits_create_img(fptr, FLOAT_IMG, 2, naxes, &status);
+
+	fits_write_key(fptr, TSTRING, "IMAGETYP", imagetyp, "Type of image", &status);
+	fits_write_key(fptr, TDOUBLE, "EXPTIME", &exposure, "Exposure time in seconds", &status);
+	fits_write_key(fptr, TINT, "XBINNING", (void *) &info->bin, "Binning factor in width", &status);
+	fits_write_key(fptr, TINT, "YBINNING", (void *) &info->bin, "Binning factor in height", &status);
+	fits_write_key(fptr, TINT, "XORGSUBF", &zero, "Subframe X position in binned pixels", &status);
+	fits_write_key(fptr, TINT, "YORGSUBF", &zero, "Subframe Y position in binned pixels", &status);
+	fits_write_key(fptr, TINT, "QHYGAIN", (void *) &info->gain, "CCD Gain, 0..255", &status);
+	fits_write_key(fptr, TINT, "QHYBIAS", (void *) &info->offset, "CCD Offset", &status);
+	fits_write_key(fptr, TDOUBLE, "CCDTEMP", &temp, "CCD temperature, mean over the frames, degC", &status);
+	fits_write_key(fptr, TDOUBLE, "SET-TEMP", &setpoint, "CCD set temperature, degC", &status);
+	fits_write_key(fptr, TINT, "NCOMBINE", &n, "Frames averaged", &status);
+	fits_write_key(fptr, TSTRING, "DATE", date, "Master created, UTC", &status);
+
+	for (y = 0; y < h && !status; y++) {
+		const uint32_t *s = &sum[(size_t) y * w];
+
+		for (x = 0; x < w; x++)
+			row[x] = (float) s[x] / n;
+
+		fits_write_img(fptr, TFLOAT, (long long) y * w + 1, w, &row[0], &status);
+	}
+
+	fits_close_file(fptr, &status);
+
+	if (status) {
+		fits_report_error(stderr, status);
+		unlink(tmp.c_str() + 1);
+		return false;
+	}
+
+	if (rename(tmp.c_str() + 1, path)) {
+		perror(path);
+		unlink(tmp.c_str() + 1);
+		return false;
+	}
+
+	qhy9_trace_text("library: %s, %d frames of %dx%d, %.2f C", path, n, w, h, temp);
+
+	return true;
+}
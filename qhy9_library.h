@@ -0,0 +1,61 @@
+#ifndef __QHY9_LIBRARY_H
+#define __QHY9_LIBRARY_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <vector>
+
+/* one master of the dark library plan */
+struct QHY9DarkJob {
+	double exposure;		/* sec, 0 for a bias */
+	int bin;
+	int gain;
+};
+
+/* what a finished master was taken with, for its header */
+struct QHY9MasterInfo {
+	double exposure;		/* sec, 0 for a bias */
+	int bin;
+	int gain, offset;
+	double setpoint;		/* cooler target, degC */
+};
+
+/*
+ * Jobs for every exposure x bin x gain, from comma separated lists such as
+ * "0, 1, 10, 60"; an empty gain list means defgain. False if a list does not
+ * parse.
+ */
+bool qhy9_dark_plan(const char *exposures, const char *bins, const char *gains, int defgain,
+		    std::vector<QHY9DarkJob> &jobs);
+
+/*
+ * Running average of 16 bit frames: one 32 bit sum per pixel, so the frames
+ * themselves need not be kept, and the mean written as a float FITS master
+ * that QHY9Calibration picks up.
+ */
+class QHY9Accumulator
+{
+public:
+	QHY9Accumulator();
+
+	void start(int w, int h);
+	void reset();
+
+	void add(const uint16_t *data, double temperature);
+
+	int count() { return n; }
+	int width() { return w; }
+	int height() { return h; }
+
+	/* written to a temporary name and renamed into place */
+	bool write(const char *path, const QHY9MasterInfo *info);
+
+private:
+	std::vector<uint32_t> sum;
+	int w, h;
+	int n;
+	double tsum;			/* sensor temperature */
+};
+
+#endif
@@ -0,0 +1,108 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "qhy9_preview.h"
+#include "qhy9_kernels.h"
+
+#define PREVIEW_BACKGROUND 0.25		/* where the median ends up, of full scale */
+#define PREVIEW_SHADOWS    2.8		/* black, in noise sigmas under the median */
+#define PREVIEW_HIGHLIGHTS 0.999	/* white, fraction of pixels below it */
+
+
+/* midtones transfer: 0, m and 1 go to 0, 0.5 and 1 */
+static double mtf(double x, double m)
+{
+	if (x <= 0)
+		return 0;
+	if (x >= 1)
+		return 1;
+
+	return (m - 1) * x / ((2 * m - 1) * x - m);
+}
+
+/* value below which a fraction of the n pixels in hist lie */
+static int percentile(const std::vector<uint32_t> &hist, size_t n, double fraction)
+{
+	size_t sum = 0, want = (size_t) (n * fraction);
+	int i;
+
+	for (i = 0; i < 65535; i++) {
+		sum += hist[i];
+		if (sum > want)
+			break;
+	}
+
+	return i;
+}
+
+void qhy9_make_preview(const uint16_t *src, int w, int h, int factor, QHY9Preview *preview)
+{
+	std::vector<uint16_t> small;
+	std::vector<uint32_t> acc, hist(65536, 0);
+	uint8_t curve[QHY9_STRETCH_LEVELS];
+	int pw, ph, i, med, d, black, white;
+	size_t n, c;
+	double sigma, x, m;
+	char head[32];
+	int hlen;
+
+	if (factor < 1)
+		factor = 1;
+	while (factor > 1 && (w / factor < 1 || h / factor < 1))
+		factor--;
+
+	pw = w / factor;
+	ph = h / factor;
+	n = (size_t) pw * ph;
+
+	/* block averages, the vertical sums vectorized */
+	small.resize(n);
+	acc.resize(pw * factor);
+	for (i = 0; i < ph; i++) {
+		if (factor == 1)
+			memcpy(&small[i * pw], src + (size_t) i * w, pw * sizeof(uint16_t));
+		else
+			qhy9_bin_row(&small[i * pw], src + (size_t) i * factor * w, w, pw, factor, factor, 1, &acc[0]);
+	}
+
+	for (c = 0; c < n; c++)
+		hist[small[c]]++;
+
+	/* background and its noise, median absolute deviation around it */
+	med = percentile(hist, n, 0.5);
+	c = hist[med];
+	for (d = 0; c <= n / 2 && d < 65535; ) {
+		d++;
+		if (med + d <= 65535) c += hist[med + d];
+		if (med - d >= 0)     c += hist[med - d];
+	}
+	sigma = 1.4826 * d;
+
+	black = med - (int) (PREVIEW_SHADOWS * sigma);
+	if (black < 0)
+		black = 0;
+	white = percentile(hist, n, PREVIEW_HIGHLIGHTS);
+	if (white <= med)
+		white = med + 1;
+
+	/* midtones balance taking the background to PREVIEW_BACKGROUND */
+	x = (double) (med - black) / (white - black);
+	m = x * (1 - PREVIEW_BACKGROUND) / (x - 2 * x * PREVIEW_BACKGROUND + PREVIEW_BACKGROUND);
+
+	for (i = 0; i < QHY9_STRETCH_LEVELS; i++)
+		curve[i] = (uint8_t) (mtf((double) i / (QHY9_STRETCH_LEVELS - 1), m) * 255.0 + 0.5);
+
+	hlen = snprintf(head, sizeof(head), "P5\n%d %d\n255\n", pw, ph);
+
+	preview->pgm.resize(hlen + n);
+	memcpy(&preview->pgm[0], head, hlen);
+	for (i = 0; i < ph; i++)
+		qhy9_stretch_row(&preview->pgm[hlen + i * pw], &small[i * pw], pw, black, white, curve);
+
+	preview->width = pw;
+	preview->height = ph;
+	preview->factor = factor;
+	preview->black = black;
+	preview->white = white;
+	preview->median = med;
+}
@@ -0,0 +1,25 @@
+#ifndef __QHY9_PREVIEW_H
+#define __QHY9_PREVIEW_H
+
+#include <stdint.h>
+
+#include <vector>
+
+/* a small 8 bit view of a frame, for framing and focus checks */
+struct QHY9Preview {
+	int width, height;
+	int factor;			/* frame pixels per preview pixel, each way */
+	uint16_t black, white;		/* frame values mapped to 0 and 255 */
+	uint16_t median;
+	std::vector<uint8_t> pgm;	/* binary PGM, header and pixels */
+};
+
+/*
+ * Average factor x factor blocks of the w x h frame and stretch the result
+ * for display: black a little under the sky background, white at the
+ * brightest 0.1 %, and a midtones curve that puts the background at a
+ * quarter of full scale.
+ */
+void qhy9_make_preview(const uint16_t *src, int w, int h, int factor, QHY9Preview *preview);
+
+#endif
@@ -0,0 +1,281 @@
+#include <string.h>
+#include <time.h>
+
+#include "qhy9_readout.h"
+#include "qhy9_timing.h"
+#include "qhy9_trace.h"
+
+
+QHY9Readout::QHY9Readout()
+{
+	memset(xfers, 0, sizeof(xfers));
+
+	nxfers = next_nxfers = DEFAULT_TRANSFERS;
+	xfer_size = next_xfer_size = DEFAULT_TRANSFER_SIZE;
+	timeout_ms = next_timeout_ms = DEFAULT_TIMEOUT_MS;
+	progress = NULL;
+	progressArg = NULL;
+
+	buffer = NULL;
+	total = chunk = submitted = received = sent = hole = 0;
+	inflight = error = done = gone = timedout = 0;
+	cancelled = 0;
+}
+
+QHY9Readout::~QHY9Readout()
+{
+	int i;
+
+	for (i = 0; i < MAX_TRANSFERS; i++)
+		if (xfers[i])
+			libusb_free_transfer(xfers[i]);
+}
+
+void QHY9Readout::setTransfers(int count, int size)
+{
+	if (count < 1)
+		count = 1;
+	if (count > MAX_TRANSFERS)
+		count = MAX_TRANSFERS;
+
+	/* bulk transfers must be a multiple of the max packet size */
+	size -= size % 512;
+	if (size < 512)
+		size = 512;
+
+	__atomic_store_n(&next_nxfers, count, __ATOMIC_RELAXED);
+	__atomic_store_n(&next_xfer_size, size, __ATOMIC_RELAXED);
+}
+
+void QHY9Readout::setTimeout(int ms)
+{
+	if (ms < 100)
+		ms = 100;
+
+	__atomic_store_n(&next_timeout_ms, ms, __ATOMIC_RELAXED);
+}
+
+void QHY9Readout::setProgressHandler(void (*handler)(void *arg, long bytes), void *arg)
+{
+	progress = handler;
+	progressArg = arg;
+}
+
+int QHY9Readout::submitNext(struct libusb_transfer *xfer)
+{
+	int len = total - submitted;
+	int ret;
+
+	if (len > chunk)
+		len = chunk;
+
+	xfer->buffer = buffer + submitted;
+	xfer->length = len;
+
+	ret = libusb_submit_transfer(xfer);
+	if (ret < 0) {
+		if (ret == LIBUSB_ERROR_NO_DEVICE)
+			gone = 1;
+		qhy9_trace_text("readout: submit failed at %d: %s", submitted, libusb_error_name(ret));
+		return ret;
+	}
+
+	submitted += len;
+	inflight++;
+
+	return 0;
+}
+
+void QHY9Readout::cancelAll()
+{
+	int i;
+
+	/* every slot ever used; transfers that are not pending just return LIBUSB_ERROR_NOT_FOUND */
+	for (i = 0; i < MAX_TRANSFERS; i++)
+		if (xfers[i])
+			libusb_cancel_transfer(xfers[i]);
+}
+
+void QHY9Readout::cancel()
+{
+	cancelled = 1;
+	cancelAll();
+}
+
+void QHY9Readout::transferCallback(struct libusb_transfer *xfer)
+{
+	QHY9Readout *self = (QHY9Readout *) xfer->user_data;
+
+	self->transferDone(xfer);
+}
+
+/*
+ * Transfers on the endpoint complete in the order they were submitted, each
+ * at its own offset. Whatever the status, actual_length bytes left the
+ * camera, including transfers that finish or are cancelled after an error;
+ * they only count as received while there is no gap in front of them.
+ */
+void QHY9Readout::transferDone(struct libusb_transfer *xfer)
+{
+	int offset = xfer->buffer - buffer;
+
+	inflight--;
+
+	if (xfer->status == LIBUSB_TRANSFER_NO_DEVICE)
+		gone = 1;
+	if (xfer->status == LIBUSB_TRANSFER_TIMED_OUT)
+		timedout = 1;
+
+	sent += xfer->actual_length;
+	if (!hole && offset == received) {
+		received += xfer->actual_length;
+		if (xfer->actual_length != xfer->length)
+			hole = 1;
+	}
+
+	if (xfer->status != LIBUSB_TRANSFER_COMPLETED || xfer->actual_length != xfer->length) {
+		if (!error) {
+			qhy9_trace_usb(QHY9_TRACE_USB_XFER, xfer->status, xfer->actual_length, xfer->length, received);
+			error = 1;
+			cancelAll();
+		}
+	} else if (!error) {
+		if (progress)
+			progress(progressArg, received);
+
+		/* put it straight back in the queue */
+		if (cancelled) {
+			error = 1;
+			cancelAll();
+		} else if (submitted < total && submitNext(xfer) < 0) {
+			error = 1;
+			cancelAll();
+		}
+	}
+
+	if (inflight == 0)
+		done = 1;
+}
+
+/* one pass over what is left, from received to total; 0 once everything is in */
+int QHY9Readout::stream(libusb_context *ctx, libusb_device_handle *handle, int ep)
+{
+	struct timespec now, progress;
+	struct timeval tv;
+	int i, ret, last;
+
+	submitted = sent = received;
+	inflight = error = done = timedout = hole = 0;
+
+	for (i = 0; i < nxfers && submitted < total; i++) {
+		if (!xfers[i]) {
+			xfers[i] = libusb_alloc_transfer(0);
+			if (!xfers[i]) {
+				error = 1;
+				break;
+			}
+		}
+
+		libusb_fill_bulk_transfer(xfers[i], handle, ep, NULL, 0,
+					  transferCallback, this, timeout_ms);
+
+		if (submitNext(xfers[i]) < 0) {
+			error = 1;
+			break;
+		}
+	}
+
+	if (error)
+		cancelAll();
+
+	if (inflight == 0)
+		done = 1;
+
+	clock_gettime(CLOCK_MONOTONIC, &progress);
+	last = received;
+
+	while (!done) {
+		tv.tv_sec = 0;
+		tv.tv_usec = 250000;
+
+		ret = libusb_handle_events_timeout_completed(ctx, &tv, &done);
+		if (ret < 0 && ret != LIBUSB_ERROR_INTERRUPTED) {
+			qhy9_trace_text("readout: handle_events: %s", libusb_error_name(ret));
+			if (!error) {
+				error = 1;
+				cancelAll();
+			}
+		}
+
+		/* watchdog: transfers that neither complete nor time out */
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (received != last) {
+			last = received;
+			progress = now;
+		} else if (!error && ts_ms(&now, &progress) > 2 * timeout_ms) {
+			qhy9_trace_text("readout: stalled at %d of %d bytes", received, total);
+			timedout = 1;
+			error = 1;
+			cancelAll();
+		}
+	}
+
+	if (!error && received == total)
+		return 0;
+
+	return timedout ? LIBUSB_ERROR_TIMEOUT : LIBUSB_ERROR_IO;
+}
+
+int QHY9Readout::read(libusb_context *ctx, libusb_device_handle *handle, int ep,
+		      unsigned char *data, int psize, int pnum, int *pos)
+{
+	int attempt, ret;
+
+	if (!handle || psize <= 0 || pnum <= 0)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	/* cancelled before it started, the flag only clears with clearCancel */
+	if (cancelled) {
+		*pos = 0;
+		return LIBUSB_ERROR_INTERRUPTED;
+	}
+
+	/* settings changed since the last read apply from here */
+	nxfers = __atomic_load_n(&next_nxfers, __ATOMIC_RELAXED);
+	xfer_size = __atomic_load_n(&next_xfer_size, __ATOMIC_RELAXED);
+	timeout_ms = __atomic_load_n(&next_timeout_ms, __ATOMIC_RELAXED);
+
+	buffer = data;
+	total = psize * pnum;
+	received = sent = 0;
+	gone = 0;
+
+	/* whole packets per transfer, so *pos stays meaningful */
+	chunk = (xfer_size / psize) * psize;
+	if (chunk < psize)
+		chunk = psize;
+
+	/* the camera keeps streaming after a hiccup, so carry on where the data stopped */
+	for (attempt = 0; ; attempt++) {
+		ret = stream(ctx, handle, ep);
+		if (ret == 0 || gone || cancelled || attempt == MAX_RESUMES)
+			break;
+
+		/* the camera is further along than the buffer, resuming would shift the rest */
+		if (sent != received) {
+			qhy9_trace_text("readout: %d bytes past a gap at %d, not resuming", sent - received, received);
+			break;
+		}
+
+		qhy9_trace_usb(QHY9_TRACE_USB_RESUME, ep, ret, total, received);
+	}
+
+	*pos = received / psize;
+
+	if (gone)
+		return LIBUSB_ERROR_NO_DEVICE;
+	if (ret && cancelled)
+		return LIBUSB_ERROR_INTERRUPTED;
+
+	return ret;
+}
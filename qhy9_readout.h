@@ -0,0 +1,109 @@
+#ifndef __QHY9_READOUT_H
+#define __QHY9_READOUT_H
+
+#include <stdint.h>
+
+#include <libusb-1.0/libusb.h>
+
+/*
+ * Asynchronous bulk readout engine.
+ *
+ * Keeps a number of large bulk transfers in flight on the data endpoint and
+ * resubmits each one as soon as it completes, so the pipe never goes idle
+ * between packets. Transfers on a single endpoint complete in order, so each
+ * one targets its final offset in the destination buffer directly.
+ */
+class QHY9Readout
+{
+public:
+	static const int DEFAULT_TRANSFERS     = 8;
+	static const int DEFAULT_TRANSFER_SIZE = 512 * 1024;
+	static const int MAX_TRANSFERS         = 32;
+
+	static const int DEFAULT_TIMEOUT_MS    = 5000;	/* per transfer */
+	static const int MAX_RESUMES           = 3;	/* restarts of a broken download */
+
+	QHY9Readout();
+	~QHY9Readout();
+
+	/*
+	 * Number of transfers kept in flight and size of each transfer, in bytes.
+	 * Settings are taken up at the start of the next read, never during one;
+	 * the getters return them as they will be used.
+	 */
+	void setTransfers(int count, int size);
+
+	int getTransferCount() { return __atomic_load_n(&next_nxfers, __ATOMIC_RELAXED); }
+	int getTransferSize()  { return __atomic_load_n(&next_xfer_size, __ATOMIC_RELAXED); }
+
+	/*
+	 * Each transfer must complete within timeout msec. A watchdog gives up on
+	 * the whole read if nothing at all arrives for twice that long, in case
+	 * the callbacks themselves stop coming.
+	 */
+	void setTimeout(int ms);
+	int getTimeout() { return __atomic_load_n(&next_timeout_ms, __ATOMIC_RELAXED); }
+
+	/* bytes in place so far, from inside read */
+	void setProgressHandler(void (*handler)(void *arg, long bytes), void *arg);
+
+	/*
+	 * Read pnum packets of psize bytes into data; *pos is the number of complete
+	 * packets received. A short or timed out transfer does not end the read,
+	 * streaming picks up again right after the last byte that arrived, up to
+	 * MAX_RESUMES times, as long as every byte the camera sent is accounted
+	 * for. Bytes that landed past a gap would put the rest of the frame out of
+	 * step, so then the read ends with *pos at the gap. Returns 0,
+	 * LIBUSB_ERROR_NO_DEVICE if the camera went away, LIBUSB_ERROR_INTERRUPTED
+	 * after cancel(), LIBUSB_ERROR_TIMEOUT if it stopped sending,
+	 * LIBUSB_ERROR_IO otherwise.
+	 */
+	int read(libusb_context *ctx, libusb_device_handle *handle, int ep,
+		 unsigned char *data, int psize, int pnum, int *pos);
+
+	/* abort a read in progress, or the next one; safe to call from another thread */
+	void cancel();
+	/* the next read goes ahead again */
+	void clearCancel() { cancelled = 0; }
+
+private:
+	struct libusb_transfer *xfers[MAX_TRANSFERS];
+
+	/* in use by the current read */
+	int nxfers;
+	int xfer_size;
+	int timeout_ms;
+
+	/* set from any thread, copied in when a read starts */
+	int next_nxfers;
+	int next_xfer_size;
+	int next_timeout_ms;
+
+	void (*progress)(void *arg, long bytes);
+	void *progressArg;
+
+	/* state of the current read, touched only from libusb event handling */
+	unsigned char *buffer;
+	int total;			/* bytes requested */
+	int chunk;			/* bytes per transfer */
+	int submitted;			/* bytes handed to transfers so far */
+	int received;			/* bytes completed, in order, without a gap */
+	int sent;			/* bytes the camera sent, end of the stream in buffer terms */
+	int hole;			/* a transfer came back short, later bytes are out of place */
+	int inflight;
+	int error;
+	int gone;			/* device disconnected */
+	int timedout;			/* a transfer timed out or the watchdog fired */
+	int done;
+
+	volatile int cancelled;
+
+	int stream(libusb_context *ctx, libusb_device_handle *handle, int ep);
+	int submitNext(struct libusb_transfer *xfer);
+	void cancelAll();
+
+	void transferDone(struct libusb_transfer *xfer);
+	static void transferCallback(struct libusb_transfer *xfer);
+};
+
+#endif
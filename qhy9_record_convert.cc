@@ -0,0 +1,251 @@
+/*
+ * Convert a raw recording written by the driver (CCD_RECORD) to FITS: one
+ * file per frame, or a single cube of all frames of the first frame's size.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+
+#include <string>
+#include <vector>
+
+#include <fitsio.h>
+
+#include "qhy9_recorder.h"
+
+/* ns since the epoch as FITS date and time, msec precision */
+static void fits_date(int64_t ns, char *out, size_t len)
+{
+	time_t sec = ns / 1000000000;
+	struct tm *tm = gmtime(&sec);
+
+	snprintf(out, len, "%04d-%02d-%02dT%02d:%02d:%02d.%03d",
+		 1900 + tm->tm_year, 1 + tm->tm_mon, tm->tm_mday,
+		 tm->tm_hour, tm->tm_min, tm->tm_sec, (int) (ns % 1000000000 / 1000000));
+}
+
+/* the keys the driver writes for a frame, as far as the record has them */
+static void write_keys(fitsfile *fptr, const QHY9RecordFrame *f, const char *camera, int *status)
+{
+	char date[32];
+	double temp;
+	float exposure = f->exposure / 1000.0;
+	int binx = f->bx, biny = f->by;
+	int subx = f->x / f->bx, suby = f->y / f->by;
+	int gain = f->reg[0], offset = f->reg[1], hwbin = f->reg[5], speed = f->reg[33];
+	long long seq = f->seq, camseq = f->camera_seq;
+
+	fits_write_key(fptr, TSTRING, "INSTRUME", (void *) camera, "CCD Name", status);
+
+	fits_date(f->open_rt, date, sizeof(date));
+	fits_write_key(fptr, TSTRING, "DATE-OBS", date, "Date of start of observation, UTC", status);
+	fits_write_key(fptr, TSTRING, "TIME-OBS", date + 11, "Time of start of observation, UTC", status);
+	fits_date(f->close_rt, date, sizeof(date));
+	fits_write_key(fptr, TSTRING, "DATE-END", date, "Date of end of observation, UTC", status);
+
+	fits_write_key(fptr, TFLOAT, "EXPTIME", &exposure, "Exposure time in seconds", status);
+	fits_write_key(fptr, TINT, "CCDBIN1", &binx, "CCD BIN X", status);
+	fits_write_key(fptr, TINT, "CCDBIN2", &biny, "CCD BIN Y", status);
+	fits_write_key(fptr, TINT, "XORGSUBF", &subx, "Subframe X position in binned pixels", status);
+	fits_write_key(fptr, TINT, "YORGSUBF", &suby, "Subframe Y position in binned pixels", status);
+	fits_write_key(fptr, TINT, "QHYHWBIN", &hwbin, "Binning done by the camera", status);
+	fits_write_key(fptr, TINT, "QHYGAIN", &gain, "CCD Gain, 0..255", status);
+	fits_write_key(fptr, TINT, "QHYBIAS", &offset, "CCD Offset", status);
+	fits_write_key(fptr, TINT, "QHYSPEED", &speed, "CCD readout speed", status);
+
+	temp = f->temp;
+	fits_write_key(fptr, TDOUBLE, "CCDTEMP", &temp, "CCD temperature, degC", status);
+	temp = f->setpoint;
+	fits_write_key(fptr, TDOUBLE, "CCDTSET", &temp, "CCD set temperature, degC", status);
+	temp = f->temp_min;
+	fits_write_key(fptr, TDOUBLE, "CCDTMIN", &temp, "CCD temperature during exposure, min, degC", status);
+	temp = f->temp_max;
+	fits_write_key(fptr, TDOUBLE, "CCDTMAX", &temp, "CCD temperature during exposure, max, degC", status);
+
+	fits_write_key(fptr, TLONGLONG, "QHYRSEQ", &seq, "Frame in the recording", status);
+	if (f->flags & QHY9_RECORD_VIDEO)
+		fits_write_key(fptr, TLONGLONG, "QHYVSEQ", &camseq, "Live video frame", status);
+
+	if (f->flags & QHY9_RECORD_PARTIAL) {
+		int partial = 1;
+		fits_write_key(fptr, TLOGICAL, "QHYPART", &partial, "Incomplete download, missing data is zero", status);
+	}
+
+	/* calibrated in the driver before it was recorded */
+	if (f->flags & QHY9_RECORD_CALIBRATED) {
+		char calstat[sizeof(f->calstat) + 1];
+		int pedestal = f->pedestal;
+
+		memcpy(calstat, f->calstat, sizeof(f->calstat));
+		calstat[sizeof(f->calstat)] = 0;
+		fits_write_key(fptr, TSTRING, "CALSTAT", calstat, "Calibration applied: bias, dark, flat", status);
+		fits_write_key(fptr, TINT, "PEDESTAL", &pedestal, "Add to get calibrated ADU", status);
+	}
+
+	if (f->flags & QHY9_RECORD_SWAPPED) {
+		int swapped = 1;
+		fits_write_key(fptr, TLOGICAL, "QHYSWAP", &swapped, "Pixel bytes swapped by the driver", status);
+	}
+}
+
+static bool write_frame(const char *path, const QHY9RecordFrame *f, const char *camera,
+			std::vector<uint16_t> &pixels)
+{
+	std::string name = std::string("!") + path;
+	long naxes[2] = { f->width, f->height };
+	fitsfile *fptr;
+	int status = 0;
+
+	fits_create_file(&fptr, name.c_str(), &status);
+	if (status) {
+		fits_report_error(stderr, status);
+		return false;
+	}
+
+	fits_create_img(fptr, USHORT_IMG, 2, naxes, &status);
+	write_keys(fptr, f, camera, &status);
+	fits_write_img(fptr, TUSHORT, 1, pixels.size(), &pixels[0], &status);
+	fits_close_file(fptr, &status);
+
+	if (status) {
+		fits_report_error(stderr, status);
+		return false;
+	}
+
+	return true;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [options] recording.qr9\n"
+		"  -o, --output PREFIX  output name, PREFIX_00001.fits or PREFIX.fits (default: recording name)\n"
+		"  -c, --cube           one 3D FITS of all frames the size of the first\n"
+		"  -f, --first N        start at frame N (default 1)\n"
+		"  -n, --count N        at most N frames\n",
+		prog);
+}
+
+int main(int argc, char *argv[])
+{
+	static const struct option options[] = {
+		{ "output", required_argument, NULL, 'o' },
+		{ "cube",   no_argument,       NULL, 'c' },
+		{ "first",  required_argument, NULL, 'f' },
+		{ "count",  required_argument, NULL, 'n' },
+		{ "help",   no_argument,       NULL, 'h' },
+		{ NULL, 0, NULL, 0 }
+	};
+
+	QHY9RecordReader reader;
+	QHY9RecordFrame frame, first;
+	std::vector<uint16_t> pixels;
+	std::string prefix;
+	char camera[sizeof(((QHY9RecordFileHeader *) 0)->camera) + 1];
+	bool cube = false;
+	long long start = 1, count = -1, n = 0, skipped = 0;
+	fitsfile *fptr = NULL;
+	long naxes[3];
+	int c, status = 0;
+
+	while ((c = getopt_long(argc, argv, "o:cf:n:h", options, NULL)) != -1) {
+		switch (c) {
+		case 'o':
+			prefix = optarg;
+			break;
+		case 'c':
+			cube = true;
+			break;
+		case 'f':
+			start = atoll(optarg);
+			break;
+		case 'n':
+			count = atoll(optarg);
+			break;
+		default:
+			usage(argv[0]);
+			return c == 'h' ? 0 : 1;
+		}
+	}
+
+	if (optind != argc - 1 || start < 1) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (prefix.empty()) {
+		prefix = argv[optind];
+		if (prefix.size() > 4 && prefix.compare(prefix.size() - 4, 4, ".qr9") == 0)
+			prefix.erase(prefix.size() - 4);
+	}
+
+	if (!reader.open(argv[optind]))
+		return 1;
+
+	memcpy(camera, reader.getHeader().camera, sizeof(camera) - 1);
+	camera[sizeof(camera) - 1] = 0;
+
+	while ((count < 0 || n < count) && reader.next(&frame, pixels)) {
+		if ((long long) frame.seq < start)
+			continue;
+
+		if (!cube) {
+			char name[32];
+
+			snprintf(name, sizeof(name), "_%05llu.fits", (unsigned long long) frame.seq);
+			if (!write_frame((prefix + name).c_str(), &frame, camera, pixels))
+				return 1;
+			n++;
+			continue;
+		}
+
+		/* the first frame sets the size and the header */
+		if (!fptr) {
+			std::string name = "!" + prefix + ".fits";
+
+			naxes[0] = frame.width;
+			naxes[1] = frame.height;
+			naxes[2] = 0;
+			fits_create_file(&fptr, name.c_str(), &status);
+			fits_create_img(fptr, USHORT_IMG, 3, naxes, &status);
+			write_keys(fptr, &frame, camera, &status);
+			if (status) {
+				fits_report_error(stderr, status);
+				return 1;
+			}
+			first = frame;
+		}
+
+		if (frame.width != first.width || frame.height != first.height) {
+			skipped++;
+			continue;
+		}
+
+		/* the cube grows a plane at a time */
+		n++;
+		naxes[2] = n;
+		fits_resize_img(fptr, USHORT_IMG, 3, naxes, &status);
+		fits_write_img(fptr, TUSHORT, (n - 1) * pixels.size() + 1, pixels.size(), &pixels[0], &status);
+		if (status) {
+			fits_report_error(stderr, status);
+			return 1;
+		}
+	}
+
+	if (fptr) {
+		fits_close_file(fptr, &status);
+		if (status) {
+			fits_report_error(stderr, status);
+			return 1;
+		}
+	}
+
+	if (skipped)
+		fprintf(stderr, "%lld frames of another size left out of the cube\n", skipped);
+	fprintf(stderr, "%lld frames converted\n", n);
+
+	return 0;
+}
@@ -0,0 +1,466 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "qhy9_recorder.h"
+#include "qhy9_timing.h"
+#include "qhy9_trace.h"
+
+#define HEADER_MAGIC_LEN 8
+
+
+static size_t round_block(size_t n)
+{
+	return (n + QHY9_RECORD_BLOCK - 1) / QHY9_RECORD_BLOCK * QHY9_RECORD_BLOCK;
+}
+
+
+QHY9Recorder::QHY9Recorder()
+{
+	pthread_mutex_init(&lock, NULL);
+	pthread_cond_init(&work, NULL);
+
+	fd = -1;
+	direct = false;
+	memset(camera, 0, sizeof(camera));
+	created = 0;
+	memset(buffers, 0, sizeof(buffers));
+	capacity = 0;
+	fill = 0;
+	pending = -1;
+	prealloc = allocated = offset = 0;
+	frames = dropped = 0;
+	writeMs = 0;
+	error = 0;
+	running = quit = false;
+}
+
+QHY9Recorder::~QHY9Recorder()
+{
+	close();
+
+	pthread_cond_destroy(&work);
+	pthread_mutex_destroy(&lock);
+}
+
+bool QHY9Recorder::open(const char *path, const char *camera, size_t prealloc, size_t buffer, size_t maxPixels)
+{
+	int i;
+
+	close();
+
+	/* O_DIRECT needs aligned buffers, offsets and sizes, which the records are */
+	fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+	direct = fd >= 0;
+	if (fd < 0 && errno == EINVAL)
+		fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		perror(path);
+		return false;
+	}
+
+	memset(this->camera, 0, sizeof(this->camera));
+	strncpy(this->camera, camera ? camera : "", sizeof(this->camera) - 1);
+	created = time(NULL);
+
+	capacity = round_block(sizeof(QHY9RecordFrame) + maxPixels * 2);
+	if (capacity < buffer)
+		capacity = round_block(buffer);
+
+	for (i = 0; i < 2; i++) {
+		void *p;
+
+		if (posix_memalign(&p, QHY9_RECORD_BLOCK, capacity)) {
+			fprintf(stderr, "recorder: cannot allocate %zu byte buffers\n", capacity);
+			freeBuffers();
+			::close(fd);
+			fd = -1;
+			return false;
+		}
+		buffers[i].data = (uint8_t *) p;
+		buffers[i].used = 0;
+	}
+
+	this->prealloc = round_block(prealloc);
+	allocated = 0;
+	if (this->prealloc && fallocate(fd, 0, 0, QHY9_RECORD_BLOCK + this->prealloc))
+		this->prealloc = 0;		/* not on this file system, it just grows */
+	else
+		allocated = this->prealloc;
+
+	fill = 0;
+	pending = -1;
+	offset = 0;
+	frames = dropped = 0;
+	writeMs = 0;
+	error = 0;
+	quit = false;
+
+	/* a recording that is never closed is still readable, up to its last whole frame */
+	if (!writeHeader(false)) {
+		perror(path);
+		freeBuffers();
+		::close(fd);
+		fd = -1;
+		return false;
+	}
+
+	if (pthread_create(&thread, NULL, writerEntry, this)) {
+		fprintf(stderr, "recorder: cannot start writer\n");
+		freeBuffers();
+		::close(fd);
+		fd = -1;
+		return false;
+	}
+	running = true;
+
+	qhy9_trace_text("recorder: %s, %s, %zu byte buffers", path, direct ? "direct" : "buffered", capacity);
+
+	return true;
+}
+
+bool QHY9Recorder::add(QHY9RecordFrame *frame, const uint16_t *pixels)
+{
+	size_t bytes = (size_t) frame->width * frame->height * 2;
+	size_t size = round_block(sizeof(*frame) + bytes);
+	Buffer *b;
+
+	pthread_mutex_lock(&lock);
+
+	if (fd < 0 || error || size > capacity) {
+		dropped++;
+		pthread_mutex_unlock(&lock);
+		return false;
+	}
+
+	/* full: the other one goes next unless the writer still has it */
+	if (buffers[fill].used + size > capacity) {
+		if (pending >= 0) {
+			dropped++;
+			pthread_mutex_unlock(&lock);
+			return false;
+		}
+
+		pending = fill;
+		fill ^= 1;
+		pthread_cond_signal(&work);
+	}
+
+	frame->magic = QHY9_RECORD_FRAME_MAGIC;
+	frame->size = size;
+	frame->seq = ++frames;
+
+	b = &buffers[fill];
+	memcpy(b->data + b->used, frame, sizeof(*frame));
+	memcpy(b->data + b->used + sizeof(*frame), pixels, bytes);
+	memset(b->data + b->used + sizeof(*frame) + bytes, 0, size - sizeof(*frame) - bytes);
+	b->used += size;
+
+	/* an idle writer takes it right away, frames pile up only while it is busy */
+	if (pending < 0) {
+		pending = fill;
+		fill ^= 1;
+		pthread_cond_signal(&work);
+	}
+
+	pthread_mutex_unlock(&lock);
+
+	return true;
+}
+
+bool QHY9Recorder::close()
+{
+	bool ok;
+
+	if (fd < 0)
+		return true;
+
+	if (running) {
+		pthread_mutex_lock(&lock);
+		quit = true;
+		pthread_cond_signal(&work);
+		pthread_mutex_unlock(&lock);
+
+		pthread_join(thread, NULL);
+		running = false;
+	}
+
+	ok = !error;
+
+	/* the header block again, now with the count */
+	if (!writeHeader(true))
+		ok = false;
+
+	/* hand back what the preallocation did not use */
+	if (ftruncate(fd, QHY9_RECORD_BLOCK + offset))
+		ok = false;
+	if (fdatasync(fd))
+		ok = false;
+
+	::close(fd);
+	fd = -1;
+	freeBuffers();
+
+	qhy9_trace_text("recorder: closed, %llu frames, %llu dropped, %.1f MB/s",
+			(unsigned long long) frames, (unsigned long long) dropped, getRate());
+
+	return ok;
+}
+
+uint64_t QHY9Recorder::getFrames()
+{
+	uint64_t n;
+
+	pthread_mutex_lock(&lock);
+	n = frames;
+	pthread_mutex_unlock(&lock);
+
+	return n;
+}
+
+uint64_t QHY9Recorder::getDropped()
+{
+	uint64_t n;
+
+	pthread_mutex_lock(&lock);
+	n = dropped;
+	pthread_mutex_unlock(&lock);
+
+	return n;
+}
+
+uint64_t QHY9Recorder::getBytes()
+{
+	uint64_t n;
+
+	pthread_mutex_lock(&lock);
+	n = offset;
+	pthread_mutex_unlock(&lock);
+
+	return n;
+}
+
+double QHY9Recorder::getRate()
+{
+	double rate = 0;
+
+	pthread_mutex_lock(&lock);
+	if (writeMs > 0)
+		rate = offset / 1e3 / writeMs;
+	pthread_mutex_unlock(&lock);
+
+	return rate;
+}
+
+void *QHY9Recorder::writerEntry(void *arg)
+{
+	((QHY9Recorder *) arg)->writer();
+	return NULL;
+}
+
+/* writer thread: one buffer at a time to disk, the next one fills meanwhile */
+void QHY9Recorder::writer()
+{
+	struct timespec t0, t1;
+	uint64_t at;
+	size_t len;
+	Buffer *b;
+	bool ok;
+
+	pthread_mutex_lock(&lock);
+
+	for (;;) {
+		/* on close, whatever is still in the fill buffer goes too */
+		if (pending < 0 && quit && buffers[fill].used) {
+			pending = fill;
+			fill ^= 1;
+		}
+
+		if (pending < 0) {
+			if (quit)
+				break;
+			pthread_cond_wait(&work, &lock);
+			continue;
+		}
+
+		b = &buffers[pending];
+		len = b->used;
+		at = QHY9_RECORD_BLOCK + offset;
+		pthread_mutex_unlock(&lock);
+
+		/* grow the preallocation ahead of the writes */
+		if (prealloc && at + len > QHY9_RECORD_BLOCK + allocated &&
+		    fallocate(fd, 0, QHY9_RECORD_BLOCK + allocated, prealloc + len) == 0)
+			allocated += prealloc + len;
+
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		ok = writeOut(b->data, len, at);
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+
+		pthread_mutex_lock(&lock);
+		if (ok) {
+			offset += len;
+			writeMs += ts_ms(&t1, &t0);
+		} else if (!error) {
+			error = errno ? errno : EIO;
+		}
+		b->used = 0;
+		pending = -1;
+
+		/* frames that came in during the write go next */
+		if (buffers[fill].used) {
+			pending = fill;
+			fill ^= 1;
+		}
+	}
+
+	pthread_mutex_unlock(&lock);
+}
+
+bool QHY9Recorder::writeOut(const uint8_t *data, size_t len, uint64_t at)
+{
+	ssize_t n;
+
+	while (len) {
+		n = pwrite(fd, data, len, at);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			qhy9_trace_text("recorder: write at %llu failed: %s",
+					(unsigned long long) at, strerror(n < 0 ? errno : EIO));
+			return false;
+		}
+
+		data += n;
+		len -= n;
+		at += n;
+	}
+
+	return true;
+}
+
+/* header block at offset 0; frames and end stay 0 until the recording is closed */
+bool QHY9Recorder::writeHeader(bool closed)
+{
+	QHY9RecordFileHeader *header;
+	void *p;
+	bool ok;
+
+	if (posix_memalign(&p, QHY9_RECORD_BLOCK, QHY9_RECORD_BLOCK))
+		return false;
+
+	memset(p, 0, QHY9_RECORD_BLOCK);
+	header = (QHY9RecordFileHeader *) p;
+
+	memcpy(header->magic, QHY9_RECORD_MAGIC, HEADER_MAGIC_LEN);
+	header->block = QHY9_RECORD_BLOCK;
+	header->frame_header = sizeof(QHY9RecordFrame);
+	if (closed) {
+		header->frames = frames;
+		header->end = offset;
+	}
+	header->created = created;
+	memcpy(header->camera, camera, sizeof(header->camera));
+
+	ok = writeOut((const uint8_t *) p, QHY9_RECORD_BLOCK, 0);
+	free(p);
+
+	return ok;
+}
+
+void QHY9Recorder::freeBuffers()
+{
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		free(buffers[i].data);
+		buffers[i].data = NULL;
+		buffers[i].used = 0;
+	}
+	capacity = 0;
+}
+
+
+QHY9RecordReader::QHY9RecordReader()
+{
+	fp = NULL;
+	memset(&header, 0, sizeof(header));
+	pos = count = 0;
+}
+
+QHY9RecordReader::~QHY9RecordReader()
+{
+	close();
+}
+
+bool QHY9RecordReader::open(const char *path)
+{
+	close();
+
+	fp = fopen(path, "rb");
+	if (!fp) {
+		perror(path);
+		return false;
+	}
+
+	if (fread(&header, sizeof(header), 1, fp) != 1 ||
+	    memcmp(header.magic, QHY9_RECORD_MAGIC, HEADER_MAGIC_LEN) ||
+	    header.block < sizeof(header) || header.frame_header < 2 * sizeof(uint32_t)) {
+		fprintf(stderr, "%s: not a QHY9 recording\n", path);
+		close();
+		return false;
+	}
+
+	if (!header.frames)
+		fprintf(stderr, "%s: not closed, reading up to the last whole frame\n", path);
+
+	pos = count = 0;
+
+	return true;
+}
+
+void QHY9RecordReader::close()
+{
+	if (fp)
+		fclose(fp);
+	fp = NULL;
+}
+
+bool QHY9RecordReader::next(QHY9RecordFrame *frame, std::vector<uint16_t> &pixels)
+{
+	size_t hsize = header.frame_header < sizeof(*frame) ? header.frame_header : sizeof(*frame);
+	size_t npix;
+
+	if (!fp)
+		return false;
+	if (header.frames && (count >= header.frames || pos >= header.end))
+		return false;
+
+	memset(frame, 0, sizeof(*frame));
+	if (fseeko(fp, header.block + pos, SEEK_SET) ||
+	    fread(frame, hsize, 1, fp) != 1)
+		return false;
+
+	/* an unfinished recording ends at the first record that is not one */
+	if (frame->magic != QHY9_RECORD_FRAME_MAGIC || frame->size < header.frame_header ||
+	    frame->width <= 0 || frame->height <= 0)
+		return false;
+
+	npix = (size_t) frame->width * frame->height;
+	if (header.frame_header + npix * 2 > frame->size)
+		return false;
+
+	pixels.resize(npix);
+	if (fseeko(fp, header.block + pos + header.frame_header, SEEK_SET) ||
+	    fread(&pixels[0], 2, npix, fp) != npix)
+		return false;
+
+	pos += frame->size;
+	count++;
+
+	return true;
+}
@@ -0,0 +1,157 @@
+#ifndef __QHY9_RECORDER_H
+#define __QHY9_RECORDER_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#include <vector>
+
+/*
+ * Raw recording file: a header block, then one record per frame, each a
+ * QHY9RecordFrame, the pixels as the driver has them (cropped and binned,
+ * native byte order, unless the flags say calibrated or byte swapped) and
+ * zero padding up to a whole block. The
+ * header gets the frame count on close; a recording that was not closed
+ * has 0 there and is read until the records stop.
+ */
+#define QHY9_RECORD_BLOCK	4096
+#define QHY9_RECORD_MAGIC	"QHY9REC1"
+#define QHY9_RECORD_FRAME_MAGIC	0x4d524651	/* "QFRM" */
+
+/* QHY9RecordFrame flags */
+enum {
+	QHY9_RECORD_VIDEO   = 1,	/* from live video */
+	QHY9_RECORD_PARTIAL = 2,	/* download cut short, the tail is zero */
+	QHY9_RECORD_CALIBRATED = 4,	/* master frames applied, see calstat and pedestal */
+	QHY9_RECORD_SWAPPED = 8,	/* bytes swapped by the driver (CCD_BYTE_SWAP) */
+};
+
+struct QHY9RecordFileHeader {
+	char magic[8];
+	uint32_t block;			/* record alignment, bytes */
+	uint32_t frame_header;		/* sizeof(QHY9RecordFrame) when written */
+	uint64_t frames;		/* 0 if not closed */
+	uint64_t end;			/* bytes of records after the header block */
+	int64_t created;		/* unix time */
+	char camera[64];		/* INDI device name */
+};
+
+/* 256 bytes in front of each frame */
+struct QHY9RecordFrame {
+	uint32_t magic;
+	uint32_t size;			/* whole record: header, pixels, padding */
+	uint64_t seq;			/* 1, 2, ... in the file */
+	uint64_t camera_seq;		/* video frame number, 0 for exposures */
+	int32_t x, y, w, h;		/* subframe, unbinned sensor pixels */
+	int32_t bx, by;
+	int32_t width, height;		/* pixels that follow */
+	double exposure;		/* msec */
+	int64_t open_rt, close_rt;	/* exposure start and end, ns since the epoch */
+	int64_t open_mono, close_mono;	/* the same, CLOCK_MONOTONIC ns */
+	float temp, temp_min, temp_max;	/* sensor over the exposure, degC */
+	float setpoint;
+	uint32_t flags;
+	uint8_t reg[64];		/* register block on the camera */
+	char calstat[4];		/* masters applied, "BDF" as in the CALSTAT key */
+	int32_t pedestal;		/* add to get calibrated ADU, as the PEDESTAL key */
+	uint8_t reserved[68];
+};
+
+/*
+ * Raw frame recorder.
+ *
+ * Frames are copied into one of two block aligned buffers; a writer thread
+ * takes the other to disk with O_DIRECT (plain writes where the file system
+ * refuses it) into a preallocated file. add never waits for the disk: with
+ * both buffers busy the frame is dropped and counted instead.
+ */
+class QHY9Recorder
+{
+public:
+	QHY9Recorder();
+	~QHY9Recorder();
+
+	/*
+	 * Create path and preallocate bytes of it, growing by as much again when
+	 * that runs out. Each buffer holds at least buffer bytes and one frame of
+	 * maxPixels.
+	 */
+	bool open(const char *path, const char *camera, size_t prealloc, size_t buffer, size_t maxPixels);
+
+	/* copy a frame in, seq and size are filled in; false if it was dropped */
+	bool add(QHY9RecordFrame *frame, const uint16_t *pixels);
+
+	/* write out the rest, finish the header and trim the file; false if any write failed */
+	bool close();
+
+	bool isOpen() { return fd >= 0; }
+	bool isDirect() { return direct; }
+	int getError() { return error; }	/* errno of the first failed write */
+
+	uint64_t getFrames();
+	uint64_t getDropped();
+	uint64_t getBytes();			/* on disk */
+	double getRate();			/* MB/s while writing */
+
+private:
+	struct Buffer {
+		uint8_t *data;
+		size_t used;
+	};
+
+	int fd;
+	bool direct;
+	char camera[64];
+	int64_t created;
+
+	Buffer buffers[2];
+	size_t capacity;
+	int fill;				/* buffer frames go into */
+	int pending;				/* buffer with the writer, -1 if none */
+
+	size_t prealloc;
+	uint64_t allocated;			/* file bytes preallocated so far */
+	uint64_t offset;			/* record bytes written */
+
+	uint64_t frames, dropped;
+	double writeMs;
+	int error;
+
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+	bool running;
+	bool quit;
+
+	static void *writerEntry(void *arg);
+	void writer();
+	bool writeOut(const uint8_t *data, size_t len, uint64_t at);
+	bool writeHeader(bool closed);
+	void freeBuffers();
+};
+
+/* reads a recording back, frame by frame */
+class QHY9RecordReader
+{
+public:
+	QHY9RecordReader();
+	~QHY9RecordReader();
+
+	bool open(const char *path);
+	void close();
+
+	const QHY9RecordFileHeader &getHeader() { return header; }
+
+	/* the next frame and its pixels; false at the end */
+	bool next(QHY9RecordFrame *frame, std::vector<uint16_t> &pixels);
+
+private:
+	FILE *fp;
+	QHY9RecordFileHeader header;
+	uint64_t pos;				/* next record, from the first */
+	uint64_t count;
+};
+
+#endif
@@ -0,0 +1,143 @@
+#include <stdio.h>
+
+#include "qhy9_registers.h"
+
+
+int qhy9_hardware_bin(int hbin, int vbin)
+{
+	int bin;
+
+	for (bin = QHY9_MAX_HW_BIN; bin > 1; bin--)
+		if (hbin % bin == 0 && vbin % bin == 0)
+			return bin;
+
+	return 1;
+}
+
+void qhy9_frame_layout(QHY9Registers *r, int bin, int suby, int subh)
+{
+	unsigned long T;
+
+	/* Compute frame sizes, skips, number of patches, etc according to binning. wth is a "patch" ? */
+	switch (bin) {
+	case 0:
+	case 1:
+	default:
+		r->HBIN = 1;
+		r->VBIN = 1;
+		r->LineSize = 3584;
+		r->VerticalSize = 2574;
+		r->p_size = 3584 * 2; // must be multiple of 512
+		break;
+
+	case 2:
+		r->HBIN = 2;
+		r->VBIN = 2;
+		r->LineSize = 1792;
+		r->VerticalSize = 1287;
+		r->p_size = 3584 * 2; // multiple of 512
+		break;
+
+	case 3:
+		r->HBIN = 3;
+		r->VBIN = 3;
+		r->LineSize = 1194;               // was 1196, bad
+		r->VerticalSize = 858;
+		r->p_size = 1024;
+		break;
+
+	case 4:
+		r->HBIN = 4;
+		r->VBIN = 4;
+		r->LineSize = 896;
+		r->VerticalSize = 644;
+		r->p_size = 1024;
+		break;
+	}
+
+	r->SKIP_TOP = suby / r->VBIN;
+	r->SKIP_BOTTOM = r->VerticalSize - r->SKIP_TOP - subh / r->VBIN;
+	r->VerticalSize = r->VerticalSize - r->SKIP_TOP - r->SKIP_BOTTOM;
+
+	T = (r->LineSize * r->VerticalSize + r->TopSkipPix) * 2;
+
+	if (T % r->p_size) {
+		r->total_p = T / r->p_size + 1;
+		r->patchnum = (r->total_p * r->p_size - T) / 2 + 16;
+	} else {
+		r->total_p = T / r->p_size;
+		r->patchnum = 16;
+	}
+}
+
+void qhy9_pack_registers(const QHY9Registers *r, uint8_t *REG)
+{
+	uint8_t time_L, time_M, time_H;
+
+	/* fill in register buffer */
+	memset(REG, 0, 64);
+
+	time_L = r->Exptime % 256;
+	time_M = (r->Exptime - time_L)/256;
+	time_H = (r->Exptime - time_L - time_M * 256) / 65536;
+
+	REG[0]=r->camgain;
+	REG[1]=r->camoffset;
+
+	REG[2]=time_H;
+	REG[3]=time_M;
+	REG[4]=time_L;
+
+	REG[5]=r->HBIN;
+	REG[6]=r->VBIN;
+
+	REG[7]=MSB(r->LineSize);
+	REG[8]=LSB(r->LineSize);
+
+	REG[9]= MSB(r->VerticalSize);
+	REG[10]=LSB(r->VerticalSize);
+
+	REG[11]=MSB(r->SKIP_TOP);
+	REG[12]=LSB(r->SKIP_TOP);
+
+	REG[13]=MSB(r->SKIP_BOTTOM);
+	REG[14]=LSB(r->SKIP_BOTTOM);
+
+	REG[15]=MSB(r->LiveVideo_BeginLine);
+	REG[16]=LSB(r->LiveVideo_BeginLine);
+
+	REG[17]=MSB(r->patchnum);
+	REG[18]=LSB(r->patchnum);
+
+	REG[19]=MSB(r->AnitInterlace);
+	REG[20]=LSB(r->AnitInterlace);
+
+	REG[22]=r->MultiFieldBIN;
+
+	REG[29]=MSB(r->ClockADJ);
+	REG[30]=LSB(r->ClockADJ);
+
+	REG[32]=r->AMPVOLTAGE;
+
+	REG[33]=r->DownloadSpeed;
+
+	REG[35]=r->TgateMode;
+	REG[36]=r->ShortExposure;
+	REG[37]=r->VSUB;
+	REG[38]=r->CLAMP;
+
+	REG[42]=r->TransferBIT;
+
+	REG[46]=r->TopSkipNull;
+
+	REG[47]=MSB(r->TopSkipPix);
+	REG[48]=LSB(r->TopSkipPix);
+
+	REG[51]=r->MechanicalShutterMode;
+	REG[52]=r->DownloadCloseTEC;
+
+	REG[53]=(r->WindowHeater&~0xf0)*16+(r->MotorHeating&~0xf0);
+
+	REG[58]=r->SDRAM_MAXSIZE;
+	REG[63]=r->Trig;
+}
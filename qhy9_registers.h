@@ -0,0 +1,72 @@
+#ifndef __QHY9_REGISTERS_H
+#define __QHY9_REGISTERS_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define QHY9_SENSOR_WIDTH  3584
+#define QHY9_SENSOR_HEIGHT 2574
+
+/* hardware bins 1x1 to 4x4, anything else is completed in software */
+#define QHY9_MAX_HW_BIN 4
+#define QHY9_MAX_BIN    16
+
+/* Camera settings, everything that goes into the 64 byte register block */
+struct QHY9Registers
+{
+	QHY9Registers() { memset(this, 0, sizeof(*this)); }
+
+	unsigned char camgain;
+	unsigned char camoffset;
+	unsigned long Exptime;
+	unsigned char HBIN;
+	unsigned char VBIN;
+	unsigned short LineSize;
+	unsigned short VerticalSize;
+	unsigned short SKIP_TOP;
+	unsigned short SKIP_BOTTOM;
+	unsigned short LiveVideo_BeginLine;
+	unsigned short AnitInterlace;
+	unsigned char MultiFieldBIN;
+	unsigned char AMPVOLTAGE;
+	unsigned char DownloadSpeed;
+	unsigned char TgateMode;
+	unsigned char ShortExposure;
+	unsigned char VSUB;
+	unsigned char CLAMP;
+	unsigned char TransferBIT;
+	unsigned char TopSkipNull;
+	unsigned short TopSkipPix;
+	unsigned char MechanicalShutterMode;
+	unsigned char DownloadCloseTEC;
+	unsigned char SDRAM_MAXSIZE;
+	unsigned short ClockADJ;
+	unsigned char Trig;
+	unsigned char MotorHeating;   //0,1,2
+	unsigned char WindowHeater;   //0-15
+
+	/* I don't fully understand these */
+	unsigned int p_size;
+	unsigned int patchnum;
+	unsigned int total_p;
+};
+
+/* largest camera binning that divides the requested one */
+int qhy9_hardware_bin(int hbin, int vbin);
+
+/* line size, skips, packet size and padding for a camera bin and a subframe in unbinned rows */
+void qhy9_frame_layout(QHY9Registers *r, int bin, int suby, int subh);
+
+void qhy9_pack_registers(const QHY9Registers *r, uint8_t *REG);
+
+static inline uint8_t MSB(unsigned short val)
+{
+	return (val / 256);
+}
+
+static inline uint8_t LSB(unsigned short val)
+{
+	return (val & 0xff);
+}
+
+#endif
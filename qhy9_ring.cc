@@ -0,0 +1,237 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "qhy9_ring.h"
+#include "qhy9_timing.h"
+
+#define SLOT_ALIGN 4096			/* direct I/O can take the pixels as they are */
+
+
+QHY9FrameRing::QHY9FrameRing()
+{
+	pthread_mutex_init(&lock, NULL);
+	pthread_cond_init(&cond, NULL);
+
+	ring = NULL;
+	nslots = 0;
+	size = 0;
+	head = 0;
+	waiters = 0;
+	stopped = false;
+}
+
+QHY9FrameRing::~QHY9FrameRing()
+{
+	reset();
+
+	pthread_cond_destroy(&cond);
+	pthread_mutex_destroy(&lock);
+}
+
+bool QHY9FrameRing::allocate(int nslots, size_t size)
+{
+	int i;
+
+	reset();
+
+	if (nslots < 1 || nslots > MAX_SLOTS)
+		return false;
+
+	size = (size + SLOT_ALIGN - 1) / SLOT_ALIGN * SLOT_ALIGN;
+
+	ring = new Slot[nslots];
+	memset(ring, 0, sizeof(Slot) * nslots);
+
+	for (i = 0; i < nslots; i++) {
+		void *p;
+
+		if (posix_memalign(&p, SLOT_ALIGN, size)) {
+			fprintf(stderr, "ring: cannot allocate %d slots of %zu bytes\n", nslots, size);
+			this->nslots = i;
+			reset();
+			return false;
+		}
+
+		/* fault the pages in now, not under the first frames */
+		memset(p, 0, size);
+
+		ring[i].frame.data = (uint16_t *) p;
+		ring[i].frame.slot = i;
+	}
+
+	this->nslots = nslots;
+	this->size = size;
+	head = 0;
+	stopped = false;
+
+	return true;
+}
+
+void QHY9FrameRing::reset()
+{
+	int i;
+
+	for (i = 0; i < nslots; i++)
+		free(ring[i].frame.data);
+
+	delete[] ring;
+	ring = NULL;
+	nslots = 0;
+	size = 0;
+	head = 0;
+}
+
+QHY9RingFrame *QHY9FrameRing::claim()
+{
+	uint64_t oldest, seq;
+	int i, pick, tries, zero;
+
+	for (tries = 0; tries < nslots * 4; tries++) {
+		pick = -1;
+		oldest = UINT64_MAX;
+
+		/* empty slots have seq 0 and go first */
+		for (i = 0; i < nslots; i++) {
+			if (__atomic_load_n(&ring[i].refs, __ATOMIC_ACQUIRE))
+				continue;
+
+			seq = __atomic_load_n(&ring[i].seq, __ATOMIC_ACQUIRE);
+			if (seq < oldest) {
+				oldest = seq;
+				pick = i;
+			}
+		}
+
+		if (pick < 0)
+			return NULL;
+
+		/* a consumer may have pinned it since */
+		zero = 0;
+		if (__atomic_compare_exchange_n(&ring[pick].refs, &zero, -1, false,
+						__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+			__atomic_store_n(&ring[pick].seq, 0, __ATOMIC_RELEASE);
+			return &ring[pick].frame;
+		}
+	}
+
+	return NULL;
+}
+
+void QHY9FrameRing::publish(QHY9RingFrame *frame)
+{
+	Slot *s = &ring[frame->slot];
+
+	frame->seq = head + 1;
+
+	__atomic_store_n(&s->seq, frame->seq, __ATOMIC_RELEASE);
+	__atomic_store_n(&s->refs, 0, __ATOMIC_RELEASE);
+	__atomic_store_n(&head, frame->seq, __ATOMIC_SEQ_CST);
+
+	/* paired with the waiters count in wait */
+	if (__atomic_load_n(&waiters, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&lock);
+		pthread_cond_broadcast(&cond);
+		pthread_mutex_unlock(&lock);
+	}
+}
+
+void QHY9FrameRing::discard(QHY9RingFrame *frame)
+{
+	__atomic_store_n(&ring[frame->slot].refs, 0, __ATOMIC_RELEASE);
+}
+
+QHY9RingFrame *QHY9FrameRing::acquire(uint64_t after, bool latest)
+{
+	uint64_t best, seq;
+	int i, pick, tries, refs;
+
+	for (tries = 0; tries < nslots * 4; tries++) {
+		pick = -1;
+		best = latest ? after : UINT64_MAX;
+
+		for (i = 0; i < nslots; i++) {
+			seq = __atomic_load_n(&ring[i].seq, __ATOMIC_ACQUIRE);
+			if (seq <= after)
+				continue;
+
+			if (latest ? seq > best : seq < best) {
+				best = seq;
+				pick = i;
+			}
+		}
+
+		if (pick < 0)
+			return NULL;
+
+		/* pin it unless the producer got there first */
+		refs = __atomic_load_n(&ring[pick].refs, __ATOMIC_ACQUIRE);
+		while (refs >= 0 && !__atomic_compare_exchange_n(&ring[pick].refs, &refs, refs + 1, false,
+								  __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+			;
+		if (refs < 0)
+			continue;
+
+		/* pinned, the producer leaves it alone now; still the frame we picked? */
+		if (__atomic_load_n(&ring[pick].seq, __ATOMIC_ACQUIRE) == best)
+			return &ring[pick].frame;
+
+		__atomic_fetch_sub(&ring[pick].refs, 1, __ATOMIC_RELEASE);
+	}
+
+	return NULL;
+}
+
+QHY9RingFrame *QHY9FrameRing::acquireLatest(uint64_t after)
+{
+	return acquire(after, true);
+}
+
+QHY9RingFrame *QHY9FrameRing::acquireNext(uint64_t after)
+{
+	return acquire(after, false);
+}
+
+void QHY9FrameRing::release(QHY9RingFrame *frame)
+{
+	__atomic_fetch_sub(&ring[frame->slot].refs, 1, __ATOMIC_RELEASE);
+}
+
+bool QHY9FrameRing::wait(uint64_t after, int ms)
+{
+	struct timespec deadline;
+	bool ret;
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	ts_add(&deadline, ms);
+
+	pthread_mutex_lock(&lock);
+	__atomic_add_fetch(&waiters, 1, __ATOMIC_SEQ_CST);
+
+	while (!stopped && published() <= after)
+		if (pthread_cond_timedwait(&cond, &lock, &deadline) == ETIMEDOUT)
+			break;
+
+	ret = !stopped && published() > after;
+
+	__atomic_sub_fetch(&waiters, 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&lock);
+
+	return ret;
+}
+
+void QHY9FrameRing::stop()
+{
+	pthread_mutex_lock(&lock);
+	stopped = true;
+	pthread_cond_broadcast(&cond);
+	pthread_mutex_unlock(&lock);
+}
+
+void QHY9FrameRing::start()
+{
+	pthread_mutex_lock(&lock);
+	stopped = false;
+	pthread_mutex_unlock(&lock);
+}
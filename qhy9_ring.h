@@ -0,0 +1,96 @@
+#ifndef __QHY9_RING_H
+#define __QHY9_RING_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include <pthread.h>
+
+/* one live video frame, as it sits in a ring slot */
+struct QHY9RingFrame {
+	uint64_t seq;			/* 1, 2, ... in capture order */
+	int x, y;			/* subframe origin, unbinned */
+	int w, h;			/* image pixels */
+	int bx, by;
+	double exposure;		/* msec */
+	struct timespec open_rt;	/* exposure start and end, wall clock */
+	struct timespec close_rt;
+	struct timespec open_mono;	/* the same, CLOCK_MONOTONIC */
+	struct timespec close_mono;
+	bool partial;			/* camera stopped early, the tail is zero */
+	uint16_t *data;			/* w x h pixels, page aligned */
+	int slot;			/* ring internal */
+};
+
+/*
+ * Frame ring for live video.
+ *
+ * A fixed set of preallocated slots between one producer, the readout
+ * thread, and any number of consumers. Nothing on the data path waits: the
+ * producer always takes the oldest slot nobody holds, so a slow consumer
+ * loses frames instead of holding up the camera. Slots are claimed and
+ * pinned with a compare and swap on their reference count, -1 while the
+ * producer writes one; the slot sequence is stored last, like the trace
+ * ring does.
+ *
+ * Consumers take the newest frame (stream, stats) or the oldest after the
+ * last one they saw (recorder), and tell how many they missed from the
+ * sequence numbers. wait is the only call that sleeps.
+ */
+class QHY9FrameRing
+{
+public:
+	static const int MAX_SLOTS = 64;
+
+	QHY9FrameRing();
+	~QHY9FrameRing();
+
+	/* nslots slots of size bytes; not while the ring is in use */
+	bool allocate(int nslots, size_t size);
+	void reset();
+
+	int slots() { return nslots; }
+	size_t slotSize() { return size; }
+
+	/* producer: the oldest slot nobody holds, NULL if all are held */
+	QHY9RingFrame *claim();
+	/* numbers the frame and hands it to the consumers */
+	void publish(QHY9RingFrame *frame);
+	/* claimed but not filled, the slot keeps nothing */
+	void discard(QHY9RingFrame *frame);
+
+	/* consumers: newest frame, or oldest one, after seq; NULL if there is none */
+	QHY9RingFrame *acquireLatest(uint64_t after);
+	QHY9RingFrame *acquireNext(uint64_t after);
+	void release(QHY9RingFrame *frame);
+
+	/* sleep until a frame after seq is out; false on timeout or once stopped */
+	bool wait(uint64_t after, int ms);
+	void stop();
+	void start();
+
+	/* seq of the newest frame, 0 before the first */
+	uint64_t published() { return __atomic_load_n(&head, __ATOMIC_SEQ_CST); }
+
+private:
+	struct Slot {
+		QHY9RingFrame frame;
+		uint64_t seq;			/* frame.seq once published, 0 while empty or written */
+		int refs;			/* consumers holding it, -1 while the producer writes */
+	};
+
+	Slot *ring;
+	int nslots;
+	size_t size;
+
+	uint64_t head;				/* last seq published */
+
+	pthread_mutex_t lock;			/* only for sleeping in wait */
+	pthread_cond_t cond;
+	int waiters;
+	bool stopped;
+
+	QHY9RingFrame *acquire(uint64_t after, bool latest);
+};
+
+#endif
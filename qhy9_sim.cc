@@ -0,0 +1,408 @@
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include <libusb-1.0/libusb.h>
+
+#include "qhy9_sim.h"
+#include "qhy9_dc201.h"
+#include "qhy9_timing.h"
+
+#define SIM_AMBIENT     15.0		/* degC */
+#define SIM_TEC_DELTA   45.0		/* degC below ambient at full PWM */
+#define SIM_TEC_TAU     40.0		/* sec, thermal time constant */
+
+#define SIM_READ_NOISE  6.0		/* ADU */
+#define SIM_SKY_RATE    30.0		/* ADU / sec / unbinned pixel */
+#define SIM_STAR_SIGMA  1.6		/* unbinned pixels */
+
+#define SIM_CHUNK       (256 * 1024)	/* download pacing granularity */
+
+
+
+QHY9SimTransport::QHY9SimTransport()
+{
+	int i;
+
+	pthread_mutex_init(&lock, NULL);
+
+	memset(&regs, 0, sizeof(regs));
+	regsValid = false;
+
+	shutter = 2;
+	filter = 0;
+	exposing = false;
+	cancelled = 0;
+	stopped = 0;
+	realtime = true;
+	progress = NULL;
+	progressArg = NULL;
+
+	ambient = SIM_AMBIENT;
+	sensorTemp = SIM_AMBIENT;
+	pwm = 0;
+	fan = 0;
+	downloading = false;
+	clock_gettime(CLOCK_MONOTONIC, &thermal_time);
+
+	/* same sky every time */
+	seed = 0x51e9;
+
+	for (i = 0; i < NSTARS; i++) {
+		stars[i].x = 20 + nextRandom() % (3584 - 40);
+		stars[i].y = 20 + nextRandom() % (2574 - 40);
+		stars[i].flux = 500.0 * pow(400.0, (nextRandom() % 1000) / 1000.0);
+	}
+
+	/* Box-Muller */
+	for (i = 0; i < NOISE_SIZE; i += 2) {
+		double u1 = (nextRandom() % 65535 + 1) / 65536.0;
+		double u2 = (nextRandom() % 65536) / 65536.0;
+		double r = sqrt(-2.0 * log(u1));
+
+		noise[i]     = r * cos(2 * M_PI * u2);
+		noise[i + 1] = r * sin(2 * M_PI * u2);
+	}
+}
+
+QHY9SimTransport::~QHY9SimTransport()
+{
+	pthread_mutex_destroy(&lock);
+}
+
+uint32_t QHY9SimTransport::nextRandom()
+{
+	/* xorshift32 */
+	seed ^= seed << 13;
+	seed ^= seed >> 17;
+	seed ^= seed << 5;
+
+	return seed;
+}
+
+void QHY9SimTransport::setRealtime(bool realtime)
+{
+	this->realtime = realtime;
+}
+
+double QHY9SimTransport::downloadRate(int speed)
+{
+	/* rough figures for the three readout speeds */
+	switch (speed) {
+	case 0:
+		return 14.0e6;
+	case 1:
+		return 7.0e6;
+	default:
+		return 3.5e6;
+	}
+}
+
+double QHY9SimTransport::getSensorTemperature()
+{
+	double t;
+
+	pthread_mutex_lock(&lock);
+	updateThermal();
+	t = sensorTemp;
+	pthread_mutex_unlock(&lock);
+
+	return t;
+}
+
+/* called with lock held */
+void QHY9SimTransport::updateThermal()
+{
+	struct timespec now;
+	double dt, target;
+	int power = pwm;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	dt = ts_ms(&now, &thermal_time) / 1000.0;
+	thermal_time = now;
+
+	/* the camera drops the TEC while it reads out */
+	if (downloading && regs.DownloadCloseTEC)
+		power = 0;
+
+	target = ambient - SIM_TEC_DELTA * power / 255.0;
+	sensorTemp += (target - sensorTemp) * (1.0 - exp(-dt / SIM_TEC_TAU));
+}
+
+/* called with lock held */
+void QHY9SimTransport::decodeRegisters(const uint8_t *REG)
+{
+	regs.gain = REG[0];
+	regs.offset = REG[1];
+
+	regs.exptime = REG[2] * 65536 + REG[3] * 256 + REG[4];
+
+	regs.hbin = REG[5] ? REG[5] : 1;
+	regs.vbin = REG[6] ? REG[6] : 1;
+
+	regs.LineSize     = REG[7]  * 256 + REG[8];
+	regs.VerticalSize = REG[9]  * 256 + REG[10];
+	regs.SkipTop      = REG[11] * 256 + REG[12];
+	regs.SkipBottom   = REG[13] * 256 + REG[14];
+	regs.patchnum     = REG[17] * 256 + REG[18];
+	regs.TopSkipPix   = REG[47] * 256 + REG[48];
+
+	regs.DownloadSpeed = REG[33];
+	regs.MechanicalShutterMode = REG[51];
+	regs.DownloadCloseTEC = REG[52];
+
+	regsValid = true;
+}
+
+int QHY9SimTransport::vendorWrite(uint8_t request, uint8_t *data, uint16_t length)
+{
+	pthread_mutex_lock(&lock);
+
+	switch (request) {
+	case QHY9_REGISTERS_CMD:
+		if (length != 64) {
+			pthread_mutex_unlock(&lock);
+			return LIBUSB_ERROR_PIPE;
+		}
+		decodeRegisters(data);
+		break;
+
+	case QHY9_BEGIN_VIDEO_CMD:
+		clock_gettime(CLOCK_MONOTONIC, &exposure_start);
+		exposing = true;
+		stopped = 0;
+		break;
+
+	case QHY9_SHUTTER_CMD:
+		if (length >= 1)
+			shutter = data[0];
+		break;
+
+	case QHY9_CFW_CMD:
+		if (length >= 2)
+			filter = data[1];
+		break;
+
+	default:
+		break;
+	}
+
+	pthread_mutex_unlock(&lock);
+
+	return length;
+}
+
+int QHY9SimTransport::interruptWrite(uint8_t *data, int length)
+{
+	pthread_mutex_lock(&lock);
+
+	if (length >= 3 && data[0] == 0x01) {
+		/* DC201: PWM, fan */
+		updateThermal();
+		pwm = data[1];
+		fan = data[2];
+	} else if (length == 1 && data[0] == 0xff) {
+		/* abort exposure, the camera stops sending */
+		exposing = false;
+		stopped = 1;
+	}
+
+	pthread_mutex_unlock(&lock);
+
+	return length;
+}
+
+int QHY9SimTransport::interruptRead(uint8_t *data, int length)
+{
+	int16_t mv;
+
+	if (length < 3)
+		return LIBUSB_ERROR_OVERFLOW;
+
+	/* the driver reads the thermistor as mv_to_degrees(1.024 * raw) */
+	mv = (int16_t) lrint(dc201_degrees_to_mv(getSensorTemperature()) / 1.024);
+
+	memset(data, 0, length);
+	data[1] = (uint8_t) ((uint16_t) mv >> 8);
+	data[2] = (uint8_t) ((uint16_t) mv & 0xff);
+
+	return length;
+}
+
+void QHY9SimTransport::setProgressHandler(void (*handler)(void *arg, long bytes), void *arg)
+{
+	progress = handler;
+	progressArg = arg;
+}
+
+void QHY9SimTransport::cancelRead()
+{
+	cancelled = 1;
+}
+
+void QHY9SimTransport::clearCancel()
+{
+	cancelled = 0;
+}
+
+/* sleep until deadline, false if cancelled or the camera stopped */
+bool QHY9SimTransport::sleepUntil(const struct timespec *deadline)
+{
+	struct timespec now, step;
+	double left;
+
+	for (;;) {
+		if (cancelled || stopped)
+			return false;
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		left = ts_ms(deadline, &now) / 1000.0;
+		if (left <= 0)
+			return true;
+
+		/* wake up now and then to notice a cancel */
+		if (left > 0.01)
+			left = 0.01;
+
+		step.tv_sec = 0;
+		step.tv_nsec = (long) (left * 1e9);
+		nanosleep(&step, NULL);
+	}
+}
+
+void QHY9SimTransport::render(uint16_t *image, const Registers &r, bool dark)
+{
+	double exposure = r.exptime / 1000.0;
+	double gain = 1.0 + r.gain / 64.0;
+	double area = r.hbin * r.vbin;
+	double bias, level, sigma, current;
+	int x, y, i, n;
+	uint32_t k;
+
+	/* dark current doubles every 6 degC */
+	current = 0.2 * pow(2.0, sensorTemp / 6.0);
+
+	bias  = 400.0 + 6.0 * r.offset;
+	level = bias + gain * area * exposure * (current + (dark ? 0.0 : SIM_SKY_RATE));
+	sigma = sqrt(SIM_READ_NOISE * SIM_READ_NOISE + (level - bias));
+
+	n = r.LineSize * r.VerticalSize;
+	k = nextRandom();
+	for (i = 0; i < n; i++) {
+		double v = level + sigma * noise[(k + (uint32_t) i * 7919u) & (NOISE_SIZE - 1)];
+		image[i] = (v <= 0) ? 0 : (v >= 65535) ? 65535 : (uint16_t) v;
+	}
+
+	if (dark)
+		return;
+
+	for (i = 0; i < NSTARS; i++) {
+		double sx = stars[i].x / r.hbin;
+		double sy = stars[i].y / r.vbin - r.SkipTop;
+		double s = SIM_STAR_SIGMA / r.hbin;
+		double amp, v;
+		int x0, x1, y0, y1, box;
+
+		if (s < 0.5)
+			s = 0.5;
+
+		amp = gain * stars[i].flux * exposure / (2 * M_PI * s * s);
+		box = (int) ceil(4 * s);
+
+		x0 = (int) sx - box;
+		x1 = (int) sx + box;
+		y0 = (int) sy - box;
+		y1 = (int) sy + box;
+
+		if (x0 < 0) x0 = 0;
+		if (y0 < 0) y0 = 0;
+		if (x1 >= r.LineSize) x1 = r.LineSize - 1;
+		if (y1 >= r.VerticalSize) y1 = r.VerticalSize - 1;
+
+		for (y = y0; y <= y1; y++) {
+			for (x = x0; x <= x1; x++) {
+				double dx = x + 0.5 - sx, dy = y + 0.5 - sy;
+
+				v = image[y * r.LineSize + x] + amp * exp(-(dx * dx + dy * dy) / (2 * s * s));
+				image[y * r.LineSize + x] = (v >= 65535) ? 65535 : (uint16_t) v;
+			}
+		}
+	}
+}
+
+int QHY9SimTransport::readFrame(uint8_t *data, int psize, int pnum, int *pos)
+{
+	struct timespec start, end, deadline;
+	Registers r;
+	long image, total, sent, chunk;
+	bool dark;
+	double rate;
+
+	*pos = 0;
+
+	/* like the real readout, a cancel before the start sticks */
+	if (cancelled)
+		return LIBUSB_ERROR_INTERRUPTED;
+
+	pthread_mutex_lock(&lock);
+	if (!regsValid || !exposing) {
+		pthread_mutex_unlock(&lock);
+		fprintf(stderr, "sim: readFrame without an exposure\n");
+		return LIBUSB_ERROR_IO;
+	}
+	r = regs;
+	start = exposure_start;
+	dark = r.MechanicalShutterMode || shutter == 1;
+	pthread_mutex_unlock(&lock);
+
+	/* the camera sends the image, then pads to whole packets plus 16 pixels */
+	image = ((long) r.LineSize * r.VerticalSize + r.TopSkipPix) * 2;
+	total = (long) psize * pnum;
+	if (image + (r.patchnum - 16) * 2 != total)
+		fprintf(stderr, "sim: host expects %ld bytes, registers give %ld + %d padding\n",
+			total, image, (r.patchnum - 16) * 2);
+
+	/* the camera holds the data until the exposure is over */
+	end = start;
+	ts_add(&end, r.exptime);
+	if (realtime && !sleepUntil(&end))
+		return LIBUSB_ERROR_INTERRUPTED;
+
+	pthread_mutex_lock(&lock);
+	if (!exposing) {
+		pthread_mutex_unlock(&lock);
+		return LIBUSB_ERROR_INTERRUPTED;
+	}
+	updateThermal();
+	downloading = true;
+	pthread_mutex_unlock(&lock);
+
+	memset(data, 0, total);
+	if (image <= total)
+		render((uint16_t *) data + r.TopSkipPix, r, dark);
+
+	/* pace the transfer at the readout speed */
+	rate = downloadRate(r.DownloadSpeed);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (sent = 0; sent < total; sent += chunk) {
+		chunk = total - sent < SIM_CHUNK ? total - sent : SIM_CHUNK;
+
+		deadline = start;
+		ts_add(&deadline, (sent + chunk) * 1000.0 / rate);
+		if (realtime && !sleepUntil(&deadline))
+			break;
+
+		*pos = (sent + chunk) / psize;
+		if (progress)
+			progress(progressArg, sent + chunk);
+	}
+
+	pthread_mutex_lock(&lock);
+	updateThermal();
+	downloading = false;
+	exposing = false;
+	pthread_mutex_unlock(&lock);
+
+	return (*pos == pnum) ? 0 : LIBUSB_ERROR_INTERRUPTED;
+}
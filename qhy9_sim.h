@@ -0,0 +1,105 @@
+#ifndef __QHY9_SIM_H
+#define __QHY9_SIM_H
+
+#include <time.h>
+#include <pthread.h>
+
+#include "qhy9_transport.h"
+
+/*
+ * Software QHY9 behind the transport interface.
+ *
+ * Decodes the 64 byte register block the way the camera does, renders a
+ * synthetic star field with the same line size, skips and patch padding the
+ * camera would send, paces the download by DownloadSpeed and emulates the
+ * DC201 cooler with a first order thermal model.
+ */
+class QHY9SimTransport : public QHY9Transport
+{
+public:
+	QHY9SimTransport();
+	~QHY9SimTransport();
+
+	const char *getName() { return "Simulator"; }
+
+	int vendorWrite(uint8_t request, uint8_t *data, uint16_t length);
+	int interruptWrite(uint8_t *data, int length);
+	int interruptRead(uint8_t *data, int length);
+	int readFrame(uint8_t *data, int psize, int pnum, int *pos);
+	void cancelRead();
+	void clearCancel();
+	void setProgressHandler(void (*handler)(void *arg, long bytes), void *arg);
+
+	/* wait out exposures and pace downloads in real time; off for benchmarks */
+	void setRealtime(bool realtime);
+
+	double getSensorTemperature();
+
+	/* bytes per second for a DownloadSpeed setting */
+	static double downloadRate(int speed);
+
+private:
+	/* what the camera takes from the register block */
+	struct Registers {
+		int gain;
+		int offset;
+		unsigned long exptime;		/* msec */
+		int hbin, vbin;
+		int LineSize;
+		int VerticalSize;
+		int SkipTop;
+		int SkipBottom;
+		int patchnum;
+		int TopSkipPix;
+		int DownloadSpeed;
+		int MechanicalShutterMode;
+		int DownloadCloseTEC;
+	};
+
+	struct Star {
+		double x, y;			/* unbinned sensor pixels */
+		double flux;			/* ADU per second */
+	};
+
+	static const int NSTARS = 80;
+	static const int NOISE_SIZE = 65536;
+
+	pthread_mutex_t lock;
+
+	Registers regs;
+	bool regsValid;
+
+	int shutter;
+	int filter;
+
+	bool exposing;
+	struct timespec exposure_start;
+
+	volatile int cancelled;			/* host side, cancelRead until clearCancel */
+	volatile int stopped;			/* camera side, abort command until the next exposure */
+	bool realtime;
+
+	void (*progress)(void *arg, long bytes);
+	void *progressArg;
+
+	/* DC201 */
+	double ambient;
+	double sensorTemp;
+	int pwm;
+	int fan;
+	bool downloading;
+	struct timespec thermal_time;
+
+	Star stars[NSTARS];
+	float noise[NOISE_SIZE];		/* unit gaussian samples */
+	uint32_t seed;
+
+	void decodeRegisters(const uint8_t *REG);
+	void updateThermal();
+	void render(uint16_t *image, const Registers &r, bool dark);
+	bool sleepUntil(const struct timespec *deadline);
+
+	uint32_t nextRandom();
+};
+
+#endif
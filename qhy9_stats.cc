@@ -0,0 +1,374 @@
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include <algorithm>
+
+#include "qhy9_stats.h"
+#include "qhy9_kernels.h"
+#include "qhy9_timing.h"
+#include "qhy9_trace.h"
+
+#define SATURATION 65000		/* ADU, a peak this high is clipped */
+#define MAD_SIGMA  1.4826		/* MAD to sigma for gaussian noise */
+#define FWHM_SIGMA 2.3548
+
+
+static double median_of(std::vector<double> &v)
+{
+	size_t mid = v.size() / 2;
+
+	if (v.empty())
+		return 0;
+
+	std::nth_element(v.begin(), v.begin() + mid, v.end());
+	return v[mid];
+}
+
+
+QHY9Stats::QHY9Stats()
+{
+	pthread_mutex_init(&lock, NULL);
+	pthread_cond_init(&work, NULL);
+	pthread_cond_init(&idle, NULL);
+
+	running = false;
+	quit = false;
+
+	data = NULL;
+	w = h = 0;
+	fed = done = 0;
+	started = finishing = ready = busy = false;
+
+	threshold = 5.0;
+	radius = 12;
+
+	memset(&result, 0, sizeof(result));
+}
+
+QHY9Stats::~QHY9Stats()
+{
+	abort();
+
+	if (running) {
+		pthread_mutex_lock(&lock);
+		quit = true;
+		pthread_cond_broadcast(&work);
+		pthread_mutex_unlock(&lock);
+
+		pthread_join(thread, NULL);
+	}
+
+	pthread_cond_destroy(&idle);
+	pthread_cond_destroy(&work);
+	pthread_mutex_destroy(&lock);
+}
+
+void *QHY9Stats::workerEntry(void *arg)
+{
+	((QHY9Stats *) arg)->worker();
+	return NULL;
+}
+
+void QHY9Stats::worker()
+{
+	int y0, y1;
+
+	pthread_mutex_lock(&lock);
+
+	while (!quit) {
+		if (started && done < fed) {
+			y0 = done;
+			y1 = fed;
+			busy = true;
+			pthread_mutex_unlock(&lock);
+
+			countRows(y0, y1);
+
+			pthread_mutex_lock(&lock);
+			done = y1;
+			busy = false;
+			pthread_cond_broadcast(&idle);
+			continue;
+		}
+
+		if (started && finishing && done == h && !ready) {
+			busy = true;
+			pthread_mutex_unlock(&lock);
+
+			summarize();
+
+			pthread_mutex_lock(&lock);
+			ready = true;
+			busy = false;
+			pthread_cond_broadcast(&idle);
+			continue;
+		}
+
+		pthread_cond_wait(&work, &lock);
+	}
+
+	pthread_mutex_unlock(&lock);
+}
+
+void QHY9Stats::begin(const uint16_t *data, int w, int h)
+{
+	abort();
+
+	if (!running) {
+		if (pthread_create(&thread, NULL, workerEntry, this)) {
+			fprintf(stderr, "stats: cannot start worker\n");
+			return;
+		}
+		running = true;
+	}
+
+	pthread_mutex_lock(&lock);
+
+	this->data = data;
+	this->w = w;
+	this->h = h;
+
+	hist.assign(65536, 0);
+	min = 65535;
+	max = 0;
+	sum = 0;
+
+	fed = done = 0;
+	finishing = ready = false;
+	started = true;
+
+	pthread_mutex_unlock(&lock);
+}
+
+void QHY9Stats::feed(size_t npixels)
+{
+	int rows = w ? npixels / w : 0;
+
+	pthread_mutex_lock(&lock);
+
+	if (rows > h)
+		rows = h;
+	if (started && rows > fed) {
+		fed = rows;
+		pthread_cond_signal(&work);
+	}
+
+	pthread_mutex_unlock(&lock);
+}
+
+void QHY9Stats::abort()
+{
+	pthread_mutex_lock(&lock);
+
+	started = false;
+	while (busy)
+		pthread_cond_wait(&idle, &lock);
+
+	pthread_mutex_unlock(&lock);
+}
+
+bool QHY9Stats::finish(QHY9FrameStats *stats)
+{
+	struct timespec t0, t1;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+
+	pthread_mutex_lock(&lock);
+
+	if (!started) {
+		pthread_mutex_unlock(&lock);
+		return false;
+	}
+
+	fed = h;
+	finishing = true;
+	pthread_cond_signal(&work);
+
+	while (!ready)
+		pthread_cond_wait(&idle, &lock);
+
+	started = false;
+	pthread_mutex_unlock(&lock);
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	*stats = result;
+	stats->ms = ts_ms(&t1, &t0);
+
+	qhy9_trace_text("stats: median %.0f mad %.1f, %d stars, hfr %.2f fwhm %.2f, %.2f ms after download",
+			stats->median, stats->mad, stats->stars, stats->hfr, stats->fwhm, stats->ms);
+
+	return true;
+}
+
+/* worker: extremes, sum and histogram of rows y0 .. y1 */
+void QHY9Stats::countRows(int y0, int y1)
+{
+	uint32_t *hp = &hist[0];
+	int x, y;
+
+	for (y = y0; y < y1; y++) {
+		const uint16_t *row = data + (size_t) y * w;
+
+		sum += qhy9_stats_row(row, w, &min, &max);
+		for (x = 0; x < w; x++)
+			hp[row[x]]++;
+	}
+}
+
+/* worker: all rows counted, median and MAD off the histogram, then the stars */
+void QHY9Stats::summarize()
+{
+	size_t n = (size_t) w * h, half = (n + 1) / 2, count;
+	int median, d;
+
+	memset(&result, 0, sizeof(result));
+	if (!n)
+		return;
+
+	result.min = min;
+	result.max = max;
+	result.mean = (double) sum / n;
+
+	for (median = 0, count = 0; median < 65535; median++) {
+		count += hist[median];
+		if (count >= half)
+			break;
+	}
+	result.median = median;
+
+	/* widen a window around the median until it holds half the pixels */
+	count = hist[median];
+	for (d = 0; count < half && d < 65535; ) {
+		d++;
+		if (median - d >= 0)
+			count += hist[median - d];
+		if (median + d <= 65535)
+			count += hist[median + d];
+	}
+	result.mad = d;
+
+	if (threshold > 0)
+		findStars(result.median, result.mad > 0 ? result.mad * MAD_SIGMA : 1.0);
+
+	if (!stars.empty()) {
+		std::vector<double> hfr, fwhm;
+		size_t i;
+
+		for (i = 0; i < stars.size(); i++) {
+			hfr.push_back(stars[i].hfr);
+			fwhm.push_back(stars[i].fwhm);
+		}
+
+		result.stars = stars.size();
+		result.hfr = median_of(hfr);
+		result.fwhm = median_of(fwhm);
+	}
+}
+
+/* worker: local maxima over the threshold, one per box, brightest kept */
+void QHY9Stats::findStars(double background, double sigma)
+{
+	double limit = background + threshold * sigma;
+	int x, y, r = radius, above;
+	size_t i;
+	Star star;
+
+	stars.clear();
+
+	for (y = r; y < h - r; y++) {
+		const uint16_t *row = data + (size_t) y * w;
+		const uint16_t *up = row - w, *down = row + w;
+
+		for (x = r; x < w - r; x++) {
+			uint16_t v = row[x];
+
+			if (v <= limit || v >= SATURATION)
+				continue;
+
+			/* ties go to the first pixel of a flat top */
+			if (v <= row[x - 1] || v <= up[x - 1] || v <= up[x] || v <= up[x + 1] ||
+			    v < row[x + 1] || v < down[x - 1] || v < down[x] || v < down[x + 1])
+				continue;
+
+			/* a star spreads, a hot pixel or cosmic does not */
+			above = (row[x - 1] > limit) + (row[x + 1] > limit) + (up[x] > limit) + (down[x] > limit);
+			if (above < 2)
+				continue;
+
+			if (!measureStar(x, y, background, &star))
+				continue;
+
+			for (i = 0; i < stars.size(); i++)
+				if (fabs(stars[i].x - star.x) < r && fabs(stars[i].y - star.y) < r)
+					break;
+
+			if (i < stars.size()) {
+				if (star.peak > stars[i].peak)
+					stars[i] = star;
+				continue;
+			}
+
+			stars.push_back(star);
+			if ((int) stars.size() >= MAX_STARS)
+				return;
+		}
+	}
+}
+
+/*
+ * worker: centroid, half flux radius and FWHM in the box around a peak. The
+ * background noise is summed with its sign so it cancels out in the wings
+ * instead of widening the star.
+ */
+bool QHY9Stats::measureStar(int x, int y, double background, Star *star)
+{
+	double f, flux = 0, sx = 0, sy = 0, sr = 0, sr2 = 0, dx, dy, r2;
+	int i, j, r = radius;
+
+	for (j = y - r; j <= y + r; j++) {
+		const uint16_t *row = data + (size_t) j * w;
+
+		for (i = x - r; i <= x + r; i++) {
+			f = row[i] - background;
+			flux += f;
+			sx += f * i;
+			sy += f * j;
+		}
+	}
+
+	if (flux <= 0)
+		return false;
+
+	star->x = sx / flux;
+	star->y = sy / flux;
+	if (fabs(star->x - x) > r / 2 || fabs(star->y - y) > r / 2)
+		return false;
+
+	star->peak = data[(size_t) y * w + x] - background;
+	star->flux = flux;
+
+	for (j = y - r; j <= y + r; j++) {
+		const uint16_t *row = data + (size_t) j * w;
+
+		for (i = x - r; i <= x + r; i++) {
+			f = row[i] - background;
+			dx = i - star->x;
+			dy = j - star->y;
+			r2 = dx * dx + dy * dy;
+			sr += f * sqrt(r2);
+			sr2 += f * r2;
+		}
+	}
+
+	if (sr <= 0 || sr2 <= 0)
+		return false;
+
+	star->hfr = sr / flux;
+	/* a round gaussian has <r^2> = 2 sigma^2 */
+	star->fwhm = FWHM_SIGMA * sqrt(sr2 / flux / 2);
+
+	return true;
+}
@@ -0,0 +1,102 @@
+#ifndef __QHY9_STATS_H
+#define __QHY9_STATS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#include <vector>
+
+/* what a frame looks like, for focusing and exposure planning */
+struct QHY9FrameStats {
+	uint16_t min, max;
+	double mean;
+	double median;			/* ADU, from the histogram */
+	double mad;			/* median absolute deviation, ADU */
+	int stars;			/* detected, up to QHY9Stats::MAX_STARS */
+	double hfr, fwhm;		/* px, median over the stars; 0 without stars */
+	double ms;			/* left to do after the download */
+};
+
+/*
+ * Frame statistics on a worker thread.
+ *
+ * Rows are counted into min / max / sum and a 16 bit histogram as they are
+ * fed, so on a direct download most of the work is done by the time the
+ * last packet lands. finish then takes the median and MAD from the histogram
+ * and looks for stars: local maxima some noise sigmas over the background,
+ * measured in a box around their centroid for half flux radius and FWHM
+ * (from the second moment). Hot pixels, saturated stars and those too close
+ * to the edge are left out.
+ *
+ * begin, feed, finish and abort all come from the readout thread; one frame
+ * at a time.
+ */
+class QHY9Stats
+{
+public:
+	static const int MAX_STARS = 500;
+
+	QHY9Stats();
+	~QHY9Stats();
+
+	/* detection threshold in noise sigmas, 0 for no star detection */
+	void setThreshold(double sigma) { threshold = sigma; }
+	/* half size of the box stars are measured in, px */
+	void setRadius(int px) { radius = px < 2 ? 2 : px; }
+
+	/* a new w x h frame at data; the pixels must stay put until finish or abort */
+	void begin(const uint16_t *data, int w, int h);
+
+	/* the first npixels have arrived, count the rows they complete */
+	void feed(size_t npixels);
+
+	/* all rows in, waits for the rest; false if nothing was begun */
+	bool finish(QHY9FrameStats *stats);
+
+	/* drop the frame, waits for the worker so the pixels can go */
+	void abort();
+
+	bool active() { return started; }
+
+private:
+	struct Star {
+		double x, y;
+		double peak, flux;
+		double hfr, fwhm;
+	};
+
+	pthread_mutex_t lock;
+	pthread_cond_t work;		/* worker waits for rows */
+	pthread_cond_t idle;		/* finish and abort wait for the worker */
+	pthread_t thread;
+	bool running;
+	bool quit;
+
+	const uint16_t *data;
+	int w, h;
+	int fed;			/* rows available */
+	int done;			/* rows counted */
+	bool started;
+	bool finishing;			/* all rows fed, summarize when counted */
+	bool ready;			/* result is valid */
+	bool busy;			/* worker is on the pixels */
+
+	double threshold;
+	int radius;
+
+	std::vector<uint32_t> hist;
+	uint16_t min, max;
+	uint64_t sum;
+	std::vector<Star> stars;
+	QHY9FrameStats result;
+
+	static void *workerEntry(void *arg);
+	void worker();
+	void countRows(int y0, int y1);
+	void summarize();
+	void findStars(double background, double sigma);
+	bool measureStar(int x, int y, double background, Star *star);
+};
+
+#endif
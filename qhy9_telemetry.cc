@@ -0,0 +1,226 @@
+#include <string.h>
+#include <math.h>
+
+#include "qhy9_telemetry.h"
+#include "qhy9_timing.h"
+
+
+static void stats_add(QHY9TempStats *stats, double min, double max, double sum, int n)
+{
+	if (!stats->count || min < stats->min) stats->min = min;
+	if (!stats->count || max > stats->max) stats->max = max;
+
+	/* mean holds the sum until the end */
+	stats->mean += sum;
+	stats->count += n;
+}
+
+
+QHY9Telemetry::QHY9Telemetry()
+{
+	pthread_mutex_init(&lock, NULL);
+	reset();
+}
+
+QHY9Telemetry::~QHY9Telemetry()
+{
+	pthread_mutex_destroy(&lock);
+}
+
+void QHY9Telemetry::reset()
+{
+	pthread_mutex_lock(&lock);
+
+	head = count = 0;
+	phead = pcount = 0;
+	ptotal = 0;
+
+	memset(&current, 0, sizeof(current));
+	tsum = psum = esum = 0.0;
+
+	pthread_mutex_unlock(&lock);
+}
+
+/* called with lock held */
+const QHY9TelemetrySample *QHY9Telemetry::sample(int age)
+{
+	return &samples[(head - 1 - age + SAMPLES) % SAMPLES];
+}
+
+/* called with lock held */
+void QHY9Telemetry::closePoint()
+{
+	current.tmean = tsum / current.count;
+	current.power = psum / current.count;
+	current.error = esum / current.count;
+
+	points[phead] = current;
+	phead = (phead + 1) % POINTS;
+	if (pcount < POINTS)
+		pcount++;
+	ptotal++;
+
+	current.count = 0;
+	tsum = psum = esum = 0.0;
+}
+
+void QHY9Telemetry::add(double temperature, double power, double error)
+{
+	QHY9TelemetrySample *s;
+
+	pthread_mutex_lock(&lock);
+
+	s = &samples[head];
+	clock_gettime(CLOCK_MONOTONIC, &s->time);
+	s->temperature = temperature;
+	s->power = power;
+	s->error = error;
+
+	head = (head + 1) % SAMPLES;
+	if (count < SAMPLES)
+		count++;
+
+	if (current.count && ts_ms(&s->time, &current.start) >= POINT_SEC * 1000.0)
+		closePoint();
+
+	if (!current.count) {
+		current.start = s->time;
+		current.tmin = current.tmax = temperature;
+	}
+	if (temperature < current.tmin) current.tmin = temperature;
+	if (temperature > current.tmax) current.tmax = temperature;
+
+	tsum += temperature;
+	psum += power;
+	esum += error;
+	current.count++;
+
+	pthread_mutex_unlock(&lock);
+}
+
+bool QHY9Telemetry::stability(double window, double *error, double *slope, double *power, QHY9TempStats *stats)
+{
+	const QHY9TelemetrySample *s, *last;
+	double t, sx = 0, sy = 0, sxx = 0, sxy = 0, psum = 0, emax = 0, d;
+	bool covered = false;
+	int i, n = 0;
+
+	memset(stats, 0, sizeof(*stats));
+	*error = *slope = *power = 0.0;
+
+	pthread_mutex_lock(&lock);
+
+	if (!count) {
+		pthread_mutex_unlock(&lock);
+		return false;
+	}
+
+	last = sample(0);
+
+	for (i = 0; i < count; i++) {
+		s = sample(i);
+		t = ts_ms(&s->time, &last->time) / 1000.0;	/* <= 0 */
+		if (-t > window) {
+			covered = true;
+			break;
+		}
+
+		sx += t;
+		sy += s->temperature;
+		sxx += t * t;
+		sxy += t * s->temperature;
+		psum += s->power;
+		if (fabs(s->error) > emax)
+			emax = fabs(s->error);
+
+		stats_add(stats, s->temperature, s->temperature, s->temperature, 1);
+		n++;
+	}
+
+	pthread_mutex_unlock(&lock);
+
+	stats->mean /= n;
+	*error = emax;
+	*power = psum / n;
+
+	/* least squares, per minute */
+	d = n * sxx - sx * sx;
+	if (n > 1 && d > 0)
+		*slope = (n * sxy - sx * sy) / d * 60.0;
+
+	return covered;
+}
+
+void QHY9Telemetry::range(const struct timespec *from, const struct timespec *to, QHY9TempStats *stats)
+{
+	const QHY9TelemetrySample *s, *before = NULL;
+	const QHY9TelemetryPoint *p;
+	struct timespec oldest;
+	int i;
+
+	memset(stats, 0, sizeof(*stats));
+
+	pthread_mutex_lock(&lock);
+
+	for (i = 0; i < count; i++) {
+		s = sample(i);
+		if (ts_ms(&s->time, to) > 0)
+			continue;
+		if (ts_ms(&s->time, from) < 0) {
+			before = s;
+			break;
+		}
+
+		stats_add(stats, s->temperature, s->temperature, s->temperature, 1);
+	}
+
+	/* long exposure, the raw samples do not reach back to the start */
+	if (count && !before) {
+		oldest = sample(count - 1)->time;
+
+		for (i = 0; i < pcount; i++) {
+			p = &points[(phead - 1 - i + POINTS) % POINTS];
+			if (ts_ms(&p->start, from) < 0)
+				break;
+			if (ts_ms(&oldest, &p->start) < POINT_SEC * 1000.0)
+				continue;
+
+			stats_add(stats, p->tmin, p->tmax, (double) p->tmean * p->count, p->count);
+		}
+	}
+
+	/* shorter than a cooler step */
+	if (!stats->count && before)
+		stats_add(stats, before->temperature, before->temperature, before->temperature, 1);
+
+	pthread_mutex_unlock(&lock);
+
+	if (stats->count)
+		stats->mean /= stats->count;
+}
+
+int QHY9Telemetry::history(QHY9TelemetryPoint *out, int max)
+{
+	int i, n;
+
+	pthread_mutex_lock(&lock);
+
+	n = (pcount < max) ? pcount : max;
+	for (i = 0; i < n; i++)
+		out[i] = points[(phead - n + i + POINTS) % POINTS];
+
+	pthread_mutex_unlock(&lock);
+
+	return n;
+}
+
+unsigned long QHY9Telemetry::pointCount()
+{
+	unsigned long n;
+
+	pthread_mutex_lock(&lock);
+	n = ptotal;
+	pthread_mutex_unlock(&lock);
+
+	return n;
+}
@@ -0,0 +1,83 @@
+#ifndef __QHY9_TELEMETRY_H
+#define __QHY9_TELEMETRY_H
+
+#include <time.h>
+#include <pthread.h>
+
+/* one cooler step */
+struct QHY9TelemetrySample {
+	struct timespec time;		/* CLOCK_MONOTONIC */
+	float temperature;		/* degC */
+	float power;			/* TEC output, 0..1 */
+	float error;			/* temperature - setpoint, degC */
+};
+
+/* POINT_SEC worth of samples folded into one */
+struct QHY9TelemetryPoint {
+	struct timespec start;		/* CLOCK_MONOTONIC */
+	int count;
+	float tmin, tmax, tmean;
+	float power;			/* mean */
+	float error;			/* mean */
+};
+
+struct QHY9TempStats {
+	int count;			/* samples behind it, 0 if none */
+	double min, max, mean;
+};
+
+/*
+ * Cooler telemetry in fixed memory: the last SAMPLES raw samples, enough
+ * for the stability window, and POINTS downsampled points for the history.
+ * The cooler thread adds, the main loop reads; all calls lock.
+ */
+class QHY9Telemetry
+{
+public:
+	static const int SAMPLES   = 1200;	/* 5 min at 4 Hz */
+	static const int POINT_SEC = 10;
+	static const int POINTS    = 360;	/* 1 h */
+
+	QHY9Telemetry();
+	~QHY9Telemetry();
+
+	void reset();
+
+	void add(double temperature, double power, double error);
+
+	/*
+	 * Over the last window seconds: the largest setpoint error, the
+	 * temperature slope in degC per minute and min / max / mean. False while
+	 * the samples cover less than window.
+	 */
+	bool stability(double window, double *error, double *slope, double *power, QHY9TempStats *stats);
+
+	/* temperature between two CLOCK_MONOTONIC times, the last sample before if none fall in */
+	void range(const struct timespec *from, const struct timespec *to, QHY9TempStats *stats);
+
+	/* completed history points, oldest first; returns how many */
+	int history(QHY9TelemetryPoint *points, int max);
+
+	/* points completed since reset, to spot new ones */
+	unsigned long pointCount();
+
+private:
+	pthread_mutex_t lock;
+
+	QHY9TelemetrySample samples[SAMPLES];
+	int head;			/* next slot */
+	int count;
+
+	QHY9TelemetryPoint points[POINTS];
+	int phead;
+	int pcount;
+	unsigned long ptotal;
+
+	QHY9TelemetryPoint current;	/* point being filled */
+	double tsum, psum, esum;
+
+	const QHY9TelemetrySample *sample(int age);	/* 0 is the newest */
+	void closePoint();
+};
+
+#endif
@@ -0,0 +1,80 @@
+#include <string.h>
+
+#include <algorithm>
+
+#include "qhy9_timing.h"
+
+static const char *phase_names[QHY9_NPHASES] = {
+	"UPLOAD", "SETTLE", "SHUTTER", "EXPOSURE", "DOWNLOAD", "EXTRACT", "FITS", "BLOB"
+};
+
+const char *qhy9_phase_name(int phase)
+{
+	if (phase < 0 || phase >= QHY9_NPHASES)
+		return "";
+
+	return phase_names[phase];
+}
+
+QHY9PhaseStats::QHY9PhaseStats()
+{
+	reset();
+}
+
+void QHY9PhaseStats::reset()
+{
+	memset(samples, 0, sizeof(samples));
+	head = 0;
+	count = 0;
+}
+
+void QHY9PhaseStats::add(const double *ms)
+{
+	int i;
+
+	for (i = 0; i < QHY9_NPHASES; i++)
+		samples[i][head] = ms[i];
+
+	head = (head + 1) % WINDOW;
+	if (count < WINDOW)
+		count++;
+}
+
+double QHY9PhaseStats::last(int phase)
+{
+	if (!count)
+		return 0;
+
+	return samples[phase][(head + WINDOW - 1) % WINDOW];
+}
+
+double QHY9PhaseStats::mean(int phase)
+{
+	double sum = 0;
+	int i;
+
+	if (!count)
+		return 0;
+
+	/* the valid slots are always the first count ones until the window fills */
+	for (i = 0; i < count; i++)
+		sum += samples[phase][i];
+
+	return sum / count;
+}
+
+double QHY9PhaseStats::p95(int phase)
+{
+	double sorted[WINDOW];
+	int i;
+
+	if (!count)
+		return 0;
+
+	memcpy(sorted, samples[phase], count * sizeof(double));
+	std::sort(sorted, sorted + count);
+
+	i = (int) (0.95 * (count - 1) + 0.5);
+
+	return sorted[i];
+}
@@ -0,0 +1,65 @@
+#ifndef __QHY9_TIMING_H
+#define __QHY9_TIMING_H
+
+#include <time.h>
+
+/* msec between two timespecs, t1 - t2 */
+static inline double ts_ms(const struct timespec *t1, const struct timespec *t2)
+{
+	return (t1->tv_sec - t2->tv_sec) * 1000.0 + (t1->tv_nsec - t2->tv_nsec) / 1000000.0;
+}
+
+/* move ts on by ms msec */
+static inline void ts_add(struct timespec *ts, double ms)
+{
+	long long ns = ts->tv_nsec + (long long) (ms * 1000000.0);
+
+	ts->tv_sec += ns / 1000000000;
+	ts->tv_nsec = ns % 1000000000;
+}
+
+/* phases of a frame, in the order they happen */
+enum {
+	QHY9_PHASE_UPLOAD = 0,		/* register upload */
+	QHY9_PHASE_SETTLE,		/* wait after the upload */
+	QHY9_PHASE_SHUTTER,		/* closing the shutter for darks */
+	QHY9_PHASE_EXPOSURE,		/* exposure, as timed by the host */
+	QHY9_PHASE_DOWNLOAD,		/* USB transfer */
+	QHY9_PHASE_EXTRACT,		/* crop, bin, byte swap */
+	QHY9_PHASE_FITS,		/* FITS header */
+	QHY9_PHASE_BLOB,		/* image data, compression and BLOB send */
+	QHY9_NPHASES
+};
+
+/* "UPLOAD", "SETTLE", ... */
+const char *qhy9_phase_name(int phase);
+
+/*
+ * Last, mean and 95th percentile of each phase over the last WINDOW frames.
+ * Not locked, feed and read it from one thread.
+ */
+class QHY9PhaseStats
+{
+public:
+	static const int WINDOW = 64;
+
+	QHY9PhaseStats();
+
+	void reset();
+
+	/* one frame worth of phase times, msec */
+	void add(const double *ms);
+
+	double last(int phase);
+	double mean(int phase);
+	double p95(int phase);
+
+	int frames() { return count; }
+
+private:
+	double samples[QHY9_NPHASES][WINDOW];
+	int head;			/* next slot */
+	int count;			/* valid slots */
+};
+
+#endif
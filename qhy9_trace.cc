@@ -0,0 +1,308 @@
+#include <string.h>
+#include <stdarg.h>
+#include <time.h>
+
+#include <vector>
+
+#include "qhy9_trace.h"
+#include "qhy9_timing.h"
+
+#define TRACE_MASK (QHY9_TRACE_RECORDS - 1)
+
+/* binary dump header */
+#define TRACE_MAGIC   "QHY9TRC1"
+
+struct TraceFileHeader {
+	char magic[8];
+	uint32_t record_size;
+	uint32_t count;
+};
+
+static QHY9TraceRecord ring[QHY9_TRACE_RECORDS];
+static uint64_t head;			/* next slot to claim */
+
+static __thread int trace_source;
+
+static const char *usb_ops[] = { "vendor", "int-write", "int-read", "bulk", "xfer", "resume" };
+
+
+static QHY9TraceRecord *trace_begin(int type, int len, uint64_t *slotp)
+{
+	struct timespec ts;
+	QHY9TraceRecord *rec;
+	uint64_t slot;
+
+	slot = *slotp = __atomic_fetch_add(&head, 1, __ATOMIC_RELAXED);
+	rec = &ring[slot & TRACE_MASK];
+
+	/* readers skip the slot until it is published again */
+	__atomic_store_n(&rec->seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	rec->ns = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	rec->type = type;
+	rec->len = len;
+	rec->source = trace_source;
+
+	return rec;
+}
+
+void qhy9_trace_set_source(int source)
+{
+	trace_source = source;
+}
+
+static void trace_end(QHY9TraceRecord *rec, uint64_t slot)
+{
+	__atomic_store_n(&rec->seq, slot + 1, __ATOMIC_RELEASE);
+}
+
+void qhy9_trace_text(const char *fmt, ...)
+{
+	uint64_t slot;
+	QHY9TraceRecord *rec = trace_begin(QHY9_TRACE_TEXT, QHY9_TRACE_PAYLOAD, &slot);
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(rec->u.text, sizeof(rec->u.text), fmt, ap);
+	va_end(ap);
+
+	trace_end(rec, slot);
+}
+
+void qhy9_trace_regs(const uint8_t *REG, int dirty)
+{
+	uint64_t slot;
+	QHY9TraceRecord *rec = trace_begin(QHY9_TRACE_REGS, sizeof(rec->u.regs), &slot);
+
+	memcpy(rec->u.regs.reg, REG, 64);
+	rec->u.regs.dirty = dirty;
+
+	trace_end(rec, slot);
+}
+
+void qhy9_trace_layout(int LineSize, int VerticalSize, int SkipTop, int SkipBottom,
+		       int p_size, int total_p, int patchnum, int hwbin)
+{
+	uint64_t slot;
+	QHY9TraceRecord *rec = trace_begin(QHY9_TRACE_LAYOUT, sizeof(rec->u.layout), &slot);
+
+	rec->u.layout.LineSize = LineSize;
+	rec->u.layout.VerticalSize = VerticalSize;
+	rec->u.layout.SkipTop = SkipTop;
+	rec->u.layout.SkipBottom = SkipBottom;
+	rec->u.layout.p_size = p_size;
+	rec->u.layout.total_p = total_p;
+	rec->u.layout.patchnum = patchnum;
+	rec->u.layout.hwbin = hwbin;
+
+	trace_end(rec, slot);
+}
+
+void qhy9_trace_frame(int x, int y, int w, int h, int hwbin, int sbx, int sby, int direct)
+{
+	uint64_t slot;
+	QHY9TraceRecord *rec = trace_begin(QHY9_TRACE_FRAME, sizeof(rec->u.frame), &slot);
+
+	rec->u.frame.x = x;
+	rec->u.frame.y = y;
+	rec->u.frame.w = w;
+	rec->u.frame.h = h;
+	rec->u.frame.hwbin = hwbin;
+	rec->u.frame.sbx = sbx;
+	rec->u.frame.sby = sby;
+	rec->u.frame.direct = direct;
+
+	trace_end(rec, slot);
+}
+
+void qhy9_trace_usb(int op, int request, int result, int length, int pos)
+{
+	uint64_t slot;
+	QHY9TraceRecord *rec = trace_begin(QHY9_TRACE_USB, sizeof(rec->u.usb), &slot);
+
+	rec->u.usb.op = op;
+	rec->u.usb.request = request;
+	rec->u.usb.result = result;
+	rec->u.usb.length = length;
+	rec->u.usb.pos = pos;
+
+	trace_end(rec, slot);
+}
+
+void qhy9_trace_pid(double temp, double target, double pwm, double error, double integral, double deriv)
+{
+	uint64_t slot;
+	QHY9TraceRecord *rec = trace_begin(QHY9_TRACE_PID, sizeof(rec->u.pid), &slot);
+
+	rec->u.pid.temp = temp;
+	rec->u.pid.target = target;
+	rec->u.pid.pwm = pwm;
+	rec->u.pid.error = error;
+	rec->u.pid.integral = integral;
+	rec->u.pid.deriv = deriv;
+
+	trace_end(rec, slot);
+}
+
+void qhy9_trace_timing(const double *ms, int n)
+{
+	QHY9TraceRecord *rec;
+	uint64_t slot;
+	int max = sizeof(rec->u.timing) / sizeof(double);
+
+	if (n > max)
+		n = max;
+
+	rec = trace_begin(QHY9_TRACE_TIMING, n * sizeof(double), &slot);
+	memcpy(rec->u.timing, ms, n * sizeof(double));
+
+	trace_end(rec, slot);
+}
+
+int qhy9_trace_snapshot(QHY9TraceRecord *out, int max)
+{
+	uint64_t end, slot, seq;
+	QHY9TraceRecord *rec;
+	int n = 0;
+
+	end = __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+	slot = end > QHY9_TRACE_RECORDS ? end - QHY9_TRACE_RECORDS : 0;
+	if (end - slot > (uint64_t) max)
+		slot = end - max;
+
+	for (; slot < end; slot++) {
+		rec = &ring[slot & TRACE_MASK];
+
+		/* skip slots being written or already reused */
+		seq = __atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE);
+		if (seq != slot + 1)
+			continue;
+
+		memcpy(&out[n], rec, sizeof(*rec));
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&rec->seq, __ATOMIC_RELAXED) != seq)
+			continue;
+
+		n++;
+	}
+
+	return n;
+}
+
+void qhy9_trace_print(FILE *fp, const QHY9TraceRecord *rec, int n)
+{
+	uint64_t t0 = n ? rec[0].ns : 0;
+	int i, j;
+
+	for (i = 0; i < n; i++, rec++) {
+		fprintf(fp, "%12.6f [%u] ", (rec->ns - t0) / 1e9, rec->source);
+
+		switch (rec->type) {
+		case QHY9_TRACE_TEXT:
+			fprintf(fp, "text    %.*s\n", QHY9_TRACE_PAYLOAD, rec->u.text);
+			break;
+
+		case QHY9_TRACE_REGS:
+			fprintf(fp, "regs    %s", rec->u.regs.dirty == 1 ? "timing" : "full");
+			for (j = 0; j < 64; j++)
+				fprintf(fp, "%s%02x", (j % 16) ? " " : "\n                   ", rec->u.regs.reg[j]);
+			fprintf(fp, "\n");
+			break;
+
+		case QHY9_TRACE_LAYOUT:
+			fprintf(fp, "layout  bin %d linesize %d vertsize %d skip %d/%d p_size %d total_p %d patchnum %d\n",
+				rec->u.layout.hwbin, rec->u.layout.LineSize, rec->u.layout.VerticalSize,
+				rec->u.layout.SkipTop, rec->u.layout.SkipBottom,
+				rec->u.layout.p_size, rec->u.layout.total_p, rec->u.layout.patchnum);
+			break;
+
+		case QHY9_TRACE_FRAME:
+			fprintf(fp, "frame   %dx%d+%d+%d hwbin %d swbin %dx%d %s\n",
+				rec->u.frame.w, rec->u.frame.h, rec->u.frame.x, rec->u.frame.y,
+				rec->u.frame.hwbin, rec->u.frame.sbx, rec->u.frame.sby,
+				rec->u.frame.direct ? "direct" : "staged");
+			break;
+
+		case QHY9_TRACE_USB:
+			fprintf(fp, "usb     %s 0x%02x result %d length %d pos %d\n",
+				(rec->u.usb.op >= 0 && rec->u.usb.op <= QHY9_TRACE_USB_RESUME) ? usb_ops[rec->u.usb.op] : "?",
+				rec->u.usb.request, rec->u.usb.result, rec->u.usb.length, rec->u.usb.pos);
+			break;
+
+		case QHY9_TRACE_PID:
+			fprintf(fp, "pid     temp %.3f target %.3f PWM %.0f err %.6f int %.6f der %.6f\n",
+				rec->u.pid.temp, rec->u.pid.target, rec->u.pid.pwm,
+				rec->u.pid.error, rec->u.pid.integral, rec->u.pid.deriv);
+			break;
+
+		case QHY9_TRACE_TIMING:
+			fprintf(fp, "timing ");
+			for (j = 0; j < (int) (rec->len / sizeof(double)); j++)
+				fprintf(fp, " %s %.1f", qhy9_phase_name(j), rec->u.timing[j]);
+			fprintf(fp, "\n");
+			break;
+
+		default:
+			fprintf(fp, "type %d, %d bytes\n", rec->type, rec->len);
+			break;
+		}
+	}
+}
+
+int qhy9_trace_dump_text(const char *path)
+{
+	std::vector<QHY9TraceRecord> rec(QHY9_TRACE_RECORDS);
+	FILE *fp;
+	int n;
+
+	n = qhy9_trace_snapshot(&rec[0], QHY9_TRACE_RECORDS);
+
+	fp = fopen(path, "w");
+	if (!fp)
+		return -1;
+
+	qhy9_trace_print(fp, &rec[0], n);
+
+	return fclose(fp) ? -1 : 0;
+}
+
+int qhy9_trace_dump_binary(const char *path)
+{
+	std::vector<QHY9TraceRecord> rec(QHY9_TRACE_RECORDS);
+	TraceFileHeader hdr;
+	FILE *fp;
+	int n, ok;
+
+	n = qhy9_trace_snapshot(&rec[0], QHY9_TRACE_RECORDS);
+
+	memcpy(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic));
+	hdr.record_size = sizeof(QHY9TraceRecord);
+	hdr.count = n;
+
+	fp = fopen(path, "wb");
+	if (!fp)
+		return -1;
+
+	ok = fwrite(&hdr, sizeof(hdr), 1, fp) == 1 &&
+	     fwrite(&rec[0], sizeof(QHY9TraceRecord), n, fp) == (size_t) n;
+
+	return (fclose(fp) || !ok) ? -1 : 0;
+}
+
+int qhy9_trace_load(FILE *fp, QHY9TraceRecord *out, int max)
+{
+	TraceFileHeader hdr;
+	int n;
+
+	if (fread(&hdr, sizeof(hdr), 1, fp) != 1 ||
+	    memcmp(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic)) ||
+	    hdr.record_size != sizeof(QHY9TraceRecord))
+		return -1;
+
+	n = hdr.count < (uint32_t) max ? hdr.count : max;
+
+	return fread(out, sizeof(QHY9TraceRecord), n, fp);
+}
@@ -0,0 +1,103 @@
+#ifndef __QHY9_TRACE_H
+#define __QHY9_TRACE_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+/*
+ * In-memory trace ring.
+ *
+ * Fixed size binary records, written lock-free from any thread: a writer
+ * claims a slot with an atomic increment and publishes it by storing the
+ * slot sequence last. The newest QHY9_TRACE_RECORDS records are kept.
+ * Nothing is formatted until the ring is dumped.
+ */
+
+#define QHY9_TRACE_RECORDS 4096		/* power of two */
+
+enum {
+	QHY9_TRACE_TEXT = 1,		/* short message */
+	QHY9_TRACE_REGS,		/* register block upload */
+	QHY9_TRACE_LAYOUT,		/* frame layout from the registers */
+	QHY9_TRACE_FRAME,		/* download started */
+	QHY9_TRACE_USB,			/* USB request result */
+	QHY9_TRACE_PID,			/* cooler control step */
+	QHY9_TRACE_TIMING,		/* phase times of a delivered frame */
+};
+
+/* QHY9_TRACE_USB operations */
+enum {
+	QHY9_TRACE_USB_VENDOR = 0,	/* request = vendor command */
+	QHY9_TRACE_USB_INT_WRITE,
+	QHY9_TRACE_USB_INT_READ,
+	QHY9_TRACE_USB_BULK,		/* whole frame */
+	QHY9_TRACE_USB_XFER,		/* one failed bulk transfer, request = libusb status */
+	QHY9_TRACE_USB_RESUME,		/* download restarted at pos bytes */
+};
+
+#define QHY9_TRACE_PAYLOAD 72
+
+struct QHY9TraceRecord {
+	uint64_t seq;			/* slot number + 1 once written */
+	uint64_t ns;			/* CLOCK_MONOTONIC */
+	uint16_t type;
+	uint16_t len;
+	uint32_t source;		/* camera that wrote it */
+
+	union {
+		char text[QHY9_TRACE_PAYLOAD];
+
+		struct {
+			uint8_t reg[64];
+			int32_t dirty;
+		} regs;
+
+		struct {
+			int32_t LineSize, VerticalSize, SkipTop, SkipBottom;
+			int32_t p_size, total_p, patchnum, hwbin;
+		} layout;
+
+		struct {
+			int32_t x, y, w, h;
+			int32_t hwbin, sbx, sby;
+			int32_t direct;
+		} frame;
+
+		struct {
+			int32_t op, request, result, length, pos;
+		} usb;
+
+		struct {
+			double temp, target, pwm, error, integral, deriv;
+		} pid;
+
+		double timing[9];
+	} u;
+};
+
+/* camera the calling thread works for, tags everything it writes */
+void qhy9_trace_set_source(int source);
+
+void qhy9_trace_text(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+void qhy9_trace_regs(const uint8_t *REG, int dirty);
+void qhy9_trace_layout(int LineSize, int VerticalSize, int SkipTop, int SkipBottom,
+		       int p_size, int total_p, int patchnum, int hwbin);
+void qhy9_trace_frame(int x, int y, int w, int h, int hwbin, int sbx, int sby, int direct);
+void qhy9_trace_usb(int op, int request, int result, int length, int pos);
+void qhy9_trace_pid(double temp, double target, double pwm, double error, double integral, double deriv);
+void qhy9_trace_timing(const double *ms, int n);
+
+/* copy out the records still in the ring, oldest first; returns how many */
+int qhy9_trace_snapshot(QHY9TraceRecord *out, int max);
+
+/* decode records as text */
+void qhy9_trace_print(FILE *fp, const QHY9TraceRecord *rec, int n);
+
+/* whole ring, as text or as a binary file for qhy9_trace_decode; 0 on success */
+int qhy9_trace_dump_text(const char *path);
+int qhy9_trace_dump_binary(const char *path);
+
+/* read a binary dump back; returns the number of records or -1 */
+int qhy9_trace_load(FILE *fp, QHY9TraceRecord *out, int max);
+
+#endif
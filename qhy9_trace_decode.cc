@@ -0,0 +1,39 @@
+/*
+ * Decode a binary trace dump written by the driver (TRACE_DUMP, Binary).
+ */
+
+#include <stdio.h>
+
+#include <vector>
+
+#include "qhy9_trace.h"
+
+int main(int argc, char *argv[])
+{
+	std::vector<QHY9TraceRecord> rec(QHY9_TRACE_RECORDS);
+	FILE *fp;
+	int n;
+
+	if (argc != 2) {
+		fprintf(stderr, "usage: %s trace.bin\n", argv[0]);
+		return 1;
+	}
+
+	fp = fopen(argv[1], "rb");
+	if (!fp) {
+		perror(argv[1]);
+		return 1;
+	}
+
+	n = qhy9_trace_load(fp, &rec[0], QHY9_TRACE_RECORDS);
+	fclose(fp);
+
+	if (n < 0) {
+		fprintf(stderr, "%s: not a QHY9 trace\n", argv[1]);
+		return 1;
+	}
+
+	qhy9_trace_print(stdout, &rec[0], n);
+
+	return 0;
+}
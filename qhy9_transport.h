@@ -0,0 +1,77 @@
+#ifndef __QHY9_TRANSPORT_H
+#define __QHY9_TRANSPORT_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+/* control request types */
+// LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE;
+static const int QHY9_VENDOR_REQUEST_WRITE = 0x40;
+
+// LIBUSB_ENDPOINT_IN  | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE;
+static const int QHY9_VENDOR_REQUEST_READ  = 0xC0;
+
+/* vendor request commands */
+static const int QHY9_BEGIN_VIDEO_CMD = 0xB3;
+static const int QHY9_REGISTERS_CMD   = 0xB5;
+static const int QHY9_CFW_CMD         = 0xC1;
+static const int QHY9_VERSION_CMD     = 0xC2;
+static const int QHY9_SHUTTER_CMD     = 0xC7;
+
+static const int QHY9_DATA_BULK_EP       = 0x86;
+static const int QHY9_INTERRUPT_WRITE_EP = 0x01;
+static const int QHY9_INTERRUPT_READ_EP  = 0x81;
+
+
+/*
+ * Everything the driver says to the camera goes through a transport: vendor
+ * requests, the DC201 interrupt endpoints and the frame data endpoint. Return
+ * values follow libusb, bytes transferred or a negative LIBUSB_ERROR code.
+ *
+ * readFrame runs on the readout thread, the interrupt endpoints belong to the
+ * cooler thread and vendor requests come from the main loop, so
+ * implementations must allow the three at the same time.
+ */
+class QHY9Transport
+{
+public:
+	virtual ~QHY9Transport() {}
+
+	virtual const char *getName() = 0;
+
+	/* vendor request, QHY9_VENDOR_REQUEST_WRITE */
+	virtual int vendorWrite(uint8_t request, uint8_t *data, uint16_t length) = 0;
+
+	/* DC201 and abort, QHY9_INTERRUPT_WRITE_EP / QHY9_INTERRUPT_READ_EP */
+	virtual int interruptWrite(uint8_t *data, int length) = 0;
+	virtual int interruptRead(uint8_t *data, int length) = 0;
+
+	/* frame data, pnum packets of psize bytes; *pos is the number of complete packets received */
+	virtual int readFrame(uint8_t *data, int psize, int pnum, int *pos) = 0;
+
+	/*
+	 * Abort a readFrame in progress, from any thread. It stays aborted, a
+	 * readFrame that has not started yet returns right away, until
+	 * clearCancel, which the readout thread calls as it takes on a new frame.
+	 */
+	virtual void cancelRead() = 0;
+	virtual void clearCancel() {}
+
+	/*
+	 * Hotplug. handler runs on a transport thread when the camera goes away
+	 * or a camera shows up; the driver then checks isLost and calls reopen
+	 * from its own thread. Transports that cannot lose the camera keep these.
+	 */
+	virtual void setHotplugHandler(void (*handler)(void *arg), void *arg) {}
+	virtual bool isLost() { return false; }
+	virtual bool reopen() { return true; }
+
+	/* called on the readout thread as readFrame data arrives, bytes so far, in order */
+	virtual void setProgressHandler(void (*handler)(void *arg, long bytes), void *arg) {}
+
+	/* buffers for readFrame, may come from device memory */
+	virtual uint8_t *allocBuffer(size_t size) { return (uint8_t *) malloc(size); }
+	virtual void freeBuffer(uint8_t *buffer, size_t size) { free(buffer); }
+};
+
+#endif
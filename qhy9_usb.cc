@@ -0,0 +1,399 @@
+#include <stdio.h>
+
+#include "qhy9_usb.h"
+#include "qhy9_trace.h"
+
+
+QHY9USBTransport::QHY9USBTransport(QHY9Readout *readout)
+{
+	ctx = NULL;
+	handle = NULL;
+	devmem = NULL;
+
+	hotplug = false;
+	lost = false;
+	arrived = NULL;
+	pthread_mutex_init(&hotplugLock, NULL);
+	hotplugHandler = NULL;
+	hotplugArg = NULL;
+
+	eventRunning = false;
+	eventQuit = 0;
+
+	this->readout = readout;
+}
+
+QHY9USBTransport::~QHY9USBTransport()
+{
+	close();
+
+	if (eventRunning) {
+		eventQuit = 1;
+		pthread_join(eventThread, NULL);
+	}
+
+	if (hotplug)
+		libusb_hotplug_deregister_callback(ctx, hotplugHandle);
+
+	if (arrived)
+		libusb_unref_device(arrived);
+
+	if (ctx)
+		libusb_exit(ctx);
+
+	pthread_mutex_destroy(&hotplugLock);
+}
+
+static bool is_qhy9(libusb_device *dev, struct libusb_device_descriptor *desc)
+{
+	unsigned int devID;
+
+	if (libusb_get_device_descriptor(dev, desc) < 0)
+		return false;
+
+	devID = (desc->idVendor << 16) + desc->idProduct;
+
+	return devID == QHY9_USB_DEVID;
+}
+
+static std::string device_port(libusb_device *dev)
+{
+	uint8_t ports[8];
+	char buf[64];
+	int i, n, len;
+
+	len = snprintf(buf, sizeof(buf), "%d", libusb_get_bus_number(dev));
+
+	n = libusb_get_port_numbers(dev, ports, sizeof(ports));
+	for (i = 0; i < n && len < (int) sizeof(buf); i++)
+		len += snprintf(buf + len, sizeof(buf) - len, "%c%d", i ? '.' : '-', ports[i]);
+
+	return buf;
+}
+
+static std::string device_serial(libusb_device_handle *handle, struct libusb_device_descriptor *desc)
+{
+	unsigned char buf[64];
+
+	if (!desc->iSerialNumber ||
+	    libusb_get_string_descriptor_ascii(handle, desc->iSerialNumber, buf, sizeof(buf)) <= 0)
+		return "";
+
+	return (char *) buf;
+}
+
+int QHY9USBTransport::enumerate(std::vector<QHY9DeviceInfo> &devices)
+{
+	libusb_context *ctx;
+	libusb_device **list;
+	libusb_device_handle *handle;
+	struct libusb_device_descriptor desc;
+	QHY9DeviceInfo info;
+	int i, n;
+
+	devices.clear();
+
+	if (libusb_init(&ctx))
+		return 0;
+
+	n = libusb_get_device_list(ctx, &list);
+	for (i = 0; i < n; i++) {
+		if (!is_qhy9(list[i], &desc))
+			continue;
+
+		info.port = device_port(list[i]);
+		info.serial = "";
+
+		/* a camera in use by someone else still counts */
+		if (libusb_open(list[i], &handle) == 0) {
+			info.serial = device_serial(handle, &desc);
+			libusb_close(handle);
+		}
+
+		devices.push_back(info);
+	}
+
+	if (n >= 0)
+		libusb_free_device_list(list, 1);
+	libusb_exit(ctx);
+
+	return devices.size();
+}
+
+/* libusb context and hotplug watch, once per transport */
+bool QHY9USBTransport::initContext()
+{
+	if (ctx)
+		return true;
+
+	if (libusb_init(&ctx)) {
+		ctx = NULL;
+		return false;
+	}
+
+	if (libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG) &&
+	    libusb_hotplug_register_callback(ctx,
+			(libusb_hotplug_event) (LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT),
+			LIBUSB_HOTPLUG_NO_FLAGS, QHY9_USB_DEVID >> 16, QHY9_USB_DEVID & 0xffff,
+			LIBUSB_HOTPLUG_MATCH_ANY, hotplugCallback, this, &hotplugHandle) == 0)
+		hotplug = true;
+	else
+		fprintf(stderr, "usb: no hotplug support, reconnects are polled\n");
+
+	/* hotplug events are delivered from event handling, keep it going between reads */
+	if (hotplug && pthread_create(&eventThread, NULL, eventThreadEntry, this) == 0)
+		eventRunning = true;
+
+	return true;
+}
+
+void *QHY9USBTransport::eventThreadEntry(void *arg)
+{
+	QHY9USBTransport *self = (QHY9USBTransport *) arg;
+	struct timeval tv;
+
+	/* the readout thread handles events too while it reads, libusb takes turns */
+	while (!self->eventQuit) {
+		tv.tv_sec = 0;
+		tv.tv_usec = 100000;
+		libusb_handle_events_timeout_completed(self->ctx, &tv, &self->eventQuit);
+	}
+
+	return NULL;
+}
+
+/* event thread: nothing here may block, the driver does the work */
+int QHY9USBTransport::hotplugCallback(libusb_context *ctx, libusb_device *dev,
+				      libusb_hotplug_event event, void *arg)
+{
+	QHY9USBTransport *self = (QHY9USBTransport *) arg;
+	void (*handler)(void *arg);
+	void *handlerArg;
+
+	pthread_mutex_lock(&self->hotplugLock);
+
+	if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT) {
+		if (!self->handle || self->lost || libusb_get_device(self->handle) != dev) {
+			pthread_mutex_unlock(&self->hotplugLock);
+			return 0;
+		}
+
+		self->lost = true;
+		self->readout->cancel();
+		qhy9_trace_text("usb: camera at %s left", self->port.c_str());
+	} else {
+		/* bound to a port: only that port counts; a serial is checked when reopening */
+		if (!self->lost || (self->id.find('-') != std::string::npos && device_port(dev) != self->id)) {
+			pthread_mutex_unlock(&self->hotplugLock);
+			return 0;
+		}
+
+		if (self->arrived)
+			libusb_unref_device(self->arrived);
+		self->arrived = libusb_ref_device(dev);
+
+		qhy9_trace_text("usb: QHY9 arrived at %s", device_port(dev).c_str());
+	}
+
+	/* the handler may change meanwhile, call the one that was set */
+	handler = self->hotplugHandler;
+	handlerArg = self->hotplugArg;
+
+	pthread_mutex_unlock(&self->hotplugLock);
+
+	if (handler)
+		handler(handlerArg);
+
+	return 0;
+}
+
+void QHY9USBTransport::setHotplugHandler(void (*handler)(void *arg), void *arg)
+{
+	pthread_mutex_lock(&hotplugLock);
+	hotplugHandler = handler;
+	hotplugArg = arg;
+	pthread_mutex_unlock(&hotplugLock);
+}
+
+/* open dev if it is the camera we want */
+bool QHY9USBTransport::openDevice(libusb_device *dev, struct libusb_device_descriptor *desc)
+{
+	std::string devport = device_port(dev);
+	libusb_device_handle *h;
+
+	if (libusb_open(dev, &h))
+		return false;
+
+	/* not the port, maybe the serial */
+	if (!id.empty() && devport != id && device_serial(h, desc) != id) {
+		libusb_close(h);
+		return false;
+	}
+
+	pthread_mutex_lock(&hotplugLock);
+	handle = h;
+	port = devport;
+	lost = false;
+	pthread_mutex_unlock(&hotplugLock);
+
+	return true;
+}
+
+bool QHY9USBTransport::open(const char *id)
+{
+	libusb_device **devices;
+	struct libusb_device_descriptor desc;
+	int i, n;
+
+	/* already open ? */
+	if (handle)
+		return true;
+
+	this->id = id ? id : "";
+
+	/* each camera gets its own context, so their event handling never meets */
+	if (!initContext())
+		return false;
+
+	n = libusb_get_device_list(ctx, &devices);
+	for (i = 0; i < n && !handle; i++)
+		if (is_qhy9(devices[i], &desc))
+			openDevice(devices[i], &desc);
+
+	if (n >= 0)
+		libusb_free_device_list(devices, 1);
+
+	return handle != NULL;
+}
+
+/* the camera came back: open it again on the same context, no rescan if hotplug saw it */
+bool QHY9USBTransport::reopen()
+{
+	struct libusb_device_descriptor desc;
+	libusb_device *dev;
+	bool ok = false;
+
+	pthread_mutex_lock(&hotplugLock);
+	if (handle) {
+		libusb_close(handle);
+		handle = NULL;
+	}
+	dev = arrived;
+	arrived = NULL;
+	pthread_mutex_unlock(&hotplugLock);
+
+	if (dev) {
+		ok = is_qhy9(dev, &desc) && openDevice(dev, &desc);
+		libusb_unref_device(dev);
+	}
+
+	/* without hotplug we never know, just try */
+	if (!ok && !hotplug)
+		ok = open(id.c_str());
+
+	return ok;
+}
+
+void QHY9USBTransport::close()
+{
+	pthread_mutex_lock(&hotplugLock);
+	if (handle) {
+		libusb_close(handle);
+		handle = NULL;
+	}
+	lost = false;
+	pthread_mutex_unlock(&hotplugLock);
+}
+
+int QHY9USBTransport::vendorWrite(uint8_t request, uint8_t *data, uint16_t length)
+{
+	int ret;
+
+	if (!handle)
+		return LIBUSB_ERROR_NO_DEVICE;
+
+	ret = libusb_control_transfer(handle, QHY9_VENDOR_REQUEST_WRITE, request, 0, 0, data, length, QHY9_CONTROL_TIMEOUT);
+	qhy9_trace_usb(QHY9_TRACE_USB_VENDOR, request, ret, length, 0);
+
+	return ret;
+}
+
+int QHY9USBTransport::interruptWrite(uint8_t *data, int length)
+{
+	int transferred = 0, ret;
+
+	if (!handle)
+		return LIBUSB_ERROR_NO_DEVICE;
+
+	ret = libusb_bulk_transfer(handle, QHY9_INTERRUPT_WRITE_EP, data, length, &transferred, QHY9_CONTROL_TIMEOUT);
+	qhy9_trace_usb(QHY9_TRACE_USB_INT_WRITE, data[0], ret, length, transferred);
+
+	return ret < 0 ? ret : transferred;
+}
+
+int QHY9USBTransport::interruptRead(uint8_t *data, int length)
+{
+	int transferred = 0, ret;
+
+	if (!handle)
+		return LIBUSB_ERROR_NO_DEVICE;
+
+	ret = libusb_bulk_transfer(handle, QHY9_INTERRUPT_READ_EP, data, length, &transferred, QHY9_CONTROL_TIMEOUT);
+	qhy9_trace_usb(QHY9_TRACE_USB_INT_READ, QHY9_INTERRUPT_READ_EP, ret, length, transferred);
+
+	return ret < 0 ? ret : transferred;
+}
+
+int QHY9USBTransport::readFrame(uint8_t *data, int psize, int pnum, int *pos)
+{
+	int ret;
+
+	if (!handle)
+		return LIBUSB_ERROR_NO_DEVICE;
+
+	ret = readout->read(ctx, handle, QHY9_DATA_BULK_EP, data, psize, pnum, pos);
+	qhy9_trace_usb(QHY9_TRACE_USB_BULK, QHY9_DATA_BULK_EP, ret, psize * pnum, *pos);
+
+	return ret;
+}
+
+void QHY9USBTransport::setProgressHandler(void (*handler)(void *arg, long bytes), void *arg)
+{
+	readout->setProgressHandler(handler, arg);
+}
+
+void QHY9USBTransport::cancelRead()
+{
+	readout->cancel();
+}
+
+void QHY9USBTransport::clearCancel()
+{
+	readout->clearCancel();
+}
+
+uint8_t *QHY9USBTransport::allocBuffer(size_t size)
+{
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000105)
+	if (handle && !devmem) {
+		devmem = libusb_dev_mem_alloc(handle, size);
+		if (devmem)
+			return devmem;
+	}
+#endif
+
+	return (uint8_t *) malloc(size);
+}
+
+void QHY9USBTransport::freeBuffer(uint8_t *buffer, size_t size)
+{
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000105)
+	if (buffer && buffer == devmem) {
+		libusb_dev_mem_free(handle, buffer, size);
+		devmem = NULL;
+		return;
+	}
+#endif
+
+	free(buffer);
+}
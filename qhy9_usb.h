@@ -0,0 +1,92 @@
+#ifndef __QHY9_USB_H
+#define __QHY9_USB_H
+
+#include <pthread.h>
+
+#include <libusb-1.0/libusb.h>
+
+#include <string>
+#include <vector>
+
+#include "qhy9_transport.h"
+#include "qhy9_readout.h"
+
+#define QHY9_USB_DEVID 0x16188301
+
+/* msec for control and interrupt endpoint requests, these answer at once */
+#define QHY9_CONTROL_TIMEOUT 1000
+
+/* a QHY9 on the bus */
+struct QHY9DeviceInfo {
+	std::string port;			/* "bus-port.port...", e.g. "1-2.4" */
+	std::string serial;			/* empty if the camera has none */
+};
+
+/* The real camera, through libusb */
+class QHY9USBTransport : public QHY9Transport
+{
+public:
+	QHY9USBTransport(QHY9Readout *readout);
+	~QHY9USBTransport();
+
+	/* all QHY9s on the bus */
+	static int enumerate(std::vector<QHY9DeviceInfo> &devices);
+
+	/*
+	 * Open the QHY9 at a bus port or with a serial number, the first one if
+	 * id is empty. The libusb context and the hotplug watch stay up until
+	 * the transport is deleted, close only lets go of the camera.
+	 */
+	bool open(const char *id = NULL);
+	void close();
+
+	void setHotplugHandler(void (*handler)(void *arg), void *arg);
+	bool isLost() { return lost; }
+	bool reopen();
+	void setProgressHandler(void (*handler)(void *arg, long bytes), void *arg);
+
+	const char *getName() { return "USB"; }
+
+	int vendorWrite(uint8_t request, uint8_t *data, uint16_t length);
+	int interruptWrite(uint8_t *data, int length);
+	int interruptRead(uint8_t *data, int length);
+	int readFrame(uint8_t *data, int psize, int pnum, int *pos);
+	void cancelRead();
+	void clearCancel();
+
+	uint8_t *allocBuffer(size_t size);
+	void freeBuffer(uint8_t *buffer, size_t size);
+
+private:
+	libusb_context *ctx;
+	libusb_device_handle *handle;
+
+	std::string id;				/* what open was asked for */
+	std::string port;			/* where the open camera is */
+
+	/* hotplug, flags written by the event thread */
+	bool hotplug;				/* callback registered */
+	libusb_hotplug_callback_handle hotplugHandle;
+	volatile bool lost;			/* camera left, handle is dead */
+	libusb_device *arrived;			/* QHY9 that showed up since, referenced */
+	pthread_mutex_t hotplugLock;		/* handle, lost, arrived against the callback */
+	void (*hotplugHandler)(void *arg);
+	void *hotplugArg;
+
+	pthread_t eventThread;
+	bool eventRunning;
+	int eventQuit;
+
+	bool initContext();
+	bool openDevice(libusb_device *dev, struct libusb_device_descriptor *desc);
+
+	static int hotplugCallback(libusb_context *ctx, libusb_device *dev,
+				   libusb_hotplug_event event, void *arg);
+	static void *eventThreadEntry(void *arg);
+
+	QHY9Readout *readout;
+
+	uint8_t *devmem;			/* buffer from libusb_dev_mem_alloc */
+};
+
+#endif